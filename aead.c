@@ -0,0 +1,345 @@
+/**
+ * Copyright (c) 2022 Brian Starkey <stark3y@gmail.com>
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ * ChaCha20 and Poly1305 following RFC 8439. Poly1305 is the usual
+ * 5 x 26-bit limb ("donna-32") construction.
+ */
+#include <string.h>
+
+#include "aead.h"
+
+#include "pico/platform.h"
+
+#define ROTL32(v, n) (((v) << (n)) | ((v) >> (32 - (n))))
+
+#define QR(a, b, c, d) \
+	a += b; d ^= a; d = ROTL32(d, 16); \
+	c += d; b ^= c; b = ROTL32(b, 12); \
+	a += b; d ^= a; d = ROTL32(d, 8);  \
+	c += d; b ^= c; b = ROTL32(b, 7);
+
+static inline uint32_t load32(const uint8_t *p)
+{
+	return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static inline void store32(uint8_t *p, uint32_t v)
+{
+	p[0] = v;
+	p[1] = v >> 8;
+	p[2] = v >> 16;
+	p[3] = v >> 24;
+}
+
+static void chacha20_init(uint32_t state[16], const uint8_t key[AEAD_KEY_LEN], const uint8_t in[16])
+{
+	int i;
+
+	// "expand 32-byte k"
+	state[0] = 0x61707865;
+	state[1] = 0x3320646e;
+	state[2] = 0x79622d32;
+	state[3] = 0x6b206574;
+	for (i = 0; i < 8; i++) {
+		state[4 + i] = load32(key + 4 * i);
+	}
+	for (i = 0; i < 4; i++) {
+		state[12 + i] = load32(in + 4 * i);
+	}
+}
+
+// The inner loops run from RAM, so that they don't fight the rest of the
+// bootloader for the XIP cache
+static void __not_in_flash_func(chacha20_rounds)(uint32_t x[16])
+{
+	int i;
+
+	for (i = 0; i < 10; i++) {
+		QR(x[0], x[4], x[8],  x[12]);
+		QR(x[1], x[5], x[9],  x[13]);
+		QR(x[2], x[6], x[10], x[14]);
+		QR(x[3], x[7], x[11], x[15]);
+		QR(x[0], x[5], x[10], x[15]);
+		QR(x[1], x[6], x[11], x[12]);
+		QR(x[2], x[7], x[8],  x[13]);
+		QR(x[3], x[4], x[9],  x[14]);
+	}
+}
+
+void aead_hchacha20(uint8_t out[AEAD_KEY_LEN], const uint8_t key[AEAD_KEY_LEN], const uint8_t in[16])
+{
+	uint32_t x[16];
+	int i;
+
+	chacha20_init(x, key, in);
+	chacha20_rounds(x);
+
+	for (i = 0; i < 4; i++) {
+		store32(out + 4 * i, x[i]);
+		store32(out + 16 + 4 * i, x[12 + i]);
+	}
+}
+
+// XOR len bytes of keystream into buf, starting from block 'counter'
+static void __not_in_flash_func(chacha20_xor)(const uint32_t state[16], uint32_t counter, uint8_t *buf, size_t len)
+{
+	uint32_t x[16];
+	int i;
+
+	while (len) {
+		memcpy(x, state, sizeof(x));
+		x[12] = counter;
+		chacha20_rounds(x);
+
+		size_t n = len < 64 ? len : 64;
+		if (n == 64 && !((uintptr_t)buf & 3)) {
+			uint32_t *w = (uint32_t *)buf;
+			for (i = 0; i < 16; i++) {
+				w[i] ^= x[i] + (i == 12 ? counter : state[i]);
+			}
+		} else {
+			for (i = 0; i < n; i++) {
+				uint32_t k = x[i / 4] + (i / 4 == 12 ? counter : state[i / 4]);
+				buf[i] ^= k >> (8 * (i % 4));
+			}
+		}
+
+		buf += n;
+		len -= n;
+		counter++;
+	}
+}
+
+/*
+ * The M0+ only has a 32x32->32 multiply, and gcc would call the generic
+ * 64x64 helper for (uint64_t)a * b. Poly1305 needs 25 of these per block, so
+ * build the 64-bit product from four 16x16 multiplies inline instead.
+ */
+static inline uint64_t mul32x32(uint32_t a, uint32_t b)
+{
+	uint32_t a_lo = a & 0xffff, a_hi = a >> 16;
+	uint32_t b_lo = b & 0xffff, b_hi = b >> 16;
+
+	uint32_t lo = a_lo * b_lo;
+	uint32_t mid1 = a_hi * b_lo + (lo >> 16);
+	uint32_t mid2 = a_lo * b_hi + (mid1 & 0xffff);
+	uint32_t hi = a_hi * b_hi + (mid1 >> 16) + (mid2 >> 16);
+
+	return ((uint64_t)hi << 32) | (mid2 << 16) | (lo & 0xffff);
+}
+
+struct poly1305 {
+	uint32_t r[5];
+	uint32_t s[4];
+	uint32_t h[5];
+	uint8_t buf[16];
+	size_t buf_len;
+};
+
+static void poly1305_init(struct poly1305 *p, const uint8_t key[32])
+{
+	// Clamp r
+	p->r[0] = (load32(key + 0)) & 0x3ffffff;
+	p->r[1] = (load32(key + 3) >> 2) & 0x3ffff03;
+	p->r[2] = (load32(key + 6) >> 4) & 0x3ffc0ff;
+	p->r[3] = (load32(key + 9) >> 6) & 0x3f03fff;
+	p->r[4] = (load32(key + 12) >> 8) & 0x00fffff;
+
+	p->s[0] = load32(key + 16);
+	p->s[1] = load32(key + 20);
+	p->s[2] = load32(key + 24);
+	p->s[3] = load32(key + 28);
+
+	memset(p->h, 0, sizeof(p->h));
+	p->buf_len = 0;
+}
+
+static void __not_in_flash_func(poly1305_blocks)(struct poly1305 *p, const uint8_t *m, size_t len, uint32_t hibit)
+{
+	const uint32_t r0 = p->r[0], r1 = p->r[1], r2 = p->r[2], r3 = p->r[3], r4 = p->r[4];
+	const uint32_t s1 = r1 * 5, s2 = r2 * 5, s3 = r3 * 5, s4 = r4 * 5;
+	uint32_t h0 = p->h[0], h1 = p->h[1], h2 = p->h[2], h3 = p->h[3], h4 = p->h[4];
+
+	while (len >= 16) {
+		uint64_t d0, d1, d2, d3, d4;
+		uint32_t c;
+
+		h0 += (load32(m + 0)) & 0x3ffffff;
+		h1 += (load32(m + 3) >> 2) & 0x3ffffff;
+		h2 += (load32(m + 6) >> 4) & 0x3ffffff;
+		h3 += (load32(m + 9) >> 6) & 0x3ffffff;
+		h4 += (load32(m + 12) >> 8) | hibit;
+
+		d0 = mul32x32(h0, r0) + mul32x32(h1, s4) + mul32x32(h2, s3) + mul32x32(h3, s2) + mul32x32(h4, s1);
+		d1 = mul32x32(h0, r1) + mul32x32(h1, r0) + mul32x32(h2, s4) + mul32x32(h3, s3) + mul32x32(h4, s2);
+		d2 = mul32x32(h0, r2) + mul32x32(h1, r1) + mul32x32(h2, r0) + mul32x32(h3, s4) + mul32x32(h4, s3);
+		d3 = mul32x32(h0, r3) + mul32x32(h1, r2) + mul32x32(h2, r1) + mul32x32(h3, r0) + mul32x32(h4, s4);
+		d4 = mul32x32(h0, r4) + mul32x32(h1, r3) + mul32x32(h2, r2) + mul32x32(h3, r1) + mul32x32(h4, r0);
+
+		c = (uint32_t)(d0 >> 26); h0 = (uint32_t)d0 & 0x3ffffff;
+		d1 += c; c = (uint32_t)(d1 >> 26); h1 = (uint32_t)d1 & 0x3ffffff;
+		d2 += c; c = (uint32_t)(d2 >> 26); h2 = (uint32_t)d2 & 0x3ffffff;
+		d3 += c; c = (uint32_t)(d3 >> 26); h3 = (uint32_t)d3 & 0x3ffffff;
+		d4 += c; c = (uint32_t)(d4 >> 26); h4 = (uint32_t)d4 & 0x3ffffff;
+		h0 += c * 5; c = h0 >> 26; h0 &= 0x3ffffff;
+		h1 += c;
+
+		m += 16;
+		len -= 16;
+	}
+
+	p->h[0] = h0;
+	p->h[1] = h1;
+	p->h[2] = h2;
+	p->h[3] = h3;
+	p->h[4] = h4;
+}
+
+static void poly1305_update(struct poly1305 *p, const uint8_t *m, size_t len)
+{
+	if (p->buf_len) {
+		size_t n = 16 - p->buf_len;
+		if (n > len) {
+			n = len;
+		}
+		memcpy(p->buf + p->buf_len, m, n);
+		p->buf_len += n;
+		m += n;
+		len -= n;
+
+		if (p->buf_len < 16) {
+			return;
+		}
+		poly1305_blocks(p, p->buf, 16, 1 << 24);
+		p->buf_len = 0;
+	}
+
+	size_t whole = len & ~(size_t)15;
+	poly1305_blocks(p, m, whole, 1 << 24);
+	m += whole;
+	len -= whole;
+
+	memcpy(p->buf, m, len);
+	p->buf_len = len;
+}
+
+// The AEAD construction pads each part to 16 bytes
+static void poly1305_pad(struct poly1305 *p)
+{
+	if (p->buf_len) {
+		memset(p->buf + p->buf_len, 0, 16 - p->buf_len);
+		poly1305_blocks(p, p->buf, 16, 1 << 24);
+		p->buf_len = 0;
+	}
+}
+
+static void poly1305_finish(struct poly1305 *p, uint8_t tag[AEAD_TAG_LEN])
+{
+	uint32_t h0 = p->h[0], h1 = p->h[1], h2 = p->h[2], h3 = p->h[3], h4 = p->h[4];
+	uint32_t g0, g1, g2, g3, g4, c, mask;
+	uint64_t f;
+
+	// Fully carry h
+	c = h1 >> 26; h1 &= 0x3ffffff;
+	h2 += c; c = h2 >> 26; h2 &= 0x3ffffff;
+	h3 += c; c = h3 >> 26; h3 &= 0x3ffffff;
+	h4 += c; c = h4 >> 26; h4 &= 0x3ffffff;
+	h0 += c * 5; c = h0 >> 26; h0 &= 0x3ffffff;
+	h1 += c;
+
+	// h - p, and pick that if it didn't go negative
+	g0 = h0 + 5; c = g0 >> 26; g0 &= 0x3ffffff;
+	g1 = h1 + c; c = g1 >> 26; g1 &= 0x3ffffff;
+	g2 = h2 + c; c = g2 >> 26; g2 &= 0x3ffffff;
+	g3 = h3 + c; c = g3 >> 26; g3 &= 0x3ffffff;
+	g4 = h4 + c - (1 << 26);
+
+	mask = (g4 >> 31) - 1;
+	h0 = (h0 & ~mask) | (g0 & mask);
+	h1 = (h1 & ~mask) | (g1 & mask);
+	h2 = (h2 & ~mask) | (g2 & mask);
+	h3 = (h3 & ~mask) | (g3 & mask);
+	h4 = (h4 & ~mask) | (g4 & mask);
+
+	// h = h % 2^128, + s
+	h0 = (h0 | (h1 << 26)) & 0xffffffff;
+	h1 = ((h1 >> 6) | (h2 << 20)) & 0xffffffff;
+	h2 = ((h2 >> 12) | (h3 << 14)) & 0xffffffff;
+	h3 = ((h3 >> 18) | (h4 << 8)) & 0xffffffff;
+
+	f = (uint64_t)h0 + p->s[0];             store32(tag + 0, f);
+	f = (uint64_t)h1 + p->s[1] + (f >> 32); store32(tag + 4, f);
+	f = (uint64_t)h2 + p->s[2] + (f >> 32); store32(tag + 8, f);
+	f = (uint64_t)h3 + p->s[3] + (f >> 32); store32(tag + 12, f);
+}
+
+static void aead_tag(const uint32_t state[16], const uint8_t *aad, size_t aad_len,
+		const uint8_t *ct, size_t len, uint8_t tag[AEAD_TAG_LEN])
+{
+	struct poly1305 p;
+	uint8_t otk[64] = { 0 };
+	uint8_t lens[16];
+
+	// One-time key is the first half of block 0
+	chacha20_xor(state, 0, otk, sizeof(otk));
+	poly1305_init(&p, otk);
+
+	poly1305_update(&p, aad, aad_len);
+	poly1305_pad(&p);
+	poly1305_update(&p, ct, len);
+	poly1305_pad(&p);
+
+	store32(lens + 0, aad_len);
+	store32(lens + 4, 0);
+	store32(lens + 8, len);
+	store32(lens + 12, 0);
+	poly1305_update(&p, lens, sizeof(lens));
+
+	poly1305_finish(&p, tag);
+}
+
+static void aead_init(uint32_t state[16], const uint8_t key[AEAD_KEY_LEN], const uint8_t nonce[AEAD_NONCE_LEN])
+{
+	uint8_t in[16] = { 0 };
+
+	memcpy(in + 4, nonce, AEAD_NONCE_LEN);
+	chacha20_init(state, key, in);
+}
+
+void aead_encrypt(const uint8_t key[AEAD_KEY_LEN], const uint8_t nonce[AEAD_NONCE_LEN],
+		const uint8_t *aad, size_t aad_len, uint8_t *buf, size_t len,
+		uint8_t tag[AEAD_TAG_LEN])
+{
+	uint32_t state[16];
+
+	aead_init(state, key, nonce);
+	chacha20_xor(state, 1, buf, len);
+	aead_tag(state, aad, aad_len, buf, len, tag);
+}
+
+bool aead_decrypt(const uint8_t key[AEAD_KEY_LEN], const uint8_t nonce[AEAD_NONCE_LEN],
+		const uint8_t *aad, size_t aad_len, uint8_t *buf, size_t len,
+		const uint8_t tag[AEAD_TAG_LEN])
+{
+	uint32_t state[16];
+	uint8_t calc[AEAD_TAG_LEN];
+	uint8_t diff = 0;
+	int i;
+
+	aead_init(state, key, nonce);
+	aead_tag(state, aad, aad_len, buf, len, calc);
+
+	// Constant time compare
+	for (i = 0; i < AEAD_TAG_LEN; i++) {
+		diff |= calc[i] ^ tag[i];
+	}
+	if (diff) {
+		return false;
+	}
+
+	chacha20_xor(state, 1, buf, len);
+
+	return true;
+}
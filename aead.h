@@ -0,0 +1,35 @@
+/**
+ * Copyright (c) 2022 Brian Starkey <stark3y@gmail.com>
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+#ifndef __AEAD_H__
+#define __AEAD_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * ChaCha20-Poly1305 (RFC 8439), plus HChaCha20 for key derivation. Plain C,
+ * written for the M0+ (32-bit operations only, 26-bit Poly1305 limbs).
+ */
+#define AEAD_KEY_LEN   32
+#define AEAD_NONCE_LEN 12
+#define AEAD_TAG_LEN   16
+
+// out = HChaCha20(key, in): derives a subkey from a key and a 16-byte input
+void aead_hchacha20(uint8_t out[AEAD_KEY_LEN], const uint8_t key[AEAD_KEY_LEN], const uint8_t in[16]);
+
+// Encrypt buf in place, and write the tag
+void aead_encrypt(const uint8_t key[AEAD_KEY_LEN], const uint8_t nonce[AEAD_NONCE_LEN],
+		const uint8_t *aad, size_t aad_len, uint8_t *buf, size_t len,
+		uint8_t tag[AEAD_TAG_LEN]);
+
+// Check the tag, and only if it matches, decrypt buf in place.
+// Returns false (leaving buf untouched) if the tag doesn't match.
+bool aead_decrypt(const uint8_t key[AEAD_KEY_LEN], const uint8_t nonce[AEAD_NONCE_LEN],
+		const uint8_t *aad, size_t aad_len, uint8_t *buf, size_t len,
+		const uint8_t tag[AEAD_TAG_LEN]);
+
+#endif /* __AEAD_H__ */
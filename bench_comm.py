@@ -0,0 +1,99 @@
+#!/usr/bin/env python3
+# Copyright (c) 2022 Brian Starkey <stark3y@gmail.com>
+#
+# SPDX-License-Identifier: BSD-3-Clause
+#
+# Measure per-command latency, and pipelined throughput in each direction.
+# Run it against two builds to compare them (e.g. with and without
+# PICOWOTA_RAM_HOTPATH). Nothing in flash is changed: writes go to the RAM
+# load region, and are skipped if there isn't one.
+
+import argparse
+import asyncio
+import collections
+import statistics
+import sys
+import time
+
+import picowota_client as pw
+
+def any_int(x):
+    try:
+        return int(x, 0)
+    except:
+        raise argparse.ArgumentTypeError("expected an integer, not '{!r}'".format(x))
+
+parser = argparse.ArgumentParser()
+parser.add_argument("host", help="Device address")
+parser.add_argument("-p", "--port", help="TCP port", type=int, default=pw.DEFAULT_PORT)
+parser.add_argument("-k", "--psk", help="Pre-shared key (64 hex digits), if the device needs one",
+                    type=pw.parse_psk)
+parser.add_argument("-n", "--iterations", help="Number of samples for each latency", type=int, default=50)
+parser.add_argument("-s", "--size", help="Bytes to move for each throughput test",
+                    type=any_int, default=256 * 1024)
+parser.add_argument("-w", "--window", help="Commands in flight for the throughput tests", type=int, default=8)
+args = parser.parse_args()
+
+async def timed(coro):
+    start = time.perf_counter()
+    await coro
+    return time.perf_counter() - start
+
+async def latency(dev, fn):
+    return [await timed(fn()) for i in range(args.iterations)]
+
+async def pipelined(dev, op, addr, region, chunk, data_fn, resp_nargs, resp_data_len):
+    pending = collections.deque()
+    start = time.perf_counter()
+    for offs in range(0, args.size, chunk):
+        if len(pending) >= args.window:
+            await dev.recv(*pending.popleft())
+        data = data_fn(chunk)
+        dev.send(op, (addr + (offs % region), chunk), data)
+        pending.append((resp_nargs, resp_data_len))
+        await dev.writer.drain()
+    while pending:
+        await dev.recv(*pending.popleft())
+    return time.perf_counter() - start
+
+def report(name, samples):
+    samples = sorted(samples)
+    p99 = samples[min(len(samples) - 1, (len(samples) * 99) // 100)]
+    print("{:<24} {:8.2f} ms (median), {:8.2f} ms (p99)".format(
+          name, statistics.median(samples) * 1000, p99 * 1000))
+
+async def run():
+    async with await pw.Client.connect(args.host, args.port, psk=args.psk) as dev:
+        info = dev.info
+        chunk = info.max_data_len
+        ram_start, ram_size = await dev.ram_info()
+
+        print("latency ({} samples):".format(args.iterations))
+        report("INFO", await latency(dev, lambda: dev.command(pw.CMD_INFO, resp_nargs=5)))
+        report("READ {}".format(chunk), await latency(dev, lambda: dev.read(info.flash_start, chunk)))
+        report("CRCC {}".format(info.erase_size), await latency(dev, lambda: dev.crc(info.flash_start, info.erase_size)))
+        if ram_size >= chunk:
+            report("WRIT {} (RAM)".format(chunk), await latency(dev, lambda: dev.write(ram_start, bytes(chunk))))
+
+        # The first command after a CRC of the whole app region
+        after = []
+        for i in range(min(args.iterations, 10)):
+            await dev.crc(info.flash_start, info.flash_size & ~0x3)
+            after.append(await timed(dev.command(pw.CMD_INFO, resp_nargs=5)))
+        report("INFO after CRC", after)
+
+        print("throughput ({} bytes, window {}):".format(args.size, args.window))
+        t = await pipelined(dev, pw.CMD_READ, info.flash_start, info.flash_size, chunk,
+                            lambda n: b"", 0, chunk)
+        print("{:<24} {:8.2f} MB/s".format("READ", args.size / t / 1e6))
+        if ram_size >= chunk:
+            t = await pipelined(dev, pw.CMD_WRITE, ram_start, ram_size - (ram_size % chunk), chunk,
+                                lambda n: bytes(n), 1, 0)
+            print("{:<24} {:8.2f} MB/s".format("WRIT (RAM)", args.size / t / 1e6))
+        else:
+            print("WRIT skipped, the device has no RAM load region")
+
+try:
+    asyncio.run(run())
+except (pw.ProtocolError, OSError, asyncio.TimeoutError) as e:
+    sys.exit("benchmark failed: {}".format(e))
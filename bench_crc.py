@@ -0,0 +1,94 @@
+#!/usr/bin/env python3
+# Copyright (c) 2022 Brian Starkey <stark3y@gmail.com>
+#
+# SPDX-License-Identifier: BSD-3-Clause
+#
+# Measure CRC throughput over the app region, and the latency of the first
+# command after each CRC (which suffers if the CRC evicted the bootloader's
+# code from the XIP cache). Run it against two builds to compare them.
+
+import argparse
+import socket
+import statistics
+import struct
+import sys
+import time
+
+def opcode(s):
+    return struct.unpack("<I", s.encode())[0]
+
+CMD_SYNC = opcode("SYNC")
+RSP_SYNC = opcode("WOTA")
+CMD_INFO = opcode("INFO")
+CMD_CRC = opcode("CRCC")
+RSP_OK = opcode("OKOK")
+
+def any_int(x):
+    try:
+        return int(x, 0)
+    except:
+        raise argparse.ArgumentTypeError("expected an integer, not '{!r}'".format(x))
+
+parser = argparse.ArgumentParser()
+parser.add_argument("host", help="Device address")
+parser.add_argument("-p", "--port", help="TCP port", type=int, default=4242)
+parser.add_argument("-s", "--size", help="Bytes to CRC (default: the whole app region)",
+                    type=any_int, default=0)
+parser.add_argument("-n", "--iterations", help="Number of CRCs to run", type=int, default=10)
+parser.add_argument("-l", "--latency-samples", help="Number of INFOs for the baseline latency",
+                    type=int, default=20)
+args = parser.parse_args()
+
+def recv_exact(sock, n):
+    data = b""
+    while len(data) < n:
+        chunk = sock.recv(n - len(data))
+        if not chunk:
+            sys.exit("Connection closed")
+        data += chunk
+    return data
+
+def command(sock, op, cmd_args, resp_nargs, expect=RSP_OK):
+    sock.sendall(struct.pack("<{}I".format(1 + len(cmd_args)), op, *cmd_args))
+    status, = struct.unpack("<I", recv_exact(sock, 4))
+    if status != expect:
+        sys.exit("Command {:08x} failed: {:08x}".format(op, status))
+    return struct.unpack("<{}I".format(resp_nargs), recv_exact(sock, 4 * resp_nargs))
+
+def timed(fn):
+    start = time.perf_counter()
+    res = fn()
+    return time.perf_counter() - start, res
+
+sock = socket.create_connection((args.host, args.port))
+sock.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+
+command(sock, CMD_SYNC, [], 0, expect=RSP_SYNC)
+flash_start, flash_size, _, _, _ = command(sock, CMD_INFO, [], 5)
+
+size = args.size if args.size else flash_size
+size &= ~0x3
+
+info = lambda: command(sock, CMD_INFO, [], 5)
+crc = lambda: command(sock, CMD_CRC, [flash_start, size], 1)
+
+baseline = [timed(info)[0] for i in range(args.latency_samples)]
+
+crc_times = []
+after_times = []
+for i in range(args.iterations):
+    t, _ = timed(crc)
+    crc_times.append(t)
+    after_times.append(timed(info)[0])
+
+# The CRC time includes a round trip, so take the baseline out to get the
+# time spent on the device
+rtt = statistics.median(baseline)
+crc_device = max(statistics.median(crc_times) - rtt, 1e-6)
+
+print("crc size:           {} bytes @ {:#010x}".format(size, flash_start))
+print("baseline latency:   {:.2f} ms (median of {})".format(rtt * 1000, len(baseline)))
+print("crc time:           {:.2f} ms (median of {})".format(statistics.median(crc_times) * 1000, len(crc_times)))
+print("crc throughput:     {:.2f} MB/s".format(size / crc_device / 1e6))
+print("post-crc latency:   {:.2f} ms (median), {:.2f} ms (max)".format(
+      statistics.median(after_times) * 1000, max(after_times) * 1000))
@@ -0,0 +1,88 @@
+#!/usr/bin/env python3
+# Copyright (c) 2022 Brian Starkey <stark3y@gmail.com>
+#
+# SPDX-License-Identifier: BSD-3-Clause
+#
+# Measure the cost of taking flash out of XIP mode for each program, by
+# writing the same data with one flash session per WRIT, and with several
+# WRITs in each session (batched in a BTCH). The difference per session is
+# the fixed overhead which batching saves.
+#
+# This ERASES AND OVERWRITES flash at --addr, which has to be in an app slot
+# which doesn't matter (e.g. an unused slot, see picowota_slots.py).
+
+import argparse
+import asyncio
+import collections
+import os
+import sys
+import time
+
+import picowota_client as pw
+
+def any_int(x):
+    try:
+        return int(x, 0)
+    except:
+        raise argparse.ArgumentTypeError("expected an integer, not '{!r}'".format(x))
+
+parser = argparse.ArgumentParser()
+parser.add_argument("host", help="Device address")
+parser.add_argument("-a", "--addr", help="Scratch flash address to write to", type=any_int, required=True)
+parser.add_argument("-p", "--port", help="TCP port", type=int, default=pw.DEFAULT_PORT)
+parser.add_argument("-k", "--psk", help="Pre-shared key (64 hex digits), if the device needs one",
+                    type=pw.parse_psk)
+parser.add_argument("-s", "--size", help="Bytes to write for each run", type=any_int, default=64 * 1024)
+parser.add_argument("-b", "--batch", help="WRITs per BTCH for the batched run", type=int, default=4)
+parser.add_argument("-r", "--runs", help="Runs of each", type=int, default=3)
+args = parser.parse_args()
+
+async def run_one(dev, data, chunk, batch):
+    info = dev.info
+    await dev.erase(args.addr, pw.align_up(len(data), info.erase_size))
+    # Wait for the background erase, so that it isn't part of the timing
+    await dev.crc(args.addr, 4)
+
+    pending = collections.deque()
+    start = time.perf_counter()
+    for offs in range(0, len(data), chunk * batch):
+        cmds = [(pw.CMD_WRITE, (args.addr + o, chunk), data[o:o + chunk])
+                for o in range(offs, min(offs + chunk * batch, len(data)), chunk)]
+        if len(pending) >= 2:
+            await pending.popleft()
+        if batch == 1:
+            dev.send(*cmds[0])
+            pending.append(dev.recv(resp_nargs=1))
+        else:
+            dev.send_batch(cmds)
+            pending.append(dev.recv_batch(len(cmds), resp_nargs=1))
+        await dev.writer.drain()
+    while pending:
+        await pending.popleft()
+    return time.perf_counter() - start
+
+async def run():
+    async with await pw.Client.connect(args.host, args.port, psk=args.psk) as dev:
+        info = dev.info
+        chunk = info.max_data_len - (info.max_data_len % info.write_size)
+        data = os.urandom(args.size - (args.size % chunk))
+        n_writes = len(data) // chunk
+
+        times = {}
+        for batch in (1, args.batch):
+            times[batch] = min([await run_one(dev, data, chunk, batch) for i in range(args.runs)])
+
+        sessions = {b: -(-n_writes // b) for b in times}
+        for b, t in times.items():
+            print("{:>2} WRIT/session: {:8.2f} ms for {} x {} bytes, {:.1f} us per WRIT, {:.2f} MB/s".format(
+                  b, t * 1000, n_writes, chunk, t / n_writes * 1e6, len(data) / t / 1e6))
+
+        saved = sessions[1] - sessions[args.batch]
+        if saved > 0:
+            overhead = (times[1] - times[args.batch]) / saved
+            print("overhead per flash session: {:.1f} us".format(overhead * 1e6))
+
+try:
+    asyncio.run(run())
+except (pw.ProtocolError, OSError, asyncio.TimeoutError) as e:
+    sys.exit("benchmark failed: {}".format(e))
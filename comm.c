@@ -0,0 +1,1004 @@
+/**
+ * Copyright (c) 2022 Brian Starkey <stark3y@gmail.com>
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+#include <assert.h>
+#include <string.h>
+
+#include "pico/rand.h"
+#include "pico/time.h"
+
+#include "aead.h"
+#include "comm.h"
+#include "pool.h"
+#include "trace.h"
+
+#ifdef DEBUG
+#include <stdio.h>
+#define DEBUG_printf(...) printf(__VA_ARGS__)
+#else
+#define DEBUG_printf(...) { }
+#endif
+
+#define COMM_MAX_NARG     5
+
+enum conn_state {
+	CONN_STATE_WAIT_FOR_SYNC,
+	CONN_STATE_READ_OPCODE,
+	CONN_STATE_READ_ARGS,
+	CONN_STATE_READ_DATA,
+	// Handler returned COMM_RSP_BUSY, waiting for comm_session_process()
+	CONN_STATE_HANDLE,
+	// Waiting for space in the transport for the response
+	CONN_STATE_WRITE_RESP,
+	// Sending an error, the connection gets closed afterwards
+	CONN_STATE_WRITE_ERROR,
+	CONN_STATE_CLOSED,
+};
+
+struct comm_session {
+	enum conn_state conn_state;
+
+	// Note: sizeof(buf) is used elsewhere, so if this is changed to not
+	// be an array, those will need updating
+	uint8_t buf[(sizeof(uint32_t) * (1 + COMM_MAX_NARG)) + COMM_MAX_BATCH_LEN];
+
+	// Batch responses are collected here, as they can be bigger than the
+	// part of the batch which they replace
+	uint32_t batch_rsp[COMM_MAX_BATCH_ITEMS * (1 + COMM_MAX_NARG)];
+	// Progress through the current batch, so that it can pick up where it
+	// left off if a command is busy
+	uint16_t batch_offs;
+	uint16_t batch_n_run;
+	uint16_t batch_rsp_words;
+
+	uint8_t *rx_dst;
+	uint16_t rx_bytes_needed;
+
+	// While a handler is busy, the next opcode is read ahead, so that a
+	// preempt command can be run straight away. The parser gets the
+	// lookahead before anything else, and the preempt command's response
+	// is kept until the parser reaches it.
+	uint32_t lookahead;
+	uint8_t lookahead_len;
+	uint8_t lookahead_offs;
+	bool preempt_done;
+	uint32_t preempt_rsp[1 + COMM_MAX_NARG];
+
+	// Response being sent, tx_offs < tx_len while it's waiting for space
+	const uint8_t *tx_data;
+	uint16_t tx_len;
+	uint16_t tx_offs;
+
+	uint32_t resp_data_len;
+
+	// Once AUTH has completed, everything in both directions is sealed
+	// with session_key.
+	bool secure;
+	uint8_t session_key[AEAD_KEY_LEN];
+	uint64_t rx_counter;
+	uint64_t tx_counter;
+	// Sealed frame being received (len, ciphertext, tag). Once it has
+	// been opened, the plaintext is parsed from plain_offs to plain_len,
+	// and the next frame isn't read until it has all been used.
+	uint8_t *rx_frame;
+	uint16_t rx_frame_have;
+	uint16_t plain_offs;
+	uint16_t plain_len;
+	// Sealed copy of a response
+	uint8_t *tx_frame;
+
+	// Only SYNC, AUTH and TAKE are accepted while set
+	bool standby;
+
+	uint32_t idle_timeout_ms;
+	uint32_t progress_timeout_ms;
+	// Last time the client sent or took some data, or a handler was busy
+	uint32_t last_activity_ms;
+
+	const struct comm_command *cmd;
+	const struct comm_table *table;
+
+	const struct comm_transport_ops *ops;
+	void *priv;
+};
+
+#define COMM_BUF_OPCODE(_buf)       ((uint32_t *)((uint8_t *)(_buf)))
+#define COMM_BUF_ARGS(_buf)         ((uint32_t *)((uint8_t *)(_buf) + sizeof(uint32_t)))
+#define COMM_BUF_BODY(_buf, _nargs) ((uint8_t *)(_buf) + (sizeof(uint32_t) * ((_nargs) + 1)))
+
+#define COMM_FRAME_MAX_LEN (sizeof(((struct comm_session *)0)->buf) + COMM_FRAME_OVERHEAD)
+
+static_assert(COMM_MAX_BATCH_LEN >= COMM_MAX_DATA_LEN, "batch must be able to hold any command");
+
+// Sessions, and a sealed frame buffer for each direction if there's a PSK
+#if defined(PICOWOTA_PSK_BYTES)
+#define COMM_FRAME_POOL_LEN (2 * COMM_MAX_SESSIONS)
+#else
+#define COMM_FRAME_POOL_LEN 0
+#endif
+POOL_DEFINE(session_pool, "comm_session", sizeof(struct comm_session), COMM_MAX_SESSIONS);
+POOL_DEFINE(frame_pool, "comm_frame", COMM_FRAME_MAX_LEN, COMM_FRAME_POOL_LEN);
+
+static uint32_t size_batch(uint32_t *args_in, uint32_t *data_len_out, uint32_t *resp_data_len_out)
+{
+	uint32_t len = args_in[0];
+
+	if (len > COMM_MAX_BATCH_LEN) {
+		return COMM_RSP_ERR;
+	}
+
+	*data_len_out = len;
+	// Filled in once the batch has run
+	*resp_data_len_out = 0;
+
+	return COMM_RSP_OK;
+}
+
+static const struct comm_command batch_cmd = {
+	// BTCH len [frames]
+	// OKOK n_run [status resp_args]...
+	.opcode = COMM_BATCH_OPCODE,
+	.nargs = 1,
+	.resp_nargs = 1,
+	.size = &size_batch,
+	.handle = NULL,
+};
+
+static const struct comm_command auth_cmd = {
+	// AUTH client_nonce[16]
+	// OKOK device_nonce[16]
+	.opcode = COMM_AUTH_OPCODE,
+	.nargs = 4,
+	.resp_nargs = 4,
+	.size = NULL,
+	.handle = NULL,
+};
+
+static const struct comm_command takeover_cmd = {
+	// TAKE
+	// OKOK
+	.opcode = COMM_TAKEOVER_OPCODE,
+	.nargs = 0,
+	.resp_nargs = 0,
+	.size = NULL,
+	.handle = NULL,
+};
+
+static uint32_t comm_now_ms(void)
+{
+	return to_ms_since_boot(get_absolute_time());
+}
+
+static void comm_set_state(struct comm_session *sess, enum conn_state state)
+{
+	trace_event(TRACE_CONN_STATE, state, 0);
+	sess->conn_state = state;
+}
+
+static const struct comm_command *find_command_desc(struct comm_session *sess, uint32_t opcode)
+{
+	const struct comm_table *table = sess->table;
+	unsigned int i;
+
+	if (opcode == COMM_BATCH_OPCODE) {
+		return &batch_cmd;
+	} else if (opcode == COMM_AUTH_OPCODE) {
+		return &auth_cmd;
+	} else if (opcode == COMM_TAKEOVER_OPCODE) {
+		return &takeover_cmd;
+	}
+
+	for (i = 0; i < table->n_cmds; i++) {
+		if (table->cmds[i]->opcode == opcode) {
+			return table->cmds[i];
+		}
+	}
+
+	return NULL;
+}
+
+static bool is_error(uint32_t status)
+{
+	return status == COMM_RSP_ERR;
+}
+
+static int comm_sync_begin(struct comm_session *sess);
+static int comm_sync_complete(struct comm_session *sess);
+static int comm_opcode_begin(struct comm_session *sess);
+static int comm_opcode_complete(struct comm_session *sess);
+static int comm_args_begin(struct comm_session *sess);
+static int comm_args_complete(struct comm_session *sess);
+static int comm_data_begin(struct comm_session *sess, uint32_t data_len);
+static int comm_data_complete(struct comm_session *sess);
+static int comm_response_begin(struct comm_session *sess);
+static int comm_response_complete(struct comm_session *sess);
+static int comm_error_begin(struct comm_session *sess);
+static int comm_batch_complete(struct comm_session *sess);
+static int comm_auth_complete(struct comm_session *sess);
+static int comm_takeover_complete(struct comm_session *sess);
+
+static int comm_sync_begin(struct comm_session *sess)
+{
+	comm_set_state(sess, CONN_STATE_WAIT_FOR_SYNC);
+	sess->rx_dst = (uint8_t *)COMM_BUF_OPCODE(sess->buf);
+	sess->rx_bytes_needed = sizeof(uint32_t);
+
+	return 0;
+}
+
+static int comm_sync_complete(struct comm_session *sess)
+{
+	if (sess->table->sync_opcode != *COMM_BUF_OPCODE(sess->buf)) {
+		DEBUG_printf("sync not correct: %c%c%c%c\n", sess->buf[0], sess->buf[1], sess->buf[2], sess->buf[3]);
+		return comm_error_begin(sess);
+	}
+
+	return comm_opcode_complete(sess);
+}
+
+static int comm_opcode_begin(struct comm_session *sess)
+{
+	comm_set_state(sess, CONN_STATE_READ_OPCODE);
+	sess->rx_dst = (uint8_t *)COMM_BUF_OPCODE(sess->buf);
+	sess->rx_bytes_needed = sizeof(uint32_t);
+
+	return 0;
+}
+
+static int comm_opcode_complete(struct comm_session *sess)
+{
+	trace_event(TRACE_COMMAND, 0, *COMM_BUF_OPCODE(sess->buf));
+	sess->cmd = find_command_desc(sess, *COMM_BUF_OPCODE(sess->buf));
+	if (!sess->cmd) {
+		DEBUG_printf("no command for '%c%c%c%c'\n", sess->buf[0], sess->buf[1], sess->buf[2], sess->buf[3]);
+		return comm_error_begin(sess);
+	} else {
+		DEBUG_printf("got command '%c%c%c%c'\n", sess->buf[0], sess->buf[1], sess->buf[2], sess->buf[3]);
+	}
+
+	// With a PSK, nothing but the handshake is allowed in the clear
+	if (sess->table->psk && !sess->secure &&
+	    (sess->cmd->opcode != sess->table->sync_opcode) && (sess->cmd != &auth_cmd)) {
+		DEBUG_printf("not authenticated\n");
+		return comm_error_begin(sess);
+	}
+
+	if (sess->standby && (sess->cmd->opcode != sess->table->sync_opcode) &&
+	    (sess->cmd != &auth_cmd) && (sess->cmd != &takeover_cmd)) {
+		DEBUG_printf("session is in standby\n");
+		return comm_error_begin(sess);
+	}
+
+	return comm_args_begin(sess);
+}
+
+static int comm_args_begin(struct comm_session *sess)
+{
+	comm_set_state(sess, CONN_STATE_READ_ARGS);
+	sess->rx_dst = (uint8_t *)COMM_BUF_ARGS(sess->buf);
+	sess->rx_bytes_needed = sess->cmd->nargs * sizeof(uint32_t);
+
+	if (sess->cmd->nargs == 0) {
+		return comm_args_complete(sess);
+	}
+
+	return 0;
+}
+
+static int comm_args_complete(struct comm_session *sess)
+{
+	const struct comm_command *cmd = sess->cmd;
+
+	uint32_t data_len = 0;
+
+	sess->resp_data_len = 0;
+	if (cmd->size) {
+		uint32_t status = cmd->size(COMM_BUF_ARGS(sess->buf),
+					    &data_len,
+					    &sess->resp_data_len);
+		if (is_error(status)) {
+			return comm_error_begin(sess);
+		}
+	}
+
+	return comm_data_begin(sess, data_len);
+}
+
+static int comm_data_begin(struct comm_session *sess, uint32_t data_len)
+{
+	comm_set_state(sess, CONN_STATE_READ_DATA);
+	sess->rx_dst = COMM_BUF_BODY(sess->buf, sess->cmd->nargs);
+	sess->rx_bytes_needed = data_len;
+
+	if (data_len == 0) {
+		return comm_data_complete(sess);
+	}
+
+	return 0;
+}
+
+static int comm_data_complete(struct comm_session *sess)
+{
+	const struct comm_command *cmd = sess->cmd;
+
+	if (cmd == &batch_cmd) {
+		return comm_batch_complete(sess);
+	} else if (cmd == &auth_cmd) {
+		return comm_auth_complete(sess);
+	} else if (cmd == &takeover_cmd) {
+		return comm_takeover_complete(sess);
+	}
+
+	if (cmd->preempt && sess->preempt_done) {
+		// Already run, while the command in front of it was busy
+		sess->preempt_done = false;
+		if (is_error(sess->preempt_rsp[0])) {
+			return comm_error_begin(sess);
+		}
+
+		memcpy(sess->buf, sess->preempt_rsp, sizeof(uint32_t) * (1 + cmd->resp_nargs));
+	} else if (cmd->handle) {
+		uint32_t status = cmd->handle(COMM_BUF_ARGS(sess->buf),
+					      COMM_BUF_BODY(sess->buf, cmd->nargs),
+					      COMM_BUF_ARGS(sess->buf),
+					      COMM_BUF_BODY(sess->buf, cmd->resp_nargs));
+		if (status == COMM_RSP_BUSY) {
+			comm_set_state(sess, CONN_STATE_HANDLE);
+			return 0;
+		} else if (is_error(status)) {
+			return comm_error_begin(sess);
+		}
+
+		*COMM_BUF_OPCODE(sess->buf) = status;
+	} else {
+		// TODO: Should we just assert(desc->handle)?
+		*COMM_BUF_OPCODE(sess->buf) = COMM_RSP_OK;
+	}
+
+	return comm_response_begin(sess);
+}
+
+struct batch_item {
+	const struct comm_command *cmd;
+	uint32_t *args;
+	uint8_t *data;
+};
+
+// Parse the frame at *offs in a batch, and advance *offs past it.
+static int comm_batch_next(struct comm_session *sess, uint8_t *data, uint32_t len,
+		uint32_t *offs, struct batch_item *item)
+{
+	uint32_t data_len = 0, resp_data_len = 0;
+	uint32_t remaining = len - *offs;
+
+	if (remaining < sizeof(uint32_t)) {
+		return -1;
+	}
+
+	item->cmd = find_command_desc(sess, *COMM_BUF_OPCODE(data + *offs));
+	if (!item->cmd || (item->cmd == &batch_cmd) || (item->cmd == &auth_cmd) ||
+	    (item->cmd == &takeover_cmd)) {
+		return -1;
+	}
+
+	if (remaining < sizeof(uint32_t) * (1 + item->cmd->nargs)) {
+		return -1;
+	}
+
+	item->args = COMM_BUF_ARGS(data + *offs);
+	item->data = COMM_BUF_BODY(data + *offs, item->cmd->nargs);
+	remaining -= sizeof(uint32_t) * (1 + item->cmd->nargs);
+
+	if (item->cmd->size) {
+		uint32_t status = item->cmd->size(item->args, &data_len, &resp_data_len);
+		if (is_error(status)) {
+			return -1;
+		}
+	}
+
+	// Keep the following frames aligned
+	if ((data_len > remaining) || (data_len & 0x3) || resp_data_len) {
+		return -1;
+	}
+
+	*offs = len - (remaining - data_len);
+
+	return 0;
+}
+
+static int comm_batch_complete(struct comm_session *sess)
+{
+	uint32_t len = COMM_BUF_ARGS(sess->buf)[0];
+	uint8_t *data = COMM_BUF_BODY(sess->buf, batch_cmd.nargs);
+	uint32_t offs, n_items = 0;
+	struct batch_item item;
+
+	if (sess->conn_state != CONN_STATE_HANDLE) {
+		// Check the whole thing before running any of it
+		for (offs = 0; offs < len; n_items++) {
+			if ((n_items == COMM_MAX_BATCH_ITEMS) ||
+			    comm_batch_next(sess, data, len, &offs, &item)) {
+				DEBUG_printf("bad batch item %d\n", n_items);
+				return comm_error_begin(sess);
+			}
+		}
+
+		sess->batch_offs = 0;
+		sess->batch_n_run = 0;
+		sess->batch_rsp_words = 0;
+	}
+
+	// Command with queued work, which needs flushing before anything else
+	const struct comm_command *queued = NULL;
+	uint32_t *rsp = sess->batch_rsp + sess->batch_rsp_words;
+	while (sess->batch_offs < len) {
+		offs = sess->batch_offs;
+		comm_batch_next(sess, data, len, &offs, &item);
+
+		if (queued && (queued != item.cmd)) {
+			queued->flush();
+			queued = NULL;
+		}
+
+		uint32_t status = COMM_RSP_OK;
+		if (item.cmd->queue) {
+			status = item.cmd->queue(item.args, item.data, rsp + 1);
+			if (!is_error(status) && (status != COMM_RSP_BUSY)) {
+				queued = item.cmd;
+			}
+		} else if (item.cmd->handle) {
+			status = item.cmd->handle(item.args, item.data, rsp + 1, NULL);
+		}
+
+		if (status == COMM_RSP_BUSY) {
+			if (queued) {
+				queued->flush();
+			}
+
+			// Run this one again on resume
+			sess->batch_rsp_words = rsp - sess->batch_rsp;
+			comm_set_state(sess, CONN_STATE_HANDLE);
+			return 0;
+		}
+
+		sess->batch_offs = offs;
+		sess->batch_n_run++;
+
+		*rsp++ = status;
+		if (is_error(status)) {
+			DEBUG_printf("batch item %d failed\n", sess->batch_n_run - 1);
+			break;
+		}
+		rsp += item.cmd->resp_nargs;
+	}
+
+	if (queued) {
+		queued->flush();
+	}
+
+	sess->resp_data_len = (rsp - sess->batch_rsp) * sizeof(uint32_t);
+
+	*COMM_BUF_OPCODE(sess->buf) = COMM_RSP_OK;
+	COMM_BUF_ARGS(sess->buf)[0] = sess->batch_n_run;
+	memcpy(COMM_BUF_BODY(sess->buf, batch_cmd.resp_nargs), sess->batch_rsp, sess->resp_data_len);
+
+	return comm_response_begin(sess);
+}
+
+static int comm_auth_complete(struct comm_session *sess)
+{
+	uint8_t *client_nonce = (uint8_t *)COMM_BUF_ARGS(sess->buf);
+	uint32_t device_nonce[4];
+	uint64_t rand;
+
+	if (!sess->table->psk || sess->secure) {
+		return comm_error_begin(sess);
+	}
+
+	rand = get_rand_64();
+	memcpy(&device_nonce[0], &rand, sizeof(rand));
+	rand = get_rand_64();
+	memcpy(&device_nonce[2], &rand, sizeof(rand));
+
+	// Both sides contribute a nonce, so every session gets a fresh key, and
+	// the frame counters can start from 0
+	aead_hchacha20(sess->session_key, sess->table->psk, client_nonce);
+	aead_hchacha20(sess->session_key, sess->session_key, (uint8_t *)device_nonce);
+
+	*COMM_BUF_OPCODE(sess->buf) = COMM_RSP_OK;
+	memcpy(COMM_BUF_ARGS(sess->buf), device_nonce, sizeof(device_nonce));
+
+	// The response goes in the clear, comm_response_complete() switches
+	// to sealed frames after it
+	return comm_response_begin(sess);
+}
+
+static int comm_takeover_complete(struct comm_session *sess)
+{
+	if (sess->standby) {
+		if (!sess->ops->takeover || sess->ops->takeover(sess->priv)) {
+			return comm_error_begin(sess);
+		}
+
+		DEBUG_printf("session took over\n");
+		sess->standby = false;
+	}
+
+	*COMM_BUF_OPCODE(sess->buf) = COMM_RSP_OK;
+
+	return comm_response_begin(sess);
+}
+
+static void comm_frame_nonce(uint8_t nonce[AEAD_NONCE_LEN], uint32_t dir, uint64_t counter)
+{
+	memcpy(nonce, &dir, sizeof(dir));
+	memcpy(nonce + sizeof(dir), &counter, sizeof(counter));
+}
+
+// Seal len bytes of sess->buf into sess->tx_frame, returns the frame length
+static uint16_t comm_frame_seal(struct comm_session *sess, uint16_t len)
+{
+	uint8_t nonce[AEAD_NONCE_LEN];
+	uint32_t frame_len = len;
+
+	comm_frame_nonce(nonce, COMM_DIR_TO_HOST, sess->tx_counter++);
+
+	memcpy(sess->tx_frame, &frame_len, sizeof(frame_len));
+	memcpy(sess->tx_frame + sizeof(frame_len), sess->buf, len);
+	aead_encrypt(sess->session_key, nonce, sess->tx_frame, sizeof(frame_len),
+		     sess->tx_frame + sizeof(frame_len), len,
+		     sess->tx_frame + sizeof(frame_len) + len);
+
+	return len + COMM_FRAME_OVERHEAD;
+}
+
+// Read the next frame into rx_frame, and once it's all there, authenticate
+// and decrypt it. Returns 1 if a frame was opened, 0 if there isn't a whole
+// one yet, or -1 if it's bad.
+static int comm_frame_open(struct comm_session *sess)
+{
+	uint8_t nonce[AEAD_NONCE_LEN];
+	uint8_t *frame = sess->rx_frame;
+	uint32_t len = 0, want = sizeof(len);
+
+	for ( ; ; ) {
+		if (sess->rx_frame_have >= sizeof(len)) {
+			memcpy(&len, frame, sizeof(len));
+			if ((len == 0) || (len > sizeof(sess->buf))) {
+				DEBUG_printf("bad frame len %d\n", len);
+				return -1;
+			}
+			want = len + COMM_FRAME_OVERHEAD;
+		}
+
+		if (sess->rx_frame_have == want) {
+			break;
+		}
+
+		uint32_t n = sess->ops->read(sess->priv, frame + sess->rx_frame_have,
+					     want - sess->rx_frame_have);
+		if (!n) {
+			return 0;
+		}
+		sess->rx_frame_have += n;
+		sess->last_activity_ms = comm_now_ms();
+	}
+
+	sess->rx_frame_have = 0;
+
+	comm_frame_nonce(nonce, COMM_DIR_TO_DEVICE, sess->rx_counter);
+	if (!aead_decrypt(sess->session_key, nonce, frame, sizeof(len),
+			  frame + sizeof(len), len, frame + sizeof(len) + len)) {
+		DEBUG_printf("frame %d failed authentication\n", (int)sess->rx_counter);
+		return -1;
+	}
+	sess->rx_counter++;
+
+	sess->plain_offs = sizeof(len);
+	sess->plain_len = sizeof(len) + len;
+
+	return 1;
+}
+
+// Send as much of the current response as the transport will take
+static int comm_tx_flush(struct comm_session *sess)
+{
+	while (sess->tx_offs < sess->tx_len) {
+		int n = sess->ops->write(sess->priv, sess->tx_data + sess->tx_offs,
+					 sess->tx_len - sess->tx_offs);
+		if (n < 0) {
+			return -1;
+		} else if (n == 0) {
+			break;
+		}
+
+		sess->tx_offs += n;
+		sess->last_activity_ms = comm_now_ms();
+	}
+
+	return 0;
+}
+
+static bool comm_tx_pending(struct comm_session *sess)
+{
+	return sess->tx_offs < sess->tx_len;
+}
+
+// Responses are sealed (if need be) once, and then sent from sess->buf or
+// sess->tx_frame, so sess->buf can't be re-used until they've gone.
+static int comm_tx_write(struct comm_session *sess, uint16_t len)
+{
+	sess->tx_data = sess->buf;
+	sess->tx_len = len;
+	sess->tx_offs = 0;
+
+	if (sess->secure) {
+		sess->tx_len = comm_frame_seal(sess, len);
+		sess->tx_data = sess->tx_frame;
+	}
+
+	return comm_tx_flush(sess);
+}
+
+static int comm_response_begin(struct comm_session *sess)
+{
+	comm_set_state(sess, CONN_STATE_WRITE_RESP);
+
+	uint16_t len = sess->resp_data_len + ((sess->cmd->resp_nargs + 1) * sizeof(uint32_t));
+	if (comm_tx_write(sess, len)) {
+		return -1;
+	}
+
+	if (comm_tx_pending(sess)) {
+		DEBUG_printf("send buffer full, holding response\n");
+		trace_event(TRACE_TX_BLOCKED, 0, len);
+		return 0;
+	}
+
+	return comm_response_complete(sess);
+}
+
+static int comm_error_begin(struct comm_session *sess)
+{
+	comm_set_state(sess, CONN_STATE_WRITE_ERROR);
+
+	*COMM_BUF_OPCODE(sess->buf) = COMM_RSP_ERR;
+
+	return comm_tx_write(sess, sizeof(uint32_t));
+}
+
+static int comm_response_complete(struct comm_session *sess)
+{
+	if (sess->cmd == &auth_cmd) {
+		DEBUG_printf("session authenticated\n");
+		sess->secure = true;
+	}
+
+	return comm_opcode_begin(sess);
+}
+
+static int comm_rx_complete(struct comm_session *sess)
+{
+	switch (sess->conn_state) {
+	case CONN_STATE_WAIT_FOR_SYNC:
+		return comm_sync_complete(sess);
+	case CONN_STATE_READ_OPCODE:
+		return comm_opcode_complete(sess);
+	case CONN_STATE_READ_ARGS:
+		return comm_args_complete(sess);
+	case CONN_STATE_READ_DATA:
+		return comm_data_complete(sess);
+	default:
+		return -1;
+	}
+}
+
+static bool comm_rx_wanted(struct comm_session *sess)
+{
+	switch (sess->conn_state) {
+	case CONN_STATE_WAIT_FOR_SYNC:
+	case CONN_STATE_READ_OPCODE:
+	case CONN_STATE_READ_ARGS:
+	case CONN_STATE_READ_DATA:
+		return true;
+	default:
+		return false;
+	}
+}
+
+// Copy up to len bytes of input to dst. When secure, that's plaintext from
+// the current frame.
+static int comm_rx_read_stream(struct comm_session *sess, uint8_t *dst, uint16_t len)
+{
+	if (!sess->secure) {
+		uint32_t n = sess->ops->read(sess->priv, dst, len);
+		if (n) {
+			sess->last_activity_ms = comm_now_ms();
+		}
+		return n;
+	}
+
+	// Sealed frames are only opened when the parser runs out of
+	// plaintext, so nothing reaches a handler unauthenticated
+	if (sess->plain_offs == sess->plain_len) {
+		int res = comm_frame_open(sess);
+		if (res <= 0) {
+			return res;
+		}
+	}
+
+	if (len > sess->plain_len - sess->plain_offs) {
+		len = sess->plain_len - sess->plain_offs;
+	}
+	memcpy(dst, sess->rx_frame + sess->plain_offs, len);
+	sess->plain_offs += len;
+
+	return len;
+}
+
+// As comm_rx_read_stream(), but anything which was read ahead comes first
+static int comm_rx_read(struct comm_session *sess, uint8_t *dst, uint16_t len)
+{
+	if (sess->lookahead_offs == sess->lookahead_len) {
+		return comm_rx_read_stream(sess, dst, len);
+	}
+
+	if (len > sess->lookahead_len - sess->lookahead_offs) {
+		len = sess->lookahead_len - sess->lookahead_offs;
+	}
+	memcpy(dst, (uint8_t *)&sess->lookahead + sess->lookahead_offs, len);
+	sess->lookahead_offs += len;
+
+	if (sess->lookahead_offs == sess->lookahead_len) {
+		sess->lookahead_len = 0;
+		sess->lookahead_offs = 0;
+	}
+
+	return len;
+}
+
+// While a handler is busy, read the next opcode, and if it's a preempt
+// command, run it now
+static int comm_preempt_check(struct comm_session *sess)
+{
+	if (sess->lookahead_len < sizeof(sess->lookahead)) {
+		int n = comm_rx_read_stream(sess, (uint8_t *)&sess->lookahead + sess->lookahead_len,
+					    sizeof(sess->lookahead) - sess->lookahead_len);
+		if (n < 0) {
+			return n;
+		}
+
+		sess->lookahead_len += n;
+		if (sess->lookahead_len < sizeof(sess->lookahead)) {
+			return 0;
+		}
+	} else if (sess->preempt_done) {
+		return 0;
+	}
+
+	const struct comm_command *cmd = find_command_desc(sess, sess->lookahead);
+	if (!cmd || !cmd->preempt || !cmd->handle || sess->standby) {
+		// Wait for it in the usual way
+		return 0;
+	}
+
+	assert((cmd->nargs == 0) && !cmd->size);
+	DEBUG_printf("running '%c%c%c%c' early\n", cmd->opcode, cmd->opcode >> 8,
+		     cmd->opcode >> 16, cmd->opcode >> 24);
+	sess->preempt_rsp[0] = cmd->handle(NULL, NULL, sess->preempt_rsp + 1, NULL);
+	sess->preempt_done = true;
+
+	return 0;
+}
+
+// Run as many commands as possible from the received data. Stops when
+// there's not enough data for the next step, or a response is waiting for
+// space in the transport.
+static int comm_rx_process(struct comm_session *sess)
+{
+	while (comm_rx_wanted(sess)) {
+		int n = comm_rx_read(sess, sess->rx_dst, sess->rx_bytes_needed);
+		if (n < 0) {
+			return n;
+		} else if (n == 0) {
+			break;
+		}
+
+		sess->rx_dst += n;
+		sess->rx_bytes_needed -= n;
+		if (sess->rx_bytes_needed) {
+			continue;
+		}
+
+		int res = comm_rx_complete(sess);
+		if (res) {
+			return res;
+		}
+	}
+
+	return 0;
+}
+
+static int comm_session_step(struct comm_session *sess)
+{
+	int res;
+
+	if (sess->conn_state == CONN_STATE_CLOSED) {
+		return 0;
+	}
+
+	if (sess->conn_state == CONN_STATE_HANDLE) {
+		// The client is waiting for us, that's not its fault
+		sess->last_activity_ms = comm_now_ms();
+		res = comm_preempt_check(sess);
+		if (res) {
+			return res;
+		}
+
+		res = comm_data_complete(sess);
+		if (res) {
+			return res;
+		}
+	}
+
+	if (comm_tx_pending(sess)) {
+		if (comm_tx_flush(sess)) {
+			return -1;
+		}
+
+		if (comm_tx_pending(sess)) {
+			// Still no space
+			return 0;
+		}
+
+		if (sess->conn_state == CONN_STATE_WRITE_RESP) {
+			res = comm_response_complete(sess);
+			if (res) {
+				return res;
+			}
+		}
+	}
+
+	if (sess->conn_state == CONN_STATE_WRITE_ERROR) {
+		// Close once the error has been delivered
+		return sess->ops->tx_done(sess->priv) ? -1 : 0;
+	}
+
+	return comm_rx_process(sess);
+}
+
+// True if the client is part way through a command, or hasn't received all
+// of a response
+static bool comm_session_mid_command(struct comm_session *sess)
+{
+	switch (sess->conn_state) {
+	case CONN_STATE_WAIT_FOR_SYNC:
+	case CONN_STATE_READ_OPCODE:
+		return (sess->rx_bytes_needed != sizeof(uint32_t)) ||
+		       (sess->rx_frame_have != 0) ||
+		       !sess->ops->tx_done(sess->priv);
+	default:
+		return true;
+	}
+}
+
+static bool comm_session_timed_out(struct comm_session *sess)
+{
+	uint32_t timeout_ms;
+
+	if (sess->conn_state == CONN_STATE_CLOSED) {
+		return false;
+	}
+
+	if (sess->standby || comm_session_mid_command(sess)) {
+		timeout_ms = sess->progress_timeout_ms;
+	} else {
+		timeout_ms = sess->idle_timeout_ms;
+	}
+
+	return timeout_ms && ((comm_now_ms() - sess->last_activity_ms) > timeout_ms);
+}
+
+int comm_session_process(struct comm_session *sess)
+{
+	int res = comm_session_step(sess);
+	if (!res && comm_session_timed_out(sess)) {
+		DEBUG_printf("session timed out in state %d\n", sess->conn_state);
+		res = COMM_SESSION_TIMED_OUT;
+	}
+
+	if (res) {
+		comm_session_close(sess);
+	}
+
+	return res;
+}
+
+void comm_session_open(struct comm_session *sess)
+{
+	sess->tx_len = 0;
+	sess->tx_offs = 0;
+	sess->secure = false;
+	sess->rx_counter = 0;
+	sess->tx_counter = 0;
+	sess->rx_frame_have = 0;
+	sess->plain_offs = 0;
+	sess->plain_len = 0;
+	sess->lookahead_len = 0;
+	sess->lookahead_offs = 0;
+	sess->preempt_done = false;
+	sess->standby = false;
+	sess->last_activity_ms = comm_now_ms();
+
+	comm_sync_begin(sess);
+}
+
+void comm_session_close(struct comm_session *sess)
+{
+	comm_set_state(sess, CONN_STATE_CLOSED);
+	sess->rx_bytes_needed = 0;
+	sess->tx_len = 0;
+	sess->tx_offs = 0;
+}
+
+bool comm_session_is_open(struct comm_session *sess)
+{
+	return sess->conn_state != CONN_STATE_CLOSED;
+}
+
+void comm_session_set_standby(struct comm_session *sess, bool standby)
+{
+	sess->standby = standby;
+}
+
+bool comm_session_is_standby(struct comm_session *sess)
+{
+	return sess->standby;
+}
+
+void comm_session_set_timeouts(struct comm_session *sess, uint32_t idle_ms, uint32_t progress_ms)
+{
+	sess->idle_timeout_ms = idle_ms;
+	sess->progress_timeout_ms = progress_ms;
+}
+
+struct comm_session *comm_session_new(const struct comm_table *table,
+		const struct comm_transport_ops *ops, void *priv)
+{
+	struct comm_session *sess = pool_alloc(&session_pool);
+	if (!sess) {
+		return NULL;
+	}
+	memset(sess, 0, sizeof(*sess));
+
+	unsigned int i;
+	for (i = 0; i < table->n_cmds; i++) {
+		assert(table->cmds[i]->nargs <= COMM_MAX_NARG);
+		assert(table->cmds[i]->resp_nargs <= COMM_MAX_NARG);
+	}
+
+	if (table->psk) {
+		sess->rx_frame = pool_alloc(&frame_pool);
+		sess->tx_frame = pool_alloc(&frame_pool);
+		if (!sess->rx_frame || !sess->tx_frame) {
+			comm_session_delete(sess);
+			return NULL;
+		}
+	}
+
+	sess->table = table;
+	sess->ops = ops;
+	sess->priv = priv;
+	comm_session_close(sess);
+
+	return sess;
+}
+
+void comm_session_delete(struct comm_session *sess)
+{
+	pool_free(&frame_pool, sess->rx_frame);
+	pool_free(&frame_pool, sess->tx_frame);
+	pool_free(&session_pool, sess);
+}
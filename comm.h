@@ -0,0 +1,203 @@
+/**
+ * Copyright (c) 2022 Brian Starkey <stark3y@gmail.com>
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+#ifndef __COMM_H__
+#define __COMM_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "aead.h"
+
+/*
+ * The command protocol, independent of how the bytes get there. Each backend
+ * (tcp_comm, usb_comm, uart_comm) provides a byte stream, and runs a
+ * comm_session on it, sharing the same table of commands.
+ */
+
+#define COMM_MAX_DATA_LEN 1024
+#define COMM_RSP_OK       (('O' << 0) | ('K' << 8) | ('O' << 16) | ('K' << 24))
+#define COMM_RSP_ERR      (('E' << 0) | ('R' << 8) | ('R' << 16) | ('!' << 24))
+
+/*
+ * Not sent on the wire. A handler can return this (without having done
+ * anything) if it can't run yet, e.g. because a background job needs to
+ * finish first. The session stalls, and the handler gets called again
+ * on the next comm_session_process(). Meanwhile, the only command which
+ * gets looked at is the next one, and only to run it early if it's a
+ * preempt command (see struct comm_command).
+ */
+#define COMM_RSP_BUSY     (('B' << 0) | ('U' << 8) | ('S' << 16) | ('Y' << 24))
+
+/*
+ * BTCH len [frames]
+ * OKOK n_run [status resp_args]...
+ *
+ * Handled by comm itself. The data is a list of ordinary command frames
+ * (opcode, args, data), which are run in order, stopping at the first one
+ * which fails. The response holds the status and response args of each
+ * command which was run, so the last status is ERR! if one failed.
+ * Commands with response data (READ) and nested batches aren't allowed,
+ * and neither are data lengths which aren't a multiple of 4. If the batch is
+ * malformed, none of it is run and the response is just ERR!.
+ */
+#define COMM_BATCH_OPCODE    (('B' << 0) | ('T' << 8) | ('C' << 16) | ('H' << 24))
+#define COMM_MAX_BATCH_LEN   (4 * (COMM_MAX_DATA_LEN + 64))
+#define COMM_MAX_BATCH_ITEMS 32
+
+/*
+ * AUTH client_nonce[16]
+ * OKOK device_nonce[16]
+ *
+ * Handled by comm itself, and only when the command table has a PSK, in
+ * which case nothing except SYNC and AUTH is accepted until it has been done.
+ * Both nonces are random, and the session key is:
+ *
+ *   HChaCha20(HChaCha20(psk, client_nonce), device_nonce)
+ *
+ * After the (plain) AUTH response, everything in both directions is sent in
+ * sealed frames:
+ *
+ *   len (u32), ChaCha20-Poly1305 ciphertext (len bytes), tag (16 bytes)
+ *
+ * The len field is the associated data, and the nonce is a direction (u32,
+ * 0 to the device, 1 to the host) followed by the number of frames already
+ * sent in that direction (u64). Frames don't need to line up with commands,
+ * but len can't be more than the biggest command (a full batch). A frame is
+ * checked before any of it is parsed, and one which fails closes the
+ * session.
+ */
+#define COMM_AUTH_OPCODE (('A' << 0) | ('U' << 8) | ('T' << 16) | ('H' << 24))
+#define COMM_PSK_LEN     32
+
+// Sealed frames are: len, ciphertext, tag
+#define COMM_FRAME_OVERHEAD (sizeof(uint32_t) + AEAD_TAG_LEN)
+#define COMM_DIR_TO_DEVICE  0
+#define COMM_DIR_TO_HOST    1
+
+/*
+ * TAKE
+ * OKOK
+ *
+ * Handled by comm itself. A backend which already has a client can open a
+ * session for another one in standby, where nothing except SYNC, AUTH and
+ * TAKE is accepted. TAKE has the backend drop the other client (e.g. one
+ * which vanished without closing the connection), and makes this session the
+ * active one. With a PSK it has to come after AUTH, like everything else.
+ * Outside of standby it does nothing.
+ */
+#define COMM_TAKEOVER_OPCODE (('T' << 0) | ('A' << 8) | ('K' << 16) | ('E' << 24))
+
+/*
+ * A session is closed if the client stops making progress in the middle of a
+ * command (including not acknowledging a response) for
+ * PICOWOTA_PROGRESS_TIMEOUT_S, or, if the backend asks for it, sends nothing
+ * at all for PICOWOTA_IDLE_TIMEOUT_S. Sessions in standby only get the
+ * progress timeout, however idle they are.
+ */
+#ifndef PICOWOTA_IDLE_TIMEOUT_S
+#define PICOWOTA_IDLE_TIMEOUT_S 60
+#endif
+
+#ifndef PICOWOTA_PROGRESS_TIMEOUT_S
+#define PICOWOTA_PROGRESS_TIMEOUT_S 10
+#endif
+
+// Returned by comm_session_process() when a timeout closed the session
+#define COMM_SESSION_TIMED_OUT 2
+
+// Maximum number of sessions open at once (two for TCP, one each for USB
+// and UART)
+#ifndef COMM_MAX_SESSIONS
+#define COMM_MAX_SESSIONS 2
+#endif
+
+struct comm_command {
+	uint32_t opcode;
+	uint32_t nargs;
+	uint32_t resp_nargs;
+	uint32_t (*size)(uint32_t *args_in, uint32_t *data_len_out, uint32_t *resp_data_len_out);
+	uint32_t (*handle)(uint32_t *args_in, uint8_t *data_in, uint32_t *resp_args_out, uint8_t *resp_data_out);
+	/*
+	 * Optional, for commands whose work is cheaper done in bulk. In a
+	 * batch, queue() is used instead of handle(), and can leave the work
+	 * (and filling in resp_args_out) until flush(). args_in, data_in and
+	 * resp_args_out stay valid until then. flush() gets called before any
+	 * other command in the batch runs, and whenever the batch stops (when
+	 * it's done, a command fails, or one is busy).
+	 */
+	uint32_t (*queue)(uint32_t *args_in, uint8_t *data_in, uint32_t *resp_args_out);
+	void (*flush)(void);
+	/*
+	 * Run as soon as it arrives, even if the command in front of it is
+	 * stalled on COMM_RSP_BUSY, so that it can cancel whatever that
+	 * command is waiting for (ABRT). Only for commands with no args or
+	 * data, and not in a batch. The response still comes back in order,
+	 * after the stalled command's.
+	 */
+	bool preempt;
+};
+
+struct comm_table {
+	const struct comm_command *const *cmds;
+	unsigned int n_cmds;
+	uint32_t sync_opcode;
+	// If set, sessions must AUTH first. Must stay valid.
+	const uint8_t *psk;
+};
+
+/*
+ * Provided by a backend. Both directions can move any number of bytes at a
+ * time, so the backend's own buffering can be as small as it likes.
+ */
+struct comm_transport_ops {
+	// Copy up to len received bytes to dst, and consume them. Returns the
+	// number copied, 0 if there's nothing waiting.
+	uint32_t (*read)(void *priv, uint8_t *dst, uint32_t len);
+	// Queue up to len bytes for sending. Returns the number queued (0 if
+	// there's no space yet), or -1 on error.
+	int (*write)(void *priv, const uint8_t *src, uint32_t len);
+	// True once everything written has been delivered
+	bool (*tx_done)(void *priv);
+	// Optional. Drop the client which this (standby) session is taking
+	// over from. Returns 0 on success.
+	int (*takeover)(void *priv);
+};
+
+struct comm_session;
+
+// Returns NULL if there are already COMM_MAX_SESSIONS sessions
+struct comm_session *comm_session_new(const struct comm_table *table,
+		const struct comm_transport_ops *ops, void *priv);
+void comm_session_delete(struct comm_session *sess);
+
+// Start a new connection: wait for SYNC, unauthenticated
+void comm_session_open(struct comm_session *sess);
+// The connection has gone, stop processing
+void comm_session_close(struct comm_session *sess);
+bool comm_session_is_open(struct comm_session *sess);
+
+// Only let the session take over (see COMM_TAKEOVER_OPCODE), or make it a
+// normal session again, e.g. once the other client has gone. Call after
+// comm_session_open().
+void comm_session_set_standby(struct comm_session *sess, bool standby);
+bool comm_session_is_standby(struct comm_session *sess);
+
+// In milliseconds, 0 for no timeout. Both are 0 for a new session.
+void comm_session_set_timeouts(struct comm_session *sess, uint32_t idle_ms, uint32_t progress_ms);
+
+/*
+ * Make as much progress as possible: retry a handler which returned
+ * COMM_RSP_BUSY, send a response which was waiting for space, and run
+ * commands from the received data. Call it whenever data arrives, data has
+ * been sent, or a background job makes progress.
+ *
+ * Returns non-zero if the connection should be closed (the session is
+ * already closed): COMM_SESSION_TIMED_OUT if the client stopped responding,
+ * otherwise -1.
+ */
+int comm_session_process(struct comm_session *sess);
+
+#endif /* __COMM_H__ */
@@ -65,6 +65,7 @@
 
 #define DEFAULT_DNS MAKE_IP4(8, 8, 8, 8)
 #define DEFAULT_LEASE_TIME_S (24 * 60 * 60) // in seconds
+#define DHCPS_OFFER_HOLD_S (120) // how long an OFFER reserves an address
 
 #define MAC_LEN (6)
 #define MAKE_IP4(a, b, c, d) ((a) << 24 | (b) << 16 | (c) << 8 | (d))
@@ -116,29 +117,16 @@ static int dhcp_socket_bind(struct udp_pcb **udp, uint32_t ip, uint16_t port) {
     return udp_bind(*udp, &addr, port);
 }
 
-static int dhcp_socket_sendto(struct udp_pcb **udp, const void *buf, size_t len, uint32_t ip, uint16_t port) {
-    if (len > 0xffff) {
-        len = 0xffff;
-    }
-
-    struct pbuf *p = pbuf_alloc(PBUF_TRANSPORT, len, PBUF_RAM);
-    if (p == NULL) {
-        return -ENOMEM;
-    }
-
-    memcpy(p->payload, buf, len);
-
+static int dhcp_socket_sendto(struct udp_pcb **udp, struct pbuf *p, uint32_t ip, uint16_t port) {
     ip_addr_t dest;
     IP4_ADDR(&dest, ip >> 24 & 0xff, ip >> 16 & 0xff, ip >> 8 & 0xff, ip & 0xff);
     err_t err = udp_sendto(*udp, p, &dest, port);
 
-    pbuf_free(p);
-
     if (err != ERR_OK) {
         return err;
     }
 
-    return len;
+    return p->tot_len;
 }
 
 static uint8_t *opt_find(uint8_t *opt, uint8_t cmd) {
@@ -146,6 +134,10 @@ static uint8_t *opt_find(uint8_t *opt, uint8_t cmd) {
         if (opt[i] == cmd) {
             return &opt[i];
         }
+        if (opt[i] == DHCP_OPT_PAD) {
+            i++;
+            continue;
+        }
         i += 2 + opt[i + 1];
     }
     return NULL;
@@ -178,97 +170,231 @@ static void opt_write_u32(uint8_t **opt, uint8_t cmd, uint32_t val) {
     *opt = o;
 }
 
+static uint32_t lease_hash(const uint8_t *mac) {
+    // FNV-1a
+    uint32_t h = 2166136261;
+    for (int i = 0; i < MAC_LEN; ++i) {
+        h = (h ^ mac[i]) * 16777619;
+    }
+    return h & (DHCPS_HASH_BUCKETS - 1);
+}
+
+static bool lease_expired(const dhcp_server_lease_t *lease) {
+    uint32_t expiry = lease->expiry << 16 | 0xffff;
+    return (int32_t)(expiry - cyw43_hal_ticks_ms()) < 0;
+}
+
+static void lease_set_expiry(dhcp_server_lease_t *lease, uint32_t seconds) {
+    lease->expiry = (cyw43_hal_ticks_ms() + seconds * 1000) >> 16;
+}
+
+static void lease_expire(dhcp_server_lease_t *lease) {
+    lease->expiry = (cyw43_hal_ticks_ms() >> 16) - 1;
+}
+
+static int lease_lookup(dhcp_server_t *d, const uint8_t *mac) {
+    for (uint16_t i = d->hash[lease_hash(mac)]; i != DHCPS_LEASE_NONE; i = d->lease[i].next) {
+        if (memcmp(d->lease[i].mac, mac, MAC_LEN) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static void lease_unlink(dhcp_server_t *d, int idx) {
+    dhcp_server_lease_t *lease = &d->lease[idx];
+    if (memcmp(lease->mac, "\x00\x00\x00\x00\x00\x00", MAC_LEN) == 0) {
+        // Never hashed
+        return;
+    }
+
+    uint16_t *link = &d->hash[lease_hash(lease->mac)];
+    while (*link != DHCPS_LEASE_NONE) {
+        if (*link == idx) {
+            *link = lease->next;
+            break;
+        }
+        link = &d->lease[*link].next;
+    }
+    lease->next = DHCPS_LEASE_NONE;
+    memset(lease->mac, 0, MAC_LEN);
+}
+
+// Give lease idx to mac, taking it from whoever had it before
+static void lease_assign(dhcp_server_t *d, int idx, const uint8_t *mac) {
+    dhcp_server_lease_t *lease = &d->lease[idx];
+    if (memcmp(lease->mac, mac, MAC_LEN) == 0) {
+        return;
+    }
+
+    lease_unlink(d, idx);
+
+    uint32_t h = lease_hash(mac);
+    memcpy(lease->mac, mac, MAC_LEN);
+    lease->next = d->hash[h];
+    d->hash[h] = idx;
+}
+
+// Find a free (or expired) lease for a new client
+static int lease_alloc(dhcp_server_t *d) {
+    for (int n = 0; n < DHCPS_MAX_IP; ++n) {
+        int i = d->alloc_cursor;
+        d->alloc_cursor = (d->alloc_cursor + 1) % DHCPS_MAX_IP;
+        if (memcmp(d->lease[i].mac, "\x00\x00\x00\x00\x00\x00", MAC_LEN) == 0 ||
+            lease_expired(&d->lease[i])) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// Returns the lease index for ip, or -1 if it's not one of ours
+static int lease_index(dhcp_server_t *d, const uint8_t *ip) {
+    if (memcmp(ip, &d->ip.addr, 3) != 0) {
+        return -1;
+    }
+    int idx = ip[3] - DHCPS_BASE_IP;
+    if (idx < 0 || idx >= DHCPS_MAX_IP) {
+        return -1;
+    }
+    return idx;
+}
+
 static void dhcp_server_process(void *arg, struct udp_pcb *upcb, struct pbuf *p, const ip_addr_t *src_addr, u16_t src_port) {
     dhcp_server_t *d = arg;
     (void)upcb;
     (void)src_addr;
     (void)src_port;
 
-    // This is around 548 bytes
-    dhcp_msg_t dhcp_msg;
+    // The reply is built in-place in a copy of the request, directly in the
+    // pbuf which gets sent
+    struct pbuf *rp = NULL;
 
     #define DHCP_MIN_SIZE (240 + 3)
     if (p->tot_len < DHCP_MIN_SIZE) {
         goto ignore_request;
     }
 
-    size_t len = pbuf_copy_partial(p, &dhcp_msg, sizeof(dhcp_msg), 0);
-    if (len < DHCP_MIN_SIZE) {
+    rp = pbuf_alloc(PBUF_TRANSPORT, sizeof(dhcp_msg_t), PBUF_RAM);
+    if (rp == NULL) {
         goto ignore_request;
     }
+    dhcp_msg_t *dhcp_msg = rp->payload;
 
-    dhcp_msg.op = DHCPOFFER;
-    memcpy(&dhcp_msg.yiaddr, &d->ip.addr, 4);
+    size_t len = pbuf_copy_partial(p, dhcp_msg, sizeof(*dhcp_msg), 0);
+    if (len < DHCP_MIN_SIZE) {
+        goto ignore_request;
+    }
+    memset((uint8_t *)dhcp_msg + len, 0, sizeof(*dhcp_msg) - len);
 
-    uint8_t *opt = (uint8_t *)&dhcp_msg.options;
+    uint8_t *opt = (uint8_t *)&dhcp_msg->options;
     opt += 4; // assume magic cookie: 99, 130, 83, 99
 
-    switch (opt[2]) {
+    uint8_t *o = opt_find(opt, DHCP_OPT_MSG_TYPE);
+    if (o == NULL) {
+        goto ignore_request;
+    }
+    uint8_t msg_type = o[2];
+
+    dhcp_msg->op = DHCPOFFER;
+    memcpy(&dhcp_msg->yiaddr, &d->ip.addr, 4);
+
+    switch (msg_type) {
         case DHCPDISCOVER: {
-            int yi = DHCPS_MAX_IP;
-            for (int i = 0; i < DHCPS_MAX_IP; ++i) {
-                if (memcmp(d->lease[i].mac, dhcp_msg.chaddr, MAC_LEN) == 0) {
-                    // MAC match, use this IP address
-                    yi = i;
-                    break;
+            int yi = lease_lookup(d, dhcp_msg->chaddr);
+            if (yi >= 0 && !lease_expired(&d->lease[yi])) {
+                // Already bound (or offered): offer the same address again,
+                // without cutting a bound lease down to the offer hold
+            } else {
+                if (yi < 0) {
+                    yi = lease_alloc(d);
                 }
-                if (yi == DHCPS_MAX_IP) {
-                    // Look for a free IP address
-                    if (memcmp(d->lease[i].mac, "\x00\x00\x00\x00\x00\x00", MAC_LEN) == 0) {
-                        // IP available
-                        yi = i;
-                    }
-                    uint32_t expiry = d->lease[i].expiry << 16 | 0xffff;
-                    if ((int32_t)(expiry - cyw43_hal_ticks_ms()) < 0) {
-                        // IP expired, reuse it
-                        memset(d->lease[i].mac, 0, MAC_LEN);
-                        yi = i;
-                    }
+                if (yi < 0) {
+                    // No more IP addresses left
+                    goto ignore_request;
                 }
+                // Hold the address for this client for a short while, so
+                // that concurrent DISCOVERs don't get offered the same one
+                lease_assign(d, yi, dhcp_msg->chaddr);
+                lease_set_expiry(&d->lease[yi], DHCPS_OFFER_HOLD_S);
             }
-            if (yi == DHCPS_MAX_IP) {
-                // No more IP addresses left
-                goto ignore_request;
-            }
-            dhcp_msg.yiaddr[3] = DHCPS_BASE_IP + yi;
+            dhcp_msg->yiaddr[3] = DHCPS_BASE_IP + yi;
             opt_write_u8(&opt, DHCP_OPT_MSG_TYPE, DHCPOFFER);
             break;
         }
 
         case DHCPREQUEST: {
-            uint8_t *o = opt_find(opt, DHCP_OPT_REQUESTED_IP);
-            if (o == NULL) {
-                // Should be NACK
+            o = opt_find(opt, DHCP_OPT_SERVER_ID);
+            if (o != NULL && memcmp(o + 2, &d->ip.addr, 4) != 0) {
+                // Client picked a different server, let go of our offer
+                int yi = lease_lookup(d, dhcp_msg->chaddr);
+                if (yi >= 0) {
+                    lease_expire(&d->lease[yi]);
+                }
                 goto ignore_request;
             }
-            if (memcmp(o + 2, &d->ip.addr, 3) != 0) {
-                // Should be NACK
-                goto ignore_request;
+
+            // SELECTING/INIT-REBOOT clients use the option, RENEWING and
+            // REBINDING ones use ciaddr
+            uint8_t *req_ip;
+            o = opt_find(opt, DHCP_OPT_REQUESTED_IP);
+            if (o != NULL) {
+                req_ip = o + 2;
+            } else {
+                req_ip = dhcp_msg->ciaddr;
             }
-            uint8_t yi = o[5] - DHCPS_BASE_IP;
-            if (yi >= DHCPS_MAX_IP) {
-                // Should be NACK
-                goto ignore_request;
+
+            int yi = lease_index(d, req_ip);
+            if (yi < 0) {
+                goto nak_request;
             }
-            if (memcmp(d->lease[yi].mac, dhcp_msg.chaddr, MAC_LEN) == 0) {
+
+            int cur = lease_lookup(d, dhcp_msg->chaddr);
+            if (cur == yi) {
                 // MAC match, ok to use this IP address
-            } else if (memcmp(d->lease[yi].mac, "\x00\x00\x00\x00\x00\x00", MAC_LEN) == 0) {
+            } else if (memcmp(d->lease[yi].mac, "\x00\x00\x00\x00\x00\x00", MAC_LEN) == 0 ||
+                lease_expired(&d->lease[yi])) {
                 // IP unused, ok to use this IP address
-                memcpy(d->lease[yi].mac, dhcp_msg.chaddr, MAC_LEN);
+                lease_assign(d, yi, dhcp_msg->chaddr);
+                if (cur >= 0) {
+                    // Release whatever we offered before
+                    lease_expire(&d->lease[cur]);
+                }
             } else {
                 // IP already in use
-                // Should be NACK
-                goto ignore_request;
+                goto nak_request;
             }
-            d->lease[yi].expiry = (cyw43_hal_ticks_ms() + DEFAULT_LEASE_TIME_S * 1000) >> 16;
-            dhcp_msg.yiaddr[3] = DHCPS_BASE_IP + yi;
+            lease_set_expiry(&d->lease[yi], DEFAULT_LEASE_TIME_S);
+            dhcp_msg->yiaddr[3] = DHCPS_BASE_IP + yi;
             opt_write_u8(&opt, DHCP_OPT_MSG_TYPE, DHCPACK);
             printf("DHCPS: client connected: MAC=%02x:%02x:%02x:%02x:%02x:%02x IP=%u.%u.%u.%u\n",
-                dhcp_msg.chaddr[0], dhcp_msg.chaddr[1], dhcp_msg.chaddr[2], dhcp_msg.chaddr[3], dhcp_msg.chaddr[4], dhcp_msg.chaddr[5],
-                dhcp_msg.yiaddr[0], dhcp_msg.yiaddr[1], dhcp_msg.yiaddr[2], dhcp_msg.yiaddr[3]);
+                dhcp_msg->chaddr[0], dhcp_msg->chaddr[1], dhcp_msg->chaddr[2], dhcp_msg->chaddr[3], dhcp_msg->chaddr[4], dhcp_msg->chaddr[5],
+                dhcp_msg->yiaddr[0], dhcp_msg->yiaddr[1], dhcp_msg->yiaddr[2], dhcp_msg->yiaddr[3]);
             break;
         }
 
+        case DHCPDECLINE: {
+            // Someone else is using the address, don't hand it out again
+            // until the lease time has passed
+            o = opt_find(opt, DHCP_OPT_REQUESTED_IP);
+            int yi = o ? lease_index(d, o + 2) : -1;
+            if (yi >= 0 && lease_lookup(d, dhcp_msg->chaddr) == yi) {
+                lease_assign(d, yi, (const uint8_t *)"\xff\xff\xff\xff\xff\xff");
+                lease_set_expiry(&d->lease[yi], DEFAULT_LEASE_TIME_S);
+            }
+            goto ignore_request;
+        }
+
+        case DHCPRELEASE: {
+            int yi = lease_index(d, dhcp_msg->ciaddr);
+            if (yi >= 0 && lease_lookup(d, dhcp_msg->chaddr) == yi) {
+                // Keep the MAC, so the client gets the same address back
+                // if nobody else has taken it in the meantime
+                lease_expire(&d->lease[yi]);
+            }
+            goto ignore_request;
+        }
+
         default:
             goto ignore_request;
     }
@@ -278,10 +404,24 @@ static void dhcp_server_process(void *arg, struct udp_pcb *upcb, struct pbuf *p,
     opt_write_n(&opt, DHCP_OPT_ROUTER, 4, &d->ip.addr); // aka gateway; can have mulitple addresses
     opt_write_u32(&opt, DHCP_OPT_DNS, DEFAULT_DNS); // can have mulitple addresses
     opt_write_u32(&opt, DHCP_OPT_IP_LEASE_TIME, DEFAULT_LEASE_TIME_S);
+    goto send_reply;
+
+nak_request:
+    memset(dhcp_msg->ciaddr, 0, sizeof(dhcp_msg->ciaddr));
+    memset(dhcp_msg->yiaddr, 0, sizeof(dhcp_msg->yiaddr));
+    memset(dhcp_msg->siaddr, 0, sizeof(dhcp_msg->siaddr));
+    opt_write_u8(&opt, DHCP_OPT_MSG_TYPE, DHCPNACK);
+    opt_write_n(&opt, DHCP_OPT_SERVER_ID, 4, &d->ip.addr);
+
+send_reply:
     *opt++ = DHCP_OPT_END;
-    dhcp_socket_sendto(&d->udp, &dhcp_msg, opt - (uint8_t *)&dhcp_msg, 0xffffffff, PORT_DHCP_CLIENT);
+    pbuf_realloc(rp, opt - (uint8_t *)dhcp_msg);
+    dhcp_socket_sendto(&d->udp, rp, 0xffffffff, PORT_DHCP_CLIENT);
 
 ignore_request:
+    if (rp != NULL) {
+        pbuf_free(rp);
+    }
     pbuf_free(p);
 }
 
@@ -289,6 +429,13 @@ void dhcp_server_init(dhcp_server_t *d, ip_addr_t *ip, ip_addr_t *nm) {
     ip_addr_copy(d->ip, *ip);
     ip_addr_copy(d->nm, *nm);
     memset(d->lease, 0, sizeof(d->lease));
+    for (int i = 0; i < DHCPS_MAX_IP; ++i) {
+        d->lease[i].next = DHCPS_LEASE_NONE;
+    }
+    for (int i = 0; i < DHCPS_HASH_BUCKETS; ++i) {
+        d->hash[i] = DHCPS_LEASE_NONE;
+    }
+    d->alloc_cursor = 0;
     if (dhcp_socket_new_dgram(&d->udp, d, dhcp_server_process) != 0) {
         return;
     }
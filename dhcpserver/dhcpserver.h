@@ -29,17 +29,36 @@
 #include "lwip/ip_addr.h"
 
 #define DHCPS_BASE_IP (16)
+
+// Size of the lease pool. Leases map 1:1 to addresses starting at
+// DHCPS_BASE_IP, so this can be at most 254 - DHCPS_BASE_IP + 1 on a /24
+#ifndef DHCPS_MAX_IP
 #define DHCPS_MAX_IP (8)
+#endif
+
+#if (DHCPS_BASE_IP + DHCPS_MAX_IP) > 255
+#error "DHCPS_MAX_IP too large for DHCPS_BASE_IP"
+#endif
+
+// Number of buckets in the MAC -> lease hash table, must be a power of 2
+#ifndef DHCPS_HASH_BUCKETS
+#define DHCPS_HASH_BUCKETS (DHCPS_MAX_IP <= 16 ? 16 : DHCPS_MAX_IP <= 64 ? 64 : 256)
+#endif
+
+#define DHCPS_LEASE_NONE (0xffff)
 
 typedef struct _dhcp_server_lease_t {
     uint8_t mac[6];
     uint16_t expiry;
+    uint16_t next; // next lease in the same hash bucket
 } dhcp_server_lease_t;
 
 typedef struct _dhcp_server_t {
     ip_addr_t ip;
     ip_addr_t nm;
     dhcp_server_lease_t lease[DHCPS_MAX_IP];
+    uint16_t hash[DHCPS_HASH_BUCKETS];
+    uint16_t alloc_cursor;
     struct udp_pcb *udp;
 } dhcp_server_t;
 
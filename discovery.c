@@ -0,0 +1,172 @@
+/**
+ * Copyright (c) 2022 Brian Starkey <stark3y@gmail.com>
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+#include <stdio.h>
+#include <string.h>
+
+#include "lwip/apps/mdns.h"
+#include "lwip/pbuf.h"
+#include "lwip/udp.h"
+
+#include "discovery.h"
+
+#ifdef DEBUG
+#define DEBUG_printf(...) printf(__VA_ARGS__)
+#else
+#define DEBUG_printf(...) { }
+#endif
+
+#define HOSTNAME_PREFIX "picowota-"
+
+struct discovery_ctx {
+	struct netif *netif;
+	struct udp_pcb *udp;
+	uint16_t tcp_port;
+
+	discovery_info_fn info_fn;
+	void *info_arg;
+
+	char hostname[sizeof(HOSTNAME_PREFIX) + 16];
+};
+
+static struct discovery_ctx discovery;
+
+static void discovery_txt_item(struct mdns_service *service, const char *key, const char *fmt, uint32_t val)
+{
+	char txt[32];
+
+	int len = snprintf(txt, sizeof(txt), "%s=", key);
+	len += snprintf(txt + len, sizeof(txt) - len, fmt, val);
+	if (len >= sizeof(txt)) {
+		return;
+	}
+
+	mdns_resp_add_service_txtitem(service, txt, len);
+}
+
+static void discovery_mdns_txt(struct mdns_service *service, void *arg)
+{
+	struct discovery_ctx *ctx = arg;
+	struct discovery_info info = { 0 };
+	char txt[32];
+	int i, len;
+
+	ctx->info_fn(&info, ctx->info_arg);
+
+	len = snprintf(txt, sizeof(txt), "board=");
+	for (i = 0; i < sizeof(info.board_id); i++) {
+		len += snprintf(txt + len, sizeof(txt) - len, "%02X", info.board_id[i]);
+	}
+	mdns_resp_add_service_txtitem(service, txt, len);
+
+	discovery_txt_item(service, "flash", "%lu", info.flash_size);
+	discovery_txt_item(service, "build", "%08lx", info.build_id);
+	discovery_txt_item(service, "session", "%lu", info.session_active);
+}
+
+static void discovery_udp_recv(void *arg, struct udp_pcb *pcb, struct pbuf *p,
+		const ip_addr_t *addr, u16_t port)
+{
+	struct discovery_ctx *ctx = arg;
+	uint32_t query;
+
+	if (pbuf_copy_partial(p, &query, sizeof(query), 0) != sizeof(query) ||
+	    query != DISCOVERY_QUERY) {
+		pbuf_free(p);
+		return;
+	}
+	pbuf_free(p);
+
+	struct pbuf *rsp = pbuf_alloc(PBUF_TRANSPORT, sizeof(struct discovery_response), PBUF_RAM);
+	if (!rsp) {
+		return;
+	}
+
+	struct discovery_info info = { 0 };
+	ctx->info_fn(&info, ctx->info_arg);
+
+	struct discovery_response *r = rsp->payload;
+	r->magic = DISCOVERY_RESPONSE;
+	r->version = DISCOVERY_VERSION;
+	memcpy(r->board_id, info.board_id, sizeof(r->board_id));
+	r->flash_size = info.flash_size;
+	r->build_id = info.build_id;
+	r->flags = (info.session_active ? DISCOVERY_FLAG_SESSION_ACTIVE : 0) |
+		   (info.image_valid ? DISCOVERY_FLAG_IMAGE_VALID : 0);
+	r->tcp_port = ctx->tcp_port;
+
+	err_t err = udp_sendto(pcb, rsp, addr, port);
+	if (err != ERR_OK) {
+		DEBUG_printf("discovery: sendto failed %d\n", err);
+	}
+
+	pbuf_free(rsp);
+}
+
+int discovery_init(struct netif *netif, uint16_t port, uint16_t tcp_port,
+		discovery_info_fn info_fn, void *arg)
+{
+	struct discovery_ctx *ctx = &discovery;
+	struct discovery_info info = { 0 };
+	int i, len;
+
+	ctx->netif = netif;
+	ctx->tcp_port = tcp_port;
+	ctx->info_fn = info_fn;
+	ctx->info_arg = arg;
+
+	info_fn(&info, arg);
+	len = snprintf(ctx->hostname, sizeof(ctx->hostname), HOSTNAME_PREFIX);
+	for (i = 0; i < sizeof(info.board_id); i++) {
+		len += snprintf(ctx->hostname + len, sizeof(ctx->hostname) - len, "%02X", info.board_id[i]);
+	}
+
+	ctx->udp = udp_new_ip_type(IPADDR_TYPE_ANY);
+	if (!ctx->udp) {
+		return -1;
+	}
+
+	err_t err = udp_bind(ctx->udp, IP_ANY_TYPE, port);
+	if (err != ERR_OK) {
+		DEBUG_printf("discovery: failed to bind to port %d\n", port);
+		udp_remove(ctx->udp);
+		ctx->udp = NULL;
+		return -1;
+	}
+	udp_recv(ctx->udp, discovery_udp_recv, ctx);
+
+	mdns_resp_init();
+	err = mdns_resp_add_netif(netif, ctx->hostname);
+	if (err != ERR_OK) {
+		DEBUG_printf("discovery: mdns add netif failed %d\n", err);
+		return -1;
+	}
+
+	if (mdns_resp_add_service(netif, ctx->hostname, DISCOVERY_SERVICE, DNSSD_PROTO_TCP,
+				  tcp_port, discovery_mdns_txt, ctx) < 0) {
+		DEBUG_printf("discovery: mdns add service failed\n");
+		mdns_resp_remove_netif(netif);
+		return -1;
+	}
+
+	DEBUG_printf("discovery: advertising %s.local\n", ctx->hostname);
+
+	return 0;
+}
+
+void discovery_deinit(void)
+{
+	struct discovery_ctx *ctx = &discovery;
+
+	if (ctx->netif) {
+		mdns_resp_remove_netif(ctx->netif);
+		ctx->netif = NULL;
+	}
+
+	if (ctx->udp) {
+		udp_remove(ctx->udp);
+		ctx->udp = NULL;
+	}
+}
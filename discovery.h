@@ -0,0 +1,55 @@
+/**
+ * Copyright (c) 2022 Brian Starkey <stark3y@gmail.com>
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+#ifndef __DISCOVERY_H__
+#define __DISCOVERY_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "lwip/netif.h"
+
+// mDNS service type advertised by the bootloader: _picowota._tcp.local
+#define DISCOVERY_SERVICE "_picowota"
+
+// A UDP datagram starting with DISCOVERY_QUERY sent to the discovery port
+// (usually as a broadcast) gets a single struct discovery_response back.
+#define DISCOVERY_QUERY    (('W' << 0) | ('H' << 8) | ('O' << 16) | ('?' << 24))
+#define DISCOVERY_RESPONSE (('W' << 0) | ('O' << 8) | ('T' << 16) | ('A' << 24))
+#define DISCOVERY_VERSION  1
+
+#define DISCOVERY_FLAG_SESSION_ACTIVE (1 << 0)
+#define DISCOVERY_FLAG_IMAGE_VALID    (1 << 1)
+
+struct discovery_info {
+	uint8_t board_id[8];
+	uint32_t flash_size;
+	// CRC of the installed (sealed) app image, or 0 if there isn't one
+	uint32_t build_id;
+	bool image_valid;
+	bool session_active;
+};
+
+// All fields are little-endian on the wire
+struct discovery_response {
+	uint32_t magic;
+	uint32_t version;
+	uint8_t board_id[8];
+	uint32_t flash_size;
+	uint32_t build_id;
+	uint32_t flags;
+	uint32_t tcp_port;
+};
+
+typedef void (*discovery_info_fn)(struct discovery_info *info, void *arg);
+
+// Start the mDNS responder on netif and the UDP "who's there" responder on
+// port. info_fn is called every time a response needs to be built, so that
+// the session state is always current.
+int discovery_init(struct netif *netif, uint16_t port, uint16_t tcp_port,
+		discovery_info_fn info_fn, void *arg);
+void discovery_deinit(void);
+
+#endif /* __DISCOVERY_H__ */
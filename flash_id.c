@@ -0,0 +1,124 @@
+/**
+ * Copyright (c) 2022 Brian Starkey <stark3y@gmail.com>
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+#include <stdbool.h>
+#include <string.h>
+
+#include "pico.h"
+#include "hardware/flash.h"
+#include "hardware/sync.h"
+
+#include "flash_id.h"
+
+#ifdef DEBUG
+#include <stdio.h>
+#define DEBUG_printf(...) printf(__VA_ARGS__)
+#else
+#define DEBUG_printf(...) { }
+#endif
+
+#define FLASH_CMD_READ_JEDEC_ID 0x9f
+#define FLASH_CMD_READ_SFDP     0x5a
+
+#define SFDP_SIGNATURE          0x50444653 // "SFDP"
+#define SFDP_BASIC_TABLE_ID     0xff00
+
+// XIP can only address this much
+#define FLASH_ID_SIZE_MAX       (16 * 1024 * 1024)
+// Anything smaller than this is a misread
+#define FLASH_ID_SIZE_MIN       (128 * 1024)
+
+static void flash_id_cmd(const uint8_t *tx, uint8_t *rx, size_t count)
+{
+	uint32_t irq = save_and_disable_interrupts();
+	flash_do_cmd(tx, rx, count);
+	restore_interrupts(irq);
+}
+
+static inline uint32_t get_le32(const uint8_t *p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+// Read SFDP data: command, 3 address bytes and a dummy byte, then the data
+#define SFDP_READ_MAX 8
+static void sfdp_read(uint32_t addr, uint8_t *data, size_t len)
+{
+	uint8_t tx[5 + SFDP_READ_MAX] = {
+		FLASH_CMD_READ_SFDP, addr >> 16, addr >> 8, addr,
+	};
+	uint8_t rx[5 + SFDP_READ_MAX];
+
+	flash_id_cmd(tx, rx, 5 + len);
+	memcpy(data, rx + 5, len);
+}
+
+static uint64_t sfdp_size(void)
+{
+	uint8_t buf[SFDP_READ_MAX];
+
+	// Header: signature, minor, major, number of parameter headers - 1
+	sfdp_read(0, buf, 8);
+	if (get_le32(buf) != SFDP_SIGNATURE) {
+		return 0;
+	}
+
+	// The first parameter header is always the basic table:
+	// ID LSB, minor, major, length in dwords, 24-bit pointer, ID MSB
+	sfdp_read(8, buf, 8);
+	if (((buf[7] << 8) | buf[0]) != SFDP_BASIC_TABLE_ID || buf[3] < 2) {
+		return 0;
+	}
+
+	// The second dword of the table is the density, in bits
+	uint32_t table = buf[4] | (buf[5] << 8) | (buf[6] << 16);
+	sfdp_read(table + 4, buf, 4);
+	uint32_t density = get_le32(buf);
+
+	if (density & (1u << 31)) {
+		density &= ~(1u << 31);
+		return density < 64 ? (1ull << density) / 8 : 0;
+	}
+
+	return ((uint64_t)density + 1) / 8;
+}
+
+static uint64_t jedec_size(void)
+{
+	uint8_t tx[4] = { FLASH_CMD_READ_JEDEC_ID };
+	uint8_t rx[4];
+
+	flash_id_cmd(tx, rx, sizeof(tx));
+
+	// Manufacturer, memory type, capacity (log2 of the size in bytes, for
+	// nearly everyone)
+	uint8_t capacity = rx[3];
+	if (capacity >= 32) {
+		return 0;
+	}
+
+	return 1ull << capacity;
+}
+
+static bool size_ok(uint64_t size)
+{
+	return (size >= FLASH_ID_SIZE_MIN) && !(size & (size - 1));
+}
+
+uint32_t flash_id_size(void)
+{
+	uint64_t size = sfdp_size();
+
+	DEBUG_printf("flash_id: SFDP says %llu\n", size);
+	if (!size_ok(size)) {
+		size = jedec_size();
+		DEBUG_printf("flash_id: JEDEC ID says %llu\n", size);
+		if (!size_ok(size)) {
+			return 0;
+		}
+	}
+
+	return size > FLASH_ID_SIZE_MAX ? FLASH_ID_SIZE_MAX : size;
+}
@@ -0,0 +1,21 @@
+/**
+ * Copyright (c) 2022 Brian Starkey <stark3y@gmail.com>
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+#ifndef __FLASH_ID_H__
+#define __FLASH_ID_H__
+
+#include <stdint.h>
+
+/*
+ * Ask the flash chip how big it is: from the density in its SFDP basic
+ * parameter table, or failing that, the capacity byte of its JEDEC ID.
+ *
+ * Returns the size in bytes (at most the 16 MB which XIP can address), or 0
+ * if the chip didn't give a sensible answer. Flash is taken out of XIP mode
+ * to do this, so nothing else can be using it.
+ */
+uint32_t flash_id_size(void);
+
+#endif /* __FLASH_ID_H__ */
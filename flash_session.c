@@ -0,0 +1,125 @@
+/**
+ * Copyright (c) 2022 Brian Starkey <stark3y@gmail.com>
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "pico.h"
+#include "pico/bootrom.h"
+#include "pico/critical_section.h"
+#include "hardware/flash.h"
+#include "hardware/regs/addressmap.h"
+
+#include "flash_session.h"
+
+// The same as the SDK's flash_range_erase()
+#ifndef FLASH_BLOCK_ERASE_CMD
+#define FLASH_BLOCK_ERASE_CMD 0xd8
+#endif
+
+// boot2 gets copied to RAM, so that it can be run to put XIP back once
+// we're done
+#define BOOT2_SIZE_WORDS 64
+static uint32_t boot2_copyout[BOOT2_SIZE_WORDS];
+static bool boot2_copyout_valid;
+
+static critical_section_t flash_session_lock;
+
+static int flash_session_add(struct flash_session *s, uint32_t offs, const uint8_t *data, uint32_t len)
+{
+	if (s->n_ops == FLASH_SESSION_MAX_OPS) {
+		return -1;
+	}
+
+	s->ops[s->n_ops++] = (struct flash_session_op){
+		.offs = offs,
+		.len = len,
+		.data = data,
+	};
+
+	return 0;
+}
+
+int flash_session_erase(struct flash_session *s, uint32_t offs, uint32_t len)
+{
+	return flash_session_add(s, offs, NULL, len);
+}
+
+int flash_session_program(struct flash_session *s, uint32_t offs, const uint8_t *data, uint32_t len)
+{
+	return flash_session_add(s, offs, data, len);
+}
+
+static void __no_inline_not_in_flash_func(flash_session_boot2_copyout)(void)
+{
+	int i;
+
+	if (boot2_copyout_valid) {
+		return;
+	}
+
+	for (i = 0; i < BOOT2_SIZE_WORDS; i++) {
+		boot2_copyout[i] = ((uint32_t *)XIP_BASE)[i];
+	}
+
+	__compiler_memory_barrier();
+	boot2_copyout_valid = true;
+}
+
+static void __no_inline_not_in_flash_func(flash_session_do)(struct flash_session *s)
+{
+	rom_connect_internal_flash_fn connect_internal_flash =
+		(rom_connect_internal_flash_fn)rom_func_lookup_inline(ROM_FUNC_CONNECT_INTERNAL_FLASH);
+	rom_flash_exit_xip_fn flash_exit_xip =
+		(rom_flash_exit_xip_fn)rom_func_lookup_inline(ROM_FUNC_FLASH_EXIT_XIP);
+	rom_flash_range_erase_fn rom_erase =
+		(rom_flash_range_erase_fn)rom_func_lookup_inline(ROM_FUNC_FLASH_RANGE_ERASE);
+	rom_flash_range_program_fn rom_program =
+		(rom_flash_range_program_fn)rom_func_lookup_inline(ROM_FUNC_FLASH_RANGE_PROGRAM);
+	rom_flash_flush_cache_fn flash_flush_cache =
+		(rom_flash_flush_cache_fn)rom_func_lookup_inline(ROM_FUNC_FLASH_FLUSH_CACHE);
+	unsigned int i;
+
+	flash_session_boot2_copyout();
+
+	// No flash accesses from here until XIP is back
+	__compiler_memory_barrier();
+
+	connect_internal_flash();
+	flash_exit_xip();
+
+	for (i = 0; i < s->n_ops; i++) {
+		const struct flash_session_op *op = &s->ops[i];
+
+		if (op->data) {
+			rom_program(op->offs, op->data, op->len);
+		} else {
+			rom_erase(op->offs, op->len, FLASH_BLOCK_SIZE, FLASH_BLOCK_ERASE_CMD);
+		}
+	}
+
+	// Also needed to remove the CSn IO force
+	flash_flush_cache();
+	((void (*)(void))((intptr_t)boot2_copyout + 1))();
+
+	s->n_ops = 0;
+}
+
+void flash_session_run(struct flash_session *s)
+{
+	if (!s->n_ops) {
+		return;
+	}
+
+	// The first session runs from the main loop, long before anything
+	// could race with it
+	if (!critical_section_is_initialized(&flash_session_lock)) {
+		critical_section_init(&flash_session_lock);
+	}
+
+	critical_section_enter_blocking(&flash_session_lock);
+	flash_session_do(s);
+	critical_section_exit(&flash_session_lock);
+}
@@ -0,0 +1,53 @@
+/**
+ * Copyright (c) 2022 Brian Starkey <stark3y@gmail.com>
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+#ifndef __FLASH_SESSION_H__
+#define __FLASH_SESSION_H__
+
+#include <stdint.h>
+
+/*
+ * Every flash_range_erase() and flash_range_program() takes flash out of XIP
+ * mode, does the operation, flushes the XIP cache and then sets XIP up again
+ * with boot2. A flash session queues up any number of erases and programs,
+ * and then does all of them with one exit from (and return to) XIP, and one
+ * cache flush.
+ *
+ * Offsets are from the start of flash (like flash_range_*()), and the usual
+ * alignment rules apply. Data to program must not be in flash, and has to
+ * stay valid until flash_session_run().
+ */
+#ifndef FLASH_SESSION_MAX_OPS
+// Enough for a whole sector: an erase, and each of its pages
+#define FLASH_SESSION_MAX_OPS 17
+#endif
+
+struct flash_session_op {
+	uint32_t offs;
+	uint32_t len;
+	// NULL to erase
+	const uint8_t *data;
+};
+
+struct flash_session {
+	unsigned int n_ops;
+	struct flash_session_op ops[FLASH_SESSION_MAX_OPS];
+};
+
+static inline void flash_session_init(struct flash_session *s)
+{
+	s->n_ops = 0;
+}
+
+// Queue an operation. Returns -1 if the session is full.
+int flash_session_erase(struct flash_session *s, uint32_t offs, uint32_t len);
+int flash_session_program(struct flash_session *s, uint32_t offs, const uint8_t *data, uint32_t len);
+
+// Do everything which has been queued, and empty the session. Takes a
+// critical section of its own for the duration, so that nothing runs from
+// flash while it's out of XIP mode.
+void flash_session_run(struct flash_session *s);
+
+#endif /* __FLASH_SESSION_H__ */
@@ -0,0 +1,173 @@
+#!/usr/bin/env python3
+# Copyright (c) 2022 Brian Starkey <stark3y@gmail.com>
+#
+# SPDX-License-Identifier: BSD-3-Clause
+#
+# Print a per-module breakdown of text/rodata/data/bss from a GNU ld map file,
+# and fail if the flash image is bigger than the budget. Code which runs from
+# RAM (.time_critical, and the hot path with PICOWOTA_RAM_HOTPATH) is counted
+# as text, and in the RAM total.
+
+import argparse
+import collections
+import os
+import re
+import sys
+
+def any_int(x):
+    try:
+        return int(x, 0)
+    except:
+        raise argparse.ArgumentTypeError("expected an integer, not '{!r}'".format(x))
+
+parser = argparse.ArgumentParser()
+parser.add_argument("map", help="Linker map file")
+parser.add_argument("-s", "--start", help="Start address of the flash region being budgeted",
+                    type=any_int, default=0x10000000)
+parser.add_argument("-b", "--budget", help="Flash budget in bytes (0 = report only)",
+                    type=any_int, default=0)
+parser.add_argument("-e", "--end-symbol", help="Symbol marking the end of the flash image",
+                    default="__flash_binary_end")
+parser.add_argument("-n", "--top", help="Number of modules to list individually",
+                    type=int, default=30)
+args = parser.parse_args()
+
+CATEGORIES = ["text", "rodata", "data", "bss"]
+
+def categorise(out_section, in_section):
+    if out_section in (".heap", ".stack_dummy", ".stack1_dummy", ".flash_end", ".netcache"):
+        return None
+
+    prefixes = [
+        ("text", (".text", ".time_critical", ".picowota_hot", ".init", ".fini", ".vectors", ".boot2",
+                  ".reset", ".ARM.", ".eh_frame", ".binary_info", ".ctors", ".dtors")),
+        ("rodata", (".rodata", ".flashdata", ".big_const", ".picowota_cyw43_fw_desc")),
+        ("bss", (".bss", ".sbss", "COMMON", ".uninitialized_data", ".scratch_x", ".scratch_y")),
+        ("data", (".data", ".sdata", ".mutex_array", ".preinit_array", ".init_array",
+                  ".fini_array", ".after_data", "vtable", ".ram_vector_table")),
+    ]
+    for category, names in prefixes:
+        if in_section.startswith(names):
+            return category
+
+    return None
+
+def module_name(path):
+    # Archive members look like /path/to/libfoo.a(bar.o)
+    m = re.match(r"(.*\.a)\((.*)\)$", path)
+    if m:
+        return "{}({})".format(os.path.basename(m.group(1)), m.group(2))
+
+    name = os.path.basename(path)
+    if name.endswith(".obj"):
+        name = name[:-len(".obj")]
+
+    return name
+
+HEX = r"0x[0-9a-fA-F]+"
+out_section_re = re.compile(r"^(\.\S+|COMMON)(?:\s+(" + HEX + r")\s+(" + HEX + r"))?")
+in_section_re = re.compile(r"^ (\.\S+|COMMON)(?:\s+(" + HEX + r")\s+(" + HEX + r")\s+(\S.*))?$")
+continuation_re = re.compile(r"^\s+(" + HEX + r")\s+(" + HEX + r")\s+(\S.*)$")
+symbol_re = re.compile(r"^\s+(" + HEX + r")\s+([A-Za-z_][\w.]*)\s+=")
+
+modules = collections.defaultdict(lambda: collections.defaultdict(int))
+symbols = {}
+# Code which gets copied to RAM, by module
+ram_text = collections.defaultdict(int)
+
+try:
+    mapfile = open(args.map)
+except:
+    sys.exit("Could not open map file '{}'".format(args.map))
+
+with mapfile:
+    in_map = False
+    out_section = None
+    pending = None
+
+    for line in mapfile:
+        line = line.rstrip("\n")
+        if not in_map:
+            in_map = line.startswith("Linker script and memory map")
+            continue
+
+        m = symbol_re.match(line)
+        if m:
+            symbols[m.group(2)] = int(m.group(1), 16)
+            continue
+
+        m = out_section_re.match(line)
+        if m:
+            out_section = m.group(1)
+            pending = None
+            continue
+
+        m = in_section_re.match(line)
+        if m:
+            if m.group(2) is None:
+                # Long names wrap on to the next line
+                pending = m.group(1)
+                continue
+            in_section, addr, size, path = m.group(1), m.group(2), m.group(3), m.group(4)
+        elif pending:
+            m = continuation_re.match(line)
+            pending, in_section = None, pending
+            if not m:
+                continue
+            addr, size, path = m.group(1), m.group(2), m.group(3)
+        else:
+            continue
+
+        addr, size = int(addr, 16), int(size, 16)
+        if addr == 0 or size == 0:
+            # Discarded or debug info
+            continue
+
+        category = categorise(out_section, in_section)
+        if category:
+            modules[module_name(path)][category] += size
+            if category == "text" and out_section in (".data", ".scratch_x", ".scratch_y"):
+                ram_text[module_name(path)] += size
+
+totals = collections.defaultdict(int)
+for sizes in modules.values():
+    for c in CATEGORIES:
+        totals[c] += sizes[c]
+
+def flash_size(sizes):
+    return sizes["text"] + sizes["rodata"] + sizes["data"]
+
+ordered = sorted(modules.items(), key=lambda kv: flash_size(kv[1]) + kv[1]["bss"], reverse=True)
+
+row = "{:<48} {:>8} {:>8} {:>8} {:>8}"
+print(row.format("module", *CATEGORIES))
+for name, sizes in ordered[:args.top]:
+    print(row.format(name[:48], *[sizes[c] for c in CATEGORIES]))
+if len(ordered) > args.top:
+    others = collections.defaultdict(int)
+    for _, sizes in ordered[args.top:]:
+        for c in CATEGORIES:
+            others[c] += sizes[c]
+    print(row.format("({} others)".format(len(ordered) - args.top), *[others[c] for c in CATEGORIES]))
+print(row.format("total", *[totals[c] for c in CATEGORIES]))
+# There's no heap in use, so this is all of the RAM apart from the stacks
+code = sum(ram_text.values())
+print("ram: {} bytes static ({} data + bss, {} code)".format(totals["data"] + totals["bss"] + code,
+      totals["data"] + totals["bss"], code))
+hot = symbols.get("__picowota_hot_end", 0) - symbols.get("__picowota_hot_start", 0)
+if hot:
+    print("ram hot path: {} bytes, ram code by module:".format(hot))
+    for name, size in sorted(ram_text.items(), key=lambda kv: kv[1], reverse=True)[:args.top]:
+        print("  {:<46} {:>8}".format(name[:46], size))
+
+if args.end_symbol not in symbols:
+    sys.exit("Could not find {} in {}".format(args.end_symbol, args.map))
+
+used = symbols[args.end_symbol] - args.start
+if args.budget:
+    print("flash: {} of {} bytes ({:.1f}%), {} free".format(used, args.budget,
+          100.0 * used / args.budget, args.budget - used))
+    if used > args.budget:
+        sys.exit("ERROR: flash image is {} bytes over budget".format(used - args.budget))
+else:
+    print("flash: {} bytes".format(used))
@@ -37,8 +37,8 @@ def any_int(x):
 parser = argparse.ArgumentParser()
 parser.add_argument("ifile", help="Input application binary (binary)")
 parser.add_argument("ofile", help="Output header file (binary)")
-parser.add_argument("-a", "--addr", help="Load address of the application image",
-                    type=any_int, default=0x10004000)
+parser.add_argument("-a", "--addr", help="Load address of the application image (see PICOWOTA_APP_ADDR)",
+                    type=any_int)
 parser.add_argument("-m", "--map", help="Map file to scan for application image section")
 parser.add_argument("-s", "--section", help="Section name to look for in map file",
                     default=".app_bin")
@@ -62,8 +62,10 @@ if args.map:
 
     if vtor is None:
         sys.exit("Could not find section {} in {}".format(args.section,args.map))
-else:
+elif args.addr is not None:
     vtor = args.addr
+else:
+    sys.exit("One of --addr or --map is required")
 
 size = len(idata)
 crc = binascii.crc32(idata)
@@ -13,14 +13,13 @@
 #ifndef LWIP_SOCKET
 #define LWIP_SOCKET                 0
 #endif
-#if PICO_CYW43_ARCH_POLL
-#define MEM_LIBC_MALLOC             1
-#else
-// MEM_LIBC_MALLOC is incompatible with non polling versions
+// No heap: mem_malloc() comes from fixed-size pools (see lwippools.h), which
+// are statically allocated like the rest of the memp pools
 #define MEM_LIBC_MALLOC             0
-#endif
+#define MEM_USE_POOLS               1
+#define MEM_USE_POOLS_TRY_BIGGER_POOL 1
+#define MEMP_USE_CUSTOM_POOLS       1
 #define MEM_ALIGNMENT               4
-#define MEM_SIZE                    4000
 #define MEMP_NUM_TCP_SEG            32
 #define MEMP_NUM_ARP_QUEUE          10
 #define PBUF_POOL_SIZE              24
@@ -36,9 +35,12 @@
 #define LWIP_NETIF_LINK_CALLBACK    1
 #define LWIP_NETIF_HOSTNAME         1
 #define LWIP_NETCONN                0
+// Pool usage is reported by the POOL command, so keep MEMP_STATS in release
+// builds too
+#define LWIP_STATS                  1
 #define MEM_STATS                   0
 #define SYS_STATS                   0
-#define MEMP_STATS                  0
+#define MEMP_STATS                  1
 #define LINK_STATS                  0
 // #define ETH_PAD_SIZE                2
 #define LWIP_CHKSUM_ALGORITHM       3
@@ -52,9 +54,18 @@
 #define DHCP_DOES_ARP_CHECK         0
 #define LWIP_DHCP_DOES_ACD_CHECK    0
 
+#if PICOWOTA_DISCOVERY == 1
+// mDNS responder for _picowota._tcp discovery
+#define LWIP_MDNS_RESPONDER         1
+#define LWIP_IGMP                   1
+#define LWIP_NUM_NETIF_CLIENT_DATA  1
+#define LWIP_NETIF_EXT_STATUS_CALLBACK 1
+#define MDNS_RESP_USENETIF_EXTCALLBACK 1
+#define MEMP_NUM_SYS_TIMEOUT        (LWIP_NUM_SYS_TIMEOUT_INTERNAL + 3)
+#endif
+
 #ifndef NDEBUG
 #define LWIP_DEBUG                  1
-#define LWIP_STATS                  1
 #define LWIP_STATS_DISPLAY          1
 #endif
 
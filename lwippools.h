@@ -0,0 +1,51 @@
+/**
+ * Copyright (c) 2022 Brian Starkey <stark3y@gmail.com>
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+/*
+ * Pools backing lwIP's mem_malloc() (MEM_USE_POOLS), included by lwIP itself.
+ * An allocation takes a block from the smallest pool which is big enough, or
+ * the next one up if that's empty. The sizes have to be literals, as they end
+ * up in the pool names.
+ *
+ * All of the counts can be overridden at build time, and the POOL command
+ * reports the high-water mark of each pool, to help with sizing them.
+ */
+
+// Small TCP responses, UDP replies
+#ifndef PICOWOTA_MEMPOOL_256_LEN
+#define PICOWOTA_MEMPOOL_256_LEN  16
+#endif
+
+// DHCP messages, mDNS host and service records
+#ifndef PICOWOTA_MEMPOOL_768_LEN
+#define PICOWOTA_MEMPOOL_768_LEN  4
+#endif
+
+// Full-size TCP segments
+#ifndef PICOWOTA_MEMPOOL_1600_LEN
+#define PICOWOTA_MEMPOOL_1600_LEN 8
+#endif
+#if (TCP_MSS + 160) > 1600
+#error "1600 byte mempool is too small for TCP_MSS"
+#endif
+
+// Coalesced receive chains (up to a whole receive window). There can be two
+// for a moment, while the old one is copied in to the new one.
+#ifndef PICOWOTA_MEMPOOL_11712_LEN
+#define PICOWOTA_MEMPOOL_11712_LEN 2
+#endif
+#if (TCP_WND + 32) > 11712
+#error "11712 byte mempool is too small for TCP_WND"
+#endif
+
+#if MEM_USE_POOLS
+LWIP_MALLOC_MEMPOOL_START
+LWIP_MALLOC_MEMPOOL(PICOWOTA_MEMPOOL_256_LEN, 256)
+LWIP_MALLOC_MEMPOOL(PICOWOTA_MEMPOOL_768_LEN, 768)
+LWIP_MALLOC_MEMPOOL(PICOWOTA_MEMPOOL_1600_LEN, 1600)
+LWIP_MALLOC_MEMPOOL(PICOWOTA_MEMPOOL_11712_LEN, 11712)
+LWIP_MALLOC_MEMPOOL_END
+#endif
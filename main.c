@@ -18,6 +18,7 @@
 #include "hardware/flash.h"
 #include "hardware/structs/dma.h"
 #include "hardware/structs/watchdog.h"
+#include "hardware/structs/xip_ctrl.h"
 #include "hardware/gpio.h"
 #include "hardware/resets.h"
 #include "hardware/uart.h"
@@ -25,15 +26,44 @@
 
 #include "pico/stdlib.h"
 #include "pico/cyw43_arch.h"
-
+#include "pico/unique_id.h"
+
+#include "lwip/stats.h"
+#include "lwip/priv/memp_priv.h"
+
+#include "comm.h"
+#include "flash_id.h"
+#include "flash_session.h"
+#include "netcache.h"
+#include "peer.h"
+#include "pool.h"
+#include "protocol.h"
+#include "sector_cache.h"
 #include "tcp_comm.h"
+#include "trace.h"
+
+#if PICOWOTA_USB == 1
+#include "usb_comm.h"
+#endif
+
+#if PICOWOTA_UART == 1
+#include "uart_comm.h"
+#endif
 
+#include "picowota/cyw43_firmware.h"
+#include "picowota/partition.h"
 #include "picowota/reboot.h"
 
 #ifdef DEBUG
 #include <stdio.h>
+#if PICOWOTA_USB == 1
+// USB belongs to usb_comm, so debug goes to the stdio UART
+#include "pico/stdio_uart.h"
+#define DBG_PRINTF_INIT() stdio_uart_init()
+#else
 #include "pico/stdio_usb.h"
 #define DBG_PRINTF_INIT() stdio_usb_init()
+#endif
 #define DBG_PRINTF(...) printf(__VA_ARGS__)
 #else
 #define DBG_PRINTF_INIT() { }
@@ -45,9 +75,21 @@
 static dhcp_server_t dhcp_server;
 #endif
 
+#if PICOWOTA_DISCOVERY == 1
+#include "discovery.h"
+#endif
+
 #define QUOTE(name) #name
 #define STR(macro) QUOTE(macro)
 
+// Like __not_in_flash_func(), but only with PICOWOTA_RAM_HOTPATH. For the
+// helpers which every WRIT/READ/CRCC goes through.
+#if PICOWOTA_RAM_HOTPATH == 1
+#define __hot_func(name) __attribute__((section(".picowota_hot." #name))) name
+#else
+#define __hot_func(name) name
+#endif
+
 #ifndef PICOWOTA_WIFI_SSID
 #warning "PICOWOTA_WIFI_SSID not defined"
 #else
@@ -60,6 +102,19 @@ const char *wifi_ssid = STR(PICOWOTA_WIFI_SSID);
 const char *wifi_pass = STR(PICOWOTA_WIFI_PASS);
 #endif
 
+// Placed in front of the cyw43 firmware by the linker script, so that apps
+// can find (and check) the bootloader's copy
+extern const char __picowota_cyw43_fw_start[];
+extern const char __picowota_cyw43_fw_end[];
+
+const struct picowota_cyw43_fw_desc __attribute__((section(".picowota_cyw43_fw_desc"), used)) cyw43_fw_desc = {
+	.magic = PICOWOTA_CYW43_FW_DESC_MAGIC,
+	.version = PICOWOTA_CYW43_FW_DESC_VERSION,
+	.fw_start = (uint32_t)__picowota_cyw43_fw_start,
+	.fw_end = (uint32_t)__picowota_cyw43_fw_end,
+	.name = STR(PICOWOTA_CYW43_FW_NAME),
+};
+
 critical_section_t critical_section;
 
 #define EVENT_QUEUE_LENGTH 8
@@ -86,27 +141,249 @@ struct event {
 #define BOOTLOADER_ENTRY_PIN 15
 
 #define TCP_PORT 4242
+#define DISCOVERY_PORT 4242
 
 struct image_header app_image_header;
 #define IMAGE_HEADER_ADDR   ((uint32_t)&app_image_header)
-#define IMAGE_HEADER_OFFSET (IMAGE_HEADER_ADDR - XIP_BASE)
 
 #define WRITE_ADDR_MIN (IMAGE_HEADER_ADDR + FLASH_SECTOR_SIZE)
-#define ERASE_ADDR_MIN (IMAGE_HEADER_ADDR)
-#define FLASH_ADDR_MAX (XIP_BASE + PICO_FLASH_SIZE_BYTES)
-
-#define CMD_SYNC          (('S' << 0) | ('Y' << 8) | ('N' << 16) | ('C' << 24))
-#define RSP_SYNC          (('W' << 0) | ('O' << 8) | ('T' << 16) | ('A' << 24))
-#define CMD_INFO          (('I' << 0) | ('N' << 8) | ('F' << 16) | ('O' << 24))
-
-#define CMD_READ   (('R' << 0) | ('E' << 8) | ('A' << 16) | ('D' << 24))
-#define CMD_CSUM   (('C' << 0) | ('S' << 8) | ('U' << 16) | ('M' << 24))
-#define CMD_CRC    (('C' << 0) | ('R' << 8) | ('C' << 16) | ('C' << 24))
-#define CMD_ERASE  (('E' << 0) | ('R' << 8) | ('A' << 16) | ('S' << 24))
-#define CMD_WRITE  (('W' << 0) | ('R' << 8) | ('I' << 16) | ('T' << 24))
-#define CMD_SEAL   (('S' << 0) | ('E' << 8) | ('A' << 16) | ('L' << 24))
-#define CMD_GO     (('G' << 0) | ('O' << 8) | ('G' << 16) | ('O' << 24))
-#define CMD_REBOOT (('B' << 0) | ('O' << 8) | ('O' << 16) | ('T' << 24))
+// Data partitions (if any) come before the app slots
+#define ERASE_ADDR_MIN (PICOWOTA_DATA_ADDR)
+
+// The layout is built for PICO_FLASH_SIZE_BYTES, but the real size is read
+// from the chip at startup (see flash_size_init())
+static uint32_t flash_size = PICO_FLASH_SIZE_BYTES;
+#define FLASH_ADDR_MAX (XIP_BASE + flash_size)
+
+// The app region is split into PICOWOTA_SLOTS slots of PICOWOTA_SLOT_SIZE,
+// each a header sector followed by the app. Slot 0's header is
+// app_image_header. With one slot, it runs to the end of flash, so gets any
+// extra on a bigger chip. With more than one, the last sector of the flash
+// the layout was built for records which one to boot (see
+// slot_select_write()), and the slots stop there. That sector doesn't move
+// with the detected size, so the selection is found again whatever the chip.
+#ifndef PICOWOTA_SLOTS
+#define PICOWOTA_SLOTS 1
+#endif
+#ifndef PICOWOTA_SLOT_SIZE
+#define PICOWOTA_SLOT_SIZE (FLASH_ADDR_MAX - IMAGE_HEADER_ADDR)
+#endif
+#define SLOT_HEADER_ADDR(_slot) (IMAGE_HEADER_ADDR + ((_slot) * PICOWOTA_SLOT_SIZE))
+#define SLOT_APP_ADDR(_slot)    (SLOT_HEADER_ADDR(_slot) + FLASH_SECTOR_SIZE)
+#define SLOT_SELECT_ADDR        (XIP_BASE + PICO_FLASH_SIZE_BYTES - FLASH_SECTOR_SIZE)
+#if PICOWOTA_SLOTS > 1
+#define SLOT_END_ADDR           SLOT_SELECT_ADDR
+#else
+#define SLOT_END_ADDR           FLASH_ADDR_MAX
+#endif
+#define SLOT_NONE               0xffffffff
+
+// The bottom PICOWOTA_RAMLOAD_SIZE bytes of SRAM aren't used by the
+// bootloader (see bootloader_shell.ld.in), so that no_flash apps can be
+// uploaded there and run without touching flash.
+#ifndef PICOWOTA_RAMLOAD_SIZE
+#define PICOWOTA_RAMLOAD_SIZE 0
+#endif
+#define RAMLOAD_ADDR_MIN SRAM_BASE
+#define RAMLOAD_ADDR_MAX (SRAM_BASE + PICOWOTA_RAMLOAD_SIZE)
+
+// The most one FILL can cover, so that it doesn't hold the network up for
+// too long
+#ifndef PICOWOTA_FILL_MAX_LEN
+#define PICOWOTA_FILL_MAX_LEN (64 * 1024)
+#endif
+
+// ERAS just queues the erase, which then runs a sector (or 64k block) at a
+// time from the main loop, so the network keeps running. Anything which
+// touches flash that hasn't been erased yet waits for it.
+struct erase_job {
+	uint32_t id;
+	uint32_t start;
+	uint32_t next;
+	uint32_t end;
+};
+static struct erase_job erase_job;
+
+static bool erase_busy(void)
+{
+	return erase_job.next < erase_job.end;
+}
+
+static bool erase_pending(uint32_t addr, uint32_t size)
+{
+	return erase_busy() && (addr < erase_job.end) && (addr + size > erase_job.next);
+}
+
+// Returns true if there was anything to do
+static bool erase_job_step(void)
+{
+	if (!erase_busy()) {
+		return false;
+	}
+
+	uint32_t size = FLASH_SECTOR_SIZE;
+	if (!(erase_job.next & (FLASH_BLOCK_SIZE - 1)) &&
+	    (erase_job.end - erase_job.next >= FLASH_BLOCK_SIZE)) {
+		size = FLASH_BLOCK_SIZE;
+	}
+
+	trace_event(TRACE_FLASH_ERASE, 1, erase_job.next);
+	critical_section_enter_blocking(&critical_section);
+	flash_range_erase(erase_job.next - XIP_BASE, size);
+	critical_section_exit(&critical_section);
+	trace_event(TRACE_FLASH_ERASE, 0, erase_job.next);
+
+	erase_job.next += size;
+
+	return true;
+}
+
+static bool addr_is_flash(uint32_t addr, uint32_t size)
+{
+	return (addr >= XIP_BASE) && (addr < FLASH_ADDR_MAX) && (size <= FLASH_ADDR_MAX - addr);
+}
+
+static bool addr_is_ramload(uint32_t addr, uint32_t size)
+{
+	return (addr >= RAMLOAD_ADDR_MIN) && (addr < RAMLOAD_ADDR_MAX) && (size <= RAMLOAD_ADDR_MAX - addr);
+}
+
+static uint32_t slot_app_size(uint32_t slot)
+{
+	uint32_t end = (slot == PICOWOTA_SLOTS - 1) ? SLOT_END_ADDR : SLOT_HEADER_ADDR(slot + 1);
+
+	return end - SLOT_APP_ADDR(slot);
+}
+
+// The slot whose app area holds all of addr to addr + size, or -1
+static int addr_slot(uint32_t addr, uint32_t size)
+{
+	if (addr < IMAGE_HEADER_ADDR) {
+		return -1;
+	}
+
+	uint32_t slot = (addr - IMAGE_HEADER_ADDR) / PICOWOTA_SLOT_SIZE;
+	if (slot >= PICOWOTA_SLOTS) {
+		// Could still be in the extra space at the end of the last one
+		slot = PICOWOTA_SLOTS - 1;
+	}
+
+	uint32_t start = SLOT_APP_ADDR(slot);
+	uint32_t end = start + slot_app_size(slot);
+	if ((addr < start) || (addr > end) || (size > end - addr)) {
+		return -1;
+	}
+
+	return slot;
+}
+
+// The data partition whose data area holds all of addr to addr + size, or -1
+static int addr_partition(uint32_t addr, uint32_t size)
+{
+	unsigned int i;
+
+	for (i = 0; i < picowota_n_partitions; i++) {
+		uint32_t start = picowota_partition_data_addr(&picowota_partitions[i]);
+		uint32_t end = start + picowota_partitions[i].capacity;
+
+		if ((addr >= start) && (addr <= end) && (size <= end - addr)) {
+			return i;
+		}
+	}
+
+	return -1;
+}
+
+// Somewhere which uploads can write to: an app slot or a data partition
+static bool addr_is_upload(uint32_t addr, uint32_t size)
+{
+	return (addr_slot(addr, size) >= 0) || (addr_partition(addr, size) >= 0);
+}
+
+// Changing a partition's data breaks its seal, so erase the header of any
+// sealed partition which overlaps addr to addr + size before touching it.
+// Only the first write of an upload pays for the erase.
+static void partition_unseal(uint32_t addr, uint32_t size)
+{
+	unsigned int i;
+
+	for (i = 0; i < picowota_n_partitions; i++) {
+		const struct picowota_partition_entry *entry = &picowota_partitions[i];
+		uint32_t start = picowota_partition_data_addr(entry);
+		uint32_t end = start + entry->capacity;
+
+		if ((addr >= end) || (addr + size <= start) || !picowota_partition_sealed(entry)) {
+			continue;
+		}
+
+		trace_event(TRACE_FLASH_ERASE, 1, entry->header_addr);
+		critical_section_enter_blocking(&critical_section);
+		flash_range_erase(entry->header_addr - XIP_BASE, FLASH_SECTOR_SIZE);
+		critical_section_exit(&critical_section);
+		trace_event(TRACE_FLASH_ERASE, 0, entry->header_addr);
+	}
+}
+
+#if PICOWOTA_DISCOVERY == 1
+// What discovery reports. Finding the boot slot means checking CRCs, which is
+// too slow to do for every query, so discovery_refresh() only does it after
+// sealing, selecting a slot, an erase finishing and ABRT. In between, writing
+// to the slot it found breaks that image until it's sealed again, so the
+// slot is dropped as soon as anything is written there, without a CRC.
+static uint32_t discovery_slot = SLOT_NONE;
+static uint32_t discovery_build_id;
+
+static void discovery_invalidate(uint32_t addr, uint32_t size)
+{
+	if (discovery_slot == SLOT_NONE) {
+		return;
+	}
+
+	uint32_t start = SLOT_HEADER_ADDR(discovery_slot);
+	uint32_t end = SLOT_APP_ADDR(discovery_slot) + slot_app_size(discovery_slot);
+	if ((addr < end) && (addr + size > start)) {
+		discovery_slot = SLOT_NONE;
+		discovery_build_id = 0;
+	}
+}
+#else
+static void discovery_invalidate(uint32_t addr, uint32_t size)
+{
+}
+#endif
+
+// Run a DMA transfer of size bytes from addr, through the sniffer which the
+// caller has set up. Flash is read via the XIP streaming FIFO, which doesn't
+// go through the cache, so checking a big image doesn't evict all of our own
+// code from it.
+// addr must be 4-byte aligned and size must be a multiple of 4
+static void __hot_func(dma_sniff_run)(int channel, dma_channel_config *c, uint32_t addr, uint32_t size)
+{
+	uint32_t dummy_dest;
+
+	trace_event(TRACE_CHECKSUM, 1, addr);
+
+	if (addr_is_flash(addr, size)) {
+		// Drain anything left over from before
+		while (!(xip_ctrl_hw->stat & XIP_STAT_FIFO_EMPTY)) {
+			(void)xip_ctrl_hw->stream_fifo;
+		}
+
+		xip_ctrl_hw->stream_addr = addr;
+		xip_ctrl_hw->stream_ctr = size / 4;
+
+		channel_config_set_read_increment(c, false);
+		channel_config_set_dreq(c, DREQ_XIP_STREAM);
+		dma_channel_configure(channel, c, &dummy_dest, (void *)XIP_AUX_BASE, size / 4, true);
+	} else {
+		channel_config_set_read_increment(c, true);
+		dma_channel_configure(channel, c, &dummy_dest, (void *)addr, size / 4, true);
+	}
+
+	dma_channel_wait_for_finish_blocking(channel);
+
+	trace_event(TRACE_CHECKSUM, 0, addr);
+}
 
 static uint32_t handle_sync(uint32_t *args_in, uint8_t *data_in, uint32_t *resp_args_out, uint8_t *resp_data_out)
 {
@@ -124,8 +401,8 @@ const struct comm_command sync_cmd = {
 static uint32_t size_read(uint32_t *args_in, uint32_t *data_len_out, uint32_t *resp_data_len_out)
 {
 	uint32_t size = args_in[1];
-	if (size > TCP_COMM_MAX_DATA_LEN) {
-		return TCP_COMM_RSP_ERR;
+	if (size > COMM_MAX_DATA_LEN) {
+		return COMM_RSP_ERR;
 	}
 
 	// TODO: Validate address
@@ -133,17 +410,29 @@ static uint32_t size_read(uint32_t *args_in, uint32_t *data_len_out, uint32_t *r
 	*data_len_out = 0;
 	*resp_data_len_out = size;
 
-	return TCP_COMM_RSP_OK;
+	return COMM_RSP_OK;
 }
 
-static uint32_t handle_read(uint32_t *args_in, uint8_t *data_in, uint32_t *resp_args_out, uint8_t *resp_data_out)
+static uint32_t __hot_func(handle_read)(uint32_t *args_in, uint8_t *data_in, uint32_t *resp_args_out, uint8_t *resp_data_out)
 {
 	uint32_t addr = args_in[0];
 	uint32_t size = args_in[1];
 
+	if (erase_pending(addr, size)) {
+		return COMM_RSP_BUSY;
+	}
+
+	// Reads see anything written with UPDT
+	sector_cache_flush(addr, size);
+
+	if (addr_is_flash(addr, size)) {
+		// Don't pollute the XIP cache with data we'll only read once
+		addr = addr - XIP_BASE + XIP_NOCACHE_NOALLOC_BASE;
+	}
+
 	memcpy(resp_data_out, (void *)addr, size);
 
-	return TCP_COMM_RSP_OK;
+	return COMM_RSP_OK;
 }
 
 const struct comm_command read_cmd = {
@@ -163,7 +452,7 @@ static uint32_t size_csum(uint32_t *args_in, uint32_t *data_len_out, uint32_t *r
 
 	if ((addr & 0x3) || (size & 0x3)) {
 		// Must be aligned
-		return TCP_COMM_RSP_ERR;
+		return COMM_RSP_ERR;
 	}
 
 	// TODO: Validate address
@@ -171,36 +460,38 @@ static uint32_t size_csum(uint32_t *args_in, uint32_t *data_len_out, uint32_t *r
 	*data_len_out = 0;
 	*resp_data_len_out = 0;
 
-	return TCP_COMM_RSP_OK;
+	return COMM_RSP_OK;
 }
 
 static uint32_t handle_csum(uint32_t *args_in, uint8_t *data_in, uint32_t *resp_args_out, uint8_t *resp_data_out)
 {
-	uint32_t dummy_dest;
 	uint32_t addr = args_in[0];
 	uint32_t size = args_in[1];
 
+	if (erase_pending(addr, size)) {
+		return COMM_RSP_BUSY;
+	}
+
+	sector_cache_flush(addr, size);
+
 	int channel = dma_claim_unused_channel(true);
 
 	dma_channel_config c = dma_channel_get_default_config(channel);
 	channel_config_set_transfer_data_size(&c, DMA_SIZE_32);
-	channel_config_set_read_increment(&c, true);
 	channel_config_set_write_increment(&c, false);
 	channel_config_set_sniff_enable(&c, true);
 
 	dma_hw->sniff_data = 0;
 	dma_sniffer_enable(channel, 0xf, true);
 
-	dma_channel_configure(channel, &c, &dummy_dest, (void *)addr, size / 4, true);
-
-	dma_channel_wait_for_finish_blocking(channel);
+	dma_sniff_run(channel, &c, addr, size);
 
 	dma_sniffer_disable();
 	dma_channel_unclaim(channel);
 
 	*resp_args_out = dma_hw->sniff_data;
 
-	return TCP_COMM_RSP_OK;
+	return COMM_RSP_OK;
 }
 
 struct comm_command csum_cmd = {
@@ -220,7 +511,7 @@ static uint32_t size_crc(uint32_t *args_in, uint32_t *data_len_out, uint32_t *re
 
 	if ((addr & 0x3) || (size & 0x3)) {
 		// Must be aligned
-		return TCP_COMM_RSP_ERR;
+		return COMM_RSP_ERR;
 	}
 
 	// TODO: Validate address
@@ -228,18 +519,17 @@ static uint32_t size_crc(uint32_t *args_in, uint32_t *data_len_out, uint32_t *re
 	*data_len_out = 0;
 	*resp_data_len_out = 0;
 
-	return TCP_COMM_RSP_OK;
+	return COMM_RSP_OK;
 }
 
 // ptr must be 4-byte aligned and len must be a multiple of 4
-static uint32_t calc_crc32(void *ptr, uint32_t len)
+static uint32_t __hot_func(calc_crc32)(void *ptr, uint32_t len)
 {
-	uint32_t dummy_dest, crc;
+	uint32_t crc;
 
 	int channel = dma_claim_unused_channel(true);
 	dma_channel_config c = dma_channel_get_default_config(channel);
 	channel_config_set_transfer_data_size(&c, DMA_SIZE_32);
-	channel_config_set_read_increment(&c, true);
 	channel_config_set_write_increment(&c, false);
 	channel_config_set_sniff_enable(&c, true);
 
@@ -251,9 +541,7 @@ static uint32_t calc_crc32(void *ptr, uint32_t len)
 	dma_sniffer_enable(channel, 0x1, true);
 	dma_hw->sniff_ctrl |= DMA_SNIFF_CTRL_OUT_REV_BITS;
 
-	dma_channel_configure(channel, &c, &dummy_dest, ptr, len / 4, true);
-
-	dma_channel_wait_for_finish_blocking(channel);
+	dma_sniff_run(channel, &c, (uint32_t)ptr, len);
 
 	// Read the result before resetting
 	crc = dma_hw->sniff_data ^ 0xffffffff;
@@ -269,9 +557,15 @@ static uint32_t handle_crc(uint32_t *args_in, uint8_t *data_in, uint32_t *resp_a
 	uint32_t addr = args_in[0];
 	uint32_t size = args_in[1];
 
+	if (erase_pending(addr, size)) {
+		return COMM_RSP_BUSY;
+	}
+
+	sector_cache_flush(addr, size);
+
 	resp_args_out[0] = calc_crc32((void *)addr, size);
 
-	return TCP_COMM_RSP_OK;
+	return COMM_RSP_OK;
 }
 
 struct comm_command crc_cmd = {
@@ -291,24 +585,35 @@ static uint32_t handle_erase(uint32_t *args_in, uint8_t *data_in, uint32_t *resp
 
 	if ((addr < ERASE_ADDR_MIN) || (addr + size >= FLASH_ADDR_MAX)) {
 		// Outside flash
-		return TCP_COMM_RSP_ERR;
+		return COMM_RSP_ERR;
 	}
 
 	if ((addr & (FLASH_SECTOR_SIZE - 1)) || (size & (FLASH_SECTOR_SIZE - 1))) {
 		// Must be aligned
-		return TCP_COMM_RSP_ERR;
+		return COMM_RSP_ERR;
 	}
 
-	critical_section_enter_blocking(&critical_section);
-	flash_range_erase(addr - XIP_BASE, size);
-	critical_section_exit(&critical_section);
+	// One at a time
+	if (erase_busy()) {
+		return COMM_RSP_BUSY;
+	}
+
+	// Anything waiting to be written there is about to be erased anyway
+	sector_cache_discard(addr, size);
+	partition_unseal(addr, size);
+	discovery_invalidate(addr, size);
+
+	erase_job.id++;
+	erase_job.start = addr;
+	erase_job.next = addr;
+	erase_job.end = addr + size;
 
-	return TCP_COMM_RSP_OK;
+	return COMM_RSP_OK;
 }
 
 struct comm_command erase_cmd = {
 	// ERAS addr len
-	// OKOK
+	// OKOK (erase runs in the background, see STAT)
 	.opcode = CMD_ERASE,
 	.nargs = 2,
 	.resp_nargs = 0,
@@ -316,45 +621,150 @@ struct comm_command erase_cmd = {
 	.handle = &handle_erase,
 };
 
+struct image_header {
+	uint32_t vtor;
+	uint32_t size;
+	uint32_t crc;
+	uint8_t pad[FLASH_PAGE_SIZE - (3 * 4)];
+};
+static_assert(sizeof(struct image_header) == FLASH_PAGE_SIZE, "image_header must be FLASH_PAGE_SIZE bytes");
+
+// Header of an image uploaded to the RAM load region, only kept in RAM.
+// vtor is 0 unless it's been checked with SEAL.
+static struct image_header ram_image_header;
+
 static uint32_t size_write(uint32_t *args_in, uint32_t *data_len_out, uint32_t *resp_data_len_out)
 {
 	uint32_t addr = args_in[0];
 	uint32_t size = args_in[1];
 
-	if ((addr < WRITE_ADDR_MIN) || (addr + size >= FLASH_ADDR_MAX)) {
-		// Outside flash
-		return TCP_COMM_RSP_ERR;
+	if (addr_is_ramload(addr, size)) {
+		if ((addr & 0x3) || (size & 0x3) || (size > COMM_MAX_DATA_LEN)) {
+			return COMM_RSP_ERR;
+		}
+
+		*data_len_out = size;
+		*resp_data_len_out = 0;
+
+		return COMM_RSP_OK;
+	}
+
+	if (!addr_is_upload(addr, size)) {
+		// Outside the app slots and data partitions
+		return COMM_RSP_ERR;
 	}
 
 	if ((addr & (FLASH_PAGE_SIZE - 1)) || (size & (FLASH_PAGE_SIZE -1))) {
 		// Must be aligned
-		return TCP_COMM_RSP_ERR;
+		return COMM_RSP_ERR;
 	}
 
-	if (size > TCP_COMM_MAX_DATA_LEN) {
-		return TCP_COMM_RSP_ERR;
+	if (size > COMM_MAX_DATA_LEN) {
+		return COMM_RSP_ERR;
 	}
 
-	// TODO: Validate address
-
 	*data_len_out = size;
 	*resp_data_len_out = 0;
 
-	return TCP_COMM_RSP_OK;
+	return COMM_RSP_OK;
 }
 
-static uint32_t handle_write(uint32_t *args_in, uint8_t *data_in, uint32_t *resp_args_out, uint8_t *resp_data_out)
+static uint32_t __hot_func(handle_write)(uint32_t *args_in, uint8_t *data_in, uint32_t *resp_args_out, uint8_t *resp_data_out)
 {
 	uint32_t addr = args_in[0];
 	uint32_t size = args_in[1];
 
+	if (addr_is_ramload(addr, size)) {
+		// Needs sealing again before it can be run
+		ram_image_header.vtor = 0;
+		memcpy((void *)addr, data_in, size);
+		resp_args_out[0] = calc_crc32((void *)addr, size);
+
+		return COMM_RSP_OK;
+	}
+
+	if (erase_pending(addr, size)) {
+		return COMM_RSP_BUSY;
+	}
+
+	sector_cache_evict(addr, size);
+	partition_unseal(addr, size);
+	discovery_invalidate(addr, size);
+
+	trace_event(TRACE_FLASH_PROGRAM, 1, addr);
 	critical_section_enter_blocking(&critical_section);
 	flash_range_program(addr - XIP_BASE, data_in, size);
 	critical_section_exit(&critical_section);
+	trace_event(TRACE_FLASH_PROGRAM, 0, addr);
 
 	resp_args_out[0] = calc_crc32((void *)addr, size);
 
-	return TCP_COMM_RSP_OK;
+	return COMM_RSP_OK;
+}
+
+/*
+ * WRITs to flash in a batch are queued up in a flash session, and programmed
+ * together when the batch moves on, so that a batch of them only takes flash
+ * out of XIP mode once. Their CRCs are filled in afterwards.
+ */
+static struct {
+	struct flash_session session;
+	unsigned int n;
+	struct {
+		uint32_t addr;
+		uint32_t size;
+		uint32_t *crc_out;
+	} writes[FLASH_SESSION_MAX_OPS];
+} write_queue;
+
+static void __hot_func(flush_write)(void)
+{
+	unsigned int i;
+
+	if (!write_queue.n) {
+		return;
+	}
+
+	trace_event(TRACE_FLASH_PROGRAM, 1, write_queue.writes[0].addr);
+	flash_session_run(&write_queue.session);
+	trace_event(TRACE_FLASH_PROGRAM, 0, write_queue.writes[0].addr);
+
+	for (i = 0; i < write_queue.n; i++) {
+		*write_queue.writes[i].crc_out = calc_crc32((void *)write_queue.writes[i].addr,
+							    write_queue.writes[i].size);
+	}
+
+	write_queue.n = 0;
+}
+
+static uint32_t __hot_func(queue_write)(uint32_t *args_in, uint8_t *data_in, uint32_t *resp_args_out)
+{
+	uint32_t addr = args_in[0];
+	uint32_t size = args_in[1];
+
+	if (addr_is_ramload(addr, size)) {
+		return handle_write(args_in, data_in, resp_args_out, NULL);
+	}
+
+	if (erase_pending(addr, size)) {
+		return COMM_RSP_BUSY;
+	}
+
+	if (write_queue.n == FLASH_SESSION_MAX_OPS) {
+		flush_write();
+	}
+
+	sector_cache_evict(addr, size);
+	partition_unseal(addr, size);
+	discovery_invalidate(addr, size);
+
+	flash_session_program(&write_queue.session, addr - XIP_BASE, data_in, size);
+	write_queue.writes[write_queue.n].addr = addr;
+	write_queue.writes[write_queue.n].size = size;
+	write_queue.writes[write_queue.n].crc_out = &resp_args_out[0];
+	write_queue.n++;
+
+	return COMM_RSP_OK;
 }
 
 struct comm_command write_cmd = {
@@ -365,151 +775,1208 @@ struct comm_command write_cmd = {
 	.resp_nargs = 1,
 	.size = &size_write,
 	.handle = &handle_write,
+	.queue = &queue_write,
+	.flush = &flush_write,
 };
 
-struct image_header {
-	uint32_t vtor;
-	uint32_t size;
-	uint32_t crc;
-	uint8_t pad[FLASH_PAGE_SIZE - (3 * 4)];
-};
-static_assert(sizeof(struct image_header) == FLASH_PAGE_SIZE, "image_header must be FLASH_PAGE_SIZE bytes");
-
-static bool image_header_ok(struct image_header *hdr)
+static uint32_t size_fill(uint32_t *args_in, uint32_t *data_len_out, uint32_t *resp_data_len_out)
 {
-	uint32_t *vtor = (uint32_t *)hdr->vtor;
-
-	uint32_t calc = calc_crc32((void *)hdr->vtor, hdr->size);
+	uint32_t addr = args_in[0];
+	uint32_t size = args_in[1];
 
-	// CRC has to match
-	if (calc != hdr->crc) {
-		return false;
+	if (size > PICOWOTA_FILL_MAX_LEN) {
+		return COMM_RSP_ERR;
 	}
 
-	// Stack pointer needs to be in RAM
-	if (vtor[0] < SRAM_BASE) {
-		return false;
+	if (addr_is_ramload(addr, size)) {
+		if ((addr & 0x3) || (size & 0x3)) {
+			return COMM_RSP_ERR;
+		}
+	} else if (!addr_is_upload(addr, size)) {
+		// Outside the app slots and data partitions
+		return COMM_RSP_ERR;
+	} else if ((addr & (FLASH_PAGE_SIZE - 1)) || (size & (FLASH_PAGE_SIZE - 1))) {
+		// Must be aligned
+		return COMM_RSP_ERR;
 	}
 
-	// Reset vector should be in the image, and thumb (bit 0 set)
-	if ((vtor[1] < hdr->vtor) || (vtor[1] > hdr->vtor + hdr->size) || !(vtor[1] & 1)) {
-		return false;
-	}
+	*data_len_out = 0;
+	*resp_data_len_out = 0;
 
-	// Looks OK.
-	return true;
+	return COMM_RSP_OK;
 }
 
-
-static uint32_t handle_seal(uint32_t *args_in, uint8_t *data_in, uint32_t *resp_args_out, uint8_t *resp_data_out)
+static uint32_t handle_fill(uint32_t *args_in, uint8_t *data_in, uint32_t *resp_args_out, uint8_t *resp_data_out)
 {
-	struct image_header hdr = {
-		.vtor = args_in[0],
-		.size = args_in[1],
-		.crc = args_in[2],
-	};
+	static uint32_t fill_page[FLASH_PAGE_SIZE / 4];
+	struct flash_session session;
+	uint32_t addr = args_in[0];
+	uint32_t size = args_in[1];
+	uint32_t pattern = args_in[2];
+	uint32_t offs;
 
-	if ((hdr.vtor & 0xff) || (hdr.size & 0x3)) {
-		// Must be aligned
-		return TCP_COMM_RSP_ERR;
+	if (!size) {
+		// Lets clients check that FILL is supported
+		resp_args_out[0] = 0;
+		return COMM_RSP_OK;
 	}
 
-	if (!image_header_ok(&hdr)) {
-		return TCP_COMM_RSP_ERR;
+	if (addr_is_ramload(addr, size)) {
+		ram_image_header.vtor = 0;
+		for (offs = 0; offs < size; offs += 4) {
+			*(uint32_t *)(addr + offs) = pattern;
+		}
+		resp_args_out[0] = calc_crc32((void *)addr, size);
+
+		return COMM_RSP_OK;
 	}
 
-	critical_section_enter_blocking(&critical_section);
-	flash_range_erase(IMAGE_HEADER_OFFSET, FLASH_SECTOR_SIZE);
-	flash_range_program(IMAGE_HEADER_OFFSET, (const uint8_t *)&hdr, sizeof(hdr));
-	critical_section_exit(&critical_section);
+	if (erase_pending(addr, size)) {
+		return COMM_RSP_BUSY;
+	}
 
-	struct image_header *check = &app_image_header;
-	if (memcmp(&hdr, check, sizeof(hdr))) {
-		return TCP_COMM_RSP_ERR;
+	sector_cache_evict(addr, size);
+	partition_unseal(addr, size);
+	discovery_invalidate(addr, size);
+
+	// Programming can only clear bits, so there's nothing to do for all
+	// ones. The CRC shows whether the flash really was erased.
+	if (pattern != 0xffffffff) {
+		for (offs = 0; offs < FLASH_PAGE_SIZE / 4; offs++) {
+			fill_page[offs] = pattern;
+		}
+
+		trace_event(TRACE_FLASH_PROGRAM, 1, addr);
+		flash_session_init(&session);
+		for (offs = 0; offs < size; offs += FLASH_PAGE_SIZE) {
+			flash_session_program(&session, addr - XIP_BASE + offs, (uint8_t *)fill_page, FLASH_PAGE_SIZE);
+			if ((session.n_ops == FLASH_SESSION_MAX_OPS) || (offs + FLASH_PAGE_SIZE == size)) {
+				flash_session_run(&session);
+			}
+		}
+		trace_event(TRACE_FLASH_PROGRAM, 0, addr);
 	}
 
-	return TCP_COMM_RSP_OK;
+	resp_args_out[0] = calc_crc32((void *)addr, size);
+
+	return COMM_RSP_OK;
 }
 
-struct comm_command seal_cmd = {
-	// SEAL vtor len crc
-	// OKOK
-	.opcode = CMD_SEAL,
+struct comm_command fill_cmd = {
+	// FILL addr len pattern
+	// OKOK crc
+	// Like WRIT, but len bytes of the 32-bit pattern repeated, without
+	// sending them. Up to PICOWOTA_FILL_MAX_LEN.
+	.opcode = CMD_FILL,
 	.nargs = 3,
-	.resp_nargs = 0,
-	.size = NULL,
-	.handle = &handle_seal,
+	.resp_nargs = 1,
+	.size = &size_fill,
+	.handle = &handle_fill,
 };
 
-static void disable_interrupts(void)
+static uint32_t size_update(uint32_t *args_in, uint32_t *data_len_out, uint32_t *resp_data_len_out)
 {
-	SysTick->CTRL &= ~1;
+	uint32_t addr = args_in[0];
+	uint32_t size = args_in[1];
 
-	NVIC->ICER[0] = 0xFFFFFFFF;
-	NVIC->ICPR[0] = 0xFFFFFFFF;
+	if (size > COMM_MAX_DATA_LEN) {
+		return COMM_RSP_ERR;
+	}
+
+	if (!addr_is_ramload(addr, size) && !addr_is_upload(addr, size)) {
+		return COMM_RSP_ERR;
+	}
+
+	*data_len_out = size;
+	*resp_data_len_out = 0;
+
+	return COMM_RSP_OK;
 }
 
-static void reset_peripherals(void)
+static uint32_t __hot_func(handle_update)(uint32_t *args_in, uint8_t *data_in, uint32_t *resp_args_out, uint8_t *resp_data_out)
 {
-    reset_block(~(
-            RESETS_RESET_IO_QSPI_BITS |
-            RESETS_RESET_PADS_QSPI_BITS |
+	uint32_t addr = args_in[0];
+	uint32_t size = args_in[1];
+
+	if (addr_is_ramload(addr, size)) {
+		ram_image_header.vtor = 0;
+		memcpy((void *)addr, data_in, size);
+		return COMM_RSP_OK;
+	}
+
+	if (erase_pending(addr, size)) {
+		return COMM_RSP_BUSY;
+	}
+
+	partition_unseal(addr, size);
+	discovery_invalidate(addr, size);
+	sector_cache_write(addr, data_in, size);
+
+	return COMM_RSP_OK;
+}
+
+struct comm_command update_cmd = {
+	// UPDT addr len [data]
+	// OKOK
+	// Any alignment and length, merged with what's already in flash. The
+	// data is cached, and written back on FLSH, SEAL, GOGO or BOOT, or when
+	// the cache needs the space.
+	.opcode = CMD_UPDATE,
+	.nargs = 2,
+	.resp_nargs = 0,
+	.size = &size_update,
+	.handle = &handle_update,
+};
+
+static uint32_t handle_flush(uint32_t *args_in, uint8_t *data_in, uint32_t *resp_args_out, uint8_t *resp_data_out)
+{
+	sector_cache_flush_all();
+
+	return COMM_RSP_OK;
+}
+
+struct comm_command flush_cmd = {
+	// FLSH
+	// OKOK
+	.opcode = CMD_FLUSH,
+	.nargs = 0,
+	.resp_nargs = 0,
+	.size = NULL,
+	.handle = &handle_flush,
+};
+
+static bool image_header_ok(struct image_header *hdr)
+{
+	uint32_t *vtor = (uint32_t *)hdr->vtor;
+
+	// Image has to be inside one of the app slots, or the RAM load region
+	// (catches erased/garbage headers before we try and CRC them)
+	if (!addr_is_ramload(hdr->vtor, hdr->size) && (addr_slot(hdr->vtor, hdr->size) < 0)) {
+		return false;
+	}
+
+	uint32_t calc = calc_crc32((void *)hdr->vtor, hdr->size);
+
+	// CRC has to match
+	if (calc != hdr->crc) {
+		return false;
+	}
+
+	// Stack pointer needs to be in RAM
+	if (vtor[0] < SRAM_BASE) {
+		return false;
+	}
+
+	// Reset vector should be in the image, and thumb (bit 0 set)
+	if ((vtor[1] < hdr->vtor) || (vtor[1] > hdr->vtor + hdr->size) || !(vtor[1] & 1)) {
+		return false;
+	}
+
+	// Looks OK.
+	return true;
+}
+
+static struct image_header *slot_header(uint32_t slot)
+{
+	return (struct image_header *)SLOT_HEADER_ADDR(slot);
+}
+
+static bool slot_ok(uint32_t slot)
+{
+	struct image_header *hdr = slot_header(slot);
+
+	// The header has to describe an image in its own slot
+	return image_header_ok(hdr) && (addr_slot(hdr->vtor, hdr->size) == (int)slot);
+}
+
+#if PICOWOTA_SLOTS > 1
+/*
+ * The default slot is chosen by appending a record to the select sector, one
+ * per flash page, and the last good one wins. The sector only gets erased
+ * when it's full, so choosing a slot is normally just a page program.
+ */
+#define SLOT_SELECT_MAGIC   (('S' << 0) | ('L' << 8) | ('O' << 16) | ('T' << 24))
+#define SLOT_SELECT_RECORDS (FLASH_SECTOR_SIZE / FLASH_PAGE_SIZE)
+
+struct slot_select {
+	uint32_t magic;
+	uint32_t slot;
+	uint32_t slot_inv;
+	uint8_t pad[FLASH_PAGE_SIZE - (3 * 4)];
+};
+static_assert(sizeof(struct slot_select) == FLASH_PAGE_SIZE, "slot_select must be FLASH_PAGE_SIZE bytes");
+
+static bool slot_select_erased(const struct slot_select *rec)
+{
+	return (rec->magic == 0xffffffff) && (rec->slot == 0xffffffff) && (rec->slot_inv == 0xffffffff);
+}
+
+static uint32_t slot_default(void)
+{
+	const struct slot_select *rec = (const struct slot_select *)SLOT_SELECT_ADDR;
+	uint32_t slot = 0;
+	int i;
+
+	// A torn write just leaves a bad record, which is skipped
+	for (i = 0; i < SLOT_SELECT_RECORDS; i++) {
+		if ((rec[i].magic == SLOT_SELECT_MAGIC) && (rec[i].slot < PICOWOTA_SLOTS) &&
+		    (rec[i].slot_inv == ~rec[i].slot)) {
+			slot = rec[i].slot;
+		}
+	}
+
+	return slot;
+}
+
+static void slot_select_write(uint32_t slot)
+{
+	const struct slot_select *rec = (const struct slot_select *)SLOT_SELECT_ADDR;
+	struct slot_select new = {
+		.magic = SLOT_SELECT_MAGIC,
+		.slot = slot,
+		.slot_inv = ~slot,
+	};
+	int i;
+
+	for (i = 0; i < SLOT_SELECT_RECORDS; i++) {
+		if (slot_select_erased(&rec[i])) {
+			break;
+		}
+	}
+
+	struct flash_session session;
+	flash_session_init(&session);
+	if (i == SLOT_SELECT_RECORDS) {
+		flash_session_erase(&session, SLOT_SELECT_ADDR - XIP_BASE, FLASH_SECTOR_SIZE);
+		i = 0;
+	}
+	flash_session_program(&session, SLOT_SELECT_ADDR - XIP_BASE + (i * FLASH_PAGE_SIZE),
+			      (const uint8_t *)&new, sizeof(new));
+
+	trace_event(TRACE_FLASH_PROGRAM, 1, SLOT_SELECT_ADDR);
+	flash_session_run(&session);
+	trace_event(TRACE_FLASH_PROGRAM, 0, SLOT_SELECT_ADDR);
+}
+#else
+static uint32_t slot_default(void)
+{
+	return 0;
+}
+#endif
+
+// The slot to run: the default one if it's OK, otherwise the first one
+// which is, or SLOT_NONE
+static uint32_t slot_boot(void)
+{
+	uint32_t def = slot_default();
+	uint32_t slot;
+
+	if (slot_ok(def)) {
+		return def;
+	}
+
+	for (slot = 0; slot < PICOWOTA_SLOTS; slot++) {
+		if ((slot != def) && slot_ok(slot)) {
+			return slot;
+		}
+	}
+
+	return SLOT_NONE;
+}
+
+#if PICOWOTA_DISCOVERY == 1
+// See discovery_invalidate()
+static void discovery_refresh(void)
+{
+	discovery_slot = slot_boot();
+	discovery_build_id = (discovery_slot != SLOT_NONE) ? slot_header(discovery_slot)->crc : 0;
+}
+#else
+static void discovery_refresh(void)
+{
+}
+#endif
+
+// Check an image, and store its header so that it can be run. Returns a
+// COMM_RSP_* code.
+static uint32_t image_seal(const struct image_header *src)
+{
+	struct image_header hdr = *src;
+
+	if ((hdr.vtor & 0xff) || (hdr.size & 0x3)) {
+		// Must be aligned
+		return COMM_RSP_ERR;
+	}
+
+	if (erase_busy()) {
+		return COMM_RSP_BUSY;
+	}
+
+	sector_cache_flush_all();
+
+	if (!image_header_ok(&hdr)) {
+		return COMM_RSP_ERR;
+	}
+
+	if (addr_is_ramload(hdr.vtor, hdr.size)) {
+		// Nothing to store in flash, just remember it's OK to run
+		ram_image_header = hdr;
+		return COMM_RSP_OK;
+	}
+
+	// The header goes in the slot which the image is in
+	uint32_t slot = addr_slot(hdr.vtor, hdr.size);
+	uint32_t hdr_addr = SLOT_HEADER_ADDR(slot);
+
+	struct flash_session session;
+	flash_session_init(&session);
+	flash_session_erase(&session, hdr_addr - XIP_BASE, FLASH_SECTOR_SIZE);
+	flash_session_program(&session, hdr_addr - XIP_BASE, (const uint8_t *)&hdr, sizeof(hdr));
+
+	trace_event(TRACE_FLASH_ERASE, 1, hdr_addr);
+	flash_session_run(&session);
+	trace_event(TRACE_FLASH_ERASE, 0, hdr_addr);
+
+	discovery_refresh();
+
+	struct image_header *check = slot_header(slot);
+	if (memcmp(&hdr, check, sizeof(hdr))) {
+		return COMM_RSP_ERR;
+	}
+
+	return COMM_RSP_OK;
+}
+
+static uint32_t handle_seal(uint32_t *args_in, uint8_t *data_in, uint32_t *resp_args_out, uint8_t *resp_data_out)
+{
+	struct image_header hdr = {
+		.vtor = args_in[0],
+		.size = args_in[1],
+		.crc = args_in[2],
+	};
+
+	return image_seal(&hdr);
+}
+
+struct comm_command seal_cmd = {
+	// SEAL vtor len crc
+	// OKOK
+	.opcode = CMD_SEAL,
+	.nargs = 3,
+	.resp_nargs = 0,
+	.size = NULL,
+	.handle = &handle_seal,
+};
+
+static void disable_interrupts(void)
+{
+	SysTick->CTRL &= ~1;
+
+	NVIC->ICER[0] = 0xFFFFFFFF;
+	NVIC->ICPR[0] = 0xFFFFFFFF;
+}
+
+static void reset_peripherals(void)
+{
+    reset_block(~(
+            RESETS_RESET_IO_QSPI_BITS |
+            RESETS_RESET_PADS_QSPI_BITS |
             RESETS_RESET_SYSCFG_BITS |
             RESETS_RESET_PLL_SYS_BITS
     ));
 }
 
-static void jump_to_vtor(uint32_t vtor)
+static void jump_to_vtor(uint32_t vtor)
+{
+	// Derived from the Leaf Labs Cortex-M3 bootloader.
+	// Copyright (c) 2010 LeafLabs LLC.
+	// Modified 2021 Brian Starkey <stark3y@gmail.com>
+	// Originally under The MIT License
+	uint32_t reset_vector = *(volatile uint32_t *)(vtor + 0x04);
+
+	SCB->VTOR = (volatile uint32_t)(vtor);
+
+	asm volatile("msr msp, %0"::"g"
+			(*(volatile uint32_t *)vtor));
+	asm volatile("bx %0"::"r" (reset_vector));
+}
+
+
+static uint32_t handle_go(uint32_t *args_in, uint8_t *data_in, uint32_t *resp_args_out, uint8_t *resp_data_out)
+{
+	if (addr_is_ramload(args_in[0], 0) && (args_in[0] != ram_image_header.vtor)) {
+		// RAM images have to be SEALed (checked) first
+		return COMM_RSP_ERR;
+	}
+
+	if (erase_busy()) {
+		return COMM_RSP_BUSY;
+	}
+
+	sector_cache_flush_all();
+
+	struct event ev = {
+		.type = EVENT_TYPE_GO,
+		.go = {
+			.vtor = args_in[0],
+		},
+	};
+
+	if (!queue_try_add(&event_queue, &ev)) {
+		return COMM_RSP_ERR;
+	}
+
+	return COMM_RSP_OK;
+}
+
+struct comm_command go_cmd = {
+	// GOGO vtor
+	// NO RESPONSE
+	.opcode = CMD_GO,
+	.nargs = 1,
+	.resp_nargs = 0,
+	.size = NULL,
+	.handle = &handle_go,
+};
+
+static_assert(PICOWOTA_SLOTS * sizeof(struct slot_record) <= COMM_MAX_DATA_LEN, "too many slots for CATL");
+
+static uint32_t size_catalog(uint32_t *args_in, uint32_t *data_len_out, uint32_t *resp_data_len_out)
+{
+	*data_len_out = 0;
+	*resp_data_len_out = PICOWOTA_SLOTS * sizeof(struct slot_record);
+
+	return COMM_RSP_OK;
+}
+
+static uint32_t handle_catalog(uint32_t *args_in, uint8_t *data_in, uint32_t *resp_args_out, uint8_t *resp_data_out)
+{
+	uint32_t slot;
+
+	// The images need to be up to date for their CRCs to be checked
+	if (erase_busy()) {
+		return COMM_RSP_BUSY;
+	}
+
+	sector_cache_flush_all();
+
+	for (slot = 0; slot < PICOWOTA_SLOTS; slot++) {
+		struct image_header *hdr = slot_header(slot);
+		struct slot_record rec = {
+			.app_addr = SLOT_APP_ADDR(slot),
+			.app_size = slot_app_size(slot),
+			.vtor = hdr->vtor,
+			.size = hdr->size,
+			.crc = hdr->crc,
+			.valid = slot_ok(slot),
+		};
+
+		memcpy(resp_data_out + (slot * sizeof(rec)), &rec, sizeof(rec));
+	}
+
+	resp_args_out[0] = PICOWOTA_SLOTS;
+	resp_args_out[1] = slot_default();
+	resp_args_out[2] = slot_boot();
+
+	return COMM_RSP_OK;
+}
+
+const struct comm_command catalog_cmd = {
+	// CATL
+	// OKOK n_slots default_slot boot_slot [app_addr app_size vtor size crc valid]...
+	// boot_slot is the one which would run on reset (0xffffffff if none)
+	.opcode = CMD_CATALOG,
+	.nargs = 0,
+	.resp_nargs = CATALOG_RESP_NARGS,
+	.size = &size_catalog,
+	.handle = &handle_catalog,
+};
+
+struct partition_record {
+	char name[PICOWOTA_PARTITION_NAME_LEN];
+	uint32_t addr;
+	uint32_t capacity;
+	uint32_t size;
+	uint32_t crc;
+	uint32_t valid;
+};
+static_assert(PICOWOTA_N_PARTITIONS * sizeof(struct partition_record) <= COMM_MAX_DATA_LEN,
+	      "too many partitions for PART");
+
+// A partition is only valid if its data still matches the sealed CRC
+static bool partition_ok(const struct picowota_partition_entry *entry)
+{
+	const struct picowota_partition_header *hdr =
+		(const struct picowota_partition_header *)entry->header_addr;
+
+	return picowota_partition_sealed(entry) && hdr->size &&
+		(calc_crc32((void *)picowota_partition_data_addr(entry), hdr->size) == hdr->crc);
+}
+
+static uint32_t size_partitions(uint32_t *args_in, uint32_t *data_len_out, uint32_t *resp_data_len_out)
+{
+	*data_len_out = 0;
+	*resp_data_len_out = picowota_n_partitions * sizeof(struct partition_record);
+
+	return COMM_RSP_OK;
+}
+
+static uint32_t handle_partitions(uint32_t *args_in, uint8_t *data_in, uint32_t *resp_args_out, uint8_t *resp_data_out)
+{
+	unsigned int i;
+
+	// The data needs to be up to date for the CRCs to be checked
+	if (erase_busy()) {
+		return COMM_RSP_BUSY;
+	}
+
+	sector_cache_flush_all();
+
+	for (i = 0; i < picowota_n_partitions; i++) {
+		const struct picowota_partition_entry *entry = &picowota_partitions[i];
+		const struct picowota_partition_header *hdr =
+			(const struct picowota_partition_header *)entry->header_addr;
+		bool valid = partition_ok(entry);
+		struct partition_record rec = {
+			.addr = picowota_partition_data_addr(entry),
+			.capacity = entry->capacity,
+			.size = valid ? hdr->size : 0,
+			.crc = valid ? hdr->crc : 0,
+			.valid = valid,
+		};
+		strncpy(rec.name, entry->name, sizeof(rec.name));
+
+		memcpy(resp_data_out + (i * sizeof(rec)), &rec, sizeof(rec));
+	}
+
+	resp_args_out[0] = picowota_n_partitions;
+
+	return COMM_RSP_OK;
+}
+
+const struct comm_command partitions_cmd = {
+	// PART
+	// OKOK n_partitions [name[16] addr capacity size crc valid]...
+	.opcode = CMD_PARTITIONS,
+	.nargs = 0,
+	.resp_nargs = 1,
+	.size = &size_partitions,
+	.handle = &handle_partitions,
+};
+
+static uint32_t handle_partition_seal(uint32_t *args_in, uint8_t *data_in, uint32_t *resp_args_out, uint8_t *resp_data_out)
+{
+	uint32_t addr = args_in[0];
+	uint32_t size = args_in[1];
+	uint32_t crc = args_in[2];
+	const struct picowota_partition_entry *entry;
+	int i = addr_partition(addr, size);
+
+	if ((i < 0) || (addr != picowota_partition_data_addr(&picowota_partitions[i])) || !size || (size & 0x3)) {
+		// Has to be the whole of the data, from the start of a partition
+		return COMM_RSP_ERR;
+	}
+	entry = &picowota_partitions[i];
+
+	if (erase_busy()) {
+		return COMM_RSP_BUSY;
+	}
+
+	sector_cache_flush_all();
+
+	if (calc_crc32((void *)addr, size) != crc) {
+		return COMM_RSP_ERR;
+	}
+
+	union {
+		struct picowota_partition_header hdr;
+		uint8_t page[FLASH_PAGE_SIZE];
+	} new;
+	memset(&new, 0xff, sizeof(new));
+	new.hdr.magic = PICOWOTA_PARTITION_MAGIC;
+	new.hdr.size = size;
+	new.hdr.crc = crc;
+	memset(new.hdr.name, 0, sizeof(new.hdr.name));
+	strncpy(new.hdr.name, entry->name, sizeof(new.hdr.name));
+
+	struct flash_session session;
+	flash_session_init(&session);
+	flash_session_erase(&session, entry->header_addr - XIP_BASE, FLASH_SECTOR_SIZE);
+	flash_session_program(&session, entry->header_addr - XIP_BASE, new.page, sizeof(new.page));
+
+	trace_event(TRACE_FLASH_ERASE, 1, entry->header_addr);
+	flash_session_run(&session);
+	trace_event(TRACE_FLASH_ERASE, 0, entry->header_addr);
+
+	if (memcmp(&new.hdr, (void *)entry->header_addr, sizeof(new.hdr))) {
+		return COMM_RSP_ERR;
+	}
+
+	return COMM_RSP_OK;
+}
+
+const struct comm_command partition_seal_cmd = {
+	// PSEA addr len crc
+	// OKOK
+	// Like SEAL, for the data partition starting at addr
+	.opcode = CMD_PARTITION_SEAL,
+	.nargs = 3,
+	.resp_nargs = 0,
+	.size = NULL,
+	.handle = &handle_partition_seal,
+};
+
+static uint32_t handle_select(uint32_t *args_in, uint8_t *data_in, uint32_t *resp_args_out, uint8_t *resp_data_out)
+{
+	uint32_t slot = args_in[0];
+
+	if (slot >= PICOWOTA_SLOTS) {
+		return COMM_RSP_ERR;
+	}
+
+	if (erase_busy()) {
+		return COMM_RSP_BUSY;
+	}
+
+	sector_cache_flush_all();
+
+	// Only sealed images can be chosen
+	if (!slot_ok(slot)) {
+		return COMM_RSP_ERR;
+	}
+
+#if PICOWOTA_SLOTS > 1
+	if (slot_default() != slot) {
+		slot_select_write(slot);
+		discovery_refresh();
+	}
+#endif
+
+	return COMM_RSP_OK;
+}
+
+const struct comm_command select_cmd = {
+	// SLCT slot
+	// OKOK
+	// Boot this slot from now on. Falls back to the first good slot if it
+	// stops being valid.
+	.opcode = CMD_SELECT,
+	.nargs = 1,
+	.resp_nargs = 0,
+	.size = NULL,
+	.handle = &handle_select,
+};
+
+static uint32_t handle_go_slot(uint32_t *args_in, uint8_t *data_in, uint32_t *resp_args_out, uint8_t *resp_data_out)
+{
+	uint32_t slot = args_in[0];
+
+	if (slot >= PICOWOTA_SLOTS) {
+		return COMM_RSP_ERR;
+	}
+
+	if (erase_busy()) {
+		return COMM_RSP_BUSY;
+	}
+
+	sector_cache_flush_all();
+
+	if (!slot_ok(slot)) {
+		return COMM_RSP_ERR;
+	}
+
+	struct event ev = {
+		.type = EVENT_TYPE_GO,
+		.go = {
+			.vtor = slot_header(slot)->vtor,
+		},
+	};
+
+	if (!queue_try_add(&event_queue, &ev)) {
+		return COMM_RSP_ERR;
+	}
+
+	return COMM_RSP_OK;
+}
+
+struct comm_command go_slot_cmd = {
+	// GOSL slot
+	// NO RESPONSE (and the default slot doesn't change)
+	.opcode = CMD_GO_SLOT,
+	.nargs = 1,
+	.resp_nargs = 0,
+	.size = NULL,
+	.handle = &handle_go_slot,
+};
+
+// The number of sector CRCs MANI will send, or 0 if the request is no good
+static uint32_t manifest_len(uint32_t slot, uint32_t first, uint32_t max)
+{
+	if (slot >= PICOWOTA_SLOTS) {
+		return 0;
+	}
+
+	struct image_header *hdr = slot_header(slot);
+	if (addr_slot(hdr->vtor, hdr->size) != (int)slot) {
+		return 0;
+	}
+
+	uint32_t n_sectors = peer_n_sectors(hdr->vtor, hdr->size);
+	if (first >= n_sectors) {
+		return 0;
+	}
+
+	uint32_t n = n_sectors - first;
+	if (n > max) {
+		n = max;
+	}
+	if (n > PEER_MANIFEST_MAX) {
+		n = PEER_MANIFEST_MAX;
+	}
+
+	return n;
+}
+
+static uint32_t size_manifest(uint32_t *args_in, uint32_t *data_len_out, uint32_t *resp_data_len_out)
+{
+	uint32_t n = manifest_len(args_in[0], args_in[1], args_in[2]);
+	if (!n) {
+		return COMM_RSP_ERR;
+	}
+
+	*data_len_out = 0;
+	*resp_data_len_out = n * sizeof(uint32_t);
+
+	return COMM_RSP_OK;
+}
+
+static uint32_t handle_manifest(uint32_t *args_in, uint8_t *data_in, uint32_t *resp_args_out, uint8_t *resp_data_out)
+{
+	uint32_t slot = args_in[0];
+	uint32_t first = args_in[1];
+	uint32_t i, start, end;
+
+	if (erase_busy()) {
+		return COMM_RSP_BUSY;
+	}
+
+	sector_cache_flush_all();
+
+	// Only sealed images get handed out
+	uint32_t n = manifest_len(slot, first, args_in[2]);
+	if (!n || !slot_ok(slot)) {
+		return COMM_RSP_ERR;
+	}
+
+	struct image_header *hdr = slot_header(slot);
+	for (i = 0; i < n; i++) {
+		peer_sector_range(hdr->vtor, hdr->size, first + i, &start, &end);
+		uint32_t crc = calc_crc32((void *)start, end - start);
+		memcpy(resp_data_out + (i * sizeof(crc)), &crc, sizeof(crc));
+	}
+
+	struct manifest_header mh = {
+		.vtor = hdr->vtor,
+		.size = hdr->size,
+		.crc = hdr->crc,
+		.n = n,
+	};
+	memcpy(resp_args_out, &mh, sizeof(mh));
+
+	return COMM_RSP_OK;
+}
+
+const struct comm_command manifest_cmd = {
+	// MANI slot first_sector max_sectors
+	// OKOK vtor size crc n [crc]...
+	// The CRC of each sector of a sealed image, see peer.h
+	.opcode = CMD_MANIFEST,
+	.nargs = 3,
+	.resp_nargs = MANIFEST_RESP_NARGS,
+	.size = &size_manifest,
+	.handle = &handle_manifest,
+};
+
+// While seeding, the device stays in the bootloader so that peers can fetch
+// an image from it, and runs the image once nobody has been connected (and
+// it hasn't been fetching anything itself) for linger_ms.
+struct seed {
+	bool active;
+	uint32_t slot;
+	uint32_t linger_ms;
+	absolute_time_t last_busy;
+};
+static struct seed seed;
+
+static void seed_start(uint32_t slot, uint32_t linger_s)
+{
+	seed.active = linger_s != 0;
+	seed.slot = slot;
+	seed.linger_ms = linger_s * 1000;
+	seed.last_busy = get_absolute_time();
+}
+
+static void seed_step(bool busy)
+{
+	if (!seed.active) {
+		return;
+	}
+
+	if (busy || erase_busy() || peer_busy()) {
+		seed.last_busy = get_absolute_time();
+		return;
+	}
+
+	if (absolute_time_diff_us(seed.last_busy, get_absolute_time()) < (int64_t)seed.linger_ms * 1000) {
+		return;
+	}
+
+	seed.active = false;
+
+	sector_cache_flush_all();
+	if (!slot_ok(seed.slot)) {
+		DBG_PRINTF("Seed slot %d isn't valid any more\n", seed.slot);
+		return;
+	}
+
+	struct event ev = {
+		.type = EVENT_TYPE_GO,
+		.go = {
+			.vtor = slot_header(seed.slot)->vtor,
+		},
+	};
+
+	queue_try_add(&event_queue, &ev);
+}
+
+static uint32_t handle_seed(uint32_t *args_in, uint8_t *data_in, uint32_t *resp_args_out, uint8_t *resp_data_out)
+{
+	uint32_t slot = args_in[0];
+
+	if (slot >= PICOWOTA_SLOTS) {
+		return COMM_RSP_ERR;
+	}
+
+	if (erase_busy()) {
+		return COMM_RSP_BUSY;
+	}
+
+	sector_cache_flush_all();
+
+	if (!slot_ok(slot)) {
+		return COMM_RSP_ERR;
+	}
+
+	seed_start(slot, args_in[1]);
+
+	return COMM_RSP_OK;
+}
+
+const struct comm_command seed_cmd = {
+	// SEED slot linger_s
+	// OKOK
+	// Serve the image in slot to peers, and run it once nothing has
+	// connected for linger_s. linger_s = 0 stops seeding, without running it.
+	.opcode = CMD_SEED,
+	.nargs = 2,
+	.resp_nargs = 0,
+	.size = NULL,
+	.handle = &handle_seed,
+};
+
+#define FETCH_FLAG_SELECT (1 << 0)
+
+// What to do with an image once it's been fetched
+struct fetch_job {
+	uint32_t linger_s;
+	uint32_t flags;
+};
+static struct fetch_job fetch_job;
+
+// True if slot already holds exactly this (valid) image
+static bool slot_has_image(uint32_t slot, uint32_t vtor, uint32_t size, uint32_t crc)
+{
+	struct image_header *hdr = slot_header(slot);
+
+	return (hdr->vtor == vtor) && (hdr->size == size) && (hdr->crc == crc) && slot_ok(slot);
+}
+
+static int fetch_begin(void *priv, uint32_t vtor, uint32_t size, uint32_t crc)
+{
+	int slot = addr_slot(vtor, size);
+
+	if ((slot < 0) || (vtor & 0xff) || (size & 0x3)) {
+		return -1;
+	}
+
+	if (slot_has_image(slot, vtor, size, crc)) {
+		return 1;
+	}
+
+	// Don't overwrite an image which is being handed out
+	if (seed.active && (seed.slot == (uint32_t)slot)) {
+		return -1;
+	}
+
+	return 0;
+}
+
+static uint32_t fetch_crc(void *priv, uint32_t addr, uint32_t len)
 {
-	// Derived from the Leaf Labs Cortex-M3 bootloader.
-	// Copyright (c) 2010 LeafLabs LLC.
-	// Modified 2021 Brian Starkey <stark3y@gmail.com>
-	// Originally under The MIT License
-	uint32_t reset_vector = *(volatile uint32_t *)(vtor + 0x04);
+	sector_cache_flush(addr, len);
 
-	SCB->VTOR = (volatile uint32_t)(vtor);
+	return calc_crc32((void *)addr, len);
+}
 
-	asm volatile("msr msp, %0"::"g"
-			(*(volatile uint32_t *)vtor));
-	asm volatile("bx %0"::"r" (reset_vector));
+static int fetch_write_sector(void *priv, uint32_t addr, const uint8_t *data)
+{
+	if (erase_busy()) {
+		return 1;
+	}
+
+	// The whole sector is replaced
+	sector_cache_discard(addr, FLASH_SECTOR_SIZE);
+	discovery_invalidate(addr, FLASH_SECTOR_SIZE);
+
+	struct flash_session session;
+	flash_session_init(&session);
+	flash_session_erase(&session, addr - XIP_BASE, FLASH_SECTOR_SIZE);
+	flash_session_program(&session, addr - XIP_BASE, data, FLASH_SECTOR_SIZE);
+
+	trace_event(TRACE_FLASH_PROGRAM, 1, addr);
+	flash_session_run(&session);
+	trace_event(TRACE_FLASH_PROGRAM, 0, addr);
+
+	return 0;
+}
+
+static int fetch_finish(void *priv, uint32_t vtor, uint32_t size, uint32_t crc)
+{
+	struct image_header hdr = {
+		.vtor = vtor,
+		.size = size,
+		.crc = crc,
+	};
+	uint32_t slot = addr_slot(vtor, size);
+
+	// No need to rewrite the header if it's already right
+	if (!slot_has_image(slot, vtor, size, crc)) {
+		uint32_t res = image_seal(&hdr);
+		if (res == COMM_RSP_BUSY) {
+			return 1;
+		} else if (res != COMM_RSP_OK) {
+			return -1;
+		}
+	}
+
+#if PICOWOTA_SLOTS > 1
+	if ((fetch_job.flags & FETCH_FLAG_SELECT) && (slot_default() != slot)) {
+		slot_select_write(slot);
+		discovery_refresh();
+	}
+#endif
+
+	// Now it can be passed on
+	seed_start(slot, fetch_job.linger_s);
+
+	return 0;
 }
 
+static const struct peer_flash_ops fetch_ops = {
+	.begin = fetch_begin,
+	.crc = fetch_crc,
+	.write_sector = fetch_write_sector,
+	.finish = fetch_finish,
+};
 
-static uint32_t handle_go(uint32_t *args_in, uint8_t *data_in, uint32_t *resp_args_out, uint8_t *resp_data_out)
+static const uint8_t *fetch_psk;
+
+static uint32_t handle_fetch(uint32_t *args_in, uint8_t *data_in, uint32_t *resp_args_out, uint8_t *resp_data_out)
+{
+	struct peer_fetch fetch = {
+		.port = args_in[1],
+		.build_id = args_in[2],
+		.psk = fetch_psk,
+	};
+
+	if ((args_in[1] == 0) || (args_in[1] > 0xffff) || peer_busy()) {
+		return COMM_RSP_ERR;
+	}
+
+	ip_addr_set_ip4_u32(&fetch.addr, args_in[0]);
+
+	fetch_job.linger_s = args_in[3];
+	fetch_job.flags = args_in[4];
+
+	if (peer_fetch_start(&fetch, &fetch_ops, NULL)) {
+		return COMM_RSP_ERR;
+	}
+
+	return COMM_RSP_OK;
+}
+
+const struct comm_command fetch_cmd = {
+	// FTCH ip port build_id linger_s flags
+	// OKOK
+	// Fetch the image with build_id from another device (ip is the IPv4
+	// address as it's laid out in memory) in the background, then seal it,
+	// select it if flags bit 0 is set, and seed it for linger_s (see SEED).
+	// Progress is in FSTA.
+	.opcode = CMD_FETCH,
+	.nargs = 5,
+	.resp_nargs = 0,
+	.size = NULL,
+	.handle = &handle_fetch,
+};
+
+static uint32_t handle_fetch_status(uint32_t *args_in, uint8_t *data_in, uint32_t *resp_args_out, uint8_t *resp_data_out)
+{
+	struct peer_status status;
+
+	peer_get_status(&status);
+
+	resp_args_out[0] = status.state;
+	resp_args_out[1] = status.done;
+	resp_args_out[2] = status.total;
+	resp_args_out[3] = status.fetched;
+	resp_args_out[4] = status.err;
+
+	return COMM_RSP_OK;
+}
+
+const struct comm_command fetch_status_cmd = {
+	// FSTA
+	// OKOK state done total fetched err
+	// state and err are enum peer_state and enum peer_err
+	.opcode = CMD_FETCH_STATUS,
+	.nargs = 0,
+	.resp_nargs = 5,
+	.size = NULL,
+	.handle = &handle_fetch_status,
+};
+
+#ifdef PICOWOTA_PULL_SERVER
+/*
+ * Pull mode: on a normal boot, the bootloader first asks the update server
+ * (which speaks this same protocol, e.g. picowota_server.py) for its image,
+ * fetches whichever sectors have changed, and then runs the best image it
+ * has. If the server can't be reached, the existing image runs.
+ */
+#ifndef PICOWOTA_PULL_PORT
+#define PICOWOTA_PULL_PORT 4242
+#endif
+
+// The longest a normal boot waits for the WiFi, the server and the fetch
+// together, see CMakeLists.txt
+#ifndef PICOWOTA_PULL_TIMEOUT_MS
+#define PICOWOTA_PULL_TIMEOUT_MS 3000
+#endif
+
+#define PULL_ATTEMPTS 2
+
+static bool pull_active;
+static absolute_time_t pull_deadline;
+
+static uint32_t pull_ms_left(void)
+{
+	int64_t left_us = absolute_time_diff_us(get_absolute_time(), pull_deadline);
+
+	return left_us > 0 ? left_us / 1000 : 0;
+}
+
+// The pull is over, one way or another: run the best image there is, unless
+// someone is using the bootloader
+static void pull_finish(bool client_connected)
 {
+	pull_active = false;
+
+	if (client_connected) {
+		DBG_PRINTF("Staying in the bootloader for the client\n");
+		return;
+	}
+
+	uint32_t slot = slot_boot();
+	if (slot == SLOT_NONE) {
+		DBG_PRINTF("Nothing to run\n");
+		return;
+	}
+
 	struct event ev = {
 		.type = EVENT_TYPE_GO,
 		.go = {
-			.vtor = args_in[0],
+			.vtor = slot_header(slot)->vtor,
 		},
 	};
 
-	if (!queue_try_add(&event_queue, &ev)) {
-		return TCP_COMM_RSP_ERR;
+	queue_try_add(&event_queue, &ev);
+}
+
+static void pull_start(void)
+{
+	struct peer_fetch fetch = {
+		.port = PICOWOTA_PULL_PORT,
+		.any_build = true,
+		.psk = fetch_psk,
+		.max_attempts = PULL_ATTEMPTS,
+	};
+
+	if (!ipaddr_aton(STR(PICOWOTA_PULL_SERVER), &fetch.addr)) {
+		DBG_PRINTF("Bad pull server address\n");
+		pull_finish(false);
+		return;
+	}
+
+	// The new image becomes the one which boots, and nobody is waiting to
+	// fetch it from us
+	fetch_job.linger_s = 0;
+	fetch_job.flags = FETCH_FLAG_SELECT;
+
+	if (peer_fetch_start(&fetch, &fetch_ops, NULL)) {
+		DBG_PRINTF("Couldn't start the pull\n");
+		pull_finish(false);
+		return;
 	}
 
-	return TCP_COMM_RSP_OK;
+	pull_active = true;
 }
 
-struct comm_command go_cmd = {
-	// GOGO vtor
-	// NO RESPONSE
-	.opcode = CMD_GO,
-	.nargs = 1,
-	.resp_nargs = 0,
-	.size = NULL,
-	.handle = &handle_go,
-};
+static void pull_step(bool client_connected)
+{
+	if (!pull_active) {
+		return;
+	}
+
+	if (peer_busy()) {
+		if (!time_reached(pull_deadline)) {
+			return;
+		}
+
+		// Once the new image has started going in, its slot has
+		// already been overwritten, so let it finish
+		struct peer_status status;
+		peer_get_status(&status);
+		if (status.fetched) {
+			return;
+		}
+
+		DBG_PRINTF("Pull timed out\n");
+		peer_cancel();
+	}
+
+	pull_finish(client_connected);
+}
+#endif
 
 static uint32_t handle_info(uint32_t *args_in, uint8_t *data_in, uint32_t *resp_args_out, uint8_t *resp_data_out)
 {
+	// Slot 0, see CATL for the others
 	resp_args_out[0] = WRITE_ADDR_MIN;
-	resp_args_out[1] = (XIP_BASE + PICO_FLASH_SIZE_BYTES) - WRITE_ADDR_MIN;
+	resp_args_out[1] = slot_app_size(0);
 	resp_args_out[2] = FLASH_SECTOR_SIZE;
 	resp_args_out[3] = FLASH_PAGE_SIZE;
-	resp_args_out[4] = TCP_COMM_MAX_DATA_LEN;
+	resp_args_out[4] = COMM_MAX_DATA_LEN;
 
-	return TCP_COMM_RSP_OK;
+	return COMM_RSP_OK;
 }
 
 const struct comm_command info_cmd = {
@@ -522,16 +1989,40 @@ const struct comm_command info_cmd = {
 	.handle = &handle_info,
 };
 
+static uint32_t handle_raminfo(uint32_t *args_in, uint8_t *data_in, uint32_t *resp_args_out, uint8_t *resp_data_out)
+{
+	resp_args_out[0] = RAMLOAD_ADDR_MIN;
+	resp_args_out[1] = PICOWOTA_RAMLOAD_SIZE;
+
+	return COMM_RSP_OK;
+}
+
+const struct comm_command raminfo_cmd = {
+	// RAMI
+	// OKOK ramload_start ramload_size (size is 0 if disabled)
+	.opcode = CMD_RAMINFO,
+	.nargs = 0,
+	.resp_nargs = 2,
+	.size = NULL,
+	.handle = &handle_raminfo,
+};
+
 static uint32_t size_reboot(uint32_t *args_in, uint32_t *data_len_out, uint32_t *resp_data_len_out)
 {
 	*data_len_out = 0;
 	*resp_data_len_out = 0;
 
-	return TCP_COMM_RSP_OK;
+	return COMM_RSP_OK;
 }
 
 static uint32_t handle_reboot(uint32_t *args_in, uint8_t *data_in, uint32_t *resp_args_out, uint8_t *resp_data_out)
 {
+	if (erase_busy()) {
+		return COMM_RSP_BUSY;
+	}
+
+	sector_cache_flush_all();
+
 	struct event ev = {
 		.type = EVENT_TYPE_REBOOT,
 		.reboot = {
@@ -540,10 +2031,10 @@ static uint32_t handle_reboot(uint32_t *args_in, uint8_t *data_in, uint32_t *res
 	};
 
 	if (!queue_try_add(&event_queue, &ev)) {
-		return TCP_COMM_RSP_ERR;
+		return COMM_RSP_ERR;
 	}
 
-	return TCP_COMM_RSP_OK;
+	return COMM_RSP_OK;
 }
 
 struct comm_command reboot_cmd = {
@@ -556,6 +2047,177 @@ struct comm_command reboot_cmd = {
 	.handle = &handle_reboot,
 };
 
+static uint32_t handle_status(uint32_t *args_in, uint8_t *data_in, uint32_t *resp_args_out, uint8_t *resp_data_out)
+{
+	resp_args_out[0] = erase_job.id;
+	resp_args_out[1] = erase_busy();
+	resp_args_out[2] = erase_job.next - erase_job.start;
+	resp_args_out[3] = erase_job.end - erase_job.start;
+
+	return COMM_RSP_OK;
+}
+
+const struct comm_command status_cmd = {
+	// STAT
+	// OKOK erase_id erase_busy erase_done erase_total
+	.opcode = CMD_STATUS,
+	.nargs = 0,
+	.resp_nargs = 4,
+	.size = NULL,
+	.handle = &handle_status,
+};
+
+static uint32_t handle_abort(uint32_t *args_in, uint8_t *data_in, uint32_t *resp_args_out, uint8_t *resp_data_out)
+{
+	resp_args_out[0] = erase_busy() ? erase_job.id : 0;
+
+	// Whatever has already been erased stays erased
+	erase_job.end = erase_job.next;
+	discovery_refresh();
+
+	return COMM_RSP_OK;
+}
+
+const struct comm_command abort_cmd = {
+	// ABRT
+	// OKOK aborted_erase_id (0 if none)
+	// Runs straight away, even behind a command which is waiting for the
+	// erase
+	.opcode = CMD_ABORT,
+	.nargs = 0,
+	.resp_nargs = 1,
+	.size = NULL,
+	.handle = &handle_abort,
+	.preempt = true,
+};
+
+struct pool_record {
+	char name[16];
+	uint16_t block_size;
+	uint16_t n_blocks;
+	uint16_t used;
+	uint16_t max_used;
+	uint32_t err;
+};
+
+#define POOL_MAX_RECORDS (COMM_MAX_DATA_LEN / sizeof(struct pool_record))
+
+// lwIP only keeps the pool names in debug builds
+static const char *const lwip_pool_names[MEMP_MAX] = {
+#define LWIP_MEMPOOL(name, num, size, desc) desc,
+#include "lwip/priv/memp_std.h"
+};
+
+// Snapshot taken in size_pool(), so that the response length is fixed before
+// the handler runs
+static struct pool_record pool_buf[POOL_MAX_RECORDS];
+static uint32_t pool_buf_n;
+
+static void pool_record_add(const char *name, uint16_t block_size, uint16_t n_blocks,
+			    uint16_t used, uint16_t max_used, uint32_t err)
+{
+	if (pool_buf_n >= POOL_MAX_RECORDS) {
+		return;
+	}
+
+	struct pool_record *rec = &pool_buf[pool_buf_n++];
+	memset(rec->name, 0, sizeof(rec->name));
+	strncpy(rec->name, name, sizeof(rec->name));
+	rec->block_size = block_size;
+	rec->n_blocks = n_blocks;
+	rec->used = used;
+	rec->max_used = max_used;
+	rec->err = err;
+}
+
+static uint32_t size_pool(uint32_t *args_in, uint32_t *data_len_out, uint32_t *resp_data_len_out)
+{
+	const struct pool *pool;
+	unsigned int i;
+
+	pool_buf_n = 0;
+
+	for (pool = pool_list(); pool; pool = pool->next) {
+		pool_record_add(pool->name, pool->block_size, pool->n_blocks,
+				pool->used, pool->max_used, pool->err);
+	}
+
+	for (i = 0; i < MEMP_MAX; i++) {
+		const struct stats_mem *stats = lwip_stats.memp[i];
+		pool_record_add(lwip_pool_names[i], memp_pools[i]->size, stats->avail,
+				stats->used, stats->max, stats->err);
+	}
+
+	*data_len_out = 0;
+	*resp_data_len_out = pool_buf_n * sizeof(struct pool_record);
+
+	return COMM_RSP_OK;
+}
+
+static uint32_t handle_pool(uint32_t *args_in, uint8_t *data_in, uint32_t *resp_args_out, uint8_t *resp_data_out)
+{
+	resp_args_out[0] = pool_buf_n;
+	memcpy(resp_data_out, pool_buf, pool_buf_n * sizeof(struct pool_record));
+
+	return COMM_RSP_OK;
+}
+
+const struct comm_command pool_cmd = {
+	// POOL
+	// OKOK n_pools [records]
+	.opcode = CMD_POOL,
+	.nargs = 0,
+	.resp_nargs = 1,
+	.size = &size_pool,
+	.handle = &handle_pool,
+};
+
+#if PICOWOTA_TRACE == 1
+#define TRACE_MAX_RECORDS (COMM_MAX_DATA_LEN / sizeof(struct trace_record))
+
+// Worked out in size_trace(), so that the response length is fixed before
+// any more events get added
+static struct trace_record trace_buf[TRACE_MAX_RECORDS];
+static uint32_t trace_buf_seq, trace_buf_n;
+
+static uint32_t size_trace(uint32_t *args_in, uint32_t *data_len_out, uint32_t *resp_data_len_out)
+{
+	uint32_t max = args_in[1];
+
+	if (max > TRACE_MAX_RECORDS) {
+		max = TRACE_MAX_RECORDS;
+	}
+
+	trace_buf_seq = args_in[0];
+	trace_buf_n = trace_read(&trace_buf_seq, trace_buf, max);
+
+	*data_len_out = 0;
+	*resp_data_len_out = trace_buf_n * sizeof(struct trace_record);
+
+	return COMM_RSP_OK;
+}
+
+static uint32_t handle_trace(uint32_t *args_in, uint8_t *data_in, uint32_t *resp_args_out, uint8_t *resp_data_out)
+{
+	resp_args_out[0] = trace_buf_seq;
+	resp_args_out[1] = trace_buf_n;
+	resp_args_out[2] = trace_seq();
+	memcpy(resp_data_out, trace_buf, trace_buf_n * sizeof(struct trace_record));
+
+	return COMM_RSP_OK;
+}
+
+const struct comm_command trace_cmd = {
+	// TRCE seq max_records
+	// OKOK first_seq n_records next_seq [records]
+	.opcode = CMD_TRACE,
+	.nargs = 2,
+	.resp_nargs = 3,
+	.size = &size_trace,
+	.handle = &handle_trace,
+};
+#endif
+
 static bool should_stay_in_bootloader()
 {
 	bool wd_says_so = (watchdog_hw->scratch[5] == PICOWOTA_BOOTLOADER_ENTRY_MAGIC) &&
@@ -564,32 +2226,81 @@ static bool should_stay_in_bootloader()
 	return !gpio_get(BOOTLOADER_ENTRY_PIN) || wd_says_so;
 }
 
+#if PICOWOTA_DISCOVERY == 1
+static void discovery_get_info(struct discovery_info *info, void *arg)
+{
+	struct tcp_comm_ctx *tcp = (struct tcp_comm_ctx *)arg;
+
+	pico_get_unique_board_id((pico_unique_board_id_t *)info->board_id);
+	info->flash_size = flash_size;
+	info->image_valid = discovery_slot != SLOT_NONE;
+	info->build_id = discovery_build_id;
+	info->session_active = tcp_comm_client_connected(tcp);
+}
+#endif
+
 static void network_deinit()
 {
+#if PICOWOTA_USB == 1
+	usb_comm_deinit();
+#endif
+#if PICOWOTA_UART == 1
+	uart_comm_deinit();
+#endif
+#if PICOWOTA_DISCOVERY == 1
+	discovery_deinit();
+#endif
 #if PICOWOTA_WIFI_AP == 1
 	dhcp_server_deinit(&dhcp_server);
 #endif
 	cyw43_arch_deinit();
 }
 
+static void flash_size_init(void)
+{
+	uint32_t size = flash_id_size();
+
+	// Never less than the layout was built for: that's more likely to be
+	// a misread than the wrong chip
+	if (size > flash_size) {
+		flash_size = size;
+	}
+}
+
 int main()
 {
 	err_t err;
 
+	// Before anything writes to flash
+	critical_section_init(&critical_section);
+
+	// Before anything looks at the slots
+	flash_size_init();
+
 	gpio_init(BOOTLOADER_ENTRY_PIN);
 	gpio_pull_up(BOOTLOADER_ENTRY_PIN);
 	gpio_set_dir(BOOTLOADER_ENTRY_PIN, 0);
 
 	sleep_ms(10);
 
-	if (!should_stay_in_bootloader() && image_header_ok(&app_image_header)) {
-		uint32_t vtor = *(uint32_t *)IMAGE_HEADER_ADDR;
-		disable_interrupts();
-		reset_peripherals();
-		jump_to_vtor(vtor);
+#ifdef PICOWOTA_PULL_SERVER
+	// Check the server for an update before running anything
+	bool pull = !should_stay_in_bootloader();
+	pull_deadline = make_timeout_time_ms(PICOWOTA_PULL_TIMEOUT_MS);
+#else
+	if (!should_stay_in_bootloader()) {
+		uint32_t slot = slot_boot();
+		if (slot != SLOT_NONE) {
+			uint32_t vtor = slot_header(slot)->vtor;
+			disable_interrupts();
+			reset_peripherals();
+			jump_to_vtor(vtor);
+		}
 	}
+#endif
 
 	DBG_PRINTF_INIT();
+	DBG_PRINTF("flash size: %lu (built for %d)\n", flash_size, PICO_FLASH_SIZE_BYTES);
 
 	queue_init(&event_queue, sizeof(struct event), EVENT_QUEUE_LENGTH);
 
@@ -606,23 +2317,40 @@ int main()
 	IP4_ADDR(&gw, 192, 168, 4, 1);
 	IP4_ADDR(&mask, 255, 255, 255, 0);
 
-	dhcp_server_t dhcp_server;
 	dhcp_server_init(&dhcp_server, &gw, &mask);
 	DBG_PRINTF("Started the DHCP server.\n");
 #else
 	cyw43_arch_enable_sta_mode();
 
+	uint32_t wifi_timeout_ms = 30000;
+#ifdef PICOWOTA_PULL_SERVER
+	if (pull) {
+		wifi_timeout_ms = pull_ms_left();
+	}
+#endif
+
 	DBG_PRINTF("Connecting to WiFi...\n");
-	if (cyw43_arch_wifi_connect_timeout_ms(wifi_ssid, wifi_pass, CYW43_AUTH_WPA2_AES_PSK, 30000)) {
+	if (netcache_wifi_connect(wifi_ssid, wifi_pass, CYW43_AUTH_WPA2_AES_PSK, wifi_timeout_ms)) {
 		DBG_PRINTF("failed to connect.\n");
+#ifdef PICOWOTA_PULL_SERVER
+		// No update today, run what we've got
+		uint32_t slot = pull ? slot_boot() : SLOT_NONE;
+		if (slot != SLOT_NONE) {
+			uint32_t vtor = slot_header(slot)->vtor;
+			cyw43_arch_deinit();
+			disable_interrupts();
+			reset_peripherals();
+			jump_to_vtor(vtor);
+		}
+#endif
+#if (PICOWOTA_USB != 1) && (PICOWOTA_UART != 1)
 		return 1;
+#endif
 	} else {
 		DBG_PRINTF("Connected.\n");
 	}
 #endif
 
-	critical_section_init(&critical_section);
-
 	const struct comm_command *cmds[] = {
 		&sync_cmd,
 		&read_cmd,
@@ -630,13 +2358,83 @@ int main()
 		&crc_cmd,
 		&erase_cmd,
 		&write_cmd,
+		&fill_cmd,
+		&update_cmd,
+		&flush_cmd,
 		&seal_cmd,
+		&partitions_cmd,
+		&partition_seal_cmd,
 		&go_cmd,
+		&catalog_cmd,
+		&select_cmd,
+		&go_slot_cmd,
+		&manifest_cmd,
+		&seed_cmd,
+		&fetch_cmd,
+		&fetch_status_cmd,
 		&info_cmd,
+		&raminfo_cmd,
 		&reboot_cmd,
+		&status_cmd,
+		&abort_cmd,
+		&pool_cmd,
+#if PICOWOTA_TRACE == 1
+		&trace_cmd,
+#endif
+	};
+
+#ifdef PICOWOTA_PSK_BYTES
+	static const uint8_t psk[COMM_PSK_LEN] = { PICOWOTA_PSK_BYTES };
+
+	// Peers share the key
+	fetch_psk = psk;
+#endif
+
+	// Shared by all of the backends
+	const struct comm_table table = {
+		.cmds = cmds,
+		.n_cmds = sizeof(cmds) / sizeof(cmds[0]),
+		.sync_opcode = CMD_SYNC,
+#ifdef PICOWOTA_PSK_BYTES
+		.psk = psk,
+#endif
 	};
 
-	struct tcp_comm_ctx *tcp = tcp_comm_new(cmds, sizeof(cmds) / sizeof(cmds[0]), CMD_SYNC);
+	struct tcp_comm_ctx *tcp = tcp_comm_new(&table);
+	if (!tcp) {
+		DBG_PRINTF("Failed to create TCP server\n");
+		return 1;
+	}
+
+#if PICOWOTA_USB == 1
+	if (usb_comm_init(&table)) {
+		DBG_PRINTF("Failed to start USB\n");
+	}
+#endif
+
+#if PICOWOTA_UART == 1
+	if (uart_comm_init(&table)) {
+		DBG_PRINTF("Failed to start UART\n");
+	}
+#endif
+
+#if PICOWOTA_DISCOVERY == 1
+#if PICOWOTA_WIFI_AP == 1
+	struct netif *netif = &cyw43_state.netif[CYW43_ITF_AP];
+#else
+	struct netif *netif = &cyw43_state.netif[CYW43_ITF_STA];
+#endif
+	discovery_refresh();
+	if (discovery_init(netif, DISCOVERY_PORT, TCP_PORT, discovery_get_info, tcp)) {
+		DBG_PRINTF("Failed to start discovery.\n");
+	}
+#endif
+
+#ifdef PICOWOTA_PULL_SERVER
+	if (pull) {
+		pull_start();
+	}
+#endif
 
 	struct event ev = {
 		.type = EVENT_TYPE_SERVER_DONE,
@@ -670,8 +2468,37 @@ int main()
 			};
 		}
 
+		bool busy = false;
+
+		if (erase_job_step()) {
+			// Something waiting on the erase might be able to run now
+			tcp_comm_resume(tcp);
+			busy = true;
+
+			if (!erase_busy()) {
+				// It might have taken a sealed image with it
+				discovery_refresh();
+			}
+		}
+
+		busy |= peer_poll();
+		seed_step(tcp_comm_client_connected(tcp));
+#ifdef PICOWOTA_PULL_SERVER
+		pull_step(tcp_comm_client_connected(tcp));
+#endif
+
+#if PICOWOTA_USB == 1
+		busy |= usb_comm_poll();
+#endif
+#if PICOWOTA_UART == 1
+		busy |= uart_comm_poll();
+#endif
+
+		if (!busy) {
+			sleep_ms(5);
+		}
+
 		cyw43_arch_poll();
-		sleep_ms(5);
 	}
 
 	network_deinit();
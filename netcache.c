@@ -0,0 +1,200 @@
+/**
+ * Copyright (c) 2022 Brian Starkey <stark3y@gmail.com>
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+#include <stddef.h>
+#include <string.h>
+
+#include "hardware/flash.h"
+#include "pico/cyw43_arch.h"
+#include "pico/time.h"
+
+#include "lwip/dhcp.h"
+#include "lwip/netif.h"
+
+#include "flash_session.h"
+#include "netcache.h"
+
+#ifdef DEBUG
+#include <stdio.h>
+#define DEBUG_printf(...) printf(__VA_ARGS__)
+#else
+#define DEBUG_printf(...) { }
+#endif
+
+// How long to give the directed join + INIT-REBOOT before doing it the
+// slow way
+#define NETCACHE_CONNECT_TIMEOUT_MS 3000
+
+#define NETCACHE_MAGIC (('N' << 0) | ('C' << 8) | ('H' << 16) | ('E' << 24))
+
+struct netcache_entry {
+	uint32_t magic;
+	// Hash of SSID and password, so that changing the network config
+	// invalidates the cache
+	uint32_t key;
+	uint8_t bssid[6];
+	uint16_t channel;
+	uint32_t ip_addr;
+	uint32_t check;
+};
+
+// Reserved flash sector, placed by the linker script
+extern const struct netcache_entry picowota_netcache;
+#define NETCACHE_OFFSET ((uint32_t)&picowota_netcache - XIP_BASE)
+
+static uint32_t fnv1a(uint32_t hash, const void *data, size_t len)
+{
+	const uint8_t *p = data;
+
+	while (len--) {
+		hash ^= *p++;
+		hash *= 16777619;
+	}
+
+	return hash;
+}
+
+static uint32_t netcache_key(const char *ssid, const char *pass)
+{
+	uint32_t hash = 2166136261;
+
+	hash = fnv1a(hash, ssid, strlen(ssid) + 1);
+	hash = fnv1a(hash, pass, strlen(pass) + 1);
+
+	return hash;
+}
+
+static uint32_t netcache_check(const struct netcache_entry *e)
+{
+	return fnv1a(2166136261, e, offsetof(struct netcache_entry, check));
+}
+
+static bool netcache_load(struct netcache_entry *e, uint32_t key)
+{
+	memcpy(e, &picowota_netcache, sizeof(*e));
+
+	return (e->magic == NETCACHE_MAGIC) && (e->key == key) &&
+		(e->check == netcache_check(e));
+}
+
+static void netcache_store(struct netcache_entry *e)
+{
+	uint8_t page[FLASH_PAGE_SIZE];
+	static_assert(sizeof(*e) <= sizeof(page), "netcache_entry must fit in a page");
+
+	e->magic = NETCACHE_MAGIC;
+	e->check = netcache_check(e);
+
+	memset(page, 0xff, sizeof(page));
+	memcpy(page, e, sizeof(*e));
+
+	struct flash_session session;
+	flash_session_init(&session);
+	flash_session_erase(&session, NETCACHE_OFFSET, FLASH_SECTOR_SIZE);
+	flash_session_program(&session, NETCACHE_OFFSET, page, sizeof(page));
+
+	flash_session_run(&session);
+}
+
+// Called once the directed join has finished and lwIP has started DHCP.
+// Pretend we're still bound to the cached lease, so that lwIP's link-up
+// handling sends a DHCPREQUEST for the old address (INIT-REBOOT) instead of
+// a DISCOVER. A NAK or timeout drops lwIP back to DISCOVER on its own.
+static void netcache_dhcp_init_reboot(struct netif *netif, uint32_t ip_addr)
+{
+	struct dhcp *dhcp = netif_dhcp_data(netif);
+	if (!dhcp || (dhcp->state == DHCP_STATE_BOUND) || !ip_addr) {
+		return;
+	}
+
+	ip4_addr_set_u32(&dhcp->offered_ip_addr, ip_addr);
+	dhcp->state = DHCP_STATE_BOUND;
+	dhcp_network_changed_link_up(netif);
+}
+
+static int netcache_fast_connect(const struct netcache_entry *e, const char *ssid,
+		const char *pass, uint32_t auth, absolute_time_t limit)
+{
+	struct netif *netif = &cyw43_state.netif[CYW43_ITF_STA];
+	bool dhcp_primed = false;
+
+	int ret = cyw43_wifi_join(&cyw43_state, strlen(ssid), (const uint8_t *)ssid,
+			strlen(pass), (const uint8_t *)pass, auth, e->bssid, e->channel);
+	if (ret) {
+		return ret;
+	}
+
+	absolute_time_t deadline = make_timeout_time_ms(NETCACHE_CONNECT_TIMEOUT_MS);
+	if (absolute_time_diff_us(limit, deadline) > 0) {
+		deadline = limit;
+	}
+
+	while (!time_reached(deadline)) {
+		int status = cyw43_tcpip_link_status(&cyw43_state, CYW43_ITF_STA);
+		if (status == CYW43_LINK_UP) {
+			return 0;
+		} else if (status < 0) {
+			return status;
+		} else if ((status == CYW43_LINK_NOIP) && !dhcp_primed) {
+			netcache_dhcp_init_reboot(netif, e->ip_addr);
+			dhcp_primed = true;
+		}
+
+		cyw43_arch_poll();
+		sleep_ms(1);
+	}
+
+	return -1;
+}
+
+int netcache_wifi_connect(const char *ssid, const char *pass, uint32_t auth, uint32_t timeout_ms)
+{
+	struct netif *netif = &cyw43_state.netif[CYW43_ITF_STA];
+	struct netcache_entry cached, current = { 0 };
+	uint32_t key = netcache_key(ssid, pass);
+	bool have_cache = netcache_load(&cached, key);
+	absolute_time_t deadline = make_timeout_time_ms(timeout_ms);
+
+	if (have_cache) {
+		DEBUG_printf("netcache: trying channel %d, IP %08lx\n", cached.channel, cached.ip_addr);
+		if (netcache_fast_connect(&cached, ssid, pass, auth, deadline) == 0) {
+			DEBUG_printf("netcache: fast connect OK\n");
+			goto connected;
+		}
+
+		DEBUG_printf("netcache: fast connect failed, doing full connect\n");
+		cyw43_wifi_leave(&cyw43_state, CYW43_ITF_STA);
+	}
+
+	// Whatever the fast connect didn't use
+	int64_t left_ms = absolute_time_diff_us(get_absolute_time(), deadline) / 1000;
+	if ((left_ms <= 0) || cyw43_arch_wifi_connect_timeout_ms(ssid, pass, auth, left_ms)) {
+		return -1;
+	}
+
+connected:
+	current.key = key;
+	if (cyw43_wifi_get_bssid(&cyw43_state, current.bssid)) {
+		return 0;
+	}
+
+	uint32_t channel = 0;
+	if (cyw43_ioctl(&cyw43_state, CYW43_IOCTL_GET_CHANNEL, sizeof(channel),
+			(uint8_t *)&channel, CYW43_ITF_STA)) {
+		return 0;
+	}
+	current.channel = channel;
+	current.ip_addr = ip4_addr_get_u32(netif_ip4_addr(netif));
+
+	// Only touch flash when something actually changed
+	if (!have_cache || (cached.channel != current.channel) ||
+	    (cached.ip_addr != current.ip_addr) ||
+	    memcmp(cached.bssid, current.bssid, sizeof(current.bssid))) {
+		DEBUG_printf("netcache: updating cache\n");
+		netcache_store(&current);
+	}
+
+	return 0;
+}
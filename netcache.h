@@ -0,0 +1,22 @@
+/**
+ * Copyright (c) 2022 Brian Starkey <stark3y@gmail.com>
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+#ifndef __NETCACHE_H__
+#define __NETCACHE_H__
+
+#include <stdint.h>
+
+/*
+ * Connect to a WiFi network in station mode, using the channel, BSSID and
+ * DHCP lease from the last successful connection (if any) to do a directed
+ * join and a DHCP INIT-REBOOT. Falls back to a full scan/DISCOVER if that
+ * fails. timeout_ms covers both. On success, the cache is updated if anything
+ * changed.
+ *
+ * Returns 0 on success.
+ */
+int netcache_wifi_connect(const char *ssid, const char *pass, uint32_t auth, uint32_t timeout_ms);
+
+#endif /* __NETCACHE_H__ */
@@ -0,0 +1,786 @@
+/**
+ * Copyright (c) 2022 Brian Starkey <stark3y@gmail.com>
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+#include <string.h>
+
+#include "pico/cyw43_arch.h"
+#include "pico/rand.h"
+#include "pico/time.h"
+
+#include "lwip/pbuf.h"
+#include "lwip/tcp.h"
+
+#include "aead.h"
+#include "comm.h"
+#include "peer.h"
+#include "pool.h"
+#include "protocol.h"
+#include "trace.h"
+
+#ifdef DEBUG
+#include <stdio.h>
+#define DEBUG_printf(...) printf(__VA_ARGS__)
+#else
+#define DEBUG_printf(...) { }
+#endif
+
+// Default attempts at the whole fetch, with the delay growing by this much
+// each time
+#define PEER_MAX_ATTEMPTS   5
+#define PEER_RETRY_DELAY_MS 2000
+
+// A sector is fetched with back-to-back READs, all sent at once
+#define PEER_READ_LEN         COMM_MAX_DATA_LEN
+#define PEER_READS_PER_SECTOR (PEER_SECTOR_SIZE / PEER_READ_LEN)
+#define PEER_TX_MAX_WORDS     (PEER_READS_PER_SECTOR * 3)
+
+// The biggest response which gets asked for is a full MANI
+#define PEER_RSP_MAX   (sizeof(uint32_t) * (1 + MANIFEST_RESP_NARGS + PEER_MANIFEST_MAX))
+// Room for the next response to arrive while one is being handled
+#define PEER_PLAIN_LEN (2 * PEER_RSP_MAX)
+
+enum peer_step {
+	// Waiting to (re)connect
+	STEP_WAIT,
+	STEP_CONNECT,
+	STEP_SYNC,
+	STEP_AUTH,
+	STEP_CATALOG,
+	STEP_MANIFEST,
+	STEP_READ,
+	// A sector has all arrived, and is waiting to be written
+	STEP_WRITE,
+	// Everything is written, waiting to seal it
+	STEP_FINISH,
+	// Done or failed, ctx gets freed
+	STEP_END,
+};
+
+struct peer_ctx {
+	enum peer_step step;
+
+	struct peer_fetch fetch;
+	const struct peer_flash_ops *ops;
+	void *priv;
+
+	unsigned int attempts;
+	uint32_t wait_until_ms;
+	uint32_t last_progress_ms;
+
+	// Set from lwIP callbacks, acted on in peer_poll()
+	struct tcp_pcb *pcb;
+	struct pbuf *rx_pbuf;
+	bool connected;
+	bool closed;
+
+	bool secure;
+	uint8_t session_key[AEAD_KEY_LEN];
+	uint8_t client_nonce[16];
+	uint64_t tx_counter;
+	uint64_t rx_counter;
+
+	// The image on the source
+	uint32_t slot;
+	uint32_t vtor;
+	uint32_t size;
+	uint32_t build_id;
+	uint32_t n_sectors;
+
+	// Current sector, and the part of the manifest which covers it
+	uint32_t sector;
+	uint32_t manifest_first;
+	uint32_t manifest_n;
+	uint32_t manifest[PEER_MANIFEST_MAX];
+
+	// READs for the current sector
+	uint32_t read_start;
+	uint32_t read_end;
+	uint32_t reads_sent;
+	uint32_t reads_done;
+
+	uint8_t tx[(PEER_TX_MAX_WORDS * sizeof(uint32_t)) + COMM_FRAME_OVERHEAD];
+
+	uint32_t frame_have;
+	uint8_t frame[PEER_RSP_MAX + COMM_FRAME_OVERHEAD];
+
+	uint32_t plain_len;
+	uint8_t plain[PEER_PLAIN_LEN];
+
+	uint8_t sector_buf[PEER_SECTOR_SIZE];
+};
+
+POOL_DEFINE(ctx_pool, "peer_ctx", sizeof(struct peer_ctx), 1);
+
+static struct peer_ctx *peer;
+static struct peer_status peer_status;
+
+static uint32_t peer_now_ms(void)
+{
+	return to_ms_since_boot(get_absolute_time());
+}
+
+static err_t peer_tcp_connected(void *arg, struct tcp_pcb *tpcb, err_t err)
+{
+	struct peer_ctx *ctx = (struct peer_ctx *)arg;
+
+	ctx->connected = true;
+
+	return ERR_OK;
+}
+
+static err_t peer_tcp_recv(void *arg, struct tcp_pcb *tpcb, struct pbuf *p, err_t err)
+{
+	struct peer_ctx *ctx = (struct peer_ctx *)arg;
+
+	if (!p) {
+		DEBUG_printf("peer closed the connection\n");
+		ctx->closed = true;
+		return ERR_OK;
+	}
+
+	if (ctx->rx_pbuf) {
+		pbuf_cat(ctx->rx_pbuf, p);
+	} else {
+		ctx->rx_pbuf = p;
+	}
+
+	trace_event(TRACE_RECV, pbuf_clen(ctx->rx_pbuf), p->tot_len);
+
+	return ERR_OK;
+}
+
+static void peer_tcp_err(void *arg, err_t err)
+{
+	struct peer_ctx *ctx = (struct peer_ctx *)arg;
+
+	DEBUG_printf("peer tcp err %d\n", err);
+
+	// The pcb has already been freed
+	ctx->pcb = NULL;
+	ctx->closed = true;
+
+	if (ctx->rx_pbuf) {
+		pbuf_free(ctx->rx_pbuf);
+		ctx->rx_pbuf = NULL;
+	}
+}
+
+static void peer_disconnect(struct peer_ctx *ctx)
+{
+	if (ctx->pcb) {
+		tcp_arg(ctx->pcb, NULL);
+		tcp_recv(ctx->pcb, NULL);
+		tcp_err(ctx->pcb, NULL);
+
+		if (tcp_close(ctx->pcb) != ERR_OK) {
+			tcp_abort(ctx->pcb);
+		}
+		ctx->pcb = NULL;
+	}
+
+	if (ctx->rx_pbuf) {
+		pbuf_free(ctx->rx_pbuf);
+		ctx->rx_pbuf = NULL;
+	}
+}
+
+static void peer_fail(struct peer_ctx *ctx, enum peer_err err, bool retry)
+{
+	DEBUG_printf("peer fetch failed at step %d: %d\n", ctx->step, err);
+
+	peer_disconnect(ctx);
+	peer_status.err = err;
+
+	if (retry && (ctx->attempts < ctx->fetch.max_attempts)) {
+		ctx->step = STEP_WAIT;
+		ctx->wait_until_ms = peer_now_ms() + (ctx->attempts * PEER_RETRY_DELAY_MS);
+		return;
+	}
+
+	peer_status.state = PEER_STATE_FAILED;
+	ctx->step = STEP_END;
+}
+
+static void peer_connect(struct peer_ctx *ctx)
+{
+	ctx->attempts++;
+
+	ctx->connected = false;
+	ctx->closed = false;
+	ctx->secure = false;
+	ctx->tx_counter = 0;
+	ctx->rx_counter = 0;
+	ctx->frame_have = 0;
+	ctx->plain_len = 0;
+
+	// Everything gets checked again, but sectors which already made it
+	// won't be fetched again
+	ctx->manifest_n = 0;
+	peer_status.done = 0;
+
+	ctx->step = STEP_CONNECT;
+	ctx->last_progress_ms = peer_now_ms();
+
+	ctx->pcb = tcp_new_ip_type(IP_GET_TYPE(&ctx->fetch.addr));
+	if (!ctx->pcb) {
+		peer_fail(ctx, PEER_ERR_CONNECT, true);
+		return;
+	}
+
+	tcp_arg(ctx->pcb, ctx);
+	tcp_recv(ctx->pcb, peer_tcp_recv);
+	tcp_err(ctx->pcb, peer_tcp_err);
+
+	// Requests are sent as soon as they're ready
+	tcp_nagle_disable(ctx->pcb);
+
+	err_t err = tcp_connect(ctx->pcb, &ctx->fetch.addr, ctx->fetch.port, peer_tcp_connected);
+	if (err != ERR_OK) {
+		DEBUG_printf("peer connect failed %d\n", err);
+		peer_fail(ctx, PEER_ERR_CONNECT, true);
+	}
+}
+
+static void peer_frame_nonce(uint8_t nonce[AEAD_NONCE_LEN], uint32_t dir, uint64_t counter)
+{
+	memcpy(nonce, &dir, sizeof(dir));
+	memcpy(nonce + sizeof(dir), &counter, sizeof(counter));
+}
+
+// Send a request, in a sealed frame once the session is secure
+static int peer_send(struct peer_ctx *ctx, const uint32_t *words, uint32_t n_words)
+{
+	uint32_t len = n_words * sizeof(uint32_t);
+	uint8_t *buf = ctx->tx;
+
+	if (!ctx->pcb) {
+		return -1;
+	}
+
+	if (ctx->secure) {
+		uint8_t nonce[AEAD_NONCE_LEN];
+
+		peer_frame_nonce(nonce, COMM_DIR_TO_DEVICE, ctx->tx_counter++);
+
+		memcpy(buf, &len, sizeof(len));
+		memcpy(buf + sizeof(len), words, len);
+		aead_encrypt(ctx->session_key, nonce, buf, sizeof(len),
+			     buf + sizeof(len), len, buf + sizeof(len) + len);
+		len += COMM_FRAME_OVERHEAD;
+	} else {
+		memcpy(buf, words, len);
+	}
+
+	if (tcp_write(ctx->pcb, buf, len, TCP_WRITE_FLAG_COPY) != ERR_OK) {
+		return -1;
+	}
+
+	tcp_output(ctx->pcb);
+
+	return 0;
+}
+
+static void peer_request(struct peer_ctx *ctx, enum peer_step step, const uint32_t *words, uint32_t n_words)
+{
+	ctx->step = step;
+
+	if (peer_send(ctx, words, n_words)) {
+		peer_fail(ctx, PEER_ERR_CONNECT, true);
+	}
+}
+
+static uint32_t peer_rx_copy(struct peer_ctx *ctx, uint8_t *dst, uint32_t len)
+{
+	if (!ctx->rx_pbuf || !len) {
+		return 0;
+	}
+
+	if (len > ctx->rx_pbuf->tot_len) {
+		len = ctx->rx_pbuf->tot_len;
+	}
+
+	pbuf_copy_partial(ctx->rx_pbuf, dst, len, 0);
+	ctx->rx_pbuf = pbuf_free_header(ctx->rx_pbuf, len);
+	tcp_recved(ctx->pcb, len);
+
+	ctx->last_progress_ms = peer_now_ms();
+
+	return len;
+}
+
+// Move whatever has arrived into the plain buffer, opening frames once the
+// session is secure. Returns -1 if a frame is bad.
+static int peer_rx(struct peer_ctx *ctx)
+{
+	uint8_t nonce[AEAD_NONCE_LEN];
+	uint32_t len, want;
+
+	if (!ctx->secure) {
+		ctx->plain_len += peer_rx_copy(ctx, ctx->plain + ctx->plain_len,
+					       sizeof(ctx->plain) - ctx->plain_len);
+		return 0;
+	}
+
+	for ( ; ; ) {
+		len = 0;
+		want = sizeof(len);
+
+		if (ctx->frame_have >= sizeof(len)) {
+			memcpy(&len, ctx->frame, sizeof(len));
+			if ((len == 0) || (len > PEER_RSP_MAX)) {
+				DEBUG_printf("bad peer frame len %d\n", len);
+				return -1;
+			}
+			want = len + COMM_FRAME_OVERHEAD;
+		}
+
+		if (ctx->frame_have < want) {
+			uint32_t n = peer_rx_copy(ctx, ctx->frame + ctx->frame_have, want - ctx->frame_have);
+			if (!n) {
+				return 0;
+			}
+			ctx->frame_have += n;
+			continue;
+		}
+
+		if (len > sizeof(ctx->plain) - ctx->plain_len) {
+			// Wait until there's room for it
+			return 0;
+		}
+
+		peer_frame_nonce(nonce, COMM_DIR_TO_HOST, ctx->rx_counter);
+		if (!aead_decrypt(ctx->session_key, nonce, ctx->frame, sizeof(len),
+				  ctx->frame + sizeof(len), len, ctx->frame + sizeof(len) + len)) {
+			DEBUG_printf("peer frame failed authentication\n");
+			return -1;
+		}
+		ctx->rx_counter++;
+
+		memcpy(ctx->plain + ctx->plain_len, ctx->frame + sizeof(len), len);
+		ctx->plain_len += len;
+		ctx->frame_have = 0;
+	}
+}
+
+static uint32_t peer_read_len(struct peer_ctx *ctx, uint32_t idx)
+{
+	uint32_t addr = ctx->read_start + (idx * PEER_READ_LEN);
+
+	return ctx->read_end - addr < PEER_READ_LEN ? ctx->read_end - addr : PEER_READ_LEN;
+}
+
+// Length of the response at the front of the plain buffer, or 0 if not
+// enough of it has arrived to tell
+static uint32_t peer_rsp_len(struct peer_ctx *ctx)
+{
+	const uint32_t *words = (const uint32_t *)ctx->plain;
+	uint32_t n;
+
+	if (ctx->plain_len < sizeof(uint32_t)) {
+		return 0;
+	}
+
+	if (words[0] == COMM_RSP_ERR) {
+		return sizeof(uint32_t);
+	}
+
+	switch (ctx->step) {
+	case STEP_SYNC:
+		return sizeof(uint32_t);
+	case STEP_AUTH:
+		return sizeof(uint32_t) + sizeof(ctx->client_nonce);
+	case STEP_CATALOG:
+		// OKOK n_slots default_slot boot_slot [records]
+		if (ctx->plain_len < (1 + CATALOG_RESP_NARGS) * sizeof(uint32_t)) {
+			return 0;
+		}
+		n = words[1] < PEER_RSP_MAX ? words[1] : PEER_RSP_MAX;
+		return ((1 + CATALOG_RESP_NARGS) * sizeof(uint32_t)) + (n * sizeof(struct slot_record));
+	case STEP_MANIFEST:
+		// OKOK vtor size crc n [crcs]
+		if (ctx->plain_len < sizeof(uint32_t) + sizeof(struct manifest_header)) {
+			return 0;
+		}
+		n = ((const struct manifest_header *)&words[1])->n;
+		n = n < PEER_RSP_MAX ? n : PEER_RSP_MAX;
+		return sizeof(uint32_t) + sizeof(struct manifest_header) + (n * sizeof(uint32_t));
+	case STEP_READ:
+		return sizeof(uint32_t) + peer_read_len(ctx, ctx->reads_done);
+	default:
+		return 0;
+	}
+}
+
+static void peer_read_sector(struct peer_ctx *ctx, uint32_t start, uint32_t end)
+{
+	uint32_t words[PEER_TX_MAX_WORDS];
+	uint32_t addr, n = 0;
+
+	// Anything in the sector which isn't part of the image is left erased
+	memset(ctx->sector_buf, 0xff, sizeof(ctx->sector_buf));
+
+	ctx->read_start = start;
+	ctx->read_end = end;
+	ctx->reads_sent = 0;
+	ctx->reads_done = 0;
+
+	for (addr = start; addr < end; addr += PEER_READ_LEN) {
+		words[n++] = CMD_READ;
+		words[n++] = addr;
+		words[n++] = peer_read_len(ctx, ctx->reads_sent++);
+	}
+
+	peer_request(ctx, STEP_READ, words, n);
+}
+
+// Skip over sectors which already match the manifest, and start on the
+// next one which doesn't
+static void peer_next(struct peer_ctx *ctx)
+{
+	const struct peer_flash_ops *ops = ctx->ops;
+	uint32_t start, end;
+
+	while (ctx->sector < ctx->n_sectors) {
+		if (ctx->sector >= ctx->manifest_first + ctx->manifest_n) {
+			const uint32_t req[] = { CMD_MANIFEST, ctx->slot, ctx->sector, PEER_MANIFEST_MAX };
+			ctx->manifest_first = ctx->sector;
+			ctx->manifest_n = 0;
+			peer_request(ctx, STEP_MANIFEST, req, 4);
+			return;
+		}
+
+		peer_sector_range(ctx->vtor, ctx->size, ctx->sector, &start, &end);
+		if (ops->crc(ctx->priv, start, end - start) != ctx->manifest[ctx->sector - ctx->manifest_first]) {
+			peer_read_sector(ctx, start, end);
+			return;
+		}
+
+		peer_status.done += end - start;
+		ctx->sector++;
+	}
+
+	DEBUG_printf("peer fetch complete\n");
+	peer_disconnect(ctx);
+	ctx->step = STEP_FINISH;
+}
+
+static void peer_write(struct peer_ctx *ctx)
+{
+	const struct peer_flash_ops *ops = ctx->ops;
+	uint32_t len = ctx->read_end - ctx->read_start;
+
+	int res = ops->write_sector(ctx->priv, ctx->read_start & ~(PEER_SECTOR_SIZE - 1), ctx->sector_buf);
+	if (res > 0) {
+		return;
+	} else if (res < 0) {
+		peer_fail(ctx, PEER_ERR_LOCAL, false);
+		return;
+	}
+
+	if (ops->crc(ctx->priv, ctx->read_start, len) != ctx->manifest[ctx->sector - ctx->manifest_first]) {
+		DEBUG_printf("sector %d doesn't match after writing\n", ctx->sector);
+		peer_fail(ctx, PEER_ERR_LOCAL, false);
+		return;
+	}
+
+	peer_status.done += len;
+	peer_status.fetched += len;
+	ctx->sector++;
+
+	peer_next(ctx);
+}
+
+static void peer_finish(struct peer_ctx *ctx)
+{
+	int res = ctx->ops->finish(ctx->priv, ctx->vtor, ctx->size, ctx->build_id);
+	if (res > 0) {
+		return;
+	} else if (res < 0) {
+		peer_fail(ctx, PEER_ERR_LOCAL, false);
+		return;
+	}
+
+	peer_status.state = PEER_STATE_DONE;
+	peer_status.err = PEER_ERR_NONE;
+	ctx->step = STEP_END;
+}
+
+static void peer_handle_catalog(struct peer_ctx *ctx, const uint32_t *words, uint32_t len)
+{
+	const struct slot_record *rec = (const struct slot_record *)&words[1 + CATALOG_RESP_NARGS];
+	uint32_t i, n = words[1];
+
+	for (i = 0; i < n; i++) {
+		if (rec[i].valid && (ctx->fetch.any_build || (rec[i].crc == ctx->fetch.build_id))) {
+			break;
+		}
+	}
+
+	if (i == n) {
+		DEBUG_printf("peer doesn't have build %08x\n", ctx->fetch.build_id);
+		peer_fail(ctx, PEER_ERR_NO_IMAGE, true);
+		return;
+	}
+
+	ctx->slot = i;
+	ctx->vtor = rec[i].vtor;
+	ctx->size = rec[i].size;
+	ctx->build_id = rec[i].crc;
+	ctx->n_sectors = peer_n_sectors(ctx->vtor, ctx->size);
+	ctx->sector = 0;
+	peer_status.total = ctx->size;
+
+	int res = ctx->ops->begin(ctx->priv, ctx->vtor, ctx->size, ctx->build_id);
+	if (res < 0) {
+		peer_fail(ctx, PEER_ERR_LOCAL, false);
+		return;
+	} else if (res > 0) {
+		DEBUG_printf("already have build %08x\n", ctx->build_id);
+		peer_status.done = ctx->size;
+		peer_disconnect(ctx);
+		ctx->step = STEP_FINISH;
+		return;
+	}
+
+	peer_next(ctx);
+}
+
+static void peer_handle_manifest(struct peer_ctx *ctx, const uint32_t *words, uint32_t len)
+{
+	const struct manifest_header *mh = (const struct manifest_header *)&words[1];
+	uint32_t left = ctx->n_sectors - ctx->manifest_first;
+	uint32_t n = mh->n;
+
+	// The image mustn't have changed under us
+	if ((mh->vtor != ctx->vtor) || (mh->size != ctx->size) || (mh->crc != ctx->build_id)) {
+		peer_fail(ctx, PEER_ERR_NO_IMAGE, true);
+		return;
+	}
+
+	if ((n == 0) || (n > PEER_MANIFEST_MAX) || (n > left)) {
+		peer_fail(ctx, PEER_ERR_PROTOCOL, true);
+		return;
+	}
+
+	memcpy(ctx->manifest, mh + 1, n * sizeof(uint32_t));
+	ctx->manifest_n = n;
+
+	peer_next(ctx);
+}
+
+static void peer_handle(struct peer_ctx *ctx, uint32_t len)
+{
+	static const uint32_t catalog_req = CMD_CATALOG;
+	const uint32_t *words = (const uint32_t *)ctx->plain;
+	uint32_t offs;
+
+	if (words[0] == COMM_RSP_ERR) {
+		// e.g. the source is busy with another peer, and this one is
+		// in standby
+		peer_fail(ctx, PEER_ERR_PROTOCOL, true);
+		return;
+	}
+
+	if (words[0] != (ctx->step == STEP_SYNC ? RSP_SYNC : COMM_RSP_OK)) {
+		peer_fail(ctx, PEER_ERR_PROTOCOL, true);
+		return;
+	}
+
+	switch (ctx->step) {
+	case STEP_SYNC:
+		if (ctx->fetch.psk) {
+			uint32_t req[5] = { COMM_AUTH_OPCODE };
+			uint64_t rand = get_rand_64();
+			memcpy(&ctx->client_nonce[0], &rand, sizeof(rand));
+			rand = get_rand_64();
+			memcpy(&ctx->client_nonce[8], &rand, sizeof(rand));
+			memcpy(&req[1], ctx->client_nonce, sizeof(ctx->client_nonce));
+			peer_request(ctx, STEP_AUTH, req, 5);
+		} else {
+			peer_request(ctx, STEP_CATALOG, &catalog_req, 1);
+		}
+		break;
+	case STEP_AUTH:
+		// Same derivation as the device side, see COMM_AUTH_OPCODE
+		aead_hchacha20(ctx->session_key, ctx->fetch.psk, ctx->client_nonce);
+		aead_hchacha20(ctx->session_key, ctx->session_key, ctx->plain + sizeof(uint32_t));
+		ctx->secure = true;
+		peer_request(ctx, STEP_CATALOG, &catalog_req, 1);
+		break;
+	case STEP_CATALOG:
+		peer_handle_catalog(ctx, words, len);
+		break;
+	case STEP_MANIFEST:
+		peer_handle_manifest(ctx, words, len);
+		break;
+	case STEP_READ:
+		offs = (ctx->read_start & (PEER_SECTOR_SIZE - 1)) + (ctx->reads_done * PEER_READ_LEN);
+		memcpy(ctx->sector_buf + offs, ctx->plain + sizeof(uint32_t), len - sizeof(uint32_t));
+		ctx->reads_done++;
+		if (ctx->reads_done == ctx->reads_sent) {
+			ctx->step = STEP_WRITE;
+			peer_write(ctx);
+		}
+		break;
+	default:
+		break;
+	}
+}
+
+static bool peer_waiting_for_source(struct peer_ctx *ctx)
+{
+	return (ctx->step >= STEP_CONNECT) && (ctx->step <= STEP_READ);
+}
+
+static bool peer_step(struct peer_ctx *ctx)
+{
+	bool busy = false;
+	uint32_t len;
+
+	switch (ctx->step) {
+	case STEP_WAIT:
+		if ((int32_t)(peer_now_ms() - ctx->wait_until_ms) < 0) {
+			return false;
+		}
+		peer_connect(ctx);
+		return true;
+	case STEP_WRITE:
+		peer_write(ctx);
+		return true;
+	case STEP_FINISH:
+		peer_finish(ctx);
+		return true;
+	default:
+		break;
+	}
+
+	if ((ctx->step == STEP_CONNECT) && ctx->connected) {
+		const uint32_t req = CMD_SYNC;
+		ctx->last_progress_ms = peer_now_ms();
+		peer_request(ctx, STEP_SYNC, &req, 1);
+		busy = true;
+	}
+
+	while (peer_waiting_for_source(ctx) && (ctx->step != STEP_CONNECT)) {
+		if (peer_rx(ctx)) {
+			peer_fail(ctx, PEER_ERR_PROTOCOL, true);
+			return true;
+		}
+
+		len = peer_rsp_len(ctx);
+		if (len > sizeof(ctx->plain)) {
+			peer_fail(ctx, PEER_ERR_PROTOCOL, true);
+			return true;
+		} else if (!len || (len > ctx->plain_len)) {
+			break;
+		}
+
+		peer_handle(ctx, len);
+
+		ctx->plain_len -= len;
+		memmove(ctx->plain, ctx->plain + len, ctx->plain_len);
+		busy = true;
+	}
+
+	if (!peer_waiting_for_source(ctx)) {
+		return busy;
+	}
+
+	if (ctx->closed) {
+		peer_fail(ctx, PEER_ERR_CONNECT, true);
+		busy = true;
+	} else if (peer_now_ms() - ctx->last_progress_ms > (PICOWOTA_PROGRESS_TIMEOUT_S * 1000)) {
+		peer_fail(ctx, PEER_ERR_TIMEOUT, true);
+		busy = true;
+	}
+
+	return busy;
+}
+
+bool peer_poll(void)
+{
+	struct peer_ctx *ctx = peer;
+	bool busy;
+
+	if (!ctx) {
+		return false;
+	}
+
+	cyw43_arch_lwip_begin();
+
+	busy = peer_step(ctx);
+
+	if (ctx->step == STEP_END) {
+		peer_disconnect(ctx);
+		pool_free(&ctx_pool, ctx);
+		peer = NULL;
+	}
+
+	cyw43_arch_lwip_end();
+
+	return busy;
+}
+
+int peer_fetch_start(const struct peer_fetch *fetch, const struct peer_flash_ops *ops, void *priv)
+{
+	if (peer) {
+		return -1;
+	}
+
+	struct peer_ctx *ctx = pool_alloc(&ctx_pool);
+	if (!ctx) {
+		return -1;
+	}
+
+	memset(ctx, 0, sizeof(*ctx));
+	ctx->fetch = *fetch;
+	if (!ctx->fetch.max_attempts) {
+		ctx->fetch.max_attempts = PEER_MAX_ATTEMPTS;
+	}
+	ctx->ops = ops;
+	ctx->priv = priv;
+
+	// Connects on the next peer_poll()
+	ctx->step = STEP_WAIT;
+	ctx->wait_until_ms = peer_now_ms();
+
+	peer_status = (struct peer_status){
+		.state = PEER_STATE_RUNNING,
+	};
+
+	peer = ctx;
+
+	return 0;
+}
+
+void peer_cancel(void)
+{
+	struct peer_ctx *ctx = peer;
+
+	if (!ctx) {
+		return;
+	}
+
+	DEBUG_printf("peer fetch cancelled at step %d\n", ctx->step);
+
+	cyw43_arch_lwip_begin();
+	peer_disconnect(ctx);
+	pool_free(&ctx_pool, ctx);
+	peer = NULL;
+	cyw43_arch_lwip_end();
+
+	peer_status.state = PEER_STATE_FAILED;
+	peer_status.err = PEER_ERR_TIMEOUT;
+}
+
+bool peer_busy(void)
+{
+	return peer != NULL;
+}
+
+void peer_get_status(struct peer_status *status)
+{
+	*status = peer_status;
+}
@@ -0,0 +1,121 @@
+/**
+ * Copyright (c) 2022 Brian Starkey <stark3y@gmail.com>
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+#ifndef __PEER_H__
+#define __PEER_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "lwip/ip_addr.h"
+
+/*
+ * Fetches an image from another picowota device (the source), over the same
+ * TCP protocol the host uses: SYNC, AUTH (with a PSK), CATL to find the slot
+ * with the right build ID, then MANI for the CRC of each sector of the image,
+ * and READ for the sectors which don't already match. So a fetch which is
+ * retried, or an image which only changed a bit, only moves the difference.
+ *
+ * Only one fetch runs at a time, from peer_poll() in the main loop.
+ */
+
+// Image sectors are counted from the flash sector which holds vtor, and
+// each one only covers the bytes of the image which are in it
+#define PEER_SECTOR_SIZE 4096
+
+// Most sector CRCs in one MANI response
+#define PEER_MANIFEST_MAX 256
+
+static inline uint32_t peer_n_sectors(uint32_t vtor, uint32_t size)
+{
+	uint32_t base = vtor & ~(PEER_SECTOR_SIZE - 1);
+
+	return (vtor + size - base + PEER_SECTOR_SIZE - 1) / PEER_SECTOR_SIZE;
+}
+
+static inline void peer_sector_range(uint32_t vtor, uint32_t size, uint32_t idx,
+				     uint32_t *start, uint32_t *end)
+{
+	uint32_t sector = (vtor & ~(PEER_SECTOR_SIZE - 1)) + (idx * PEER_SECTOR_SIZE);
+
+	*start = sector < vtor ? vtor : sector;
+	*end = sector + PEER_SECTOR_SIZE > vtor + size ? vtor + size : sector + PEER_SECTOR_SIZE;
+}
+
+// Provided by the caller, to put the image in flash. The functions which can
+// return 1 get called again later.
+struct peer_flash_ops {
+	// Check the image can go here. 0 if it can, 1 if it's already here
+	// (nothing is fetched, but finish still gets called), -1 if not.
+	int (*begin)(void *priv, uint32_t vtor, uint32_t size, uint32_t crc);
+	// CRC32 of len bytes at addr (both 4-byte aligned)
+	uint32_t (*crc)(void *priv, uint32_t addr, uint32_t len);
+	// Erase the flash sector at addr, and program it with data (a whole
+	// sector). 0 on success, 1 if not yet, -1 on error.
+	int (*write_sector)(void *priv, uint32_t addr, const uint8_t *data);
+	// Everything has been fetched and checked, seal it. 0 on success, 1 if
+	// not yet, -1 on error.
+	int (*finish)(void *priv, uint32_t vtor, uint32_t size, uint32_t crc);
+};
+
+enum peer_state {
+	PEER_STATE_IDLE = 0,
+	PEER_STATE_RUNNING,
+	PEER_STATE_DONE,
+	PEER_STATE_FAILED,
+};
+
+enum peer_err {
+	PEER_ERR_NONE = 0,
+	// Couldn't connect, or the connection dropped
+	PEER_ERR_CONNECT,
+	// The source said ERR!, or sent something which didn't make sense
+	PEER_ERR_PROTOCOL,
+	// The source doesn't have a valid image with that build ID
+	PEER_ERR_NO_IMAGE,
+	// The source stopped responding
+	PEER_ERR_TIMEOUT,
+	// The image couldn't be stored here (begin/write/finish failed, or
+	// a sector didn't match after writing it). Not retried.
+	PEER_ERR_LOCAL,
+};
+
+struct peer_status {
+	uint32_t state;
+	// Bytes of the image which have been checked or fetched so far
+	uint32_t done;
+	uint32_t total;
+	// Bytes which actually had to be fetched
+	uint32_t fetched;
+	// Why the last attempt failed
+	uint32_t err;
+};
+
+struct peer_fetch {
+	ip_addr_t addr;
+	uint16_t port;
+	// The image with this build ID (CRC), or with any_build, whatever is
+	// in the first valid slot on the source
+	uint32_t build_id;
+	bool any_build;
+	// Can be NULL
+	const uint8_t *psk;
+	// Connection and protocol failures are retried, picking up where they
+	// left off. 0 for the default.
+	unsigned int max_attempts;
+};
+
+// Start a fetch. Returns 0 if it started.
+int peer_fetch_start(const struct peer_fetch *fetch, const struct peer_flash_ops *ops, void *priv);
+
+// Returns true if there was anything to do
+bool peer_poll(void);
+// Stop a running fetch, as a PEER_ERR_TIMEOUT failure. Sectors which have
+// already been written stay written, but the image isn't sealed.
+void peer_cancel(void);
+bool peer_busy(void);
+void peer_get_status(struct peer_status *status);
+
+#endif /* __PEER_H__ */
@@ -0,0 +1,797 @@
+# Copyright (c) 2022 Brian Starkey <stark3y@gmail.com>
+#
+# SPDX-License-Identifier: BSD-3-Clause
+#
+# asyncio client for the picowota protocol (see comm.h and the command
+# descriptors in main.c). Used by picowota_fleet.py, but usable on its own:
+#
+#   image = load_image("app.elf")
+#   async with await Client.connect("192.168.1.123") as dev:
+#       await dev.upload(image)
+#
+# Serial ports (USB or UART builds) work too, given as a device path like
+# "/dev/ttyACM0" or "COM3". They need the pyserial-asyncio package.
+
+import asyncio
+import collections
+import hmac
+import os
+import socket
+import struct
+import time
+import zlib
+
+try:
+    from cryptography.hazmat.primitives.ciphers.aead import ChaCha20Poly1305
+except ImportError:
+    ChaCha20Poly1305 = None
+
+DEFAULT_PORT = 4242
+DEFAULT_BAUDRATE = 921600
+XIP_BASE = 0x10000000
+XIP_END = 0x11000000
+SRAM_BASE = 0x20000000
+SRAM_END = 0x20042000
+DISCOVERY_PORT = 4242
+
+def opcode(s):
+    return struct.unpack("<I", s.encode())[0]
+
+CMD_SYNC = opcode("SYNC")
+RSP_SYNC = opcode("WOTA")
+CMD_INFO = opcode("INFO")
+CMD_READ = opcode("READ")
+CMD_CSUM = opcode("CSUM")
+CMD_CRC = opcode("CRCC")
+CMD_ERASE = opcode("ERAS")
+CMD_WRITE = opcode("WRIT")
+CMD_SEAL = opcode("SEAL")
+CMD_GO = opcode("GOGO")
+CMD_REBOOT = opcode("BOOT")
+CMD_STATUS = opcode("STAT")
+CMD_BATCH = opcode("BTCH")
+CMD_AUTH = opcode("AUTH")
+CMD_RAMINFO = opcode("RAMI")
+CMD_UPDATE = opcode("UPDT")
+CMD_FLUSH = opcode("FLSH")
+CMD_POOL = opcode("POOL")
+CMD_TAKEOVER = opcode("TAKE")
+CMD_CATALOG = opcode("CATL")
+CMD_SELECT = opcode("SLCT")
+CMD_GO_SLOT = opcode("GOSL")
+CMD_MANIFEST = opcode("MANI")
+CMD_SEED = opcode("SEED")
+CMD_FETCH = opcode("FTCH")
+CMD_FETCH_STATUS = opcode("FSTA")
+CMD_FILL = opcode("FILL")
+CMD_PARTITIONS = opcode("PART")
+CMD_PARTITION_SEAL = opcode("PSEA")
+
+RSP_OK = opcode("OKOK")
+RSP_ERR = opcode("ERR!")
+
+DISCOVERY_QUERY = b"WHO?"
+DISCOVERY_RESPONSE = opcode("WOTA")
+
+class ProtocolError(Exception):
+    pass
+
+Info = collections.namedtuple("Info", "flash_start flash_size erase_size write_size max_data_len")
+Image = collections.namedtuple("Image", "addr data")
+Pool = collections.namedtuple("Pool", "name block_size n_blocks used max_used err")
+Slot = collections.namedtuple("Slot", "app_addr app_size vtor size crc valid")
+Catalog = collections.namedtuple("Catalog", "slots default_slot boot_slot")
+Partition = collections.namedtuple("Partition", "name addr capacity size crc valid")
+POOL_RECORD = struct.Struct("<16s4HI")
+SLOT_RECORD = struct.Struct("<6I")
+PARTITION_RECORD = struct.Struct("<16s5I")
+# From picowota/partition.h
+PARTITION_HEADER_SIZE = 4096
+SLOT_NONE = 0xffffffff
+
+# From comm.h
+BATCH_MAX_LEN = 4 * (1024 + 64)
+BATCH_MAX_ITEMS = 32
+# From main.c
+FILL_MAX_LEN = 64 * 1024
+# data is the bytes, or the 32-bit pattern for a run which can be FILLed
+Extent = collections.namedtuple("Extent", "addr size data")
+Manifest = collections.namedtuple("Manifest", "vtor size crc sector_crcs")
+FetchStatus = collections.namedtuple("FetchStatus", "state done total fetched err")
+# enum peer_state and enum peer_err in peer.h
+FETCH_IDLE, FETCH_RUNNING, FETCH_DONE, FETCH_FAILED = range(4)
+FETCH_ERRORS = ["none", "connect", "protocol", "no image", "timeout", "local"]
+FETCH_FLAG_SELECT = 1 << 0
+Device = collections.namedtuple("Device", "host port board_id flash_size build_id session_active image_valid")
+
+PSK_LEN = 32
+TAG_LEN = 16
+DIR_TO_DEVICE = 0
+DIR_TO_HOST = 1
+
+def parse_psk(text):
+    psk = bytes.fromhex(text)
+    if len(psk) != PSK_LEN:
+        raise ValueError("PSK must be {} bytes ({} hex digits)".format(PSK_LEN, PSK_LEN * 2))
+    return psk
+
+# ChaCha20-Poly1305 (RFC 8439), matching aead.c. The 'cryptography' package
+# is used for the bulk of the work if it's installed, the pure Python version
+# is much slower, but fast enough for a handful of devices.
+
+def _rotl32(v, n):
+    return ((v << n) & 0xffffffff) | (v >> (32 - n))
+
+def _chacha20_rounds(x):
+    def qr(a, b, c, d):
+        x[a] = (x[a] + x[b]) & 0xffffffff; x[d] = _rotl32(x[d] ^ x[a], 16)
+        x[c] = (x[c] + x[d]) & 0xffffffff; x[b] = _rotl32(x[b] ^ x[c], 12)
+        x[a] = (x[a] + x[b]) & 0xffffffff; x[d] = _rotl32(x[d] ^ x[a], 8)
+        x[c] = (x[c] + x[d]) & 0xffffffff; x[b] = _rotl32(x[b] ^ x[c], 7)
+
+    for i in range(10):
+        qr(0, 4, 8, 12); qr(1, 5, 9, 13); qr(2, 6, 10, 14); qr(3, 7, 11, 15)
+        qr(0, 5, 10, 15); qr(1, 6, 11, 12); qr(2, 7, 8, 13); qr(3, 4, 9, 14)
+
+def _chacha20_state(key, block16):
+    return [0x61707865, 0x3320646e, 0x79622d32, 0x6b206574] + \
+           list(struct.unpack("<8I", key)) + list(struct.unpack("<4I", block16))
+
+def hchacha20(key, data):
+    x = _chacha20_state(key, data)
+    _chacha20_rounds(x)
+    return struct.pack("<8I", *(x[0:4] + x[12:16]))
+
+def _chacha20_xor(key, nonce, counter, data):
+    out = bytearray()
+    for offs in range(0, len(data), 64):
+        state = _chacha20_state(key, struct.pack("<I", counter) + nonce)
+        x = list(state)
+        _chacha20_rounds(x)
+        stream = struct.pack("<16I", *((a + b) & 0xffffffff for a, b in zip(x, state)))
+        block = data[offs:offs + 64]
+        out += (int.from_bytes(block, "little") ^
+                int.from_bytes(stream[:len(block)], "little")).to_bytes(len(block), "little")
+        counter += 1
+    return bytes(out)
+
+def _poly1305(key, msg):
+    r = int.from_bytes(key[:16], "little") & 0x0ffffffc0ffffffc0ffffffc0fffffff
+    s = int.from_bytes(key[16:], "little")
+    p = (1 << 130) - 5
+    acc = 0
+    for offs in range(0, len(msg), 16):
+        block = msg[offs:offs + 16] + b"\x01"
+        acc = ((acc + int.from_bytes(block, "little")) * r) % p
+    return ((acc + s) & ((1 << 128) - 1)).to_bytes(16, "little")
+
+def _pad16(data):
+    return data + b"\x00" * (-len(data) % 16)
+
+def _aead_tag(key, nonce, aad, ct):
+    otk = _chacha20_xor(key, nonce, 0, b"\x00" * 32)
+    return _poly1305(otk, _pad16(aad) + _pad16(ct) + struct.pack("<QQ", len(aad), len(ct)))
+
+def aead_encrypt(key, nonce, aad, data):
+    """Returns ciphertext + tag"""
+    if ChaCha20Poly1305:
+        return ChaCha20Poly1305(key).encrypt(nonce, data, aad)
+    ct = _chacha20_xor(key, nonce, 1, data)
+    return ct + _aead_tag(key, nonce, aad, ct)
+
+def aead_decrypt(key, nonce, aad, data):
+    """data is ciphertext + tag. Raises ProtocolError if it's been tampered with."""
+    if ChaCha20Poly1305:
+        try:
+            return ChaCha20Poly1305(key).decrypt(nonce, data, aad)
+        except Exception:
+            raise ProtocolError("frame failed authentication")
+    ct, tag = data[:-TAG_LEN], data[-TAG_LEN:]
+    if not hmac.compare_digest(_aead_tag(key, nonce, aad, ct), tag):
+        raise ProtocolError("frame failed authentication")
+    return _chacha20_xor(key, nonce, 1, ct)
+
+def frame_nonce(direction, counter):
+    return struct.pack("<IQ", direction, counter)
+
+def crc32(data):
+    # Same as the device's DMA sniffer CRC (IEEE 802.3)
+    return zlib.crc32(data) & 0xffffffff
+
+def align_up(x, align):
+    return (x + align - 1) & ~(align - 1)
+
+def sparse_extents(addr, data, granule=256):
+    """
+    Describe an image as Extents: runs of data, and runs where every 32-bit
+    word is the same (padding, erased gaps, zeroed tables), which FILL can
+    write without sending. Runs are made of whole granules, apart from the
+    end of the image. len(data) must be a multiple of 4.
+    """
+    extents = []
+    for offs in range(0, len(data), granule):
+        g = data[offs:offs + granule]
+        kind = struct.unpack_from("<I", g)[0] if g == g[:4] * (len(g) // 4) else None
+
+        last = extents[-1] if extents else None
+        if last and (isinstance(last.data, int) == (kind is not None)) and \
+           (kind is None or last.data == kind):
+            extents[-1] = last._replace(size=last.size + len(g))
+        else:
+            extents.append(Extent(addr + offs, len(g), kind))
+
+    return [e if isinstance(e.data, int) else e._replace(data=data[e.addr - addr:e.addr - addr + e.size])
+            for e in extents]
+
+def load_image(path, addr=None):
+    """
+    Load an app image from an ELF (using its loadable segments) or a raw
+    binary (which needs addr, or defaults to the device's flash_start when
+    uploading). ELFs can be normal (flash) apps, or no_flash apps for the
+    RAM load region.
+    """
+    with open(path, "rb") as f:
+        data = f.read()
+
+    if data[:4] != b"\x7fELF":
+        return Image(addr, data)
+
+    if data[4] != 1 or data[5] != 1:
+        raise ValueError("{}: only 32-bit little-endian ELFs are supported".format(path))
+
+    e_phoff, = struct.unpack_from("<I", data, 0x1c)
+    e_phentsize, e_phnum = struct.unpack_from("<HH", data, 0x2a)
+
+    segments = []
+    for i in range(e_phnum):
+        p_type, p_offset, p_vaddr, p_paddr, p_filesz = struct.unpack_from("<5I", data, e_phoff + i * e_phentsize)
+        # PT_LOAD, with something in the file. Use the physical (load)
+        # address, so that .data is placed in flash
+        if p_type == 1 and p_filesz > 0:
+            segments.append((p_paddr, data[p_offset:p_offset + p_filesz]))
+
+    # If there's anything for flash, it's a flash app (which may also have
+    # RAM segments, but those are copied from flash at runtime)
+    in_flash = [s for s in segments if XIP_BASE <= s[0] < XIP_END]
+    segments = in_flash if in_flash else [s for s in segments if SRAM_BASE <= s[0] < SRAM_END]
+
+    if not segments:
+        raise ValueError("{}: no loadable segments".format(path))
+
+    start = min(s[0] for s in segments)
+    end = max(s[0] + len(s[1]) for s in segments)
+    image = bytearray(b"\xff" * (end - start))
+    for paddr, seg in segments:
+        image[paddr - start:paddr - start + len(seg)] = seg
+
+    return Image(start, bytes(image))
+
+class RateLimiter:
+    """Token bucket, shared between clients to cap total bandwidth."""
+
+    def __init__(self, rate, burst=None):
+        self.rate = rate
+        self.burst = burst if burst else max(rate // 4, 64 * 1024)
+        self.tokens = self.burst
+        self.last = time.monotonic()
+        self.lock = asyncio.Lock()
+
+    async def consume(self, n):
+        if not self.rate:
+            return
+
+        async with self.lock:
+            while True:
+                now = time.monotonic()
+                self.tokens = min(self.burst, self.tokens + (now - self.last) * self.rate)
+                self.last = now
+                if self.tokens >= n:
+                    self.tokens -= n
+                    return
+                await asyncio.sleep((n - self.tokens) / self.rate)
+
+def is_serial_port(host):
+    return host.startswith("/dev/") or host.upper().startswith("COM")
+
+class Client:
+    def __init__(self, reader, writer, timeout):
+        self.reader = reader
+        self.writer = writer
+        self.timeout = timeout
+        self.info = None
+        # Session key, once authenticated (see AUTH in comm.h)
+        self.key = None
+        self.tx_counter = 0
+        self.rx_counter = 0
+        self.rx_plain = bytearray()
+        # How connect() made this, for reconnect()
+        self.connect_args = None
+        # Whether the device has FILL, once has_fill() has asked
+        self.fill = None
+
+    @classmethod
+    async def connect(cls, host, port=DEFAULT_PORT, timeout=10.0, psk=None, baudrate=DEFAULT_BAUDRATE,
+                      takeover=False):
+        if is_serial_port(host):
+            try:
+                import serial_asyncio
+            except ImportError:
+                raise ProtocolError("serial ports need the pyserial-asyncio package")
+            # Opening the port asserts DTR, which starts a USB session
+            reader, writer = await asyncio.wait_for(
+                serial_asyncio.open_serial_connection(url=host, baudrate=baudrate), timeout)
+        else:
+            reader, writer = await asyncio.wait_for(asyncio.open_connection(host, port), timeout)
+            sock = writer.get_extra_info("socket")
+            if sock is not None:
+                sock.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+
+        client = cls(reader, writer, timeout)
+        client.connect_args = dict(host=host, port=port, timeout=timeout, psk=psk, baudrate=baudrate,
+                                   takeover=takeover)
+        await client.command(CMD_SYNC, expect=RSP_SYNC)
+        if psk:
+            await client.authenticate(psk)
+        if takeover:
+            # Drop whoever else is connected, if anyone. Without this, a
+            # device which already has a client refuses everything else.
+            await client.command(CMD_TAKEOVER)
+        client.info = Info(*await client.command(CMD_INFO, resp_nargs=5))
+
+        return client
+
+    async def authenticate(self, psk):
+        client_nonce = os.urandom(16)
+        device_nonce = struct.pack("<4I", *await self.command(CMD_AUTH, struct.unpack("<4I", client_nonce),
+                                                              resp_nargs=4))
+        self.key = hchacha20(hchacha20(psk, client_nonce), device_nonce)
+
+    async def reconnect(self):
+        """Drop the connection, and start again with a new one, made the same way"""
+        if self.connect_args is None:
+            raise ProtocolError("can't reconnect, this client wasn't made by connect()")
+        await self.close()
+        fill = self.fill
+        self.__dict__.update((await type(self).connect(**self.connect_args)).__dict__)
+        self.fill = fill
+
+    async def close(self):
+        self.writer.close()
+        try:
+            await self.writer.wait_closed()
+        except (ConnectionError, OSError):
+            pass
+
+    async def __aenter__(self):
+        return self
+
+    async def __aexit__(self, *exc):
+        await self.close()
+
+    def send(self, op, args=(), data=b""):
+        msg = struct.pack("<{}I".format(1 + len(args)), op, *args) + data
+        if self.key:
+            # One sealed frame per command
+            header = struct.pack("<I", len(msg))
+            msg = header + aead_encrypt(self.key, frame_nonce(DIR_TO_DEVICE, self.tx_counter), header, msg)
+            self.tx_counter += 1
+        self.writer.write(msg)
+
+    async def read_exact(self, n):
+        if not self.key:
+            return await self.reader.readexactly(n)
+
+        while len(self.rx_plain) < n:
+            header = await self.reader.readexactly(4)
+            length, = struct.unpack("<I", header)
+            sealed = await self.reader.readexactly(length + TAG_LEN)
+            self.rx_plain += aead_decrypt(self.key, frame_nonce(DIR_TO_HOST, self.rx_counter), header, sealed)
+            self.rx_counter += 1
+
+        data = bytes(self.rx_plain[:n])
+        del self.rx_plain[:n]
+        return data
+
+    async def recv(self, resp_nargs=0, resp_data_len=0, expect=RSP_OK):
+        async def read():
+            status, = struct.unpack("<I", await self.read_exact(4))
+            if status == RSP_ERR:
+                raise ProtocolError("device returned an error")
+            elif status != expect:
+                raise ProtocolError("unexpected response {:08x}".format(status))
+
+            args = struct.unpack("<{}I".format(resp_nargs), await self.read_exact(4 * resp_nargs))
+            if resp_data_len:
+                return args, await self.read_exact(resp_data_len)
+            return args
+
+        try:
+            return await asyncio.wait_for(read(), self.timeout)
+        except asyncio.IncompleteReadError:
+            raise ProtocolError("connection closed")
+
+    async def command(self, op, args=(), data=b"", resp_nargs=0, resp_data_len=0, expect=RSP_OK):
+        self.send(op, args, data)
+        await self.writer.drain()
+        return await self.recv(resp_nargs, resp_data_len, expect)
+
+    def send_batch(self, cmds):
+        """Send a BTCH of (op, args, data) commands, see recv_batch()."""
+        body = b"".join(struct.pack("<{}I".format(1 + len(args)), op, *args) + data for op, args, data in cmds)
+        self.send(CMD_BATCH, (len(body),), body)
+
+    async def recv_batch(self, n_cmds, resp_nargs=0):
+        """The response args of each command in a batch. Raises if one failed."""
+        n_run, = await self.recv(resp_nargs=1)
+
+        async def read():
+            results = []
+            for i in range(n_run):
+                status, = struct.unpack("<I", await self.read_exact(4))
+                if status != RSP_OK:
+                    raise ProtocolError("command {} in the batch failed".format(i))
+                results.append(struct.unpack("<{}I".format(resp_nargs), await self.read_exact(4 * resp_nargs)))
+            return results
+
+        try:
+            results = await asyncio.wait_for(read(), self.timeout)
+        except asyncio.IncompleteReadError:
+            raise ProtocolError("connection closed")
+
+        if n_run != n_cmds:
+            raise ProtocolError("batch stopped after {} of {} commands".format(n_run, n_cmds))
+        return results
+
+    async def read(self, addr, size):
+        _, data = await self.command(CMD_READ, (addr, size), resp_data_len=size)
+        return data
+
+    async def crc(self, addr, size):
+        return (await self.command(CMD_CRC, (addr, size), resp_nargs=1))[0]
+
+    async def erase(self, addr, size):
+        await self.command(CMD_ERASE, (addr, size))
+
+    async def write(self, addr, data):
+        return (await self.command(CMD_WRITE, (addr, len(data)), data, resp_nargs=1))[0]
+
+    async def fill(self, addr, size, pattern):
+        """Write size bytes of a repeated 32-bit pattern, returns the CRC"""
+        return (await self.command(CMD_FILL, (addr, size, pattern), resp_nargs=1))[0]
+
+    async def has_fill(self, addr):
+        """
+        Whether the device supports FILL. Older ones turn the probe's batch
+        down with an ERR!, and then close the connection, so this makes a
+        new one for whatever comes next. Ask before starting anything which
+        that would interrupt, like an erase.
+        """
+        if self.fill is not None:
+            return self.fill
+
+        self.send_batch([(CMD_FILL, (addr, 0, 0xffffffff), b"")])
+        await self.writer.drain()
+        try:
+            await self.recv_batch(1, resp_nargs=1)
+        except ProtocolError:
+            if not is_serial_port(self.connect_args["host"] if self.connect_args else ""):
+                # Let the device finish with the old connection first
+                try:
+                    await asyncio.wait_for(self.reader.read(), self.timeout)
+                except (asyncio.TimeoutError, ConnectionError, OSError):
+                    pass
+            await self.reconnect()
+            self.fill = False
+            return False
+
+        self.fill = True
+        return True
+
+    async def update(self, addr, data):
+        """
+        Write any amount of data, at any address, without erasing first. The
+        device merges it with what's already in flash, and writes it back
+        on flush() (or seal(), go() or reboot()).
+        """
+        max_len = self.info.max_data_len
+        for offs in range(0, len(data), max_len):
+            await self.command(CMD_UPDATE, (addr + offs, len(data[offs:offs + max_len])),
+                               data[offs:offs + max_len])
+
+    async def flush(self):
+        await self.command(CMD_FLUSH)
+
+    async def seal(self, vtor, size, crc):
+        await self.command(CMD_SEAL, (vtor, size, crc))
+
+    async def ram_info(self):
+        """(start, size) of the RAM load region, size is 0 if there isn't one"""
+        return await self.command(CMD_RAMINFO, resp_nargs=2)
+
+    async def pools(self):
+        """
+        Usage of the device's fixed-size memory pools (its own, and lwIP's),
+        as a list of Pool.
+        """
+        self.send(CMD_POOL)
+        await self.writer.drain()
+        n, = await self.recv(resp_nargs=1)
+        data = await self.read_exact(n * POOL_RECORD.size)
+
+        pools = []
+        for i in range(n):
+            name, *rest = POOL_RECORD.unpack_from(data, i * POOL_RECORD.size)
+            pools.append(Pool(name.split(b"\0")[0].decode("ascii", "replace"), *rest))
+        return pools
+
+    async def catalog(self):
+        """The device's image slots, as a Catalog (boot_slot is None if nothing would boot)"""
+        self.send(CMD_CATALOG)
+        await self.writer.drain()
+        n, default_slot, boot_slot = await self.recv(resp_nargs=3)
+        data = await self.read_exact(n * SLOT_RECORD.size)
+
+        slots = []
+        for i in range(n):
+            app_addr, app_size, vtor, size, crc, valid = SLOT_RECORD.unpack_from(data, i * SLOT_RECORD.size)
+            slots.append(Slot(app_addr, app_size, vtor, size, crc, bool(valid)))
+        return Catalog(slots, default_slot, None if boot_slot == SLOT_NONE else boot_slot)
+
+    async def partitions(self):
+        """The device's data partitions (older devices say no)"""
+        self.send(CMD_PARTITIONS)
+        await self.writer.drain()
+        n, = await self.recv(resp_nargs=1)
+        data = await self.read_exact(n * PARTITION_RECORD.size)
+
+        parts = []
+        for i in range(n):
+            name, addr, capacity, size, crc, valid = PARTITION_RECORD.unpack_from(data, i * PARTITION_RECORD.size)
+            parts.append(Partition(name.split(b"\0")[0].decode("ascii", "replace"), addr, capacity,
+                                   size, crc, bool(valid)))
+        return parts
+
+    async def seal_partition(self, addr, size, crc):
+        await self.command(CMD_PARTITION_SEAL, (addr, size, crc))
+
+    async def select(self, slot):
+        """Boot this (sealed) slot from now on"""
+        await self.command(CMD_SELECT, (slot,))
+
+    async def go_slot(self, slot):
+        # No response, the device jumps straight to the app
+        self.send(CMD_GO_SLOT, (slot,))
+        await self.writer.drain()
+
+    async def manifest(self, slot, first=0, max_sectors=256):
+        """CRCs of the sectors of the sealed image in a slot, from 'first'"""
+        self.send(CMD_MANIFEST, (slot, first, max_sectors))
+        await self.writer.drain()
+        vtor, size, crc, n = await self.recv(resp_nargs=4)
+        data = await self.read_exact(n * 4)
+        return Manifest(vtor, size, crc, list(struct.unpack("<{}I".format(n), data)))
+
+    async def seed(self, slot, linger):
+        """
+        Serve the (sealed) image in slot to peers, and run it once nothing
+        has connected for 'linger' seconds. 0 stops seeding.
+        """
+        await self.command(CMD_SEED, (slot, linger))
+
+    async def fetch(self, host, port, build_id, linger=0, select=False):
+        """
+        Have the device fetch the image with build_id from another device
+        (which has to be reachable at host:port from the device), in the
+        background. See fetch_status().
+        """
+        addr, = struct.unpack("<I", socket.inet_aton(socket.gethostbyname(host)))
+        flags = FETCH_FLAG_SELECT if select else 0
+        await self.command(CMD_FETCH, (addr, port, build_id, linger, flags))
+
+    async def fetch_status(self):
+        return FetchStatus(*await self.command(CMD_FETCH_STATUS, resp_nargs=5))
+
+    async def status(self):
+        return await self.command(CMD_STATUS, resp_nargs=4)
+
+    async def go(self, vtor):
+        # No response, the device jumps straight to the app
+        self.send(CMD_GO, (vtor,))
+        await self.writer.drain()
+
+    async def reboot(self, to_bootloader=False):
+        self.send(CMD_REBOOT, (1 if to_bootloader else 0,))
+        await self.writer.drain()
+
+    async def write_pipelined(self, addr, data, write_size, progress=None, limiter=None, window=8, batch=4,
+                              sparse=True):
+        """Pipelined WRITs (and FILLs) of data, to flash which is erased (or being erased), see upload()"""
+        info = self.info
+        if sparse and await self.has_fill(addr):
+            extents = sparse_extents(addr, data)
+        else:
+            extents = [Extent(addr, len(data), data)]
+
+        # (op, args, data, expected CRC), args always start with addr, size
+        chunk_size = info.max_data_len - (info.max_data_len % write_size)
+        cmds = []
+        for e in extents:
+            if isinstance(e.data, int):
+                for o in range(0, e.size, FILL_MAX_LEN):
+                    n = min(FILL_MAX_LEN, e.size - o)
+                    cmds.append((CMD_FILL, (e.addr + o, n, e.data), b"",
+                                 crc32(struct.pack("<I", e.data) * (n // 4))))
+            else:
+                for o in range(0, e.size, chunk_size):
+                    chunk = e.data[o:o + chunk_size]
+                    cmds.append((CMD_WRITE, (e.addr + o, len(chunk)), chunk, crc32(chunk)))
+
+        batch = max(1, min(batch, BATCH_MAX_ITEMS, BATCH_MAX_LEN // (12 + chunk_size)))
+        pending = collections.deque()
+        done = 0
+
+        async def complete_one():
+            nonlocal done
+            sent = pending.popleft()
+            if len(sent) == 1:
+                crcs = [await self.recv(resp_nargs=1)]
+            else:
+                crcs = await self.recv_batch(len(sent), resp_nargs=1)
+            for (_, args, _, expect), (crc,) in zip(sent, crcs):
+                if crc != expect:
+                    raise ProtocolError("CRC mismatch writing {:#x}".format(args[0]))
+                done += args[1]
+            if progress:
+                progress(done, len(data))
+
+        for i in range(0, len(cmds), batch):
+            group = cmds[i:i + batch]
+            if len(pending) >= max(1, window // batch):
+                await complete_one()
+
+            if limiter:
+                await limiter.consume(sum(len(d) for _, _, d, _ in group))
+
+            if len(group) == 1:
+                self.send(*group[0][:3])
+            else:
+                self.send_batch([c[:3] for c in group])
+            pending.append(group)
+            await self.writer.drain()
+
+        while pending:
+            await complete_one()
+
+    async def upload(self, image, progress=None, limiter=None, window=8, go=True, select=False, batch=4,
+                     sparse=True):
+        """
+        Erase, write, verify and seal an image, then (optionally) start it.
+        Writes are pipelined, with up to 'window' in flight, and sent
+        'batch' at a time in a BTCH, which the device programs together.
+        progress is called with (bytes_done, bytes_total).
+
+        With sparse, runs of a repeated 32-bit word (see sparse_extents())
+        are sent as FILLs instead of their data, if the device supports it.
+
+        Images linked for another slot (see CATL) go to that slot, and
+        select makes it the one which boots.
+
+        Images linked for SRAM go to the RAM load region instead, with no
+        erase, and nothing in flash is touched.
+        """
+        info = self.info
+        addr = image.addr if image.addr is not None else info.flash_start
+
+        ram = SRAM_BASE <= addr < SRAM_END
+        if ram:
+            start, size = await self.ram_info()
+            write_size = 4
+        else:
+            start, size = info.flash_start, info.flash_size
+            write_size = info.write_size
+
+        slot = 0
+        if not ram and addr != start:
+            # Maybe it's for one of the other slots (older devices don't
+            # have any, and say no)
+            try:
+                slots = (await self.catalog()).slots
+            except ProtocolError:
+                slots = []
+            for i, s in enumerate(slots):
+                if s.app_addr == addr:
+                    slot, start, size = i, s.app_addr, s.app_size
+
+        if addr != start:
+            raise ProtocolError("image is linked for {:#x}, but the device wants {:#x}{}".format(
+                                addr, start, "" if size else " (no RAM load region)"))
+
+        data = image.data + b"\xff" * (align_up(len(image.data), write_size) - len(image.data))
+        if len(data) > size:
+            raise ProtocolError("image is too big ({} > {})".format(len(data), size))
+
+        # The erase runs in the background on the device, and writes to
+        # each sector are held until it has been erased.
+        if not ram:
+            if sparse:
+                # Before the erase, in case the probe costs the connection
+                await self.has_fill(addr)
+            await self.erase(addr, align_up(len(data), info.erase_size))
+
+        await self.write_pipelined(addr, data, write_size, progress, limiter, window, batch, sparse)
+
+        crc = crc32(data)
+        if await self.crc(addr, len(data)) != crc:
+            raise ProtocolError("image CRC mismatch")
+
+        await self.seal(addr, len(data), crc)
+
+        if select and not ram:
+            await self.select(slot)
+
+        if go:
+            await self.go(addr)
+
+        return len(data)
+
+    async def upload_partition(self, name, data, progress=None, limiter=None, window=8, batch=4, sparse=True):
+        """
+        Erase, write, verify and seal the data partition called name, without
+        touching the app. The old contents stop being valid as soon as the
+        erase starts. Options are the same as upload().
+        """
+        info = self.info
+        parts = {p.name: p for p in await self.partitions()}
+        if name not in parts:
+            raise ProtocolError("no partition '{}' (the device has: {})".format(
+                                name, ", ".join(parts) or "none"))
+        part = parts[name]
+
+        data = data + b"\xff" * (align_up(len(data), info.write_size) - len(data))
+        if not data or len(data) > part.capacity:
+            raise ProtocolError("data doesn't fit in '{}' ({} bytes, max {})".format(
+                                name, len(data), part.capacity))
+
+        if sparse:
+            await self.has_fill(part.addr)
+
+        # The header too, so that it's never sealed over half-written data
+        await self.erase(part.addr - PARTITION_HEADER_SIZE,
+                         PARTITION_HEADER_SIZE + align_up(len(data), info.erase_size))
+
+        await self.write_pipelined(part.addr, data, info.write_size, progress, limiter, window, batch, sparse)
+
+        crc = crc32(data)
+        if await self.crc(part.addr, len(data)) != crc:
+            raise ProtocolError("partition CRC mismatch")
+
+        await self.seal_partition(part.addr, len(data), crc)
+
+        return len(data)
+
+async def discover(timeout=2.0, broadcast="255.255.255.255", port=DISCOVERY_PORT):
+    """Find devices using the UDP discovery responder."""
+    loop = asyncio.get_running_loop()
+    found = {}
+
+    class Protocol(asyncio.DatagramProtocol):
+        def datagram_received(self, data, addr):
+            if len(data) < 36:
+                return
+            magic, version = struct.unpack_from("<II", data, 0)
+            if magic != DISCOVERY_RESPONSE:
+                return
+            board_id = data[8:16].hex().upper()
+            flash_size, build_id, flags, tcp_port = struct.unpack_from("<4I", data, 16)
+            found[board_id] = Device(addr[0], tcp_port, board_id, flash_size, build_id,
+                                     bool(flags & 1), bool(flags & 2))
+
+    transport, _ = await loop.create_datagram_endpoint(Protocol, local_addr=("0.0.0.0", 0),
+                                                       allow_broadcast=True)
+    try:
+        transport.sendto(DISCOVERY_QUERY, (broadcast, port))
+        await asyncio.sleep(timeout)
+    finally:
+        transport.close()
+
+    return list(found.values())
@@ -0,0 +1,288 @@
+#!/usr/bin/env python3
+# Copyright (c) 2022 Brian Starkey <stark3y@gmail.com>
+#
+# SPDX-License-Identifier: BSD-3-Clause
+#
+# Upload an app to many picowota devices at once.
+#
+#   picowota_fleet.py app.elf 192.168.1.10 192.168.1.11:4243
+#   picowota_fleet.py app.elf --hosts-file hosts.txt --bandwidth 2M --json summary.json
+#   picowota_fleet.py app.elf --discover
+#   picowota_fleet.py app.elf --discover --p2p
+#   picowota_fleet.py model.bin --partition model --discover
+
+import argparse
+import asyncio
+import json
+import sys
+import time
+
+import picowota_client as pw
+
+def rate(x):
+    units = {"k": 1000, "K": 1024, "m": 1000 * 1000, "M": 1024 * 1024}
+    try:
+        if x and x[-1] in units:
+            return int(float(x[:-1]) * units[x[-1]])
+        return int(x)
+    except ValueError:
+        raise argparse.ArgumentTypeError("expected a rate like 500k or 2M, not '{}'".format(x))
+
+parser = argparse.ArgumentParser()
+parser.add_argument("image", help="App image (.elf, or .bin with --addr)")
+parser.add_argument("hosts", nargs="*", help="Devices, as host, host:port or a serial port")
+parser.add_argument("-f", "--hosts-file", help="File with one host[:port] per line")
+parser.add_argument("-d", "--discover", help="Find devices with the UDP discovery query",
+                    action="store_true")
+parser.add_argument("--broadcast", help="Broadcast address for --discover", default="255.255.255.255")
+parser.add_argument("-p", "--port", help="Default TCP port", type=int, default=pw.DEFAULT_PORT)
+parser.add_argument("-a", "--addr", help="Load address for a .bin image", type=lambda x: int(x, 0))
+parser.add_argument("-c", "--concurrency", help="Maximum devices to upload to at once",
+                    type=int, default=64)
+parser.add_argument("-r", "--retries", help="Attempts per device after the first", type=int, default=3)
+parser.add_argument("-b", "--bandwidth", help="Total upload bandwidth limit, bytes/s (e.g. 2M)",
+                    type=rate, default=0)
+parser.add_argument("-w", "--window", help="WRITs in flight per device", type=int, default=8)
+parser.add_argument("-t", "--timeout", help="Per-command timeout, seconds", type=float, default=10.0)
+parser.add_argument("-k", "--psk", help="Pre-shared key (64 hex digits) for devices built with PICOWOTA_PSK",
+                    type=pw.parse_psk)
+parser.add_argument("--takeover", help="Drop any other client a device has (e.g. a stale connection)",
+                    action="store_true")
+parser.add_argument("--select", help="Make the image's slot the one which boots (see picowota_slots.py)",
+                    action="store_true")
+parser.add_argument("--no-go", help="Don't start the app after uploading", action="store_true")
+parser.add_argument("--partition", help="Upload the file as it is to this data partition, instead of as an app")
+parser.add_argument("--no-fill", help="Send every byte, instead of FILLs for runs of the same word",
+                    action="store_true")
+parser.add_argument("--p2p", help="Upload to one device, and have the rest fetch it from each other",
+                    action="store_true")
+parser.add_argument("--linger", help="With --p2p, seconds a device keeps serving the image before "
+                    "starting it", type=int, default=30)
+parser.add_argument("-j", "--json", help="Write a JSON summary here ('-' for stdout)")
+parser.add_argument("-q", "--quiet", help="No progress output", action="store_true")
+args = parser.parse_args()
+
+def parse_host(h):
+    h = h.strip()
+    if pw.is_serial_port(h):
+        return h, args.port
+    host, _, port = h.rpartition(":")
+    if not host:
+        return port, args.port
+    return host, int(port)
+
+def log(msg):
+    if not args.quiet:
+        print(msg, file=sys.stderr, flush=True)
+
+def new_result(host, port):
+    return {
+        "host": host,
+        "port": port,
+        "ok": False,
+        "attempts": 0,
+        "bytes": 0,
+        "seconds": 0.0,
+        "bytes_per_second": 0.0,
+        "error": None,
+    }
+
+async def upload_one(host, port, image, sem, limiter, go=True):
+    name = "{}:{}".format(host, port)
+    result = new_result(host, port)
+
+    async with sem:
+        for attempt in range(1 + args.retries):
+            result["attempts"] = attempt + 1
+            last_decile = -1
+
+            def progress(done, total):
+                nonlocal last_decile
+                decile = done * 10 // total
+                if decile != last_decile:
+                    last_decile = decile
+                    log("{}: {}%".format(name, decile * 10))
+
+            start = time.monotonic()
+            try:
+                async with await pw.Client.connect(host, port, args.timeout, psk=args.psk,
+                                                   takeover=args.takeover) as dev:
+                    if args.partition:
+                        n = await dev.upload_partition(args.partition, image.data, progress=progress,
+                                                       limiter=limiter, window=args.window,
+                                                       sparse=not args.no_fill)
+                    else:
+                        n = await dev.upload(image, progress=progress, limiter=limiter,
+                                             window=args.window, go=go,
+                                             select=args.select, sparse=not args.no_fill)
+                elapsed = time.monotonic() - start
+                result.update(ok=True, bytes=n, seconds=round(elapsed, 3),
+                              bytes_per_second=round(n / elapsed, 1), error=None)
+                log("{}: done, {} bytes in {:.1f} s".format(name, n, elapsed))
+                return result
+            except (pw.ProtocolError, OSError, asyncio.TimeoutError) as e:
+                result["error"] = str(e) or type(e).__name__
+                log("{}: attempt {} failed: {}".format(name, attempt + 1, result["error"]))
+                # Back off a bit, the device might still be tidying up
+                await asyncio.sleep(min(2 ** attempt, 10))
+
+    return result
+
+async def fetch_one(host, port, src, build_id):
+    """Have host fetch the image from src (another device), and wait for it"""
+    name = "{}:{}".format(host, port)
+    result = new_result(host, port)
+    result["source"] = "{}:{}".format(*src)
+    linger = 0 if args.no_go else args.linger
+
+    for attempt in range(1 + args.retries):
+        result["attempts"] = attempt + 1
+        start = time.monotonic()
+        try:
+            async with await pw.Client.connect(host, port, args.timeout, psk=args.psk,
+                                               takeover=args.takeover) as dev:
+                await dev.fetch(src[0], src[1], build_id, linger=linger, select=args.select)
+                last_decile = -1
+                while True:
+                    await asyncio.sleep(1)
+                    st = await dev.fetch_status()
+                    if st.total:
+                        decile = st.done * 10 // st.total
+                        if decile != last_decile:
+                            last_decile = decile
+                            log("{}: {}% (from {})".format(name, decile * 10, result["source"]))
+                    if st.state != pw.FETCH_RUNNING:
+                        break
+
+            if st.state != pw.FETCH_DONE:
+                raise pw.ProtocolError("fetch failed: {}".format(pw.FETCH_ERRORS[st.err]
+                                       if st.err < len(pw.FETCH_ERRORS) else st.err))
+
+            elapsed = time.monotonic() - start
+            result.update(ok=True, bytes=st.fetched, seconds=round(elapsed, 3),
+                          bytes_per_second=round(st.fetched / elapsed, 1), error=None)
+            log("{}: done, fetched {} of {} bytes in {:.1f} s".format(name, st.fetched, st.total, elapsed))
+            return result
+        except (pw.ProtocolError, OSError, asyncio.TimeoutError) as e:
+            result["error"] = str(e) or type(e).__name__
+            log("{}: attempt {} failed: {}".format(name, attempt + 1, result["error"]))
+            await asyncio.sleep(min(2 ** attempt, 10))
+
+    return result
+
+async def p2p(hosts, image, sem, limiter):
+    """
+    Upload to one device, which then serves the image to the others (see
+    FTCH in main.c). Each device which has it becomes a source too, so the
+    number of copies doubles each round, and only one crosses the link from
+    here. A source only serves one peer at a time.
+    """
+    results = {}
+    pending = list(hosts)
+    sources = []
+    build_id = None
+
+    # The first device which takes the upload is the seed
+    while pending and build_id is None:
+        host, port = pending.pop(0)
+        result = await upload_one(host, port, image, sem, limiter, go=False)
+        results[(host, port)] = result
+        if not result["ok"]:
+            continue
+        try:
+            async with await pw.Client.connect(host, port, args.timeout, psk=args.psk) as dev:
+                addr = image.addr if image.addr is not None else dev.info.flash_start
+                catalog = await dev.catalog()
+                slot = next((i for i, s in enumerate(catalog.slots) if s.valid and s.vtor == addr), None)
+                if slot is None:
+                    raise pw.ProtocolError("image isn't in any slot")
+                build_id = catalog.slots[slot].crc
+                await dev.seed(slot, 0 if args.no_go else args.linger)
+            sources.append((host, port))
+            log("{}:{}: seeding build {:08x}".format(host, port, build_id))
+        except (pw.ProtocolError, OSError, asyncio.TimeoutError) as e:
+            result.update(ok=False, error="couldn't seed: {}".format(str(e) or type(e).__name__))
+            log("{}:{}: {}".format(host, port, result["error"]))
+
+    idle = list(sources)
+    running = {}
+    while pending or running:
+        while pending and idle and len(running) < args.concurrency:
+            src = idle.pop(0)
+            dst = pending.pop(0)
+            task = asyncio.ensure_future(fetch_one(dst[0], dst[1], src, build_id))
+            running[task] = (src, dst)
+
+        if not running:
+            # Nobody left to fetch from
+            for dst in pending:
+                results[dst] = new_result(*dst)
+                results[dst]["error"] = "no source"
+            break
+
+        done, _ = await asyncio.wait(running, return_when=asyncio.FIRST_COMPLETED)
+        for task in done:
+            src, dst = running.pop(task)
+            results[dst] = task.result()
+            idle.append(src)
+            if results[dst]["ok"]:
+                idle.append(dst)
+
+    return [results[h] for h in hosts]
+
+async def main():
+    hosts = [parse_host(h) for h in args.hosts]
+    if args.hosts_file:
+        with open(args.hosts_file) as f:
+            hosts += [parse_host(l) for l in f if l.strip() and not l.startswith("#")]
+    if args.discover:
+        found = await pw.discover(broadcast=args.broadcast)
+        log("discovered {} device(s)".format(len(found)))
+        hosts += [(d.host, d.port) for d in found]
+
+    hosts = list(dict.fromkeys(hosts))
+    if not hosts:
+        sys.exit("No devices given")
+
+    if args.partition:
+        if args.p2p:
+            sys.exit("--p2p only works for apps")
+        with open(args.image, "rb") as f:
+            image = pw.Image(None, f.read())
+    else:
+        image = pw.load_image(args.image, args.addr)
+
+    sem = asyncio.Semaphore(args.concurrency)
+    limiter = pw.RateLimiter(args.bandwidth) if args.bandwidth else None
+
+    start = time.monotonic()
+    if args.p2p:
+        results = await p2p(hosts, image, sem, limiter)
+    else:
+        results = await asyncio.gather(*[upload_one(h, p, image, sem, limiter, go=not args.no_go)
+                                         for h, p in hosts])
+    elapsed = time.monotonic() - start
+
+    n_ok = sum(1 for r in results if r["ok"])
+    summary = {
+        "image": args.image,
+        "image_bytes": len(image.data),
+        "devices": len(results),
+        "succeeded": n_ok,
+        "failed": len(results) - n_ok,
+        "seconds": round(elapsed, 3),
+        "results": results,
+    }
+
+    log("{} of {} devices updated in {:.1f} s".format(n_ok, len(results), elapsed))
+
+    if args.json == "-":
+        json.dump(summary, sys.stdout, indent=2)
+        print()
+    elif args.json:
+        with open(args.json, "w") as f:
+            json.dump(summary, f, indent=2)
+
+    return 0 if n_ok == len(results) else 1
+
+sys.exit(asyncio.run(main()))
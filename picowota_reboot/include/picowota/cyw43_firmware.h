@@ -0,0 +1,54 @@
+/**
+ * Copyright (c) 2022 Brian Starkey <stark3y@gmail.com>
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#ifndef __PICOWOTA_CYW43_FIRMWARE_H__
+#define __PICOWOTA_CYW43_FIRMWARE_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+/*
+ * The bootloader places its copy of the cyw43 firmware (including the CLM
+ * data) at a fixed location in flash, preceded by this descriptor. Apps built
+ * with picowota_build_standalone(... SHARED_CYW43_FIRMWARE) link against that
+ * copy instead of carrying their own.
+ */
+#define PICOWOTA_CYW43_FW_DESC_MAGIC   (('C' << 0) | ('Y' << 8) | ('F' << 16) | ('W' << 24))
+#define PICOWOTA_CYW43_FW_DESC_VERSION 1
+#define PICOWOTA_CYW43_FW_DESC_SIZE    256
+
+struct picowota_cyw43_fw_desc {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t fw_start;
+	uint32_t fw_end;
+	// Firmware name, as used for the firmware symbol
+	// e.g. "43439A0_7_95_49_00"
+	char name[32];
+};
+
+#if PICOWOTA_SHARED_CYW43_FIRMWARE
+#define __PICOWOTA_QUOTE(name) #name
+#define __PICOWOTA_STR(macro) __PICOWOTA_QUOTE(macro)
+
+/*
+ * Check that the firmware which this app was linked against is actually
+ * present in the bootloader. Call before cyw43_arch_init().
+ */
+static inline bool picowota_cyw43_firmware_ok(void)
+{
+	const struct picowota_cyw43_fw_desc *desc =
+		(const struct picowota_cyw43_fw_desc *)PICOWOTA_CYW43_FW_DESC_ADDR;
+
+	return (desc->magic == PICOWOTA_CYW43_FW_DESC_MAGIC) &&
+		(desc->version == PICOWOTA_CYW43_FW_DESC_VERSION) &&
+		(desc->fw_start == PICOWOTA_CYW43_FW_DESC_ADDR + PICOWOTA_CYW43_FW_DESC_SIZE) &&
+		!strncmp(desc->name, __PICOWOTA_STR(PICOWOTA_CYW43_FW_NAME), sizeof(desc->name));
+}
+#endif
+
+#endif /* __PICOWOTA_CYW43_FIRMWARE_H__ */
@@ -0,0 +1,71 @@
+/**
+ * Copyright (c) 2022 Brian Starkey <stark3y@gmail.com>
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#ifndef __PICOWOTA_PARTITION_H__
+#define __PICOWOTA_PARTITION_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "picowota/partition_table.h"
+
+/*
+ * Data partitions (PICOWOTA_PARTITIONS) sit between the bootloader and the
+ * app slots. Each is a header sector followed by the data, and is uploaded
+ * and sealed on its own, so the app can be updated without sending them
+ * again (and the other way round).
+ *
+ * The bootloader only writes the header (PSEA) once the data's CRC matches,
+ * and erases it before anything it's sent (WRIT, UPDT, FILL or ERAS) touches
+ * the data. So as long as the app doesn't write to the data itself, a
+ * partition with a good header holds what was sealed, and the CRC isn't
+ * checked again here.
+ */
+#define PICOWOTA_PARTITION_MAGIC    (('P' << 0) | ('A' << 8) | ('R' << 16) | ('T' << 24))
+#define PICOWOTA_PARTITION_NAME_LEN 16
+// The header has a flash sector to itself
+#define PICOWOTA_PARTITION_HEADER_SIZE 4096
+
+struct picowota_partition_header {
+	uint32_t magic;
+	uint32_t size;
+	uint32_t crc;
+	char name[PICOWOTA_PARTITION_NAME_LEN];
+};
+
+// An entry in PICOWOTA_PARTITION_TABLE
+struct picowota_partition_entry {
+	const char *name;
+	uint32_t header_addr;
+	uint32_t capacity;
+};
+
+// A sealed partition
+struct picowota_partition {
+	const char *name;
+	const void *data;
+	uint32_t size;
+	uint32_t crc;
+};
+
+extern const struct picowota_partition_entry picowota_partitions[];
+extern const unsigned int picowota_n_partitions;
+
+// Where an entry's data starts
+static inline uint32_t picowota_partition_data_addr(const struct picowota_partition_entry *entry)
+{
+	return entry->header_addr + PICOWOTA_PARTITION_HEADER_SIZE;
+}
+
+// Whether an entry has a sealed header (without checking the CRC)
+bool picowota_partition_sealed(const struct picowota_partition_entry *entry);
+
+// Find a sealed partition by name. Returns false if there's no partition
+// with that name, or nothing has been sealed in it. The data isn't checked
+// against part->crc, see above.
+bool picowota_partition_find(const char *name, struct picowota_partition *part);
+
+#endif /* __PICOWOTA_PARTITION_H__ */
@@ -0,0 +1,53 @@
+/**
+ * Copyright (c) 2022 Brian Starkey <stark3y@gmail.com>
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#include <string.h>
+
+#include "picowota/partition.h"
+
+// The extra (empty) entry keeps the array from being zero length
+const struct picowota_partition_entry picowota_partitions[PICOWOTA_N_PARTITIONS + 1] = {
+	PICOWOTA_PARTITION_TABLE
+	{ 0 },
+};
+const unsigned int picowota_n_partitions = PICOWOTA_N_PARTITIONS;
+
+bool picowota_partition_sealed(const struct picowota_partition_entry *entry)
+{
+	const struct picowota_partition_header *hdr =
+		(const struct picowota_partition_header *)entry->header_addr;
+
+	return (hdr->magic == PICOWOTA_PARTITION_MAGIC) && (hdr->size <= entry->capacity) &&
+		!strncmp(hdr->name, entry->name, sizeof(hdr->name));
+}
+
+bool picowota_partition_find(const char *name, struct picowota_partition *part)
+{
+	unsigned int i;
+
+	for (i = 0; i < picowota_n_partitions; i++) {
+		const struct picowota_partition_entry *entry = &picowota_partitions[i];
+		const struct picowota_partition_header *hdr =
+			(const struct picowota_partition_header *)entry->header_addr;
+
+		if (strcmp(entry->name, name)) {
+			continue;
+		}
+
+		if (!picowota_partition_sealed(entry)) {
+			return false;
+		}
+
+		part->name = entry->name;
+		part->data = (const void *)picowota_partition_data_addr(entry);
+		part->size = hdr->size;
+		part->crc = hdr->crc;
+
+		return true;
+	}
+
+	return false;
+}
@@ -0,0 +1,214 @@
+#!/usr/bin/env python3
+# Copyright (c) 2022 Brian Starkey <stark3y@gmail.com>
+#
+# SPDX-License-Identifier: BSD-3-Clause
+#
+# Update server for pull mode (PICOWOTA_PULL_SERVER). It answers the same
+# commands a device does when another device fetches from it (SYNC, AUTH,
+# CATL, MANI and READ, see peer.h), with a single slot holding the image.
+# Devices compare its CRC against the image they have, and then only read
+# the sectors which are different.
+#
+# The image is reloaded whenever the file changes, so rebuilding the app is
+# enough for devices to pick it up the next time they boot.
+
+import argparse
+import asyncio
+import os
+import struct
+import sys
+
+import picowota_client as pw
+
+# From peer.h
+PEER_SECTOR_SIZE = 4096
+PEER_MANIFEST_MAX = 256
+
+# From comm.h
+COMM_MAX_DATA_LEN = 1024
+
+# Images are padded like they are for an upload
+WRITE_SIZE = 256
+
+# Number of argument words for each command which is served. None of them
+# have any data.
+COMMANDS = {
+    pw.CMD_SYNC: 0,
+    pw.CMD_AUTH: 4,
+    pw.CMD_CATALOG: 0,
+    pw.CMD_MANIFEST: 3,
+    pw.CMD_READ: 2,
+}
+
+def sector_range(vtor, size, idx):
+    sector = (vtor & ~(PEER_SECTOR_SIZE - 1)) + idx * PEER_SECTOR_SIZE
+    return max(sector, vtor), min(sector + PEER_SECTOR_SIZE, vtor + size)
+
+class Served:
+    def __init__(self, path, addr):
+        self.path = path
+        self.addr = addr
+        self.mtime = None
+        self.reload()
+
+    def reload(self):
+        mtime = os.stat(self.path).st_mtime
+        if mtime == self.mtime:
+            return
+
+        image = pw.load_image(self.path, self.addr)
+        if image.addr is None:
+            raise ValueError("{}: raw binaries need --addr".format(self.path))
+
+        self.vtor = image.addr
+        self.data = image.data + b"\xff" * (pw.align_up(len(image.data), WRITE_SIZE) - len(image.data))
+        self.crc = pw.crc32(self.data)
+        self.mtime = mtime
+        print("Serving {}: {:#x} {} bytes, build {:08x}".format(self.path, self.vtor, len(self.data), self.crc))
+
+    def catalog(self):
+        record = pw.SLOT_RECORD.pack(self.vtor, len(self.data), self.vtor, len(self.data), self.crc, 1)
+        return (1, 0, 0), record
+
+    def manifest(self, slot, first, max_sectors):
+        size = len(self.data)
+        n_sectors = (self.vtor + size - (self.vtor & ~(PEER_SECTOR_SIZE - 1)) + PEER_SECTOR_SIZE - 1) // PEER_SECTOR_SIZE
+        if slot != 0 or first >= n_sectors:
+            return None
+
+        crcs = []
+        for i in range(first, first + min(n_sectors - first, max_sectors, PEER_MANIFEST_MAX)):
+            start, end = sector_range(self.vtor, size, i)
+            crcs.append(pw.crc32(self.data[start - self.vtor:end - self.vtor]))
+
+        return (self.vtor, size, self.crc, len(crcs)), struct.pack("<{}I".format(len(crcs)), *crcs)
+
+    def read(self, addr, length):
+        offs = addr - self.vtor
+        if length > COMM_MAX_DATA_LEN or offs < 0 or offs + length > len(self.data):
+            return None
+
+        return (), self.data[offs:offs + length]
+
+class Session:
+    def __init__(self, reader, writer, served, psk):
+        self.reader = reader
+        self.writer = writer
+        self.served = served
+        self.psk = psk
+        self.key = None
+        self.tx_counter = 0
+        self.rx_counter = 0
+        self.rx_plain = bytearray()
+
+    # The device side of comm.c: once authenticated, everything in both
+    # directions is in sealed frames
+    async def read_exact(self, n):
+        if not self.key:
+            return await self.reader.readexactly(n)
+
+        while len(self.rx_plain) < n:
+            header = await self.reader.readexactly(4)
+            length, = struct.unpack("<I", header)
+            if length > COMM_MAX_DATA_LEN * 8:
+                raise pw.ProtocolError("frame too big")
+            sealed = await self.reader.readexactly(length + pw.TAG_LEN)
+            self.rx_plain += pw.aead_decrypt(self.key, pw.frame_nonce(pw.DIR_TO_DEVICE, self.rx_counter),
+                                             header, sealed)
+            self.rx_counter += 1
+
+        data = bytes(self.rx_plain[:n])
+        del self.rx_plain[:n]
+        return data
+
+    def send(self, status, args=(), data=b""):
+        msg = struct.pack("<{}I".format(1 + len(args)), status, *args) + data
+        if self.key:
+            header = struct.pack("<I", len(msg))
+            msg = header + pw.aead_encrypt(self.key, pw.frame_nonce(pw.DIR_TO_HOST, self.tx_counter), header, msg)
+            self.tx_counter += 1
+        self.writer.write(msg)
+
+    def handle(self, op, args):
+        if op == pw.CMD_SYNC:
+            self.send(pw.RSP_SYNC)
+            return True
+
+        if op == pw.CMD_AUTH:
+            if not self.psk or self.key:
+                return False
+            client_nonce = struct.pack("<4I", *args)
+            device_nonce = os.urandom(16)
+            # The response goes in the clear, and then the session is secure
+            self.send(pw.RSP_OK, struct.unpack("<4I", device_nonce))
+            self.key = pw.hchacha20(pw.hchacha20(self.psk, client_nonce), device_nonce)
+            return True
+
+        if self.psk and not self.key:
+            return False
+
+        if op == pw.CMD_CATALOG:
+            self.served.reload()
+            resp = self.served.catalog()
+        elif op == pw.CMD_MANIFEST:
+            resp = self.served.manifest(*args)
+        elif op == pw.CMD_READ:
+            resp = self.served.read(*args)
+
+        if resp is None:
+            return False
+
+        self.send(pw.RSP_OK, *resp)
+        return True
+
+    async def run(self):
+        peer = self.writer.get_extra_info("peername")
+        try:
+            while True:
+                op, = struct.unpack("<I", await self.read_exact(4))
+                nargs = COMMANDS.get(op)
+                ok = False
+                if nargs is not None:
+                    args = struct.unpack("<{}I".format(nargs), await self.read_exact(4 * nargs))
+                    ok = self.handle(op, args)
+                if not ok:
+                    # Same as a device: ERR!, and the stream can't be trusted
+                    # any more
+                    self.send(pw.RSP_ERR)
+                    await self.writer.drain()
+                    print("{}: bad command {:#010x}".format(peer, op))
+                    break
+                await self.writer.drain()
+        except (asyncio.IncompleteReadError, ConnectionError):
+            pass
+        except (pw.ProtocolError, ValueError) as e:
+            print("{}: {}".format(peer, e))
+        finally:
+            self.writer.close()
+
+async def serve(args, served):
+    async def session(reader, writer):
+        await Session(reader, writer, served, args.psk).run()
+
+    server = await asyncio.start_server(session, args.bind, args.port)
+    async with server:
+        await server.serve_forever()
+
+parser = argparse.ArgumentParser()
+parser.add_argument("image", help="App image to serve (ELF or raw binary)")
+parser.add_argument("-a", "--addr", help="Load address, for raw binaries", type=lambda x: int(x, 0))
+parser.add_argument("-b", "--bind", help="Address to listen on", default="0.0.0.0")
+parser.add_argument("-p", "--port", help="TCP port", type=int, default=pw.DEFAULT_PORT)
+parser.add_argument("-k", "--psk", help="Pre-shared key (64 hex digits), if the devices use one",
+                    type=pw.parse_psk)
+args = parser.parse_args()
+
+try:
+    served = Served(args.image, args.addr)
+except (OSError, ValueError) as e:
+    sys.exit(str(e))
+
+try:
+    asyncio.run(serve(args, served))
+except KeyboardInterrupt:
+    pass
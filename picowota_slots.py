@@ -0,0 +1,69 @@
+#!/usr/bin/env python3
+# Copyright (c) 2022 Brian Starkey <stark3y@gmail.com>
+#
+# SPDX-License-Identifier: BSD-3-Clause
+#
+# List a device's image slots (CATL) and data partitions (PART), choose which
+# slot boots (SLCT), or run one straight away (GOSL).
+
+import argparse
+import asyncio
+import sys
+
+import picowota_client as pw
+
+async def run(args):
+    async with await pw.Client.connect(args.host, args.port, psk=args.psk) as dev:
+        if args.action == "select":
+            await dev.select(args.slot)
+        elif args.action == "go":
+            await dev.go_slot(args.slot)
+            return None
+        catalog = await dev.catalog()
+        try:
+            parts = await dev.partitions()
+        except pw.ProtocolError:
+            # Older devices don't have any
+            parts = []
+        return catalog, parts
+
+parser = argparse.ArgumentParser()
+parser.add_argument("host", help="Device address")
+parser.add_argument("action", nargs="?", choices=["list", "select", "go"], default="list",
+                    help="list the slots (default), select the one to boot, or go to one now")
+parser.add_argument("slot", nargs="?", type=int, help="Slot number, for select and go")
+parser.add_argument("-p", "--port", help="TCP port", type=int, default=pw.DEFAULT_PORT)
+parser.add_argument("-k", "--psk", help="Pre-shared key (64 hex digits), if the device needs one",
+                    type=pw.parse_psk)
+args = parser.parse_args()
+
+if args.action != "list" and args.slot is None:
+    parser.error("{} needs a slot number".format(args.action))
+
+try:
+    listing = asyncio.run(run(args))
+except pw.ProtocolError as e:
+    sys.exit("{} failed: {}".format(args.action, e))
+
+if listing is None:
+    sys.exit(0)
+catalog, parts = listing
+
+row = "{:<2} {:<4} {:>10} {:>8} {:>8} {:>10}  {}"
+print(row.format("", "slot", "addr", "space", "size", "crc", "state"))
+for i, s in enumerate(catalog.slots):
+    mark = ("*" if i == catalog.boot_slot else "") + ("d" if i == catalog.default_slot else "")
+    state = "sealed" if s.valid else "empty"
+    size = s.size if s.valid else ""
+    crc = "{:#010x}".format(s.crc) if s.valid else ""
+    print(row.format(mark, i, "{:#x}".format(s.app_addr), s.app_size, size, crc, state))
+print("(d: default, *: boots on reset)")
+
+if parts:
+    print()
+    print(row.format("", "part", "addr", "space", "size", "crc", "state"))
+    for p in parts:
+        size = p.size if p.valid else ""
+        crc = "{:#010x}".format(p.crc) if p.valid else ""
+        print(row.format("", p.name, "{:#x}".format(p.addr), p.capacity, size, crc,
+                         "sealed" if p.valid else "empty"))
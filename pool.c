@@ -0,0 +1,68 @@
+/**
+ * Copyright (c) 2022 Brian Starkey <stark3y@gmail.com>
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+#include <assert.h>
+#include <stddef.h>
+
+#include "pool.h"
+
+static struct pool *pools;
+
+static void pool_init(struct pool *pool)
+{
+	uint16_t i;
+
+	// Free blocks hold a pointer to the next one
+	pool->free_list = NULL;
+	for (i = pool->n_blocks; i > 0; i--) {
+		void **block = (void **)((uint8_t *)pool->mem + ((i - 1) * pool->block_size));
+		*block = pool->free_list;
+		pool->free_list = block;
+	}
+
+	pool->next = pools;
+	pools = pool;
+	pool->ready = true;
+}
+
+void *pool_alloc(struct pool *pool)
+{
+	if (!pool->ready) {
+		pool_init(pool);
+	}
+
+	void **block = pool->free_list;
+	if (!block) {
+		pool->err++;
+		return NULL;
+	}
+
+	pool->free_list = *block;
+	pool->used++;
+	if (pool->used > pool->max_used) {
+		pool->max_used = pool->used;
+	}
+
+	return block;
+}
+
+void pool_free(struct pool *pool, void *block)
+{
+	if (!block) {
+		return;
+	}
+
+	assert(((uint8_t *)block >= (uint8_t *)pool->mem) &&
+	       ((uint8_t *)block < (uint8_t *)pool->mem + (pool->n_blocks * pool->block_size)));
+
+	*(void **)block = pool->free_list;
+	pool->free_list = block;
+	pool->used--;
+}
+
+const struct pool *pool_list(void)
+{
+	return pools;
+}
@@ -0,0 +1,51 @@
+/**
+ * Copyright (c) 2022 Brian Starkey <stark3y@gmail.com>
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+#ifndef __POOL_H__
+#define __POOL_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Fixed-size block pools, for things which would otherwise come from the libc
+ * heap. The storage is static, so it's all accounted for at link time, and
+ * alloc/free are O(1) with no fragmentation. Each pool keeps a high-water
+ * mark, which the POOL command reports (along with lwIP's pools).
+ */
+struct pool {
+	const char *name;
+	uint32_t *mem;
+	uint16_t block_size;
+	uint16_t n_blocks;
+	uint16_t used;
+	uint16_t max_used;
+	uint32_t err;
+
+	void *free_list;
+	struct pool *next;
+	bool ready;
+};
+
+#define POOL_BLOCK_WORDS(_size) (((_size) + sizeof(uint32_t) - 1) / sizeof(uint32_t))
+
+// Define a pool called _var, of _n blocks which are each at least _size bytes
+#define POOL_DEFINE(_var, _name, _size, _n)                                     \
+	static uint32_t _var##_mem[(_n) * POOL_BLOCK_WORDS(_size)];             \
+	static struct pool _var = {                                             \
+		.name = (_name),                                                \
+		.mem = _var##_mem,                                              \
+		.block_size = POOL_BLOCK_WORDS(_size) * sizeof(uint32_t),       \
+		.n_blocks = (_n),                                               \
+	}
+
+// Returns NULL if the pool is empty. The block isn't cleared.
+void *pool_alloc(struct pool *pool);
+void pool_free(struct pool *pool, void *block);
+
+// All of the pools which have been used so far, linked by ->next
+const struct pool *pool_list(void);
+
+#endif /* __POOL_H__ */
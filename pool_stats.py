@@ -0,0 +1,38 @@
+#!/usr/bin/env python3
+# Copyright (c) 2022 Brian Starkey <stark3y@gmail.com>
+#
+# SPDX-License-Identifier: BSD-3-Clause
+#
+# Print the usage and high-water marks of a device's memory pools (POOL
+# command), to help with sizing them.
+
+import argparse
+import asyncio
+import sys
+
+import picowota_client as pw
+
+async def fetch(host, port, psk):
+    async with await pw.Client.connect(host, port, psk=psk) as dev:
+        return await dev.pools()
+
+parser = argparse.ArgumentParser()
+parser.add_argument("host", help="Device address")
+parser.add_argument("-p", "--port", help="TCP port", type=int, default=pw.DEFAULT_PORT)
+parser.add_argument("-k", "--psk", help="Pre-shared key (64 hex digits), if the device needs one",
+                    type=pw.parse_psk)
+args = parser.parse_args()
+
+try:
+    pools = asyncio.run(fetch(args.host, args.port, args.psk))
+except pw.ProtocolError as e:
+    sys.exit("POOL failed: {}".format(e))
+
+row = "{:<16} {:>6} {:>6} {:>6} {:>6} {:>6} {:>8}"
+print(row.format("pool", "size", "blocks", "used", "max", "errors", "bytes"))
+total = 0
+for p in pools:
+    total += p.block_size * p.n_blocks
+    print(row.format(p.name, p.block_size, p.n_blocks, p.used, p.max_used, p.err,
+                     p.block_size * p.n_blocks))
+print(row.format("total", "", "", "", "", "", total))
@@ -0,0 +1,68 @@
+/**
+ * Copyright (c) 2022 Brian Starkey <stark3y@gmail.com>
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+#ifndef __PROTOCOL_H__
+#define __PROTOCOL_H__
+
+#include <stdint.h>
+
+/*
+ * Opcodes and record layouts of the bootloader's commands. The device side
+ * is in main.c, and peer.c uses the same commands to fetch from another
+ * device. The framing (responses, BTCH, AUTH, TAKE) is in comm.h.
+ */
+
+#define CMD_SYNC          (('S' << 0) | ('Y' << 8) | ('N' << 16) | ('C' << 24))
+#define RSP_SYNC          (('W' << 0) | ('O' << 8) | ('T' << 16) | ('A' << 24))
+#define CMD_INFO          (('I' << 0) | ('N' << 8) | ('F' << 16) | ('O' << 24))
+
+#define CMD_READ   (('R' << 0) | ('E' << 8) | ('A' << 16) | ('D' << 24))
+#define CMD_CSUM   (('C' << 0) | ('S' << 8) | ('U' << 16) | ('M' << 24))
+#define CMD_CRC    (('C' << 0) | ('R' << 8) | ('C' << 16) | ('C' << 24))
+#define CMD_ERASE  (('E' << 0) | ('R' << 8) | ('A' << 16) | ('S' << 24))
+#define CMD_WRITE  (('W' << 0) | ('R' << 8) | ('I' << 16) | ('T' << 24))
+#define CMD_SEAL   (('S' << 0) | ('E' << 8) | ('A' << 16) | ('L' << 24))
+#define CMD_GO     (('G' << 0) | ('O' << 8) | ('G' << 16) | ('O' << 24))
+#define CMD_REBOOT (('B' << 0) | ('O' << 8) | ('O' << 16) | ('T' << 24))
+#define CMD_STATUS (('S' << 0) | ('T' << 8) | ('A' << 16) | ('T' << 24))
+#define CMD_ABORT  (('A' << 0) | ('B' << 8) | ('R' << 16) | ('T' << 24))
+#define CMD_TRACE  (('T' << 0) | ('R' << 8) | ('C' << 16) | ('E' << 24))
+#define CMD_RAMINFO (('R' << 0) | ('A' << 8) | ('M' << 16) | ('I' << 24))
+#define CMD_UPDATE (('U' << 0) | ('P' << 8) | ('D' << 16) | ('T' << 24))
+#define CMD_FLUSH  (('F' << 0) | ('L' << 8) | ('S' << 16) | ('H' << 24))
+#define CMD_POOL   (('P' << 0) | ('O' << 8) | ('O' << 16) | ('L' << 24))
+#define CMD_CATALOG (('C' << 0) | ('A' << 8) | ('T' << 16) | ('L' << 24))
+#define CMD_SELECT  (('S' << 0) | ('L' << 8) | ('C' << 16) | ('T' << 24))
+#define CMD_GO_SLOT (('G' << 0) | ('O' << 8) | ('S' << 16) | ('L' << 24))
+#define CMD_MANIFEST (('M' << 0) | ('A' << 8) | ('N' << 16) | ('I' << 24))
+#define CMD_SEED     (('S' << 0) | ('E' << 8) | ('E' << 16) | ('D' << 24))
+#define CMD_FETCH    (('F' << 0) | ('T' << 8) | ('C' << 16) | ('H' << 24))
+#define CMD_FETCH_STATUS (('F' << 0) | ('S' << 8) | ('T' << 16) | ('A' << 24))
+#define CMD_FILL   (('F' << 0) | ('I' << 8) | ('L' << 16) | ('L' << 24))
+#define CMD_PARTITIONS (('P' << 0) | ('A' << 8) | ('R' << 16) | ('T' << 24))
+#define CMD_PARTITION_SEAL (('P' << 0) | ('S' << 8) | ('E' << 16) | ('A' << 24))
+
+// CATL responds with n_slots, default_slot and boot_slot, then n_slots of
+// these
+#define CATALOG_RESP_NARGS 3
+struct slot_record {
+	uint32_t app_addr;
+	uint32_t app_size;
+	uint32_t vtor;
+	uint32_t size;
+	uint32_t crc;
+	uint32_t valid;
+};
+
+// MANI responds with this, then n sector CRCs
+struct manifest_header {
+	uint32_t vtor;
+	uint32_t size;
+	uint32_t crc;
+	uint32_t n;
+};
+#define MANIFEST_RESP_NARGS (sizeof(struct manifest_header) / sizeof(uint32_t))
+
+#endif /* __PROTOCOL_H__ */
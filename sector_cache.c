@@ -0,0 +1,186 @@
+/**
+ * Copyright (c) 2022 Brian Starkey <stark3y@gmail.com>
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+#include <stdbool.h>
+#include <string.h>
+
+#include "hardware/flash.h"
+#include "hardware/regs/addressmap.h"
+
+#include "flash_session.h"
+#include "sector_cache.h"
+#include "trace.h"
+
+struct sector_cache_entry {
+	uint32_t addr;
+	uint32_t last_used;
+	bool valid;
+	bool dirty;
+	uint32_t data[FLASH_SECTOR_SIZE / sizeof(uint32_t)];
+};
+
+static struct sector_cache_entry sector_cache[PICOWOTA_SECTOR_CACHE_LEN];
+static uint32_t sector_cache_clock;
+
+static const uint32_t *flash_nocache(uint32_t addr)
+{
+	// Reading through the cached alias would evict our own code
+	return (const uint32_t *)(addr - XIP_BASE + XIP_NOCACHE_NOALLOC_BASE);
+}
+
+static bool overlaps(struct sector_cache_entry *e, uint32_t addr, uint32_t size)
+{
+	return e->valid && (addr < e->addr + FLASH_SECTOR_SIZE) && (addr + size > e->addr);
+}
+
+static bool page_erased(const uint32_t *page)
+{
+	uint32_t i;
+
+	for (i = 0; i < FLASH_PAGE_SIZE / sizeof(uint32_t); i++) {
+		if (page[i] != 0xffffffff) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+static void sector_cache_writeback(struct sector_cache_entry *e)
+{
+	const uint32_t *flash = flash_nocache(e->addr);
+	const uint32_t words_per_page = FLASH_PAGE_SIZE / sizeof(uint32_t);
+	struct flash_session session;
+	bool erase = false;
+	uint32_t i, page;
+
+	if (!e->dirty) {
+		return;
+	}
+
+	// Programming can only clear bits, so only erase if a bit needs setting
+	for (i = 0; i < FLASH_SECTOR_SIZE / sizeof(uint32_t); i++) {
+		if (e->data[i] & ~flash[i]) {
+			erase = true;
+			break;
+		}
+	}
+
+	// The erase and all of the pages are done in one go
+	flash_session_init(&session);
+	if (erase) {
+		flash_session_erase(&session, e->addr - XIP_BASE, FLASH_SECTOR_SIZE);
+	}
+
+	for (page = 0; page < FLASH_SECTOR_SIZE / FLASH_PAGE_SIZE; page++) {
+		const uint32_t *src = &e->data[page * words_per_page];
+
+		// Skip pages which are already right (after an erase, that's the
+		// ones which are all 0xff)
+		if (erase ? page_erased(src) : !memcmp(src, &flash[page * words_per_page], FLASH_PAGE_SIZE)) {
+			continue;
+		}
+
+		flash_session_program(&session, e->addr - XIP_BASE + (page * FLASH_PAGE_SIZE),
+				      (const uint8_t *)src, FLASH_PAGE_SIZE);
+	}
+
+	if (session.n_ops) {
+		trace_event(TRACE_FLASH_PROGRAM, 1, e->addr);
+		flash_session_run(&session);
+		trace_event(TRACE_FLASH_PROGRAM, 0, e->addr);
+	}
+
+	e->dirty = false;
+}
+
+static struct sector_cache_entry *sector_cache_get(uint32_t addr)
+{
+	struct sector_cache_entry *e, *victim = &sector_cache[0];
+
+	for (e = sector_cache; e < sector_cache + PICOWOTA_SECTOR_CACHE_LEN; e++) {
+		if (e->valid && (e->addr == addr)) {
+			e->last_used = ++sector_cache_clock;
+			return e;
+		}
+
+		// Prefer an empty entry, otherwise the least recently used
+		if (!victim->valid) {
+			continue;
+		} else if (!e->valid || (e->last_used < victim->last_used)) {
+			victim = e;
+		}
+	}
+
+	sector_cache_writeback(victim);
+
+	victim->addr = addr;
+	victim->valid = true;
+	victim->dirty = false;
+	victim->last_used = ++sector_cache_clock;
+	memcpy(victim->data, flash_nocache(addr), FLASH_SECTOR_SIZE);
+
+	return victim;
+}
+
+void sector_cache_write(uint32_t addr, const uint8_t *data, uint32_t len)
+{
+	while (len) {
+		uint32_t sector = addr & ~(FLASH_SECTOR_SIZE - 1);
+		uint32_t offs = addr - sector;
+		uint32_t n = FLASH_SECTOR_SIZE - offs;
+		if (n > len) {
+			n = len;
+		}
+
+		struct sector_cache_entry *e = sector_cache_get(sector);
+		memcpy((uint8_t *)e->data + offs, data, n);
+		e->dirty = true;
+
+		addr += n;
+		data += n;
+		len -= n;
+	}
+}
+
+void sector_cache_flush(uint32_t addr, uint32_t size)
+{
+	struct sector_cache_entry *e;
+
+	for (e = sector_cache; e < sector_cache + PICOWOTA_SECTOR_CACHE_LEN; e++) {
+		if (overlaps(e, addr, size)) {
+			sector_cache_writeback(e);
+		}
+	}
+}
+
+void sector_cache_flush_all(void)
+{
+	struct sector_cache_entry *e;
+
+	for (e = sector_cache; e < sector_cache + PICOWOTA_SECTOR_CACHE_LEN; e++) {
+		if (e->valid) {
+			sector_cache_writeback(e);
+		}
+	}
+}
+
+void sector_cache_evict(uint32_t addr, uint32_t size)
+{
+	sector_cache_flush(addr, size);
+	sector_cache_discard(addr, size);
+}
+
+void sector_cache_discard(uint32_t addr, uint32_t size)
+{
+	struct sector_cache_entry *e;
+
+	for (e = sector_cache; e < sector_cache + PICOWOTA_SECTOR_CACHE_LEN; e++) {
+		if (overlaps(e, addr, size)) {
+			e->valid = false;
+			e->dirty = false;
+		}
+	}
+}
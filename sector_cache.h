@@ -0,0 +1,40 @@
+/**
+ * Copyright (c) 2022 Brian Starkey <stark3y@gmail.com>
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+#ifndef __SECTOR_CACHE_H__
+#define __SECTOR_CACHE_H__
+
+#include <stdint.h>
+
+/*
+ * Write-back cache of flash sectors, so that writes can be any size and
+ * alignment. Writes are merged with the existing flash contents in RAM, and
+ * each dirty sector is written back once, when it's evicted or flushed. If
+ * the new contents only clear bits, the sector is programmed without being
+ * erased, and pages which haven't changed aren't programmed at all.
+ *
+ * Addresses are XIP addresses, and the caller is responsible for checking
+ * they're somewhere which is OK to write.
+ */
+#ifndef PICOWOTA_SECTOR_CACHE_LEN
+#define PICOWOTA_SECTOR_CACHE_LEN 2
+#endif
+
+void sector_cache_write(uint32_t addr, const uint8_t *data, uint32_t len);
+
+// Write back any dirty sectors overlapping addr to addr + size, they stay
+// cached.
+void sector_cache_flush(uint32_t addr, uint32_t size);
+void sector_cache_flush_all(void);
+
+// Write back and forget any sectors overlapping addr to addr + size, for
+// when flash is about to be changed behind the cache's back.
+void sector_cache_evict(uint32_t addr, uint32_t size);
+
+// Forget any sectors overlapping addr to addr + size, without writing them
+// back (they're about to be erased).
+void sector_cache_discard(uint32_t addr, uint32_t size);
+
+#endif /* __SECTOR_CACHE_H__ */
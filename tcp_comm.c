@@ -6,14 +6,16 @@
  *
  * SPDX-License-Identifier: BSD-3-Clause
  */
-#include <stdlib.h>
+#include <string.h>
 
 #include "pico/cyw43_arch.h"
 
 #include "lwip/pbuf.h"
 #include "lwip/tcp.h"
 
+#include "pool.h"
 #include "tcp_comm.h"
+#include "trace.h"
 
 #ifdef DEBUG
 #include <stdio.h>
@@ -22,280 +24,229 @@
 #define DEBUG_printf(...) { }
 #endif
 
-#define POLL_TIME_S 5
+// Coarse TCP timer ticks (500 ms) between polls, which is also how often
+// the session timeouts are checked
+#define POLL_INTERVAL 2
 
-#define COMM_MAX_NARG     5
+// Keepalives start after the connection has been quiet for this long, so a
+// client which disappears without closing the connection is noticed even
+// when it's between commands
+#ifndef PICOWOTA_TCP_KEEPALIVE_S
+#define PICOWOTA_TCP_KEEPALIVE_S 5
+#endif
+#define KEEPALIVE_INTERVAL_MS 2000
+#define KEEPALIVE_COUNT       4
 
-enum conn_state {
-	CONN_STATE_WAIT_FOR_SYNC,
-	CONN_STATE_READ_OPCODE,
-	CONN_STATE_READ_ARGS,
-	CONN_STATE_READ_DATA,
-	CONN_STATE_HANDLE,
-	CONN_STATE_WRITE_RESP,
-	CONN_STATE_WRITE_ERROR,
-	CONN_STATE_CLOSED,
-};
+// Received data which hasn't been processed yet is kept in lwIP's pbufs, and
+// only acknowledged with tcp_recved() once it's been consumed, so the TCP
+// window throttles the sender while commands back up. If the chain gets
+// long (e.g. lots of small segments), it's copied out of the pbuf pool, so
+// that the driver can still receive ACKs.
+#define COMM_RX_MAX_PBUFS 4
 
-struct tcp_comm_ctx {
-	struct tcp_pcb *serv_pcb;
-	volatile bool serv_done;
-	enum conn_state conn_state;
+// The active client, and one more which can take over from it
+#define TCP_COMM_MAX_CLIENTS 2
 
-	struct tcp_pcb *client_pcb;
-	// Note: sizeof(buf) is used elsewhere, so if this is changed to not
-	// be an array, those will need updating
-	uint8_t buf[(sizeof(uint32_t) * (1 + COMM_MAX_NARG)) + TCP_COMM_MAX_DATA_LEN];
+struct tcp_comm_client {
+	struct tcp_comm_ctx *ctx;
 
-	uint16_t rx_start_offs;
-	uint16_t rx_bytes_received;
-	uint16_t rx_bytes_needed;
+	struct tcp_pcb *pcb;
+	struct pbuf *rx_pbuf;
+	uint16_t tx_bytes_unacked;
 
-	uint16_t tx_bytes_sent;
-	uint16_t tx_bytes_remaining;
+	struct comm_session *sess;
+};
 
-	uint32_t resp_data_len;
+struct tcp_comm_ctx {
+	struct tcp_pcb *serv_pcb;
+	volatile bool serv_done;
 
-	const struct comm_command *cmd;
-	const struct comm_command *const *cmds;
-	unsigned int n_cmds;
-	uint32_t sync_opcode;
+	struct tcp_comm_client clients[TCP_COMM_MAX_CLIENTS];
 };
 
-#define COMM_BUF_OPCODE(_buf)       ((uint32_t *)((uint8_t *)(_buf)))
-#define COMM_BUF_ARGS(_buf)         ((uint32_t *)((uint8_t *)(_buf) + sizeof(uint32_t)))
-#define COMM_BUF_BODY(_buf, _nargs) ((uint8_t *)(_buf) + (sizeof(uint32_t) * ((_nargs) + 1)))
+POOL_DEFINE(ctx_pool, "tcp_comm_ctx", sizeof(struct tcp_comm_ctx), 1);
 
-static const struct comm_command *find_command_desc(struct tcp_comm_ctx *ctx, uint32_t opcode)
+static uint32_t tcp_comm_read(void *priv, uint8_t *dst, uint32_t len)
 {
-	unsigned int i;
+	struct tcp_comm_client *client = (struct tcp_comm_client *)priv;
 
-	for (i = 0; i < ctx->n_cmds; i++) {
-		if (ctx->cmds[i]->opcode == opcode) {
-			return ctx->cmds[i];
-		}
+	if (!client->rx_pbuf) {
+		return 0;
 	}
 
-	return NULL;
-}
+	if (len > client->rx_pbuf->tot_len) {
+		len = client->rx_pbuf->tot_len;
+	}
 
-static bool is_error(uint32_t status)
-{
-	return status == TCP_COMM_RSP_ERR;
-}
+	if (pbuf_copy_partial(client->rx_pbuf, dst, len, 0) != len) {
+		DEBUG_printf("wrong copy len\n");
+		return 0;
+	}
 
-static int tcp_comm_sync_begin(struct tcp_comm_ctx *ctx);
-static int tcp_comm_sync_complete(struct tcp_comm_ctx *ctx);
-static int tcp_comm_opcode_begin(struct tcp_comm_ctx *ctx);
-static int tcp_comm_opcode_complete(struct tcp_comm_ctx *ctx);
-static int tcp_comm_args_begin(struct tcp_comm_ctx *ctx);
-static int tcp_comm_args_complete(struct tcp_comm_ctx *ctx);
-static int tcp_comm_data_begin(struct tcp_comm_ctx *ctx, uint32_t data_len);
-static int tcp_comm_data_complete(struct tcp_comm_ctx *ctx);
-static int tcp_comm_response_begin(struct tcp_comm_ctx *ctx);
-static int tcp_comm_response_complete(struct tcp_comm_ctx *ctx);
-static int tcp_comm_error_begin(struct tcp_comm_ctx *ctx);
-
-static int tcp_comm_sync_begin(struct tcp_comm_ctx *ctx)
-{
-	ctx->conn_state = CONN_STATE_WAIT_FOR_SYNC;
-	ctx->rx_bytes_needed = sizeof(uint32_t);
+	client->rx_pbuf = pbuf_free_header(client->rx_pbuf, len);
+	tcp_recved(client->pcb, len);
 
-	return 0;
+	return len;
 }
 
-static int tcp_comm_sync_complete(struct tcp_comm_ctx *ctx)
+// Writes are copied into lwIP's send buffer
+static int tcp_comm_write(void *priv, const uint8_t *src, uint32_t len)
 {
-	if (ctx->sync_opcode != *COMM_BUF_OPCODE(ctx->buf)) {
-		DEBUG_printf("sync not correct: %c%c%c%c\n", ctx->buf[0], ctx->buf[1], ctx->buf[2], ctx->buf[3]);
-		return tcp_comm_error_begin(ctx);
+	struct tcp_comm_client *client = (struct tcp_comm_client *)priv;
+
+	if (len > tcp_sndbuf(client->pcb)) {
+		len = tcp_sndbuf(client->pcb);
 	}
 
-	return tcp_comm_opcode_complete(ctx);
-}
+	if (len == 0) {
+		return 0;
+	}
 
-static int tcp_comm_opcode_begin(struct tcp_comm_ctx *ctx)
-{
-	ctx->conn_state = CONN_STATE_READ_OPCODE;
-	ctx->rx_bytes_needed = sizeof(uint32_t);
+	err_t err = tcp_write(client->pcb, src, len, TCP_WRITE_FLAG_COPY);
+	if (err == ERR_MEM) {
+		return 0;
+	} else if (err != ERR_OK) {
+		return -1;
+	}
 
-	return 0;
+	client->tx_bytes_unacked += len;
+
+	return len;
 }
 
-static int tcp_comm_opcode_complete(struct tcp_comm_ctx *ctx)
+static bool tcp_comm_tx_done(void *priv)
 {
-	ctx->cmd = find_command_desc(ctx, *COMM_BUF_OPCODE(ctx->buf));
-	if (!ctx->cmd) {
-		DEBUG_printf("no command for '%c%c%c%c'\n", ctx->buf[0], ctx->buf[1], ctx->buf[2], ctx->buf[3]);
-		return tcp_comm_error_begin(ctx);
-	} else {
-		DEBUG_printf("got command '%c%c%c%c'\n", ctx->buf[0], ctx->buf[1], ctx->buf[2], ctx->buf[3]);
-	}
+	struct tcp_comm_client *client = (struct tcp_comm_client *)priv;
 
-	return tcp_comm_args_begin(ctx);
+	return client->tx_bytes_unacked == 0;
 }
 
-static int tcp_comm_args_begin(struct tcp_comm_ctx *ctx)
-{
-	ctx->conn_state = CONN_STATE_READ_ARGS;
-	ctx->rx_bytes_needed = ctx->cmd->nargs * sizeof(uint32_t);
-
-	if (ctx->cmd->nargs == 0) {
-		return tcp_comm_args_complete(ctx);
-	}
+static int tcp_comm_takeover(void *priv);
 
-	return 0;
-}
+static const struct comm_transport_ops tcp_comm_ops = {
+	.read = tcp_comm_read,
+	.write = tcp_comm_write,
+	.tx_done = tcp_comm_tx_done,
+	.takeover = tcp_comm_takeover,
+};
 
-static int tcp_comm_args_complete(struct tcp_comm_ctx *ctx)
+static struct tcp_comm_client *tcp_comm_active_client(struct tcp_comm_ctx *ctx)
 {
-	const struct comm_command *cmd = ctx->cmd;
-
-	uint32_t data_len = 0;
+	int i;
 
-	if (cmd->size) {
-		uint32_t status = cmd->size(COMM_BUF_ARGS(ctx->buf),
-					    &data_len,
-					    &ctx->resp_data_len);
-		if (is_error(status)) {
-			return tcp_comm_error_begin(ctx);
+	for (i = 0; i < TCP_COMM_MAX_CLIENTS; i++) {
+		struct tcp_comm_client *client = &ctx->clients[i];
+		if (client->pcb && !comm_session_is_standby(client->sess)) {
+			return client;
 		}
 	}
 
-	return tcp_comm_data_begin(ctx, data_len);
+	return NULL;
 }
 
-static int tcp_comm_data_begin(struct tcp_comm_ctx *ctx, uint32_t data_len)
+// Called whenever a client goes away. If there's one waiting in standby, it
+// doesn't need to take over any more.
+static void tcp_comm_client_gone(struct tcp_comm_ctx *ctx)
 {
-	ctx->conn_state = CONN_STATE_READ_DATA;
-	ctx->rx_bytes_needed = data_len;
+	int i;
 
-	if (data_len == 0) {
-		return tcp_comm_data_complete(ctx);
+	if (tcp_comm_active_client(ctx)) {
+		return;
 	}
 
-	return 0;
-}
-
-static int tcp_comm_data_complete(struct tcp_comm_ctx *ctx)
-{
-	const struct comm_command *cmd = ctx->cmd;
-
-	if (cmd->handle) {
-		uint32_t status = cmd->handle(COMM_BUF_ARGS(ctx->buf),
-					      COMM_BUF_BODY(ctx->buf, cmd->nargs),
-					      COMM_BUF_ARGS(ctx->buf),
-					      COMM_BUF_BODY(ctx->buf, cmd->resp_nargs));
-		if (is_error(status)) {
-			return tcp_comm_error_begin(ctx);
+	for (i = 0; i < TCP_COMM_MAX_CLIENTS; i++) {
+		struct tcp_comm_client *client = &ctx->clients[i];
+		if (client->pcb) {
+			DEBUG_printf("standby client is now active\n");
+			comm_session_set_standby(client->sess, false);
+			return;
 		}
-
-		*COMM_BUF_OPCODE(ctx->buf) = status;
-	} else {
-		// TODO: Should we just assert(desc->handle)?
-		*COMM_BUF_OPCODE(ctx->buf) = TCP_COMM_RSP_OK;
 	}
 
-	return tcp_comm_response_begin(ctx);
+	cyw43_arch_gpio_put (0, false);
 }
 
-static int tcp_comm_response_begin(struct tcp_comm_ctx *ctx)
+// Stop listening to a client's pcb, without closing it
+static void tcp_comm_client_detach(struct tcp_comm_client *client)
 {
-	ctx->conn_state = CONN_STATE_WRITE_RESP;
-	ctx->tx_bytes_sent = 0;
-	ctx->tx_bytes_remaining = ctx->resp_data_len + ((ctx->cmd->resp_nargs + 1) * sizeof(uint32_t));
+	comm_session_close(client->sess);
 
-	err_t err = tcp_write(ctx->client_pcb, ctx->buf, ctx->tx_bytes_remaining, 0);
-	if (err != ERR_OK) {
-		return -1;
-	}
+	tcp_arg(client->pcb, NULL);
+	tcp_poll(client->pcb, NULL, 0);
+	tcp_sent(client->pcb, NULL);
+	tcp_recv(client->pcb, NULL);
+	tcp_err(client->pcb, NULL);
 
-	return 0;
+	if (client->rx_pbuf) {
+		pbuf_free(client->rx_pbuf);
+		client->rx_pbuf = NULL;
+	}
 }
 
-static int tcp_comm_error_begin(struct tcp_comm_ctx *ctx)
+static err_t tcp_comm_client_close(struct tcp_comm_client *client)
 {
-	ctx->conn_state = CONN_STATE_WRITE_ERROR;
-	ctx->tx_bytes_sent = 0;
-	ctx->tx_bytes_remaining = sizeof(uint32_t);
+	err_t err = ERR_OK;
 
-	*COMM_BUF_OPCODE(ctx->buf) = TCP_COMM_RSP_ERR;
+	if (!client->pcb) {
+		return err;
+	}
 
-	err_t err = tcp_write(ctx->client_pcb, ctx->buf, ctx->tx_bytes_remaining, 0);
+	tcp_comm_client_detach(client);
+
+	err = tcp_close(client->pcb);
 	if (err != ERR_OK) {
-		return -1;
+		DEBUG_printf("close failed %d, calling abort\n", err);
+		tcp_abort(client->pcb);
+		err = ERR_ABRT;
 	}
 
-	return 0;
-}
-
+	client->pcb = NULL;
+	tcp_comm_client_gone(client->ctx);
 
-static int tcp_comm_response_complete(struct tcp_comm_ctx *ctx)
-{
-	return tcp_comm_opcode_begin(ctx);
+	return err;
 }
 
-static int tcp_comm_rx_complete(struct tcp_comm_ctx *ctx)
+// For clients which have stopped responding, so that the pcb doesn't hang
+// around retransmitting to nobody
+static err_t tcp_comm_client_abort(struct tcp_comm_client *client)
 {
-	switch (ctx->conn_state) {
-	case CONN_STATE_WAIT_FOR_SYNC:
-		return tcp_comm_sync_complete(ctx);
-	case CONN_STATE_READ_OPCODE:
-		return tcp_comm_opcode_complete(ctx);
-	case CONN_STATE_READ_ARGS:
-		return tcp_comm_args_complete(ctx);
-	case CONN_STATE_READ_DATA:
-		return tcp_comm_data_complete(ctx);
-	default:
-		return -1;
+	if (!client->pcb) {
+		return ERR_OK;
 	}
-}
 
-static int tcp_comm_tx_complete(struct tcp_comm_ctx *ctx)
-{
-	switch (ctx->conn_state) {
-	case CONN_STATE_WRITE_RESP:
-		return tcp_comm_response_complete(ctx);
-	case CONN_STATE_WRITE_ERROR:
-		return -1;
-	default:
-		return -1;
-	}
-}
+	tcp_comm_client_detach(client);
+	tcp_abort(client->pcb);
 
-static err_t tcp_comm_client_close(struct tcp_comm_ctx *ctx)
-{
-	err_t err = ERR_OK;
+	client->pcb = NULL;
+	tcp_comm_client_gone(client->ctx);
 
-	cyw43_arch_gpio_put (0, false);
-	ctx->conn_state = CONN_STATE_CLOSED;
+	return ERR_ABRT;
+}
 
-	if (!ctx->client_pcb) {
-		return err;
-	}
+static int tcp_comm_takeover(void *priv)
+{
+	struct tcp_comm_client *client = (struct tcp_comm_client *)priv;
+	struct tcp_comm_client *active = tcp_comm_active_client(client->ctx);
 
-	tcp_arg(ctx->client_pcb, NULL);
-	tcp_poll(ctx->client_pcb, NULL, 0);
-	tcp_sent(ctx->client_pcb, NULL);
-	tcp_recv(ctx->client_pcb, NULL);
-	tcp_err(ctx->client_pcb, NULL);
-	err = tcp_close(ctx->client_pcb);
-	if (err != ERR_OK) {
-		DEBUG_printf("close failed %d, calling abort\n", err);
-		tcp_abort(ctx->client_pcb);
-		err = ERR_ABRT;
+	if (active) {
+		DEBUG_printf("dropping client for takeover\n");
+		tcp_comm_client_abort(active);
 	}
 
-	ctx->client_pcb = NULL;
-
-	return err;
+	return 0;
 }
 
 err_t tcp_comm_server_close(struct tcp_comm_ctx *ctx)
 {
 	err_t err = ERR_OK;
+	int i;
+
+	for (i = 0; i < TCP_COMM_MAX_CLIENTS; i++) {
+		if (tcp_comm_client_close(&ctx->clients[i]) != ERR_OK) {
+			err = ERR_ABRT;
+		}
+	}
 
-	err = tcp_comm_client_close(ctx);
 	if ((err != ERR_OK) && ctx->serv_pcb) {
 		tcp_arg(ctx->serv_pcb, NULL);
 		tcp_abort(ctx->serv_pcb);
@@ -333,144 +284,147 @@ static void tcp_comm_server_complete(void *arg, int status)
 
 static err_t tcp_comm_client_complete(void *arg, int status)
 {
-	struct tcp_comm_ctx *ctx = (struct tcp_comm_ctx *)arg;
+	struct tcp_comm_client *client = (struct tcp_comm_client *)arg;
 	if (status == 0) {
 		DEBUG_printf("conn completed normally\n");
 	} else {
 		DEBUG_printf("conn error %d\n", status);
 	}
-	return tcp_comm_client_close(ctx);
+	return tcp_comm_client_close(client);
+}
+
+// Let the session make progress, and flush out anything it sent
+static err_t tcp_comm_client_process(struct tcp_comm_client *client)
+{
+	int res = comm_session_process(client->sess);
+	if (res == COMM_SESSION_TIMED_OUT) {
+		return tcp_comm_client_abort(client);
+	} else if (res) {
+		return tcp_comm_client_complete(client, ERR_ARG);
+	}
+
+	// Flush any responses straight away, rather than waiting for lwIP to
+	// get around to it
+	tcp_output(client->pcb);
+
+	return ERR_OK;
 }
 
 static err_t tcp_comm_client_sent(void *arg, struct tcp_pcb *tpcb, u16_t len)
 {
-	struct tcp_comm_ctx *ctx = (struct tcp_comm_ctx *)arg;
+	struct tcp_comm_client *client = (struct tcp_comm_client *)arg;
 	DEBUG_printf("tcp_comm_server_sent %u\n", len);
 
 	cyw43_arch_lwip_check();
-	if (len > ctx->tx_bytes_remaining) {
-		DEBUG_printf("tx len %d > remaining %d\n", len, ctx->tx_bytes_remaining);
-		return tcp_comm_client_complete(ctx, ERR_ARG);
+	if (len > client->tx_bytes_unacked) {
+		DEBUG_printf("tx len %d > unacked %d\n", len, client->tx_bytes_unacked);
+		return tcp_comm_client_complete(client, ERR_ARG);
 	}
 
-	ctx->tx_bytes_remaining -= len;
-	ctx->tx_bytes_sent += len;
+	client->tx_bytes_unacked -= len;
+	trace_event(TRACE_SENT, 0, len);
 
-	if (ctx->tx_bytes_remaining == 0) {
-		int res = tcp_comm_tx_complete(ctx);
-		if (res) {
-			return tcp_comm_client_complete(ctx, ERR_ARG);
-		}
-	}
-
-	return ERR_OK;
+	return tcp_comm_client_process(client);
 }
 
 static err_t tcp_comm_client_recv(void *arg, struct tcp_pcb *tpcb, struct pbuf *p, err_t err)
 {
-	struct tcp_comm_ctx *ctx = (struct tcp_comm_ctx *)arg;
+	struct tcp_comm_client *client = (struct tcp_comm_client *)arg;
 	if (!p) {
 		DEBUG_printf("no pbuf\n");
-		return tcp_comm_client_complete(ctx, 0);
+		return tcp_comm_client_complete(client, 0);
 	}
 
 	// this method is callback from lwIP, so cyw43_arch_lwip_begin is not required, however you
 	// can use this method to cause an assertion in debug mode, if this method is called when
 	// cyw43_arch_lwip_begin IS needed
 	cyw43_arch_lwip_check();
-	if (p->tot_len > 0) {
-		DEBUG_printf("tcp_comm_server_recv %d err %d\n", p->tot_len, err);
-
-		if (p->tot_len > (sizeof(ctx->buf) - ctx->rx_bytes_received)) {
-			// Doesn't fit in buffer at all. Protocol error.
-			DEBUG_printf("not enough space in buffer: %d vs %d\n", p->tot_len, sizeof(ctx->buf) - ctx->rx_bytes_received);
-
-			// TODO: Invoking the error response state here feels
-			// like a bit of a layering violation, but this is a
-			// protocol error, rather than a failure in the stack
-			// somewhere, so it's nice to try and report it rather
-			// than just dropping the connection.
-			if (tcp_comm_error_begin(ctx)) {
-				return tcp_comm_client_complete(ctx, ERR_ARG);
-			}
-			return ERR_OK;
-		} else if (p->tot_len > (sizeof(ctx->buf) - (ctx->rx_start_offs + ctx->rx_bytes_received))) {
-			// There will be space, but we need to shift the data back
-			// to the start of the buffer
-			DEBUG_printf("memmove %d bytes to make space for %d bytes\n", ctx->rx_bytes_received, p->tot_len);
-			memmove(ctx->buf, ctx->buf + ctx->rx_start_offs, ctx->rx_bytes_received);
-			ctx->rx_start_offs = 0;
-		}
-
-		uint8_t *dst = ctx->buf + ctx->rx_start_offs + ctx->rx_bytes_received;
-
-		// We can always handle the full packet
-		if (pbuf_copy_partial(p, dst, p->tot_len, 0) != p->tot_len) {
-			DEBUG_printf("wrong copy len\n");
-			return tcp_comm_client_complete(ctx, ERR_ARG);
-		}
-
-		ctx->rx_bytes_received += p->tot_len;
-		tcp_recved(tpcb, p->tot_len);
+	if (p->tot_len == 0) {
+		pbuf_free(p);
+		return ERR_OK;
+	}
 
-		while (ctx->rx_bytes_received >= ctx->rx_bytes_needed) {
-			uint16_t consumed = ctx->rx_bytes_needed;
+	DEBUG_printf("tcp_comm_server_recv %d err %d\n", p->tot_len, err);
 
-			int res = tcp_comm_rx_complete(ctx);
-			if (res) {
-				return tcp_comm_client_complete(ctx, ERR_ARG);
-			}
+	if (client->rx_pbuf) {
+		pbuf_cat(client->rx_pbuf, p);
+	} else {
+		client->rx_pbuf = p;
+	}
 
-			ctx->rx_start_offs += consumed;
-			ctx->rx_bytes_received -= consumed;
+	trace_event(TRACE_RECV, pbuf_clen(client->rx_pbuf), p->tot_len);
 
-			if (ctx->rx_bytes_received == 0) {
-				ctx->rx_start_offs = 0;
-				break;
-			}
+	if (pbuf_clen(client->rx_pbuf) > COMM_RX_MAX_PBUFS) {
+		trace_event(TRACE_RX_COALESCE, 0, client->rx_pbuf->tot_len);
+		struct pbuf *q = pbuf_clone(PBUF_RAW, PBUF_RAM, client->rx_pbuf);
+		if (q) {
+			pbuf_free(client->rx_pbuf);
+			client->rx_pbuf = q;
 		}
 	}
-	pbuf_free(p);
 
-	return ERR_OK;
+	return tcp_comm_client_process(client);
 }
 
 static err_t tcp_comm_client_poll(void *arg, struct tcp_pcb *tpcb)
 {
+	struct tcp_comm_client *client = (struct tcp_comm_client *)arg;
+
 	DEBUG_printf("tcp_comm_server_poll_fn\n");
-	return ERR_OK;
+
+	// A response can be held up by a full segment queue (ERR_MEM) with
+	// nothing in flight, so there's no sent callback to retry it. This is
+	// also where a client which has gone quiet gets timed out.
+	return tcp_comm_client_process(client);
 }
 
 static void tcp_comm_client_err(void *arg, err_t err)
 {
-	struct tcp_comm_ctx *ctx = (struct tcp_comm_ctx *)arg;
+	struct tcp_comm_client *client = (struct tcp_comm_client *)arg;
 
 	DEBUG_printf("tcp_comm_err %d\n", err);
 
-	ctx->client_pcb = NULL;
-	ctx->conn_state = CONN_STATE_CLOSED;
-	ctx->rx_bytes_needed = 0;
-	cyw43_arch_gpio_put (0, false);
+	// The pcb has already been freed
+	client->pcb = NULL;
+	comm_session_close(client->sess);
+
+	if (client->rx_pbuf) {
+		pbuf_free(client->rx_pbuf);
+		client->rx_pbuf = NULL;
+	}
+
+	tcp_comm_client_gone(client->ctx);
 }
 
-static void tcp_comm_client_init(struct tcp_comm_ctx *ctx, struct tcp_pcb *pcb)
+static void tcp_comm_client_init(struct tcp_comm_client *client, struct tcp_pcb *pcb, bool standby)
 {
-	ctx->client_pcb = pcb;
-	tcp_arg(pcb, ctx);
+	client->pcb = pcb;
+	client->tx_bytes_unacked = 0;
+	tcp_arg(pcb, client);
+
+	// Responses are flushed explicitly, don't hold them back
+	tcp_nagle_disable(pcb);
+
+	ip_set_option(pcb, SOF_KEEPALIVE);
+	pcb->keep_idle = PICOWOTA_TCP_KEEPALIVE_S * 1000;
+	pcb->keep_intvl = KEEPALIVE_INTERVAL_MS;
+	pcb->keep_cnt = KEEPALIVE_COUNT;
 
 	cyw43_arch_gpio_put (0, true);
 
-	tcp_comm_sync_begin(ctx);
+	comm_session_open(client->sess);
+	comm_session_set_standby(client->sess, standby);
 
 	tcp_sent(pcb, tcp_comm_client_sent);
 	tcp_recv(pcb, tcp_comm_client_recv);
-	tcp_poll(pcb, tcp_comm_client_poll, POLL_TIME_S * 2);
+	tcp_poll(pcb, tcp_comm_client_poll, POLL_INTERVAL);
 	tcp_err(pcb, tcp_comm_client_err);
 }
 
 static err_t tcp_comm_server_accept(void *arg, struct tcp_pcb *client_pcb, err_t err)
 {
 	struct tcp_comm_ctx *ctx = (struct tcp_comm_ctx *)arg;
+	int i;
 
 	if (err != ERR_OK || client_pcb == NULL) {
 		DEBUG_printf("Failure in accept\n");
@@ -479,15 +433,22 @@ static err_t tcp_comm_server_accept(void *arg, struct tcp_pcb *client_pcb, err_t
 	}
 	DEBUG_printf("Connection opened\n");
 
-	if (ctx->client_pcb) {
-		DEBUG_printf("Already have a connection\n");
-		tcp_abort(client_pcb);
-		return ERR_ABRT;
+	for (i = 0; i < TCP_COMM_MAX_CLIENTS; i++) {
+		struct tcp_comm_client *client = &ctx->clients[i];
+		if (!client->pcb) {
+			// If someone else is connected, this one has to take
+			// over before it can do anything
+			bool standby = tcp_comm_active_client(ctx) != NULL;
+			DEBUG_printf("client %d%s\n", i, standby ? " in standby" : "");
+			tcp_comm_client_init(client, client_pcb, standby);
+			return ERR_OK;
+		}
 	}
 
-	tcp_comm_client_init(ctx, client_pcb);
+	DEBUG_printf("Already have a connection\n");
+	tcp_abort(client_pcb);
 
-	return ERR_OK;
+	return ERR_ABRT;
 }
 
 err_t tcp_comm_listen(struct tcp_comm_ctx *ctx, uint16_t port)
@@ -521,34 +482,67 @@ err_t tcp_comm_listen(struct tcp_comm_ctx *ctx, uint16_t port)
 	return ERR_OK;
 }
 
-struct tcp_comm_ctx *tcp_comm_new(const struct comm_command *const *cmds,
-		unsigned int n_cmds, uint32_t sync_opcode)
+struct tcp_comm_ctx *tcp_comm_new(const struct comm_table *table)
 {
-	struct tcp_comm_ctx *ctx = calloc(1, sizeof(struct tcp_comm_ctx));
+	struct tcp_comm_ctx *ctx = pool_alloc(&ctx_pool);
 	if (!ctx) {
 		return NULL;
 	}
+	memset(ctx, 0, sizeof(*ctx));
 
-	unsigned int i;
-	for (i = 0; i < n_cmds; i++) {
-		assert(cmds[i]->nargs <= COMM_MAX_NARG);
-		assert(cmds[i]->resp_nargs <= COMM_MAX_NARG);
-	}
+	int i;
+	for (i = 0; i < TCP_COMM_MAX_CLIENTS; i++) {
+		struct tcp_comm_client *client = &ctx->clients[i];
 
-	ctx->cmds = cmds;
-	ctx->n_cmds = n_cmds;
-	ctx->sync_opcode = sync_opcode;
+		client->ctx = ctx;
+		client->sess = comm_session_new(table, &tcp_comm_ops, client);
+		if (!client->sess) {
+			tcp_comm_delete(ctx);
+			return NULL;
+		}
+
+		comm_session_set_timeouts(client->sess, PICOWOTA_IDLE_TIMEOUT_S * 1000,
+					  PICOWOTA_PROGRESS_TIMEOUT_S * 1000);
+	}
 
 	return ctx;
 }
 
 void tcp_comm_delete(struct tcp_comm_ctx *ctx)
 {
+	int i;
+
 	tcp_comm_server_close(ctx);
-	free(ctx);
+
+	for (i = 0; i < TCP_COMM_MAX_CLIENTS; i++) {
+		if (ctx->clients[i].sess) {
+			comm_session_delete(ctx->clients[i].sess);
+		}
+	}
+
+	pool_free(&ctx_pool, ctx);
 }
 
 bool tcp_comm_server_done(struct tcp_comm_ctx *ctx)
 {
 	return ctx->serv_done;
 }
+
+bool tcp_comm_client_connected(struct tcp_comm_ctx *ctx)
+{
+	return tcp_comm_active_client(ctx) != NULL;
+}
+
+void tcp_comm_resume(struct tcp_comm_ctx *ctx)
+{
+	int i;
+
+	cyw43_arch_lwip_begin();
+	for (i = 0; i < TCP_COMM_MAX_CLIENTS; i++) {
+		struct tcp_comm_client *client = &ctx->clients[i];
+		if (client->pcb) {
+			tcp_comm_client_process(client);
+		}
+	}
+	cyw43_arch_lwip_end();
+}
@@ -0,0 +1,264 @@
+#!/usr/bin/env python3
+# Copyright (c) 2022 Brian Starkey <stark3y@gmail.com>
+#
+# SPDX-License-Identifier: BSD-3-Clause
+#
+# Load test for the AP mode DHCP server. Pretends to be lots of clients (one
+# made-up MAC each), all doing DISCOVER/REQUEST at once, and checks that:
+#  - everyone gets an OFFER and an ACK, up to the size of the pool
+#  - no address is handed out twice
+#  - a client which is already bound gets its own address offered back
+#  - clients past the end of the pool are ignored, not given someone's address
+#  - (with --hold) a bound lease outlives the OFFER hold, even after the
+#    client has sent another DISCOVER
+#
+# Run it from a machine joined to the bootloader's AP. The server replies by
+# broadcast to port 68, so this needs to be able to bind that (usually root),
+# and the machine's own DHCP client sees the replies too, which is harmless.
+
+import argparse
+import random
+import select
+import socket
+import statistics
+import struct
+import sys
+import time
+
+DHCP_SERVER_PORT = 67
+DHCP_CLIENT_PORT = 68
+DHCP_MAGIC = b"\x63\x82\x53\x63"
+
+DHCPDISCOVER = 1
+DHCPOFFER = 2
+DHCPREQUEST = 3
+DHCPACK = 5
+DHCPNAK = 6
+DHCPRELEASE = 7
+
+OPT_REQUESTED_IP = 50
+OPT_MSG_TYPE = 53
+OPT_SERVER_ID = 54
+OPT_END = 255
+
+# The bootloader's server hands out 192.168.4.16 onwards, held for 120 s on
+# OFFER
+OFFER_HOLD_S = 120
+
+class Client:
+    def __init__(self, index, prefix):
+        self.mac = bytes([0x02, prefix, 0, 0, index >> 8, index & 0xff])
+        self.xid = random.getrandbits(32)
+        self.offered = None
+        self.server = None
+        self.bound = None
+        self.sent_at = 0.0
+        self.latency = None
+
+    def __str__(self):
+        return ":".join("{:02x}".format(b) for b in self.mac)
+
+def build(client, msg_type, requested=None, server=None, ciaddr=None):
+    msg = struct.pack("!BBBBIHH4s4s4s4s16s64s128s",
+                      1, 1, 6, 0, client.xid, 0, 0x8000,
+                      socket.inet_aton(ciaddr or "0.0.0.0"),
+                      bytes(4), bytes(4), bytes(4),
+                      client.mac, bytes(64), bytes(128))
+    opts = DHCP_MAGIC + bytes([OPT_MSG_TYPE, 1, msg_type])
+    if requested:
+        opts += bytes([OPT_REQUESTED_IP, 4]) + socket.inet_aton(requested)
+    if server:
+        opts += bytes([OPT_SERVER_ID, 4]) + socket.inet_aton(server)
+    opts += bytes([OPT_END])
+
+    return msg + opts
+
+def parse(data):
+    if len(data) < 240 or data[236:240] != DHCP_MAGIC:
+        return None
+
+    xid = struct.unpack("!I", data[4:8])[0]
+    yiaddr = socket.inet_ntoa(data[16:20])
+    mac = data[28:34]
+
+    msg_type = None
+    server = None
+    i = 240
+    while i < len(data) and data[i] != OPT_END:
+        if data[i] == 0:
+            i += 1
+            continue
+        if i + 2 > len(data):
+            break
+        code, length = data[i], data[i + 1]
+        val = data[i + 2:i + 2 + length]
+        if code == OPT_MSG_TYPE and length == 1:
+            msg_type = val[0]
+        elif code == OPT_SERVER_ID and length == 4:
+            server = socket.inet_ntoa(val)
+        i += 2 + length
+
+    return (mac, xid, msg_type, yiaddr, server)
+
+def open_socket(interface):
+    sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    sock.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+    sock.setsockopt(socket.SOL_SOCKET, socket.SO_BROADCAST, 1)
+    if interface:
+        sock.setsockopt(socket.SOL_SOCKET, socket.SO_BINDTODEVICE, interface.encode())
+    sock.bind(("", DHCP_CLIENT_PORT))
+    sock.setblocking(False)
+
+    return sock
+
+# Send one message per client, paced at rate per second, and collect the
+# replies for them. Returns {client: (msg_type, yiaddr, server)}.
+def exchange(sock, dest, clients, make, rate, timeout):
+    by_key = { (c.mac, c.xid): c for c in clients }
+    replies = {}
+    interval = 1.0 / rate if rate else 0
+    pending = list(clients)
+    next_send = time.monotonic()
+    deadline = None
+
+    while True:
+        now = time.monotonic()
+        if pending and now >= next_send:
+            c = pending.pop(0)
+            c.sent_at = now
+            sock.sendto(make(c), (dest, DHCP_SERVER_PORT))
+            next_send = now + interval
+            if not pending:
+                deadline = now + timeout
+            continue
+
+        if deadline and (now >= deadline or len(replies) == len(clients)):
+            break
+
+        wait = (next_send - now) if pending else (deadline - now)
+        r, _, _ = select.select([sock], [], [], max(wait, 0))
+        if not r:
+            continue
+
+        data, _ = sock.recvfrom(1024)
+        msg = parse(data)
+        if not msg:
+            continue
+        mac, xid, msg_type, yiaddr, server = msg
+        c = by_key.get((mac, xid))
+        if c is None or c in replies or msg_type not in (DHCPOFFER, DHCPACK, DHCPNAK):
+            continue
+        c.latency = time.monotonic() - c.sent_at
+        replies[c] = (msg_type, yiaddr, server)
+
+    return replies
+
+def report(name, clients, replies, elapsed):
+    lat = [c.latency * 1000 for c in clients if c in replies]
+    if lat:
+        print("{}: {}/{} replies in {:.2f} s, latency ms: median {:.1f}, max {:.1f}".format(
+            name, len(replies), len(clients), elapsed, statistics.median(lat), max(lat)))
+    else:
+        print("{}: no replies from {} clients".format(name, len(clients)))
+
+def phase(sock, name, clients, make, args):
+    start = time.monotonic()
+    replies = exchange(sock, args.server, clients, make, args.rate, args.timeout)
+    report(name, clients, replies, time.monotonic() - start)
+
+    return replies
+
+def main():
+    parser = argparse.ArgumentParser()
+    parser.add_argument("-n", "--clients", help="Number of clients (default: the pool size)",
+                        type=int, default=0)
+    parser.add_argument("-P", "--pool", help="Lease pool size (PICOWOTA_DHCPS_MAX_IP)",
+                        type=int, default=8)
+    parser.add_argument("-i", "--interface", help="Network interface joined to the AP")
+    parser.add_argument("-s", "--server", help="Address to send to (default: broadcast)",
+                        default="255.255.255.255")
+    parser.add_argument("-r", "--rate", help="Messages per second (0 for as fast as possible)",
+                        type=float, default=0)
+    parser.add_argument("-t", "--timeout", help="Seconds to wait for replies after the last send",
+                        type=float, default=2.0)
+    parser.add_argument("--hold", help="Also wait out the OFFER hold, and check bound leases survive it",
+                        action="store_true")
+    args = parser.parse_args()
+
+    n = args.clients or args.pool
+    # A random second byte keeps separate runs from looking like the same
+    # clients
+    prefix = random.getrandbits(8)
+    clients = [Client(i, prefix) for i in range(n)]
+    errors = []
+
+    sock = open_socket(args.interface)
+
+    # All of them at once: the first n (up to the pool) get distinct offers
+    replies = phase(sock, "DISCOVER", clients, lambda c: build(c, DHCPDISCOVER), args)
+    offered = {}
+    for c, (msg_type, yiaddr, server) in replies.items():
+        if msg_type != DHCPOFFER:
+            errors.append("{}: DISCOVER got message type {}".format(c, msg_type))
+            continue
+        if yiaddr in offered:
+            errors.append("{}: offered {}, already offered to {}".format(c, yiaddr, offered[yiaddr]))
+        offered[yiaddr] = c
+        c.offered = yiaddr
+        c.server = server
+
+    expected = min(n, args.pool)
+    if len(offered) < expected:
+        errors.append("only {} offers for {} clients and {} addresses".format(len(offered), n, args.pool))
+    elif len(replies) > args.pool:
+        errors.append("{} offers from a pool of {}".format(len(replies), args.pool))
+
+    # Take up the offers
+    takers = [c for c in clients if c.offered]
+    replies = phase(sock, "REQUEST", takers,
+                    lambda c: build(c, DHCPREQUEST, requested=c.offered, server=c.server), args)
+    for c in takers:
+        msg_type, yiaddr, _ = replies.get(c, (None, None, None))
+        if msg_type != DHCPACK:
+            errors.append("{}: REQUEST for {} got {}".format(c, c.offered, msg_type))
+        elif yiaddr != c.offered:
+            errors.append("{}: ACKed {}, offered {}".format(c, yiaddr, c.offered))
+        else:
+            c.bound = yiaddr
+
+    # Bound clients which DISCOVER again get their own address back
+    bound = [c for c in clients if c.bound]
+    for c in bound:
+        c.xid = random.getrandbits(32)
+    replies = phase(sock, "re-DISCOVER", bound, lambda c: build(c, DHCPDISCOVER), args)
+    for c in bound:
+        msg_type, yiaddr, _ = replies.get(c, (None, None, None))
+        if msg_type != DHCPOFFER or yiaddr != c.bound:
+            errors.append("{}: bound to {}, re-DISCOVER got {} {}".format(c, c.bound, msg_type, yiaddr))
+
+    # A full pool ignores newcomers rather than handing out a bound address
+    strangers = [Client(0x8000 + i, prefix) for i in range(4)]
+    if args.hold:
+        print("Waiting {} s for the OFFER hold to run out...".format(OFFER_HOLD_S + 70))
+        time.sleep(OFFER_HOLD_S + 70)
+    replies = phase(sock, "stranger DISCOVER", strangers, lambda c: build(c, DHCPDISCOVER), args)
+    taken = { c.bound: c for c in bound }
+    for c, (msg_type, yiaddr, _) in replies.items():
+        if yiaddr in taken:
+            errors.append("{}: offered {}, which is bound to {}".format(c, yiaddr, taken[yiaddr]))
+
+    # Tidy up, so that the next run starts with an empty pool
+    for c in bound + [c for c in strangers if c in replies]:
+        addr = c.bound or replies[c][1]
+        sock.sendto(build(c, DHCPRELEASE, server=c.server or replies[c][2], ciaddr=addr),
+                    (args.server, DHCP_SERVER_PORT))
+
+    for e in errors:
+        print("FAIL:", e)
+    if errors:
+        sys.exit(1)
+
+    print("OK")
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,339 @@
+#!/usr/bin/env python3
+# Copyright (c) 2022 Brian Starkey <stark3y@gmail.com>
+#
+# SPDX-License-Identifier: BSD-3-Clause
+#
+# Checks the client's sparse uploads without a device: sparse_extents() on
+# its own, then whole uploads against a fake device which speaks just enough
+# of the protocol (SYNC, INFO, ERAS, WRIT, CRCC, SEAL and BTCH, with or
+# without FILL). Checks that:
+#  - the extents cover the image exactly, and put it back together
+#  - the BTCH zero-length FILL probe tells the two kinds of device apart,
+#    and leaves the stream in step either way, reconnecting after a device
+#    without FILL has closed the connection
+#  - repeated-word runs are sent as FILLs only when the device has FILL
+#  - the flash ends up holding the image, either way
+#
+# Run it with no arguments. It exits non-zero on the first failure.
+
+import argparse
+import asyncio
+import collections
+import os
+import random
+import struct
+import sys
+import zlib
+
+sys.path.insert(0, os.path.join(os.path.dirname(os.path.abspath(__file__)), ".."))
+
+from picowota_client import (Client, Image, sparse_extents,
+                             CMD_SYNC, RSP_SYNC, CMD_INFO, CMD_ERASE, CMD_WRITE,
+                             CMD_CRC, CMD_SEAL, CMD_BATCH, CMD_FILL, RSP_OK, RSP_ERR)
+
+FLASH_START = 0x10060000
+FLASH_SIZE = 512 * 1024
+ERASE_SIZE = 4096
+WRITE_SIZE = 256
+MAX_DATA_LEN = 1024
+
+def crc32(data):
+    return zlib.crc32(data) & 0xffffffff
+
+class FakeDevice:
+    """
+    The device end of the protocol, as far as an upload needs. Commands are
+    (nargs, resp_nargs, which arg is the data length, handler), like the
+    descriptors in main.c. Batches are checked up front, like comm_batch_complete(): one
+    with an unknown command gets a bare ERR!. Like comm.c, an unknown command
+    or batch gets ERR! and then the connection is closed, but the flash is
+    kept for the next one (see open()).
+    """
+    def __init__(self, fill=True):
+        self.reader = None
+        self.rx = bytearray()
+        self.closed = True
+        self.connections = 0
+        self.flash = bytearray(b"\xff" * FLASH_SIZE)
+        self.sent = collections.Counter()
+        # FILLs which wrote something (not probes)
+        self.fills = 0
+        self.commands = {
+            CMD_SYNC: (0, 0, None, self.sync),
+            CMD_INFO: (0, 5, None, self.info),
+            CMD_ERASE: (2, 0, None, self.erase),
+            CMD_WRITE: (2, 1, 1, self.write),
+            CMD_CRC: (2, 1, None, self.crc),
+            CMD_SEAL: (3, 0, None, self.seal),
+            CMD_BATCH: (1, 1, 0, None),
+        }
+        if fill:
+            self.commands[CMD_FILL] = (3, 1, None, self.fill)
+        self.sealed = None
+
+    # A new connection, like asyncio.open_connection()
+    async def open(self, host, port):
+        self.reader = asyncio.StreamReader()
+        self.rx.clear()
+        self.closed = False
+        self.connections += 1
+        return self.reader, FakeWriter(self)
+
+    def offs(self, addr, size):
+        if addr < FLASH_START or addr + size > FLASH_START + FLASH_SIZE:
+            raise ValueError("{:#x} + {} is outside flash".format(addr, size))
+        return addr - FLASH_START
+
+    def sync(self, args, data):
+        return RSP_SYNC, ()
+
+    def info(self, args, data):
+        return RSP_OK, (FLASH_START, FLASH_SIZE, ERASE_SIZE, WRITE_SIZE, MAX_DATA_LEN)
+
+    def erase(self, args, data):
+        o = self.offs(*args)
+        self.flash[o:o + args[1]] = b"\xff" * args[1]
+        return RSP_OK, ()
+
+    def program(self, addr, data):
+        # Programming can only clear bits
+        o = self.offs(addr, len(data))
+        self.flash[o:o + len(data)] = bytes(a & b for a, b in zip(self.flash[o:o + len(data)], data))
+        return RSP_OK, (crc32(self.flash[o:o + len(data)]),)
+
+    def write(self, args, data):
+        return self.program(args[0], data)
+
+    def fill(self, args, data):
+        if not args[1]:
+            return RSP_OK, (0,)
+        self.fills += 1
+        return self.program(args[0], struct.pack("<I", args[2]) * (args[1] // 4))
+
+    def crc(self, args, data):
+        o = self.offs(*args)
+        return RSP_OK, (crc32(self.flash[o:o + args[1]]),)
+
+    def seal(self, args, data):
+        addr, size, crc = args
+        o = self.offs(addr, size)
+        if crc32(self.flash[o:o + size]) != crc:
+            return RSP_ERR, ()
+        self.sealed = (addr, size, crc)
+        return RSP_OK, ()
+
+    # Parse one command frame from buf at offs: (op, args, data, next offs),
+    # or None if there isn't a whole one there
+    def parse(self, buf, offs, in_batch=False):
+        if len(buf) < offs + 4:
+            return None
+        op, = struct.unpack_from("<I", buf, offs)
+        if op not in self.commands or (in_batch and op == CMD_BATCH):
+            raise KeyError(op)
+        nargs, _, data_arg, _ = self.commands[op]
+        if len(buf) < offs + 4 + 4 * nargs:
+            return None
+        args = struct.unpack_from("<{}I".format(nargs), buf, offs + 4)
+        data_len = args[data_arg] if data_arg is not None else 0
+        end = offs + 4 + 4 * nargs + data_len
+        if len(buf) < end:
+            return None
+        return op, args, bytes(buf[end - data_len:end]), end
+
+    def batch(self, body):
+        items = []
+        offs = 0
+        try:
+            while offs < len(body):
+                item = self.parse(body, offs, in_batch=True)
+                if item is None:
+                    raise KeyError(None)
+                items.append(item)
+                offs = item[3]
+        except KeyError:
+            return None
+
+        rsp = b""
+        n_run = 0
+        for op, args, data, _ in items:
+            self.sent[op] += 1
+            status, rsp_args = self.commands[op][3](args, data)
+            n_run += 1
+            rsp += struct.pack("<I", status)
+            if status != RSP_OK:
+                break
+            rsp += struct.pack("<{}I".format(len(rsp_args)), *rsp_args)
+
+        return struct.pack("<II", RSP_OK, n_run) + rsp
+
+    def error(self):
+        self.reader.feed_data(struct.pack("<I", RSP_ERR))
+        self.reader.feed_eof()
+        self.rx.clear()
+        self.closed = True
+
+    def receive(self, data):
+        if self.closed:
+            # Nobody is listening any more
+            return
+
+        self.rx += data
+        while True:
+            try:
+                item = self.parse(self.rx, 0)
+            except KeyError:
+                # Not a command this device knows, it gives up
+                self.error()
+                return
+            if item is None:
+                return
+            op, args, data, end = item
+            del self.rx[:end]
+
+            self.sent[op] += 1
+            if op == CMD_BATCH:
+                rsp = self.batch(data)
+                if rsp is None:
+                    self.error()
+                    return
+                self.reader.feed_data(rsp)
+                continue
+
+            status, rsp_args = self.commands[op][3](args, data)
+            rsp = struct.pack("<I", status)
+            if status != RSP_ERR:
+                rsp += struct.pack("<{}I".format(len(rsp_args)), *rsp_args)
+            self.reader.feed_data(rsp)
+
+class FakeWriter:
+    def __init__(self, device):
+        self.device = device
+        self.bytes = 0
+
+    def write(self, data):
+        self.bytes += len(data)
+        self.device.receive(data)
+
+    async def drain(self):
+        pass
+
+    def get_extra_info(self, name):
+        return None
+
+    def close(self):
+        pass
+
+    async def wait_closed(self):
+        pass
+
+def check(cond, msg):
+    if not cond:
+        print("FAIL:", msg)
+        sys.exit(1)
+
+# An image with the usual sort of gaps in it: code, zeroed tables, erased
+# padding between segments, a repeated non-trivial word, and a tail which
+# isn't a whole granule
+def make_image(rng):
+    parts = [
+        rng.randbytes(3000),
+        bytes(2048),
+        rng.randbytes(700),
+        b"\xff" * 8192,
+        struct.pack("<I", 0xdeadbeef) * 300,
+        rng.randbytes(1024),
+        bytes(100),
+    ]
+    return b"".join(parts)
+
+def test_extents(rng):
+    for granule in (4, 64, 256, 1024):
+        for data in (make_image(rng), bytes(4096), rng.randbytes(1000) + bytes(12),
+                     struct.pack("<I", 0x12345678) * 3, b""):
+            extents = sparse_extents(FLASH_START, data, granule)
+
+            # Back to back, covering all of it
+            addr = FLASH_START
+            out = bytearray()
+            for e in extents:
+                check(e.addr == addr, "granule {}: extent at {:#x}, expected {:#x}".format(granule, e.addr, addr))
+                check(e.size > 0, "granule {}: empty extent".format(granule))
+                if isinstance(e.data, int):
+                    out += struct.pack("<I", e.data) * (e.size // 4)
+                else:
+                    check(len(e.data) == e.size, "granule {}: data extent size".format(granule))
+                    out += e.data
+                addr += e.size
+            check(bytes(out) == data, "granule {}: extents don't rebuild the image".format(granule))
+
+            # Neighbours are never the same kind, or they'd have been merged
+            for a, b in zip(extents, extents[1:]):
+                same = isinstance(a.data, int) and isinstance(b.data, int) and a.data == b.data
+                same |= not isinstance(a.data, int) and not isinstance(b.data, int)
+                check(not same, "granule {}: unmerged extents at {:#x}".format(granule, b.addr))
+
+    # Granule boundaries decide what counts as a run
+    data = bytes(256) + b"\x01" + bytes(255)
+    kinds = [e.data if isinstance(e.data, int) else None for e in sparse_extents(0, data)]
+    check(kinds == [0, None], "granule split: got {}".format(kinds))
+
+    print("sparse_extents: OK")
+
+async def upload(image, fill, sparse=True):
+    device = FakeDevice(fill=fill)
+    asyncio.open_connection = device.open
+
+    client = await Client.connect("fake", timeout=2.0)
+
+    has_fill = await client.has_fill(FLASH_START)
+    check(has_fill == fill, "has_fill says {} for a device {} FILL".format(has_fill, "with" if fill else "without"))
+    check(device.connections == (1 if fill else 2), "{} connections after the probe".format(device.connections))
+
+    # The probe mustn't have left anything behind in either direction
+    check(not device.rx, "device has {} bytes left over after the probe".format(len(device.rx)))
+    check(not client.reader._buffer, "client has {} bytes left over after the probe".format(
+          len(client.reader._buffer)))
+
+    await client.upload(Image(FLASH_START, image), go=False, batch=4, sparse=sparse)
+
+    size = len(image)
+    check(device.sealed == (FLASH_START, size, crc32(image)), "image wasn't sealed")
+    check(bytes(device.flash[:size]) == image, "flash doesn't match the image")
+
+    return device, client.writer
+
+def test_upload(rng):
+    image = make_image(rng)
+    image += b"\xff" * (-len(image) % WRITE_SIZE)
+
+    device, writer = asyncio.run(upload(image, fill=True))
+    check(device.fills > 0, "no FILLs sent to a device with FILL")
+    check(writer.bytes < len(image), "sent {} bytes for a {} byte image".format(writer.bytes, len(image)))
+    sparse_bytes = writer.bytes
+    print("upload with FILL: OK ({} FILLs, {} of {} bytes sent)".format(
+          device.fills, sparse_bytes, len(image)))
+
+    device, writer = asyncio.run(upload(image, fill=False))
+    # Just the probe, in a batch which was turned down, and then everything
+    # else on the new connection
+    check(device.sent[CMD_FILL] == 0, "FILL was run on a device without it")
+    check(writer.bytes > len(image), "only sent {} bytes for a {} byte image".format(writer.bytes, len(image)))
+    print("upload without FILL: OK ({} bytes sent)".format(writer.bytes))
+
+    device, writer = asyncio.run(upload(image, fill=True, sparse=False))
+    check(device.fills == 0, "FILLs sent with sparse off")
+    print("upload with FILL, sparse off: OK")
+
+def main():
+    parser = argparse.ArgumentParser()
+    parser.add_argument("-s", "--seed", help="Random seed for the test images", type=int, default=1)
+    args = parser.parse_args()
+
+    rng = random.Random(args.seed)
+    test_extents(rng)
+    test_upload(rng)
+
+    print("OK")
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,33 @@
+/**
+ * Copyright (c) 2022 Brian Starkey <stark3y@gmail.com>
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+#include <string.h>
+
+#include "trace.h"
+
+struct trace_record trace_ring[PICOWOTA_TRACE_LEN];
+uint32_t trace_head;
+
+uint32_t trace_read(uint32_t *seq, struct trace_record *out, uint32_t max)
+{
+	uint32_t head = trace_head;
+	uint32_t oldest = head > PICOWOTA_TRACE_LEN ? head - PICOWOTA_TRACE_LEN : 0;
+	uint32_t i, n;
+
+	if ((*seq < oldest) || (*seq > head)) {
+		*seq = oldest;
+	}
+
+	n = head - *seq;
+	if (n > max) {
+		n = max;
+	}
+
+	for (i = 0; i < n; i++) {
+		out[i] = trace_ring[(*seq + i) & (PICOWOTA_TRACE_LEN - 1)];
+	}
+
+	return n;
+}
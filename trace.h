@@ -0,0 +1,75 @@
+/**
+ * Copyright (c) 2022 Brian Starkey <stark3y@gmail.com>
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+#ifndef __TRACE_H__
+#define __TRACE_H__
+
+#include <assert.h>
+#include <stdint.h>
+
+#include "hardware/structs/timer.h"
+
+/*
+ * Fixed-size RAM ring of binary trace records, cheap enough to leave on in
+ * release builds. Read back with the TRCE command, and decode with
+ * trace_decode.py (which has a copy of the event list below, keep them in
+ * sync).
+ */
+#ifndef PICOWOTA_TRACE_LEN
+#define PICOWOTA_TRACE_LEN 512
+#endif
+static_assert((PICOWOTA_TRACE_LEN & (PICOWOTA_TRACE_LEN - 1)) == 0, "PICOWOTA_TRACE_LEN must be a power of 2");
+
+enum trace_event {
+	TRACE_CONN_STATE = 1,   // arg0: new state
+	TRACE_RECV,             // arg0: pbufs queued, arg1: bytes received
+	TRACE_RX_COALESCE,      // arg1: bytes copied out of the pbuf pool
+	TRACE_COMMAND,          // arg1: opcode
+	TRACE_TX_BLOCKED,       // arg1: response length
+	TRACE_SENT,             // arg1: bytes acknowledged
+	TRACE_FLASH_ERASE,      // arg0: 1 start, 0 end, arg1: address
+	TRACE_FLASH_PROGRAM,    // arg0: 1 start, 0 end, arg1: address
+	TRACE_CHECKSUM,         // arg0: 1 start, 0 end, arg1: address (CRC or CSUM)
+};
+
+struct trace_record {
+	uint32_t time_us;
+	uint16_t event;
+	uint16_t arg0;
+	uint32_t arg1;
+};
+
+#if PICOWOTA_TRACE == 1
+extern struct trace_record trace_ring[PICOWOTA_TRACE_LEN];
+extern uint32_t trace_head;
+
+static inline void trace_event(enum trace_event event, uint16_t arg0, uint32_t arg1)
+{
+	struct trace_record *rec = &trace_ring[trace_head++ & (PICOWOTA_TRACE_LEN - 1)];
+
+	rec->time_us = timer_hw->timerawl;
+	rec->event = event;
+	rec->arg0 = arg0;
+	rec->arg1 = arg1;
+}
+
+/*
+ * Copy up to max records, starting from sequence number *seq (or the oldest
+ * one still in the ring, if that's already been overwritten). *seq is
+ * updated to the sequence number of the first record copied.
+ * Returns the number of records copied.
+ */
+uint32_t trace_read(uint32_t *seq, struct trace_record *out, uint32_t max);
+
+// Sequence number of the next record to be written
+static inline uint32_t trace_seq(void)
+{
+	return trace_head;
+}
+#else
+#define trace_event(_event, _arg0, _arg1) { }
+#endif
+
+#endif /* __TRACE_H__ */
@@ -0,0 +1,105 @@
+#!/usr/bin/env python3
+# Copyright (c) 2022 Brian Starkey <stark3y@gmail.com>
+#
+# SPDX-License-Identifier: BSD-3-Clause
+#
+# Fetch the trace ring from a device (TRCE command) and print it as a
+# timeline. The event and state lists must match trace.h and comm.c.
+
+import argparse
+import asyncio
+import struct
+import sys
+
+import picowota_client as pw
+
+CMD_TRACE = pw.opcode("TRCE")
+RECORD = struct.Struct("<IHHI")
+MAX_RECORDS = 64
+
+EVENTS = {
+    1: "CONN_STATE",
+    2: "RECV",
+    3: "RX_COALESCE",
+    4: "COMMAND",
+    5: "TX_BLOCKED",
+    6: "SENT",
+    7: "FLASH_ERASE",
+    8: "FLASH_PROGRAM",
+    9: "CHECKSUM",
+}
+
+CONN_STATES = [
+    "WAIT_FOR_SYNC",
+    "READ_OPCODE",
+    "READ_ARGS",
+    "READ_DATA",
+    "HANDLE",
+    "WRITE_RESP",
+    "WRITE_ERROR",
+    "CLOSED",
+]
+
+def describe(event, arg0, arg1):
+    name = EVENTS.get(event, "EVENT_{}".format(event))
+
+    if name == "CONN_STATE":
+        state = CONN_STATES[arg0] if arg0 < len(CONN_STATES) else str(arg0)
+        return "{:<14} {}".format(name, state)
+    elif name == "RECV":
+        return "{:<14} {} bytes, {} pbufs queued".format(name, arg1, arg0)
+    elif name in ("RX_COALESCE", "TX_BLOCKED", "SENT"):
+        return "{:<14} {} bytes".format(name, arg1)
+    elif name == "COMMAND":
+        op = struct.pack("<I", arg1)
+        text = op.decode("ascii") if all(0x20 <= c < 0x7f for c in op) else "{:08x}".format(arg1)
+        return "{:<14} {}".format(name, text)
+    elif name in ("FLASH_ERASE", "FLASH_PROGRAM", "CHECKSUM"):
+        return "{:<14} {} {:#010x}".format(name, "start" if arg0 else "end  ", arg1)
+
+    return "{:<14} {:#06x} {:#010x}".format(name, arg0, arg1)
+
+async def fetch(host, port, seq, psk):
+    records = []
+    async with await pw.Client.connect(host, port, psk=psk) as dev:
+        while True:
+            dev.send(CMD_TRACE, (seq, MAX_RECORDS))
+            await dev.writer.drain()
+            status, = struct.unpack("<I", await dev.read_exact(4))
+            if status != pw.RSP_OK:
+                raise pw.ProtocolError("TRCE failed (is the trace enabled?)")
+            first, n, head = struct.unpack("<3I", await dev.read_exact(12))
+            data = await dev.read_exact(n * RECORD.size)
+
+            if records and first != seq:
+                print("# {} records lost while reading".format(first - seq), file=sys.stderr)
+            records += [(first + i,) + RECORD.unpack_from(data, i * RECORD.size) for i in range(n)]
+            seq = first + n
+
+            # Stop once caught up, otherwise reading the trace would
+            # generate trace forever
+            if n < MAX_RECORDS or seq >= head:
+                return records
+
+parser = argparse.ArgumentParser()
+parser.add_argument("host", help="Device address")
+parser.add_argument("-p", "--port", help="TCP port", type=int, default=pw.DEFAULT_PORT)
+parser.add_argument("-s", "--since", help="First sequence number to fetch (default: oldest)",
+                    type=int, default=0)
+parser.add_argument("-k", "--psk", help="Pre-shared key (64 hex digits), if the device needs one",
+                    type=pw.parse_psk)
+args = parser.parse_args()
+
+records = asyncio.run(fetch(args.host, args.port, args.since, args.psk))
+if not records:
+    sys.exit("No trace records")
+
+start = records[0][1]
+prev = start
+for seq, time_us, event, arg0, arg1 in records:
+    # 32-bit microsecond timer, wraps every ~71 minutes
+    t = (time_us - start) & 0xffffffff
+    delta = (time_us - prev) & 0xffffffff
+    prev = time_us
+    print("{:>8} {:>12.3f} ms {:>+10.3f} ms  {}".format(seq, t / 1000, delta / 1000,
+          describe(event, arg0, arg1)))
@@ -0,0 +1,36 @@
+/**
+ * Copyright (c) 2022 Brian Starkey <stark3y@gmail.com>
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+#ifndef __TUSB_CONFIG_H__
+#define __TUSB_CONFIG_H__
+
+// TinyUSB configuration for usb_comm: a single CDC interface, device only
+
+#define CFG_TUSB_RHPORT0_MODE   (OPT_MODE_DEVICE)
+#define CFG_TUSB_OS             OPT_OS_PICO
+
+#ifndef CFG_TUSB_MEM_SECTION
+#define CFG_TUSB_MEM_SECTION
+#endif
+
+#ifndef CFG_TUSB_MEM_ALIGN
+#define CFG_TUSB_MEM_ALIGN      __attribute__ ((aligned(4)))
+#endif
+
+#define CFG_TUD_ENDPOINT0_SIZE  64
+
+#define CFG_TUD_CDC             1
+#define CFG_TUD_MSC             0
+#define CFG_TUD_HID             0
+#define CFG_TUD_MIDI            0
+#define CFG_TUD_VENDOR          0
+
+// Big enough for a whole WRIT, so that a command doesn't have to wait for
+// the main loop to come round again
+#define CFG_TUD_CDC_RX_BUFSIZE  2048
+#define CFG_TUD_CDC_TX_BUFSIZE  1024
+#define CFG_TUD_CDC_EP_BUFSIZE  64
+
+#endif /* __TUSB_CONFIG_H__ */
@@ -0,0 +1,162 @@
+/**
+ * Copyright (c) 2022 Brian Starkey <stark3y@gmail.com>
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+#include <assert.h>
+
+#include "hardware/gpio.h"
+#include "hardware/irq.h"
+#include "hardware/uart.h"
+
+#include "uart_comm.h"
+
+#ifdef DEBUG
+#include <stdio.h>
+#define DEBUG_printf(...) printf(__VA_ARGS__)
+#else
+#define DEBUG_printf(...) { }
+#endif
+
+static_assert((PICOWOTA_UART_RX_LEN & (PICOWOTA_UART_RX_LEN - 1)) == 0, "PICOWOTA_UART_RX_LEN must be a power of 2");
+
+#define UART_CONCAT_(_a, _b, _c) _a ## _b ## _c
+#define UART_CONCAT(_a, _b, _c)  UART_CONCAT_(_a, _b, _c)
+#define UART_INST UART_CONCAT(uart, PICOWOTA_UART_INST, )
+#define UART_IRQ  UART_CONCAT(UART, PICOWOTA_UART_INST, _IRQ)
+
+static struct comm_session *uart_sess;
+static bool uart_activity;
+
+// Written by the interrupt handler, read by uart_comm_read()
+static uint8_t rx_ring[PICOWOTA_UART_RX_LEN];
+static volatile uint32_t rx_head;
+static volatile uint32_t rx_tail;
+static volatile uint32_t rx_dropped;
+
+static void uart_comm_irq(void)
+{
+	while (uart_is_readable(UART_INST)) {
+		uint8_t c = uart_getc(UART_INST);
+
+		if ((rx_head - rx_tail) == PICOWOTA_UART_RX_LEN) {
+			rx_dropped++;
+			continue;
+		}
+
+		rx_ring[rx_head & (PICOWOTA_UART_RX_LEN - 1)] = c;
+		rx_head++;
+	}
+}
+
+static uint32_t uart_comm_read(void *priv, uint8_t *dst, uint32_t len)
+{
+	uint32_t n;
+
+	for (n = 0; (n < len) && (rx_tail != rx_head); n++) {
+		dst[n] = rx_ring[rx_tail & (PICOWOTA_UART_RX_LEN - 1)];
+		rx_tail++;
+	}
+
+	uart_activity |= (n != 0);
+
+	return n;
+}
+
+static int uart_comm_write(void *priv, const uint8_t *src, uint32_t len)
+{
+	uint32_t n;
+
+	for (n = 0; (n < len) && uart_is_writable(UART_INST); n++) {
+		uart_get_hw(UART_INST)->dr = src[n];
+	}
+
+	uart_activity |= (n != 0);
+
+	return n;
+}
+
+static bool uart_comm_tx_done(void *priv)
+{
+	return !(uart_get_hw(UART_INST)->fr & UART_UARTFR_BUSY_BITS);
+}
+
+static const struct comm_transport_ops uart_comm_ops = {
+	.read = uart_comm_read,
+	.write = uart_comm_write,
+	.tx_done = uart_comm_tx_done,
+};
+
+static void uart_comm_restart(void)
+{
+	// Whatever followed the bad command is meaningless
+	rx_tail = rx_head;
+	comm_session_open(uart_sess);
+}
+
+int uart_comm_init(const struct comm_table *table)
+{
+	uart_sess = comm_session_new(table, &uart_comm_ops, NULL);
+	if (!uart_sess) {
+		return -1;
+	}
+
+	// There's no connection to go idle, but a command which stalls half
+	// way (e.g. the host was killed) restarts the session, so the next
+	// SYNC doesn't get swallowed as data
+	comm_session_set_timeouts(uart_sess, 0, PICOWOTA_PROGRESS_TIMEOUT_S * 1000);
+
+	uart_init(UART_INST, PICOWOTA_UART_BAUD);
+	gpio_set_function(PICOWOTA_UART_TX_PIN, GPIO_FUNC_UART);
+	gpio_set_function(PICOWOTA_UART_RX_PIN, GPIO_FUNC_UART);
+#if (PICOWOTA_UART_CTS_PIN >= 0) && (PICOWOTA_UART_RTS_PIN >= 0)
+	// RTS is driven by the hardware, so it still works with interrupts off
+	gpio_set_function(PICOWOTA_UART_CTS_PIN, GPIO_FUNC_UART);
+	gpio_set_function(PICOWOTA_UART_RTS_PIN, GPIO_FUNC_UART);
+	uart_set_hw_flow(UART_INST, true, true);
+#endif
+
+	irq_set_exclusive_handler(UART_IRQ, uart_comm_irq);
+	irq_set_enabled(UART_IRQ, true);
+	uart_set_irq_enables(UART_INST, true, false);
+
+	uart_comm_restart();
+
+	return 0;
+}
+
+void uart_comm_deinit(void)
+{
+	if (!uart_sess) {
+		return;
+	}
+
+	uart_set_irq_enables(UART_INST, false, false);
+	irq_set_enabled(UART_IRQ, false);
+	irq_remove_handler(UART_IRQ, uart_comm_irq);
+	uart_deinit(UART_INST);
+
+	comm_session_delete(uart_sess);
+	uart_sess = NULL;
+}
+
+bool uart_comm_poll(void)
+{
+	if (!uart_sess) {
+		return false;
+	}
+
+	if (rx_dropped) {
+		DEBUG_printf("uart dropped %d bytes\n", (int)rx_dropped);
+		rx_dropped = 0;
+	}
+
+	uart_activity = false;
+
+	if (comm_session_process(uart_sess)) {
+		DEBUG_printf("uart session restarted\n");
+		uart_comm_restart();
+	}
+
+	return uart_activity;
+}
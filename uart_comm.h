@@ -0,0 +1,60 @@
+/**
+ * Copyright (c) 2022 Brian Starkey <stark3y@gmail.com>
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+#ifndef __UART_COMM_H__
+#define __UART_COMM_H__
+
+#include <stdbool.h>
+
+#include "comm.h"
+
+/*
+ * UART backend for comm. There's no connection as such, so a session is
+ * always open, and after an error it starts again from SYNC (anything
+ * received before the error was sent is thrown away).
+ *
+ * Received data is buffered from an interrupt handler, but that can't run
+ * while flash is being erased or programmed. Without RTS/CTS flow control,
+ * the host must not send anything while a command which writes flash is
+ * running, i.e. no pipelining, and wait for erases to finish (STAT).
+ */
+// UART instance, 0 or 1
+#ifndef PICOWOTA_UART_INST
+#define PICOWOTA_UART_INST 1
+#endif
+
+#ifndef PICOWOTA_UART_BAUD
+#define PICOWOTA_UART_BAUD 921600
+#endif
+
+#ifndef PICOWOTA_UART_TX_PIN
+#define PICOWOTA_UART_TX_PIN 4
+#endif
+
+#ifndef PICOWOTA_UART_RX_PIN
+#define PICOWOTA_UART_RX_PIN 5
+#endif
+
+// -1 for no flow control
+#ifndef PICOWOTA_UART_CTS_PIN
+#define PICOWOTA_UART_CTS_PIN -1
+#endif
+
+#ifndef PICOWOTA_UART_RTS_PIN
+#define PICOWOTA_UART_RTS_PIN -1
+#endif
+
+// Receive buffer, must be a power of 2
+#ifndef PICOWOTA_UART_RX_LEN
+#define PICOWOTA_UART_RX_LEN 4096
+#endif
+
+int uart_comm_init(const struct comm_table *table);
+void uart_comm_deinit(void);
+
+// Returns true if anything happened, i.e. it's worth polling again soon
+bool uart_comm_poll(void);
+
+#endif /* __UART_COMM_H__ */
@@ -0,0 +1,124 @@
+/**
+ * Copyright (c) 2022 Brian Starkey <stark3y@gmail.com>
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+#include "tusb.h"
+
+#include "usb_comm.h"
+
+#ifdef DEBUG
+#include <stdio.h>
+#define DEBUG_printf(...) printf(__VA_ARGS__)
+#else
+#define DEBUG_printf(...) { }
+#endif
+
+static struct comm_session *usb_sess;
+static bool usb_connected;
+static bool usb_activity;
+
+static uint32_t usb_comm_read(void *priv, uint8_t *dst, uint32_t len)
+{
+	uint32_t n = tud_cdc_read(dst, len);
+
+	usb_activity |= (n != 0);
+
+	return n;
+}
+
+static int usb_comm_write(void *priv, const uint8_t *src, uint32_t len)
+{
+	uint32_t n = tud_cdc_write(src, len);
+
+	usb_activity |= (n != 0);
+
+	return n;
+}
+
+static bool usb_comm_tx_done(void *priv)
+{
+	tud_cdc_write_flush();
+
+	return tud_cdc_write_available() == CFG_TUD_CDC_TX_BUFSIZE;
+}
+
+static const struct comm_transport_ops usb_comm_ops = {
+	.read = usb_comm_read,
+	.write = usb_comm_write,
+	.tx_done = usb_comm_tx_done,
+};
+
+int usb_comm_init(const struct comm_table *table)
+{
+	usb_sess = comm_session_new(table, &usb_comm_ops, NULL);
+	if (!usb_sess) {
+		return -1;
+	}
+
+	// The session ends when the port is closed, so it doesn't need an
+	// idle timeout
+	comm_session_set_timeouts(usb_sess, 0, PICOWOTA_PROGRESS_TIMEOUT_S * 1000);
+
+	if (!tusb_init()) {
+		comm_session_delete(usb_sess);
+		usb_sess = NULL;
+		return -1;
+	}
+
+	return 0;
+}
+
+void usb_comm_deinit(void)
+{
+	if (!usb_sess) {
+		return;
+	}
+
+	// Let the host see that we've gone before the app takes over
+	tud_disconnect();
+	comm_session_delete(usb_sess);
+	usb_sess = NULL;
+}
+
+bool usb_comm_poll(void)
+{
+	if (!usb_sess) {
+		return false;
+	}
+
+	tud_task();
+
+	// A session lasts as long as the host has the port open
+	bool connected = tud_cdc_connected();
+	if (connected != usb_connected) {
+		DEBUG_printf("usb %s\n", connected ? "opened" : "closed");
+		usb_connected = connected;
+		if (connected) {
+			tud_cdc_read_flush();
+			comm_session_open(usb_sess);
+		} else {
+			comm_session_close(usb_sess);
+		}
+	}
+
+	if (!usb_connected) {
+		return false;
+	}
+
+	usb_activity = false;
+
+	if (comm_session_process(usb_sess)) {
+		// The host has to close and re-open the port to start again
+		DEBUG_printf("usb session closed\n");
+	}
+
+	tud_cdc_write_flush();
+
+	return usb_activity;
+}
+
+bool usb_comm_connected(void)
+{
+	return usb_connected;
+}
@@ -0,0 +1,25 @@
+/**
+ * Copyright (c) 2022 Brian Starkey <stark3y@gmail.com>
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+#ifndef __USB_COMM_H__
+#define __USB_COMM_H__
+
+#include <stdbool.h>
+
+#include "comm.h"
+
+/*
+ * TinyUSB CDC backend for comm. The device shows up as a serial port, and
+ * opening it (asserting DTR) starts a new session. Everything runs from
+ * usb_comm_poll(), there are no interrupt handlers of our own.
+ */
+int usb_comm_init(const struct comm_table *table);
+void usb_comm_deinit(void);
+
+// Returns true if anything happened, i.e. it's worth polling again soon
+bool usb_comm_poll(void);
+bool usb_comm_connected(void);
+
+#endif /* __USB_COMM_H__ */
@@ -0,0 +1,106 @@
+/**
+ * Copyright (c) 2022 Brian Starkey <stark3y@gmail.com>
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+#include "pico/unique_id.h"
+#include "tusb.h"
+
+#ifndef PICOWOTA_USB_VID
+#define PICOWOTA_USB_VID 0x2e8a // Raspberry Pi
+#endif
+
+#ifndef PICOWOTA_USB_PID
+#define PICOWOTA_USB_PID 0x000a // Raspberry Pi Pico SDK CDC
+#endif
+
+#define USBD_ITF_CDC       0
+#define USBD_ITF_MAX       2
+
+#define USBD_CDC_EP_CMD    0x81
+#define USBD_CDC_EP_OUT    0x02
+#define USBD_CDC_EP_IN     0x82
+#define USBD_CDC_CMD_SIZE  8
+
+#define USBD_DESC_LEN      (TUD_CONFIG_DESC_LEN + TUD_CDC_DESC_LEN)
+#define USBD_MAX_POWER_MA  250
+
+enum {
+	USBD_STR_LANGUAGE,
+	USBD_STR_MANUFACTURER,
+	USBD_STR_PRODUCT,
+	USBD_STR_SERIAL,
+	USBD_STR_CDC,
+};
+
+static const tusb_desc_device_t usbd_desc_device = {
+	.bLength = sizeof(tusb_desc_device_t),
+	.bDescriptorType = TUSB_DESC_DEVICE,
+	.bcdUSB = 0x0200,
+	.bDeviceClass = TUSB_CLASS_MISC,
+	.bDeviceSubClass = MISC_SUBCLASS_COMMON,
+	.bDeviceProtocol = MISC_PROTOCOL_IAD,
+	.bMaxPacketSize0 = CFG_TUD_ENDPOINT0_SIZE,
+	.idVendor = PICOWOTA_USB_VID,
+	.idProduct = PICOWOTA_USB_PID,
+	.bcdDevice = 0x0100,
+	.iManufacturer = USBD_STR_MANUFACTURER,
+	.iProduct = USBD_STR_PRODUCT,
+	.iSerialNumber = USBD_STR_SERIAL,
+	.bNumConfigurations = 1,
+};
+
+static const uint8_t usbd_desc_cfg[USBD_DESC_LEN] = {
+	TUD_CONFIG_DESCRIPTOR(1, USBD_ITF_MAX, 0, USBD_DESC_LEN, 0, USBD_MAX_POWER_MA),
+	TUD_CDC_DESCRIPTOR(USBD_ITF_CDC, USBD_STR_CDC, USBD_CDC_EP_CMD, USBD_CDC_CMD_SIZE,
+			   USBD_CDC_EP_OUT, USBD_CDC_EP_IN, CFG_TUD_CDC_EP_BUFSIZE),
+};
+
+static const char *const usbd_desc_str[] = {
+	[USBD_STR_MANUFACTURER] = "Raspberry Pi",
+	[USBD_STR_PRODUCT] = "picowota",
+	[USBD_STR_CDC] = "picowota",
+};
+
+const uint8_t *tud_descriptor_device_cb(void)
+{
+	return (const uint8_t *)&usbd_desc_device;
+}
+
+const uint8_t *tud_descriptor_configuration_cb(uint8_t index)
+{
+	(void)index;
+	return usbd_desc_cfg;
+}
+
+const uint16_t *tud_descriptor_string_cb(uint8_t index, uint16_t langid)
+{
+	static uint16_t desc_str[1 + (2 * PICO_UNIQUE_BOARD_ID_SIZE_BYTES) + 1];
+	char serial[(2 * PICO_UNIQUE_BOARD_ID_SIZE_BYTES) + 1];
+	const char *str;
+	unsigned int len;
+
+	(void)langid;
+
+	if (index == USBD_STR_LANGUAGE) {
+		desc_str[1] = 0x0409; // English
+		len = 1;
+	} else {
+		if (index == USBD_STR_SERIAL) {
+			pico_get_unique_board_id_string(serial, sizeof(serial));
+			str = serial;
+		} else if ((index < count_of(usbd_desc_str)) && usbd_desc_str[index]) {
+			str = usbd_desc_str[index];
+		} else {
+			return NULL;
+		}
+
+		for (len = 0; str[len] && (len < count_of(desc_str) - 1); len++) {
+			desc_str[1 + len] = str[len];
+		}
+	}
+
+	desc_str[0] = (TUSB_DESC_STRING << 8) | (2 * len + 2);
+
+	return desc_str;
+}